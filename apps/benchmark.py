@@ -1,6 +1,62 @@
 # from ggplot import *
 # import pandas as pd
 
+# Run with --roofline to print, instead of the speed up plot, a roofline
+# table of the op rate and bandwidth each app achieves against the
+# peaks of the machine. The apps print these with their run times (see
+# support/benchmark.h), and make -f Makefile.bench peak_perf.txt
+# measures the peaks.
+
+import sys
+
+if len(sys.argv) > 1 and sys.argv[1] == '--roofline':
+    import os.path
+    try:
+        import ConfigParser as configparser
+    except ImportError:
+        import configparser
+
+    def read_sections(*paths):
+        c = configparser.ConfigParser()
+        c.read(paths)
+        return [dict(c.items(s)) for s in c.sections()]
+
+    def number(d, key):
+        return float(d[key]) if key in d else None
+
+    peaks = {}
+    for p in read_sections('peak_perf.txt'):
+        peaks[int(p['threads'])] = (float(p['peak_gflops']), float(p['peak_gbps']))
+    if not peaks:
+        sys.exit("No peaks in peak_perf.txt. Run make -f Makefile.bench peak_perf.txt")
+
+    print('%-16s %-6s %7s %10s %8s %8s %10s %8s %7s' %
+          ('app', 'ver', 'threads', 'runtime', 'GFLOP/s', 'GB/s', 'flop/byte', 'bound', '%roof'))
+    for app in ["blur", "hist", "unsharp", "harris", "local_laplacian", "interpolate", "bilateral_grid",
+                "camera_pipe", "conv_layer", "mat_mul"]:
+        runs = read_sections(os.path.join(app, 'ref_perf.txt'), os.path.join(app, 'auto_perf.txt'))
+        for r in runs:
+            threads = int(r['threads'])
+            if 'gbps' not in r or threads not in peaks:
+                continue
+            peak_gflops, peak_gbps = peaks[threads]
+            gflops, gbps, intensity = number(r, 'gflops'), number(r, 'gbps'), number(r, 'intensity')
+            if intensity is None:
+                # Without an estimate of the work, only the bandwidth
+                # roof applies.
+                bound, roof = '-', gbps / peak_gbps
+            else:
+                # The pipeline is compute bound if its intensity is to
+                # the right of the ridge point, where the roofs meet.
+                attainable = min(peak_gflops, intensity * peak_gbps)
+                bound = 'compute' if intensity * peak_gbps >= peak_gflops else 'memory'
+                roof = gflops / attainable
+            print('%-16s %-6s %7d %8.3fms %8s %8.2f %10s %8s %6.1f%%' %
+                  (app, r['version'], threads, float(r['runtime']),
+                   '-' if gflops is None else '%.2f' % gflops, gbps,
+                   '-' if intensity is None else '%.2f' % intensity, bound, roof * 100))
+    sys.exit(0)
+
 import matplotlib
 # Force matplotlib to not use any Xwindows backend.
 matplotlib.use('Agg')
@@ -36,7 +92,7 @@ for app in ["blur", "hist", "unsharp", "harris", "local_laplacian", "interpolate
         ax.set_xticklabels(["1", "2", "4", "8"])
         ax.set_title(app.replace('_',' ').title())
         p = p+1
-        print speed_up[app]
+        print(speed_up[app])
 
 fig = plt.gcf()
 fig.set_size_inches(20,20)
@@ -31,6 +31,7 @@ int main(int argc, char **argv) {
         bilateral_grid(atof(argv[3]), input, output);
     }, [&]() {output.copy_to_host();} );
     printf("runtime: %g\n", min_t * 1e3);
+    print_roofline("bilateral_grid", min_t, image_bytes(input, output));
 
     // save_image(output, argv[2]);
 
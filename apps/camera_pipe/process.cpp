@@ -67,6 +67,7 @@ int main(int argc, char **argv) {
                output);
     }, [&] (){output.device_sync();});
     fprintf(stdout, "runtime: %g\n", best * 1e3);
+    print_roofline("curved", best, image_bytes(input, matrix_3200, matrix_7000, output));
     //save_image(output, argv[6]);
 
     // Timings on N900 as of SIGGRAPH 2012 camera ready are (best of 10)
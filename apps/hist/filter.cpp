@@ -23,6 +23,7 @@ int main(int argc, char **argv) {
         hist(input, output);
     }, [&]() {output.device_sync();});
     printf("runtime: %g\n", min_t * 1e3);
+    print_roofline("hist", min_t, image_bytes(input, output));
 
     // save_image(output, argv[2]);
 
@@ -28,6 +28,7 @@ int main(int argc, char **argv) {
         local_laplacian(levels, alpha/(levels-1), beta, input, output);
     }, [&] (){output.copy_to_host();});
     printf("runtime: %g\n", best * 1e3);
+    print_roofline("local_laplacian", best, image_bytes(input, output));
 
     local_laplacian(levels, alpha/(levels-1), beta, input, output);
 
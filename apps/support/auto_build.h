@@ -1,8 +1,33 @@
 #pragma once
 #include <Halide.h>
+#include <fstream>
 #include <string>
 #include <vector>
 
+// Write the auto-scheduler's estimate of the work of a pipeline to
+// name.cost, for benchmark.h to compute the op rate it achieves. The
+// work doesn't depend on the schedule, so the estimate made when
+// auto-scheduling applies to all variants of the pipeline.
+void write_cost_estimate(const Halide::Module &m, const std::string &name)
+{
+    if (m.cost_estimates().empty()) {
+        return;
+    }
+    long long ops = 0, loads = 0;
+    for (const auto &f : m.cost_estimates()) {
+        if (f.second.value_ops == -1) {
+            // The size of this Func is unknown, so the work of the
+            // pipeline is too.
+            return;
+        }
+        ops += f.second.value_ops;
+        loads += f.second.value_loads;
+    }
+    std::ofstream cost(name + ".cost");
+    cost << "ops: " << ops << "\n"
+         << "loads: " << loads << "\n";
+}
+
 void auto_build(Halide::Pipeline p,
                 const std::string &name,
                 const std::vector<Halide::Argument> &args,
@@ -29,7 +54,9 @@ void auto_build(Halide::Pipeline p,
             suffix += "_gpu";
     }
     o = o.c_header(name+".h").object(name+suffix+".o");
-    p.compile_to(o, args, name, target, auto_schedule);
+    Halide::Module m = p.compile_to_module(args, name, target, auto_schedule);
+    m.compile(o);
+    write_cost_estimate(m, name);
 }
 
 void auto_build(Halide::Func f,
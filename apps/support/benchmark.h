@@ -1,7 +1,9 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
+#include <cstdio>
 #include <limits>
+#include <string>
 
 // Benchmark the operation 'op'. The number of iterations refers to
 // how many times the operation is run for each time measurement, the
@@ -71,4 +73,42 @@ double benchmark(int samples, int iterations, F op, S sync_op) {
 
 #endif
 
+// The total size in bytes of some images.
+inline double image_bytes() {
+    return 0;
+}
+
+template <typename Im, typename... Rest>
+double image_bytes(const Im &im, const Rest &... rest) {
+    double bytes = sizeof(*im.data());
+    for (int i = 0; i < im.dimensions(); i++) {
+        bytes *= im.extent(i);
+    }
+    return bytes + image_bytes(rest...);
+}
+
+// Print the rates of arithmetic and memory traffic a pipeline achieves,
+// for comparing against the peaks of the machine measured by
+// support/peak (see benchmark.py --roofline). The traffic is the bytes
+// of its inputs and outputs, which a pipeline has to move at least
+// once. The arithmetic is the auto-scheduler's estimate of the work of
+// the pipeline, read from name.cost (see auto_build.h), if it's there.
+inline void print_roofline(const std::string &name, double seconds, double bytes) {
+    printf("gbps: %g\n", bytes / seconds * 1e-9);
+
+    FILE *f = fopen((name + ".cost").c_str(), "r");
+    if (f == NULL) {
+        return;
+    }
+    long long ops = 0, loads = 0;
+    int found = fscanf(f, " ops: %lld loads: %lld", &ops, &loads);
+    fclose(f);
+    if (found != 2) {
+        return;
+    }
+    printf("gflops: %g\n", ops / seconds * 1e-9);
+    printf("gloads: %g\n", loads / seconds * 1e-9);
+    printf("intensity: %g\n", ops / bytes);
+}
+
 #endif
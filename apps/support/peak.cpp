@@ -0,0 +1,131 @@
+// Measure the peak arithmetic rate and memory bandwidth of the machine,
+// as the roofs that benchmark.py --roofline compares the apps against.
+// The bandwidth is measured with the triad of the STREAM benchmark, and
+// the arithmetic with independent chains of vector fused multiply-adds.
+// Build with optimization and -march=native, and run as
+//
+//     ./peak <threads>
+//
+// which prints the peaks in the format of the benchmark results.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+
+namespace {
+
+#ifdef __AVX512F__
+const int vector_bytes = 64;
+#else
+const int vector_bytes = 32;
+#endif
+
+typedef float vec __attribute__((vector_size(vector_bytes)));
+const int lanes = vector_bytes / sizeof(float);
+
+// Enough independent accumulators to cover the latency of a fused
+// multiply-add on two pipes.
+const int accumulators = 10;
+const long long fma_iterations = 1 << 24;
+
+// Each element of the triad reads two doubles and writes one. The
+// arrays are much bigger than the caches.
+const size_t stream_elements = 1 << 25;
+
+// Run f(thread index) on each of some threads.
+template <typename F>
+void run_on_threads(int threads, F f) {
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; t++) {
+        pool.push_back(std::thread(f, t));
+    }
+    for (auto &t : pool) {
+        t.join();
+    }
+}
+
+float fma_chains(float seed) {
+    vec acc[accumulators];
+    vec m = vec{} + 0.999999f, a = vec{} + 1e-7f;
+    for (int j = 0; j < accumulators; j++) {
+        acc[j] = vec{} + (seed + j);
+    }
+    for (long long i = 0; i < fma_iterations; i++) {
+        for (int j = 0; j < accumulators; j++) {
+            acc[j] = acc[j] * m + a;
+        }
+    }
+    float result = 0;
+    for (int j = 0; j < accumulators; j++) {
+        for (int k = 0; k < lanes; k++) {
+            result += acc[j][k];
+        }
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    int threads = 0;
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    } else if (getenv("HL_NUM_THREADS")) {
+        threads = atoi(getenv("HL_NUM_THREADS"));
+    }
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The sums are printed so that the chains can't be optimized away.
+    std::vector<float> sums(threads);
+    double fma_time = benchmark(5, 1, [&]() {
+        run_on_threads(threads, [&](int t) { sums[t] = fma_chains((float)t); });
+    });
+    double flops = 2.0 * lanes * accumulators * fma_iterations * threads;
+
+    // Each thread works on its own slice of the arrays, and touches it
+    // first, so that on numa machines it's on the thread's own node.
+    std::vector<double *> a(threads), b(threads), c(threads);
+    size_t slice = stream_elements / threads;
+    run_on_threads(threads, [&](int t) {
+        a[t] = new double[slice];
+        b[t] = new double[slice];
+        c[t] = new double[slice];
+        for (size_t i = 0; i < slice; i++) {
+            a[t][i] = 0;
+            b[t][i] = 1;
+            c[t][i] = 2;
+        }
+    });
+    double stream_time = benchmark(10, 1, [&]() {
+        run_on_threads(threads, [&](int t) {
+            double *at = a[t], *bt = b[t], *ct = c[t];
+            for (size_t i = 0; i < slice; i++) {
+                at[i] = bt[i] + 3.0 * ct[i];
+            }
+        });
+    });
+    double bytes = 3.0 * sizeof(double) * slice * threads;
+
+    float sum = 0;
+    for (int t = 0; t < threads; t++) {
+        sum += sums[t] + (float)a[t][slice - 1];
+        delete[] a[t];
+        delete[] b[t];
+        delete[] c[t];
+    }
+
+    printf("[peak.%d]\n", threads);
+    printf("threads: %d\n", threads);
+    printf("peak_gflops: %g\n", flops / fma_time * 1e-9);
+    printf("peak_gbps: %g\n", bytes / stream_time * 1e-9);
+    fprintf(stderr, "checksum: %g\n", sum);
+
+    return 0;
+}
@@ -775,7 +775,12 @@ void defineFunc()
                  "calls to halide_trace. If the Func is inlined, this call has no effect.")
             .def("trace_realizations", &Func::trace_realizations, p::arg("self"),
                  p::return_internal_reference<1>(),
-                 "Trace all realizations of this Func by emitting calls to halide_trace.");
+                 "Trace all realizations of this Func by emitting calls to halide_trace.")
+            .def("trace_store_regions", &Func::trace_store_regions, p::arg("self"),
+                 p::return_internal_reference<1>(),
+                 "Trace each region of this Func that gets produced as a single "
+                 "halide_trace_store_region event, rather than tracing each store. "
+                 "If the Func is inlined, this has no effect.");
 
     func_class.def("specialize", &Func::specialize, p::args("self", "condition"),
                    "Specialize a Func. This creates a special-case version of the "
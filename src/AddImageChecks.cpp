@@ -63,7 +63,8 @@ Stmt add_image_checks(Stmt s,
                       const Target &t,
                       const vector<string> &order,
                       const map<string, Function> &env,
-                      const FuncValueBounds &fb) {
+                      const FuncValueBounds &fb,
+                      BoundsCache *bounds_cache) {
 
     bool no_asserts = t.has_feature(Target::NoAsserts);
     bool no_bounds_query = t.has_feature(Target::NoBoundsQuery);
@@ -96,7 +97,7 @@ Stmt add_image_checks(Stmt s,
     }
 
     Scope<Interval> empty_scope;
-    map<string, Box> boxes = boxes_touched(s, empty_scope, fb);
+    map<string, Box> boxes = boxes_touched(s, empty_scope, fb, bounds_cache);
 
     // Now iterate through all the buffers, creating a list of lets
     // and a list of asserts.
@@ -23,6 +23,7 @@ class AllocationInference : public IRMutator {
 
     const map<string, Function> &env;
     const FuncValueBounds &func_bounds;
+    BoundsCache *bounds_cache;
     set<string> touched_by_extern;
 
     void visit(const Realize *op) {
@@ -31,7 +32,7 @@ class AllocationInference : public IRMutator {
         Function f = iter->second;
 
         Scope<Interval> empty_scope;
-        Box b = box_touched(op->body, op->name, empty_scope, func_bounds);
+        Box b = box_touched(op->body, op->name, empty_scope, func_bounds, bounds_cache);
         if (touched_by_extern.count(f.name())) {
             // The region touched is at least the region required at this
             // loop level of the first stage (this is important for inputs
@@ -108,8 +109,8 @@ class AllocationInference : public IRMutator {
     }
 
 public:
-    AllocationInference(const map<string, Function> &e, const FuncValueBounds &fb) :
-        env(e), func_bounds(fb) {
+    AllocationInference(const map<string, Function> &e, const FuncValueBounds &fb, BoundsCache *bc) :
+        env(e), func_bounds(fb), bounds_cache(bc) {
         // Figure out which buffers are touched by extern stages
         for (map<string, Function>::const_iterator iter = e.begin();
              iter != e.end(); ++iter) {
@@ -129,8 +130,9 @@ public:
 
 Stmt allocation_bounds_inference(Stmt s,
                                  const map<string, Function> &env,
-                                 const FuncValueBounds &fb) {
-    AllocationInference inf(env, fb);
+                                 const FuncValueBounds &fb,
+                                 BoundsCache *bounds_cache) {
+    AllocationInference inf(env, fb, bounds_cache);
     s = inf.mutate(s);
     return s;
 }
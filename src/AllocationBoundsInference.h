@@ -15,7 +15,8 @@ namespace Internal {
  * variables, and define values for those variables. */
 Stmt allocation_bounds_inference(Stmt s,
                                  const std::map<std::string, Function> &env,
-                                 const std::map<std::pair<std::string, int>, Interval> &func_bounds);
+                                 const std::map<std::pair<std::string, int>, Interval> &func_bounds,
+                                 BoundsCache *bounds_cache = nullptr);
 }
 }
 
@@ -1,10 +1,12 @@
 #include <iostream>
+#include <set>
 
 #include "Bounds.h"
 #include "IRVisitor.h"
 #include "IR.h"
 #include "IROperator.h"
 #include "IREquality.h"
+#include "LoweringCache.h"
 #include "Simplify.h"
 #include "IRPrinter.h"
 #include "Util.h"
@@ -889,7 +891,10 @@ private:
     }
 };
 
-Interval bounds_of_expr_in_scope(Expr expr, const Scope<Interval> &scope, const FuncValueBounds &fb) {
+Interval bounds_of_expr_in_scope(Expr expr, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    if (cache && &fb == &cache->value_bounds()) {
+        return cache->lookup(expr, scope);
+    }
     //debug(3) << "computing bounds_of_expr_in_scope " << expr << "\n";
     Bounds b(&scope, fb);
     expr.accept(&b);
@@ -907,6 +912,68 @@ Interval bounds_of_expr_in_scope(Expr expr, const Scope<Interval> &scope, const
     return Interval(b.min, b.max);
 }
 
+namespace {
+// Find the free variables of an expression that are bound in some scope.
+class FreeVarsInScope : public IRGraphVisitor {
+    const Scope<Interval> &scope;
+
+    using IRGraphVisitor::visit;
+
+    void visit(const Variable *op) {
+        if (scope.contains(op->name)) {
+            names.insert(op->name);
+        }
+    }
+
+public:
+    std::set<string> names;
+    FreeVarsInScope(const Scope<Interval> &s) : scope(s) {}
+};
+}
+
+bool BoundsCache::Key::operator<(const Key &other) const {
+    if (names != other.names) {
+        return names < other.names;
+    }
+    // Equal names imply the same number of exprs.
+    for (size_t i = 0; i < exprs.size(); i++) {
+        if (exprs[i] < other.exprs[i]) {
+            return true;
+        } else if (other.exprs[i] < exprs[i]) {
+            return false;
+        }
+    }
+    return false;
+}
+
+Interval BoundsCache::lookup(Expr expr, const Scope<Interval> &scope) {
+    // The bounds only depend on the intervals bound to the free
+    // variables of the expression, so those are all that goes in the
+    // key. Unrelated names elsewhere in the scope don't prevent a hit.
+    FreeVarsInScope free_vars(scope);
+    expr.accept(&free_vars);
+
+    Key key;
+    key.exprs.push_back(ExprWithCompareCache(expr, &compare_cache));
+    for (const string &name : free_vars.names) {
+        Interval in = scope.get(name);
+        key.names.push_back(name);
+        key.exprs.push_back(ExprWithCompareCache(in.min, &compare_cache));
+        key.exprs.push_back(ExprWithCompareCache(in.max, &compare_cache));
+    }
+
+    std::map<Key, Interval>::iterator iter = table.find(key);
+    if (iter != table.end()) {
+        hits++;
+        return iter->second;
+    }
+
+    misses++;
+    Interval result = bounds_of_expr_in_scope(expr, scope, func_bounds);
+    table[key] = result;
+    return result;
+}
+
 Interval interval_union(const Interval &a, const Interval &b) {
     Expr max, min;
     debug(3) << "Interval union of " << a.min << ", " << a.max << ",  " << b.min << ", " << b.max << "\n";
@@ -1113,8 +1180,9 @@ bool boxes_overlap(const Box &a, const Box &b) {
 class BoxesTouched : public IRGraphVisitor {
 
 public:
-    BoxesTouched(bool calls, bool provides, string fn, const Scope<Interval> *s, const FuncValueBounds &fb) :
-        func(fn), consider_calls(calls), consider_provides(provides), func_bounds(fb) {
+    BoxesTouched(bool calls, bool provides, string fn, const Scope<Interval> *s,
+                 const FuncValueBounds &fb, BoundsCache *c) :
+        func(fn), consider_calls(calls), consider_provides(provides), func_bounds(fb), cache(c) {
         scope.set_containing_scope(s);
     }
 
@@ -1126,6 +1194,7 @@ private:
     bool consider_calls, consider_provides;
     Scope<Interval> scope;
     const FuncValueBounds &func_bounds;
+    BoundsCache *cache;
 
     using IRGraphVisitor::visit;
 
@@ -1161,7 +1230,7 @@ private:
             b.used = const_true();
             for (size_t i = 0; i < op->args.size(); i++) {
                 op->args[i].accept(this);
-                b[i] = bounds_of_expr_in_scope(op->args[i], scope, func_bounds);
+                b[i] = bounds_of_expr_in_scope(op->args[i], scope, func_bounds, cache);
             }
             merge_boxes(boxes[op->name], b);
         }
@@ -1197,7 +1266,7 @@ private:
         if (consider_calls) {
             op->value.accept(this);
         }
-        Interval value_bounds = bounds_of_expr_in_scope(op->value, scope, func_bounds);
+        Interval value_bounds = bounds_of_expr_in_scope(op->value, scope, func_bounds, cache);
 
         bool fixed = value_bounds.min.same_as(value_bounds.max);
         value_bounds.min = simplify(value_bounds.min);
@@ -1292,7 +1361,7 @@ private:
                             likely_i.max = likely(i.max);
                         }
 
-                        Interval bi = bounds_of_expr_in_scope(b, scope, func_bounds);
+                        Interval bi = bounds_of_expr_in_scope(b, scope, func_bounds, cache);
                         if (bi.max.defined()) {
                             if (lt) {
                                 i.max = min(likely_i.max, bi.max - 1);
@@ -1320,7 +1389,7 @@ private:
                             likely_i.max = likely(i.max);
                         }
 
-                        Interval ai = bounds_of_expr_in_scope(a, scope, func_bounds);
+                        Interval ai = bounds_of_expr_in_scope(a, scope, func_bounds, cache);
                         if (ai.max.defined()) {
                             if (gt) {
                                 i.max = min(likely_i.max, ai.max - 1);
@@ -1411,14 +1480,14 @@ private:
         if (scope.contains(op->name + ".loop_min")) {
             min_val = scope.get(op->name + ".loop_min").min;
         } else {
-            min_val = bounds_of_expr_in_scope(op->min, scope, func_bounds).min;
+            min_val = bounds_of_expr_in_scope(op->min, scope, func_bounds, cache).min;
         }
 
         if (scope.contains(op->name + ".loop_max")) {
             max_val = scope.get(op->name + ".loop_max").max;
         } else {
-            max_val = bounds_of_expr_in_scope(op->extent, scope, func_bounds).max;
-            max_val += bounds_of_expr_in_scope(op->min, scope, func_bounds).max;
+            max_val = bounds_of_expr_in_scope(op->extent, scope, func_bounds, cache).max;
+            max_val += bounds_of_expr_in_scope(op->min, scope, func_bounds, cache).max;
             max_val -= 1;
         }
 
@@ -1432,7 +1501,7 @@ private:
             if (op->name == func || func.empty()) {
                 Box b(op->args.size());
                 for (size_t i = 0; i < op->args.size(); i++) {
-                    b[i] = bounds_of_expr_in_scope(op->args[i], scope, func_bounds);
+                    b[i] = bounds_of_expr_in_scope(op->args[i], scope, func_bounds, cache);
                 }
                 merge_boxes(boxes[op->name], b);
             }
@@ -1450,10 +1519,11 @@ private:
 };
 
 map<string, Box> boxes_touched(Expr e, Stmt s, bool consider_calls, bool consider_provides,
-                               string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
+                               string fn, const Scope<Interval> &scope, const FuncValueBounds &fb,
+                               BoundsCache *cache) {
     // Do calls and provides separately, for better simplification.
-    BoxesTouched calls(consider_calls, false, fn, &scope, fb);
-    BoxesTouched provides(false, consider_provides, fn, &scope, fb);
+    BoxesTouched calls(consider_calls, false, fn, &scope, fb, cache);
+    BoxesTouched provides(false, consider_provides, fn, &scope, fb, cache);
 
     if (consider_calls) {
         if (e.defined()) {
@@ -1486,60 +1556,62 @@ map<string, Box> boxes_touched(Expr e, Stmt s, bool consider_calls, bool conside
 }
 
 Box box_touched(Expr e, Stmt s, bool consider_calls, bool consider_provides,
-                string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(e, s, consider_calls, consider_provides, fn, scope, fb)[fn];
+                string fn, const Scope<Interval> &scope, const FuncValueBounds &fb,
+                BoundsCache *cache) {
+    return boxes_touched(e, s, consider_calls, consider_provides, fn, scope, fb, cache)[fn];
 }
 
-map<string, Box> boxes_required(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(e, Stmt(), true, false, "", scope, fb);
+map<string, Box> boxes_required(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(e, Stmt(), true, false, "", scope, fb, cache);
 }
 
-Box box_required(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(e, Stmt(), true, false, fn, scope, fb);
+Box box_required(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(e, Stmt(), true, false, fn, scope, fb, cache);
 }
 
-map<string, Box> boxes_required(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(Expr(), s, true, false, "", scope, fb);
+map<string, Box> boxes_required(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(Expr(), s, true, false, "", scope, fb, cache);
 }
 
-Box box_required(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(Expr(), s, true, false, fn, scope, fb);
+Box box_required(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(Expr(), s, true, false, fn, scope, fb, cache);
 }
 
-map<string, Box> boxes_provided(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(e, Stmt(), false, true, "", scope, fb);
+map<string, Box> boxes_provided(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(e, Stmt(), false, true, "", scope, fb, cache);
 }
 
-Box box_provided(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(e, Stmt(), false, true, fn, scope, fb);
+Box box_provided(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(e, Stmt(), false, true, fn, scope, fb, cache);
 }
 
-map<string, Box> boxes_provided(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(Expr(), s, false, true, "", scope, fb);
+map<string, Box> boxes_provided(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(Expr(), s, false, true, "", scope, fb, cache);
 }
 
-Box box_provided(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(Expr(), s, false, true, fn, scope, fb);
+Box box_provided(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(Expr(), s, false, true, fn, scope, fb, cache);
 }
 
-map<string, Box> boxes_touched(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(e, Stmt(), true, true, "", scope, fb);
+map<string, Box> boxes_touched(Expr e, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(e, Stmt(), true, true, "", scope, fb, cache);
 }
 
-Box box_touched(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(e, Stmt(), true, true, fn, scope, fb);
+Box box_touched(Expr e, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(e, Stmt(), true, true, fn, scope, fb, cache);
 }
 
-map<string, Box> boxes_touched(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return boxes_touched(Expr(), s, true, true, "", scope, fb);
+map<string, Box> boxes_touched(Stmt s, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return boxes_touched(Expr(), s, true, true, "", scope, fb, cache);
 }
 
-Box box_touched(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb) {
-    return box_touched(Expr(), s, true, true, fn, scope, fb);
+Box box_touched(Stmt s, string fn, const Scope<Interval> &scope, const FuncValueBounds &fb, BoundsCache *cache) {
+    return box_touched(Expr(), s, true, true, fn, scope, fb, cache);
 }
 
 FuncValueBounds compute_function_value_bounds(const vector<string> &order,
-                                              const map<string, Function> &env) {
+                                              const map<string, Function> &env,
+                                              LoweringCache *cache) {
     FuncValueBounds fb;
 
     for (size_t i = 0; i < order.size(); i++) {
@@ -1553,6 +1625,11 @@ FuncValueBounds compute_function_value_bounds(const vector<string> &order,
                 !f.has_update_definition() &&
                 !f.has_extern_definition()) {
 
+                if (cache && cache->find_value_bounds(f, j, fb, result)) {
+                    fb[key] = result;
+                    continue;
+                }
+
                 // Make a scope that says the args could be anything.
                 Scope<Interval> arg_scope;
                 for (size_t k = 0; k < f.args().size(); k++) {
@@ -1573,6 +1650,9 @@ FuncValueBounds compute_function_value_bounds(const vector<string> &order,
 
                 fb[key] = result;
 
+                if (cache) {
+                    cache->add_value_bounds(f, j, fb, result);
+                }
             }
 
             debug(2) << "Bounds on value " << j
@@ -1691,6 +1771,27 @@ void bounds_test() {
     internal_assert(equal(simplify(r2[0].min), 4));
     internal_assert(equal(simplify(r2[0].max), 19));
 
+    // Repeated queries through a cache should hit, even when the
+    // intervals are equal by value but not by identity, and even if
+    // unrelated names are in scope.
+    FuncValueBounds fb;
+    BoundsCache cache(fb);
+    Scope<Interval> other_scope;
+    other_scope.push("x", Interval(Expr(0), Expr(10)));
+    other_scope.push("z", Interval(Expr(3), Expr(4)));
+    Interval i1 = bounds_of_expr_in_scope((x+1)*2, scope, fb, &cache);
+    Interval i2 = bounds_of_expr_in_scope((x+1)*2, other_scope, fb, &cache);
+    internal_assert(cache.num_hits() == 1 && cache.num_misses() == 1);
+    internal_assert(equal(simplify(i1.min), 2) && equal(simplify(i1.max), 22));
+    internal_assert(i2.min.same_as(i1.min) && i2.max.same_as(i1.max));
+    other_scope.push("x", Interval(Expr(0), Expr(20)));
+    Interval i3 = bounds_of_expr_in_scope((x+1)*2, other_scope, fb, &cache);
+    internal_assert(cache.num_misses() == 2);
+    internal_assert(equal(simplify(i3.max), 42));
+    r = boxes_required(loop, Scope<Interval>::empty_scope(), fb, &cache);
+    internal_assert(equal(simplify(r["input"][0].min), 6));
+    internal_assert(equal(simplify(r["input"][0].max), 25));
+
     std::cout << "Bounds test passed" << std::endl;
 }
 
@@ -7,6 +7,7 @@
  */
 
 #include "IROperator.h"
+#include "IREquality.h"
 #include "Scope.h"
 
 namespace Halide {
@@ -20,6 +21,49 @@ struct Interval {
 
 typedef std::map<std::pair<std::string, int>, Interval> FuncValueBounds;
 
+/** A memo table for the results of bounds_of_expr_in_scope, meant to
+ * be shared by the bounds queries made during a single lowering
+ * (bounds inference, image checks, the auto-scheduler's region
+ * analysis, ...), which ask for the bounds of the same call sites
+ * over and over again. Results are keyed on the expression and on
+ * the intervals that the enclosing scope binds to its free
+ * variables, both compared by value. A cache is tied to one set of
+ * function value bounds, which must outlive it; queries made with
+ * any other FuncValueBounds bypass the cache. */
+class BoundsCache {
+public:
+    BoundsCache(const FuncValueBounds &fb) : func_bounds(fb), compare_cache(8), hits(0), misses(0) {}
+
+    // The keys point into compare_cache, so a cache can't be copied.
+    BoundsCache(const BoundsCache &) = delete;
+    BoundsCache &operator=(const BoundsCache &) = delete;
+
+    /** Look up the bounds of an expression in a scope, computing and
+     * recording them on a miss. */
+    EXPORT Interval lookup(Expr expr, const Scope<Interval> &scope);
+
+    /** The function value bounds this cache was built with. */
+    const FuncValueBounds &value_bounds() const {return func_bounds;}
+
+    /** The number of queries answered from and added to the cache. */
+    // @{
+    int num_hits() const {return hits;}
+    int num_misses() const {return misses;}
+    // @}
+
+private:
+    struct Key {
+        std::vector<ExprWithCompareCache> exprs;
+        std::vector<std::string> names;
+        bool operator<(const Key &other) const;
+    };
+
+    const FuncValueBounds &func_bounds;
+    IRCompareCache compare_cache;
+    std::map<Key, Interval> table;
+    int hits, misses;
+};
+
 /** Given an expression in some variables, and a map from those
  * variables to their bounds (in the form of (minimum possible value,
  * maximum possible value)), compute two expressions that give the
@@ -30,11 +74,13 @@ typedef std::map<std::pair<std::string, int>, Interval> FuncValueBounds;
  * result.
  *
  * This is for tasks such as deducing the region of a buffer
- * loaded by a chunk of code.
+ * loaded by a chunk of code. If a BoundsCache built with the same
+ * func_bounds is provided, the result is memoized in it.
  */
 Interval bounds_of_expr_in_scope(Expr expr,
                                  const Scope<Interval> &scope,
-                                 const FuncValueBounds &func_bounds = FuncValueBounds());
+                                 const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                 BoundsCache *cache = nullptr);
 
 /* Given a varying expression, try to find a constant that is either:
  * An upper bound (always greater than or equal to the expression), or
@@ -75,14 +121,17 @@ bool boxes_overlap(const Box &a, const Box &b);
 /** Compute rectangular domains large enough to cover all the 'Call's
  * to each function that occurs within a given statement or
  * expression. This is useful for figuring out what regions of things
- * to evaluate. */
+ * to evaluate. The bounds of each call site are memoized in the
+ * BoundsCache, if one is given. */
 // @{
 std::map<std::string, Box> boxes_required(Expr e,
                                           const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                          const FuncValueBounds &func_bounds = FuncValueBounds());
+                                          const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                          BoundsCache *cache = nullptr);
 std::map<std::string, Box> boxes_required(Stmt s,
                                           const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                          const FuncValueBounds &func_bounds = FuncValueBounds());
+                                          const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                          BoundsCache *cache = nullptr);
 // @}
 
 /** Compute rectangular domains large enough to cover all the
@@ -91,10 +140,12 @@ std::map<std::string, Box> boxes_required(Stmt s,
 // @{
 std::map<std::string, Box> boxes_provided(Expr e,
                                           const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                          const FuncValueBounds &func_bounds = FuncValueBounds());
+                                          const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                          BoundsCache *cache = nullptr);
 std::map<std::string, Box> boxes_provided(Stmt s,
                                           const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                          const FuncValueBounds &func_bounds = FuncValueBounds());
+                                          const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                          BoundsCache *cache = nullptr);
 // @}
 
 /** Compute rectangular domains large enough to cover all the 'Call's
@@ -103,43 +154,55 @@ std::map<std::string, Box> boxes_provided(Stmt s,
 // @{
 std::map<std::string, Box> boxes_touched(Expr e,
                                          const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                         const FuncValueBounds &func_bounds = FuncValueBounds());
+                                         const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                         BoundsCache *cache = nullptr);
 std::map<std::string, Box> boxes_touched(Stmt s,
                                          const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                                         const FuncValueBounds &func_bounds = FuncValueBounds());
+                                         const FuncValueBounds &func_bounds = FuncValueBounds(),
+                                         BoundsCache *cache = nullptr);
 // @}
 
 /** Variants of the above that are only concerned with a single function. */
 // @{
 Box box_required(Expr e, std::string fn,
                  const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                 const FuncValueBounds &func_bounds = FuncValueBounds());
+                 const FuncValueBounds &func_bounds = FuncValueBounds(),
+                 BoundsCache *cache = nullptr);
 Box box_required(Stmt s, std::string fn,
                  const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                 const FuncValueBounds &func_bounds = FuncValueBounds());
+                 const FuncValueBounds &func_bounds = FuncValueBounds(),
+                 BoundsCache *cache = nullptr);
 
 Box box_provided(Expr e, std::string fn,
                  const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                 const FuncValueBounds &func_bounds = FuncValueBounds());
+                 const FuncValueBounds &func_bounds = FuncValueBounds(),
+                 BoundsCache *cache = nullptr);
 Box box_provided(Stmt s, std::string fn,
                  const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                 const FuncValueBounds &func_bounds = FuncValueBounds());
+                 const FuncValueBounds &func_bounds = FuncValueBounds(),
+                 BoundsCache *cache = nullptr);
 
 Box box_touched(Expr e, std::string fn,
                 const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                const FuncValueBounds &func_bounds = FuncValueBounds());
+                const FuncValueBounds &func_bounds = FuncValueBounds(),
+                BoundsCache *cache = nullptr);
 Box box_touched(Stmt s, std::string fn,
                 const Scope<Interval> &scope = Scope<Interval>::empty_scope(),
-                const FuncValueBounds &func_bounds = FuncValueBounds());
+                const FuncValueBounds &func_bounds = FuncValueBounds(),
+                BoundsCache *cache = nullptr);
 // @}
 
 //Interval interval_union(const Interval &a, const Interval &b);
 Interval interval_intersect(const Interval &a, const Interval &b);
 
+class LoweringCache;
+
 /** Compute the maximum and minimum possible value for each function
- * in an environment. */
+ * in an environment. Bounds found by earlier lowerings are reused
+ * from the given cache, if any. */
 FuncValueBounds compute_function_value_bounds(const std::vector<std::string> &order,
-                                              const std::map<std::string, Function> &env);
+                                              const std::map<std::string, Function> &env,
+                                              LoweringCache *cache = nullptr);
 
 EXPORT void bounds_test();
 
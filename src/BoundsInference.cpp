@@ -106,6 +106,7 @@ class BoundsInference : public IRMutator {
 public:
     const vector<Function> &funcs;
     const FuncValueBounds &func_bounds;
+    BoundsCache *bounds_cache;
     set<string> in_pipeline, inner_productions;
     Scope<int> in_stages;
 
@@ -459,8 +460,9 @@ public:
 
     BoundsInference(const vector<Function> &f,
                     const vector<Function> &outputs,
-                    const FuncValueBounds &fb) :
-        funcs(f), func_bounds(fb) {
+                    const FuncValueBounds &fb,
+                    BoundsCache *bc) :
+        funcs(f), func_bounds(fb), bounds_cache(bc) {
         internal_assert(!f.empty());
 
         // Compute the intrinsic relationships between the stages of
@@ -587,7 +589,7 @@ public:
                     }
                 }
 
-                map<string, Box> new_boxes = boxes_required(wrapped, scope, func_bounds);
+                map<string, Box> new_boxes = boxes_required(wrapped, scope, func_bounds, bounds_cache);
                 for (const pair<string, Box> &i : new_boxes) {
                     merge_boxes(boxes[i.first], i.second);
                 }
@@ -711,7 +713,7 @@ public:
         Box box;
         if (!no_pipelines && producing >= 0) {
             Scope<Interval> empty_scope;
-            box = box_provided(body, stages[producing].name, empty_scope, func_bounds);
+            box = box_provided(body, stages[producing].name, empty_scope, func_bounds, bounds_cache);
             internal_assert((int)box.size() == f.dimensions());
         }
 
@@ -827,7 +829,8 @@ Stmt bounds_inference(Stmt s,
                       const vector<Function> &outputs,
                       const vector<string> &order,
                       const map<string, Function> &env,
-                      const FuncValueBounds &func_bounds) {
+                      const FuncValueBounds &func_bounds,
+                      BoundsCache *bounds_cache) {
 
     vector<Function> funcs(order.size());
     for (size_t i = 0; i < order.size(); i++) {
@@ -836,7 +839,7 @@ Stmt bounds_inference(Stmt s,
 
     // Add an outermost bounds inference marker
     s = For::make("<outermost>", 0, 1, ForType::Serial, DeviceAPI::None, s);
-    s = BoundsInference(funcs, outputs, func_bounds).mutate(s);
+    s = BoundsInference(funcs, outputs, func_bounds, bounds_cache).mutate(s);
     return s.as<For>()->body;
 }
 
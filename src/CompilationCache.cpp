@@ -0,0 +1,635 @@
+#include "CompilationCache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+
+#include "Debug.h"
+#include "Error.h"
+#include "IRVisitor.h"
+#include "Util.h"
+
+// The id of this build of libHalide, generated by the build system
+// from the sources and compiler flags.
+#include "build_id.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// Two independent 64-bit hashes (FNV-1a and djb2) of the same bytes,
+// concatenated, make accidental collisions between different modules
+// vanishingly unlikely.
+struct KeyHasher {
+    uint64_t fnv, djb;
+
+    KeyHasher() : fnv(0xcbf29ce484222325ULL), djb(5381) {}
+
+    void add(const void *data, size_t size) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        for (size_t i = 0; i < size; i++) {
+            fnv = (fnv ^ bytes[i]) * 0x100000001b3ULL;
+            djb = (djb * 33) ^ bytes[i];
+        }
+    }
+
+    void add(const string &s) {
+        add(s.data(), s.size());
+        // Terminate each string, so that "ab" + "c" != "a" + "bc"
+        add("", 1);
+    }
+
+    template<typename T>
+    void add_value(T value) {
+        add(&value, sizeof(value));
+    }
+
+    void add(const Type &t) {
+        add_value((int)t.code());
+        add_value(t.bits());
+        add_value(t.lanes());
+        if (t.handle_type) {
+            const halide_handle_cplusplus_type *h = t.handle_type;
+            add_value((int)h->inner_name.cpp_type_type);
+            add(h->inner_name.name);
+            add_value(h->namespaces.size());
+            for (const string &n : h->namespaces) {
+                add(n);
+            }
+            add_value(h->enclosing_types.size());
+            for (const halide_cplusplus_type_name &n : h->enclosing_types) {
+                add_value((int)n.cpp_type_type);
+                add(n.name);
+            }
+            add(h->cpp_type_modifiers.begin(), 8);
+            add_value((int)h->reference_type);
+        } else {
+            add_value(0);
+        }
+    }
+
+    string hex() const {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx",
+                 (unsigned long long)fnv, (unsigned long long)djb);
+        return buf;
+    }
+};
+
+// Names made by unique_name carry a counter that advances every time
+// anything is lowered, so the same pipeline gets different names each
+// time it is compiled. Hashing them verbatim would mean the cache
+// almost never hits. Instead, the counter is stripped from each
+// component of a name, and replaced by the order in which names with
+// that stem first appear in the module. Distinct names in a module stay
+// distinct, and renaming everything consistently doesn't change the key.
+class NameCanonicalizer {
+    std::map<string, string> canonical;
+    std::map<string, int> stem_count;
+
+    // The part of a name component that doesn't come from a
+    // unique_name counter: "f" for "f12" and "sum" for "sum$3".
+    static string stem(const string &c) {
+        size_t dollar = c.rfind('$');
+        size_t digits = (dollar == string::npos) ? 1 : dollar + 1;
+        if (c.size() <= digits) return c;
+        for (size_t i = digits; i < c.size(); i++) {
+            if (!isdigit(c[i])) return c;
+        }
+        return c.substr(0, (dollar == string::npos) ? 1 : dollar);
+    }
+
+    const string &component(const string &c) {
+        auto it = canonical.find(c);
+        if (it != canonical.end()) return it->second;
+        string s = stem(c);
+        // '\x01' can't appear in a name, so canonical components never
+        // collide with each other.
+        string result = s + "\x01" + std::to_string(stem_count[s]++);
+        return canonical[c] = result;
+    }
+
+public:
+    string operator()(const string &name) {
+        string result;
+        for (const string &c : split_string(name, ".")) {
+            if (!result.empty()) result += ".";
+            result += component(c);
+        }
+        return result;
+    }
+};
+
+// The names of everything declared or referenced in some IR, so that
+// string constants that are just the name of something (e.g. the func
+// names reported by the profiler) can be canonicalized along with it.
+class CollectNames : public IRVisitor {
+    using IRVisitor::visit;
+
+    void visit(const Variable *op) {names.insert(op->name);}
+    void visit(const Let *op) {names.insert(op->name); IRVisitor::visit(op);}
+    void visit(const LetStmt *op) {names.insert(op->name); IRVisitor::visit(op);}
+    void visit(const ProducerConsumer *op) {names.insert(op->name); IRVisitor::visit(op);}
+    void visit(const For *op) {names.insert(op->name); IRVisitor::visit(op);}
+    void visit(const Allocate *op) {names.insert(op->name); IRVisitor::visit(op);}
+    void visit(const Realize *op) {names.insert(op->name); IRVisitor::visit(op);}
+
+public:
+    std::set<string> names;
+};
+
+// Feed the structure of some IR to a KeyHasher: the kind of every
+// node, all of its types, names and other fields, and the exact bits of
+// all constants. Unlike printing the IR, this is lossless, so that IR
+// that can generate different code never shares a key. The only
+// exception is names made by unique_name, which are canonicalized as
+// described above. The symbols of extern calls are hashed verbatim.
+class IRHasher : public IRVisitor {
+    KeyHasher &h;
+    NameCanonicalizer canonical;
+    const std::set<string> &names;
+
+    void tag(const char *kind, const Type &t) {
+        h.add(kind);
+        h.add(t);
+    }
+
+    void hash(const Expr &e) {
+        if (e.defined()) {
+            e.accept(this);
+        } else {
+            h.add("_");
+        }
+    }
+
+    void hash(const Stmt &s) {
+        if (s.defined()) {
+            s.accept(this);
+        } else {
+            h.add("_");
+        }
+    }
+
+    void hash(const vector<Expr> &v) {
+        h.add_value(v.size());
+        for (const Expr &e : v) {
+            hash(e);
+        }
+    }
+
+    template<typename T>
+    void hash_binary(const char *kind, const T *op) {
+        tag(kind, op->type);
+        hash(op->a);
+        hash(op->b);
+    }
+
+    using IRVisitor::visit;
+
+    void visit(const IntImm *op) {
+        tag("IntImm", op->type);
+        h.add_value(op->value);
+    }
+
+    void visit(const UIntImm *op) {
+        tag("UIntImm", op->type);
+        h.add_value(op->value);
+    }
+
+    void visit(const FloatImm *op) {
+        tag("FloatImm", op->type);
+        h.add_value(op->value);
+    }
+
+    void visit(const StringImm *op) {
+        tag("StringImm", op->type);
+        if (names.count(op->value)) {
+            add_name(op->value);
+        } else {
+            h.add(op->value);
+        }
+    }
+
+    void visit(const Cast *op) {
+        tag("Cast", op->type);
+        hash(op->value);
+    }
+
+    void visit(const Variable *op) {
+        tag("Variable", op->type);
+        add_name(op->name);
+    }
+
+    void visit(const Add *op) {hash_binary("Add", op);}
+    void visit(const Sub *op) {hash_binary("Sub", op);}
+    void visit(const Mul *op) {hash_binary("Mul", op);}
+    void visit(const Div *op) {hash_binary("Div", op);}
+    void visit(const Mod *op) {hash_binary("Mod", op);}
+    void visit(const Min *op) {hash_binary("Min", op);}
+    void visit(const Max *op) {hash_binary("Max", op);}
+    void visit(const EQ *op) {hash_binary("EQ", op);}
+    void visit(const NE *op) {hash_binary("NE", op);}
+    void visit(const LT *op) {hash_binary("LT", op);}
+    void visit(const LE *op) {hash_binary("LE", op);}
+    void visit(const GT *op) {hash_binary("GT", op);}
+    void visit(const GE *op) {hash_binary("GE", op);}
+    void visit(const And *op) {hash_binary("And", op);}
+    void visit(const Or *op) {hash_binary("Or", op);}
+
+    void visit(const Not *op) {
+        tag("Not", op->type);
+        hash(op->a);
+    }
+
+    void visit(const Select *op) {
+        tag("Select", op->type);
+        hash(op->condition);
+        hash(op->true_value);
+        hash(op->false_value);
+    }
+
+    void visit(const Load *op) {
+        tag("Load", op->type);
+        add_name(op->name);
+        hash(op->index);
+    }
+
+    void visit(const Ramp *op) {
+        tag("Ramp", op->type);
+        h.add_value(op->lanes);
+        hash(op->base);
+        hash(op->stride);
+    }
+
+    void visit(const Broadcast *op) {
+        tag("Broadcast", op->type);
+        h.add_value(op->lanes);
+        hash(op->value);
+    }
+
+    void visit(const Call *op) {
+        tag("Call", op->type);
+        if (op->call_type == Call::Extern ||
+            op->call_type == Call::ExternCPlusPlus ||
+            op->call_type == Call::PureExtern) {
+            h.add(op->name);
+        } else {
+            add_name(op->name);
+        }
+        h.add_value((int)op->call_type);
+        h.add_value(op->value_index);
+        hash(op->args);
+    }
+
+    void visit(const Let *op) {
+        tag("Let", op->type);
+        add_name(op->name);
+        hash(op->value);
+        hash(op->body);
+    }
+
+    void visit(const LetStmt *op) {
+        h.add("LetStmt");
+        add_name(op->name);
+        hash(op->value);
+        hash(op->body);
+    }
+
+    void visit(const AssertStmt *op) {
+        h.add("AssertStmt");
+        hash(op->condition);
+        hash(op->message);
+    }
+
+    void visit(const ProducerConsumer *op) {
+        h.add("ProducerConsumer");
+        add_name(op->name);
+        hash(op->produce);
+        hash(op->update);
+        hash(op->consume);
+    }
+
+    void visit(const For *op) {
+        h.add("For");
+        add_name(op->name);
+        h.add_value((int)op->for_type);
+        h.add_value((int)op->device_api);
+        hash(op->min);
+        hash(op->extent);
+        hash(op->body);
+    }
+
+    void visit(const Store *op) {
+        h.add("Store");
+        add_name(op->name);
+        hash(op->value);
+        hash(op->index);
+    }
+
+    void visit(const Provide *op) {
+        h.add("Provide");
+        add_name(op->name);
+        hash(op->values);
+        hash(op->args);
+    }
+
+    void visit(const Allocate *op) {
+        h.add("Allocate");
+        add_name(op->name);
+        h.add(op->type);
+        hash(op->extents);
+        hash(op->condition);
+        hash(op->new_expr);
+        h.add(op->free_function);
+        hash(op->body);
+    }
+
+    void visit(const Free *op) {
+        h.add("Free");
+        add_name(op->name);
+    }
+
+    void visit(const Realize *op) {
+        h.add("Realize");
+        add_name(op->name);
+        h.add_value(op->types.size());
+        for (const Type &t : op->types) {
+            h.add(t);
+        }
+        h.add_value(op->bounds.size());
+        for (const Range &r : op->bounds) {
+            hash(r.min);
+            hash(r.extent);
+        }
+        hash(op->condition);
+        hash(op->body);
+    }
+
+    void visit(const Block *op) {
+        h.add("Block");
+        hash(op->first);
+        hash(op->rest);
+    }
+
+    void visit(const IfThenElse *op) {
+        h.add("IfThenElse");
+        hash(op->condition);
+        hash(op->then_case);
+        hash(op->else_case);
+    }
+
+    void visit(const Evaluate *op) {
+        h.add("Evaluate");
+        hash(op->value);
+    }
+
+public:
+    IRHasher(KeyHasher &h, const std::set<string> &names) : h(h), names(names) {}
+
+    void add(const Expr &e) {hash(e);}
+    void add(const Stmt &s) {hash(s);}
+    void add_name(const string &name) {h.add(canonical(name));}
+};
+
+string entry_path(const string &dir, const string &key, const string &kind) {
+    return dir + "/" + key + "." + kind;
+}
+
+bool copy_file(const string &src, const string &dst) {
+    std::ifstream in(src, std::ifstream::in | std::ifstream::binary);
+    if (!in.good()) return false;
+    std::ofstream out(dst, std::ofstream::out | std::ofstream::binary);
+    out << in.rdbuf();
+    return out.good();
+}
+
+}
+
+string compilation_cache_dir() {
+    size_t read = 0;
+    string dir = get_env_variable("HL_COMPILE_CACHE_DIR", read);
+    return read ? dir : "";
+}
+
+string compilation_cache_key(const Module &module) {
+    KeyHasher h;
+
+    // Anything built by a different Halide or llvm may generate
+    // different code for the same IR.
+    h.add("Halide " HALIDE_BUILD_ID);
+    h.add("LLVM " + std::to_string(LLVM_VERSION));
+
+    h.add(module.target().to_string());
+
+    CollectNames names;
+    for (const LoweredFunc &f : module.functions()) {
+        f.body.accept(&names);
+    }
+    IRHasher ir(h, names.names);
+
+    for (const Buffer &b : module.buffers()) {
+        ir.add_name(b.name());
+        h.add(b.type());
+        h.add_value(b.dimensions());
+        size_t span = 1;
+        for (int i = 0; i < b.dimensions(); i++) {
+            h.add_value(b.min(i));
+            h.add_value(b.extent(i));
+            h.add_value(b.stride(i));
+            if (b.extent(i) > 0) {
+                span += (size_t)(b.extent(i) - 1) * std::abs(b.stride(i));
+            }
+        }
+        if (b.host_ptr()) {
+            h.add(b.host_ptr(), span * b.type().bytes());
+        } else {
+            h.add("_");
+        }
+    }
+
+    for (const LoweredFunc &f : module.functions()) {
+        // The names of functions and their arguments end up in the
+        // object (as symbols and metadata), so they're used verbatim.
+        h.add(f.name);
+        h.add_value((int)f.linkage);
+        h.add_value(f.args.size());
+        for (const Argument &arg : f.args) {
+            h.add(arg.name);
+            h.add_value((int)arg.kind);
+            h.add(arg.type);
+            h.add_value(arg.dimensions);
+            ir.add(arg.def);
+            ir.add(arg.min);
+            ir.add(arg.max);
+        }
+        ir.add(f.body);
+    }
+
+    return h.hex();
+}
+
+struct IRKey::Contents {
+    KeyHasher h;
+    std::set<string> names;
+    IRHasher ir;
+
+    Contents() : ir(h, names) {}
+};
+
+IRKey::IRKey() : contents(new Contents) {}
+
+IRKey::~IRKey() {}
+
+void IRKey::add(const Expr &e) {
+    contents->ir.add(e);
+}
+
+void IRKey::add_name(const string &name) {
+    contents->ir.add_name(name);
+}
+
+void IRKey::add(const string &s) {
+    contents->h.add(s);
+}
+
+void IRKey::add(const Type &t) {
+    contents->h.add(t);
+}
+
+string IRKey::hex() const {
+    return contents->h.hex();
+}
+
+string compilation_cache_lookup(const string &dir, const string &key, const string &kind) {
+    string path = entry_path(dir, key, kind);
+    if (!file_exists(path)) {
+        debug(2) << "Compilation cache miss: " << path << "\n";
+        return "";
+    }
+    debug(1) << "Compilation cache hit: " << path << "\n";
+    return path;
+}
+
+bool compilation_cache_fetch(const string &dir, const string &key,
+                             const string &kind, const string &dst) {
+    string path = compilation_cache_lookup(dir, key, kind);
+    return !path.empty() && copy_file(path, dst);
+}
+
+namespace {
+
+// Entries are written to a temporary file and renamed into place, so
+// that concurrent builds never see a partial entry.
+template<typename Writer>
+void store_entry(const string &dir, const string &key, const string &kind, Writer write) {
+    string path = entry_path(dir, key, kind);
+    string tmp = path + ".tmp" + std::to_string(std::random_device()());
+    if (!write(tmp) || std::rename(tmp.c_str(), path.c_str()) != 0) {
+        // Failing to fill the cache isn't fatal, it just means the
+        // next build will compile from scratch.
+        debug(1) << "Could not add " << path << " to the compilation cache\n";
+        if (file_exists(tmp)) {
+            file_unlink(tmp);
+        }
+    }
+}
+
+}
+
+void compilation_cache_store(const string &dir, const string &key,
+                             const string &kind, const string &src) {
+    store_entry(dir, key, kind, [&](const string &tmp) {
+            return copy_file(src, tmp);
+        });
+}
+
+void compilation_cache_store_data(const string &dir, const string &key,
+                                  const string &kind, const char *data, size_t size) {
+    store_entry(dir, key, kind, [&](const string &tmp) {
+            std::ofstream out(tmp, std::ofstream::out | std::ofstream::binary);
+            out.write(data, size);
+            return out.good();
+        });
+}
+
+void compilation_cache_test() {
+    Target t(Target::Linux, Target::X86, 64);
+    Stmt body = Evaluate::make(0);
+    vector<Argument> args = {Argument("input", Argument::InputBuffer, UInt(8), 2)};
+
+    Module a("a", t), b("a", t), c("a", t.with_feature(Target::SSE41)), d("a", t);
+    a.append(LoweredFunc("f", args, body, LoweredFunc::External));
+    b.append(LoweredFunc("f", args, body, LoweredFunc::External));
+    c.append(LoweredFunc("f", args, body, LoweredFunc::External));
+    d.append(LoweredFunc("f", args, Evaluate::make(1), LoweredFunc::External));
+
+    internal_assert(compilation_cache_key(a) == compilation_cache_key(b));
+    internal_assert(compilation_cache_key(a) != compilation_cache_key(c));
+    internal_assert(compilation_cache_key(a) != compilation_cache_key(d));
+
+    // Constants that print the same, and loads that differ only in
+    // their type, must not share a key.
+    Module e("a", t), f2("a", t), g("a", t), k("a", t);
+    e.append(LoweredFunc("f", args, Evaluate::make(0.1234567f), LoweredFunc::External));
+    f2.append(LoweredFunc("f", args, Evaluate::make(0.1234568f), LoweredFunc::External));
+    g.append(LoweredFunc("f", args, Evaluate::make(Load::make(UInt(8), "input", 0, Buffer(), Parameter())),
+                         LoweredFunc::External));
+    k.append(LoweredFunc("f", args, Evaluate::make(Load::make(Int(8), "input", 0, Buffer(), Parameter())),
+                         LoweredFunc::External));
+    internal_assert(compilation_cache_key(e) != compilation_cache_key(f2));
+    internal_assert(compilation_cache_key(g) != compilation_cache_key(k));
+
+    // Names made by unique_name differ each time a pipeline is
+    // lowered, but shouldn't change the key. Using one name where
+    // there were two should.
+    auto make_loop = [&](const string &x, const string &y) {
+        Expr load = Load::make(UInt(8), "input", Variable::make(Int(32), x), Buffer(), Parameter());
+        Stmt s = Store::make("out", Add::make(load, Variable::make(UInt(8), y)), Variable::make(Int(32), x), Parameter());
+        s = LetStmt::make(y, Expr((uint8_t)1), s);
+        return For::make(x, 0, 8, ForType::Serial, DeviceAPI::Host, s);
+    };
+    string t1 = unique_name('t'), t2 = unique_name('t'), t3 = unique_name('t'), t4 = unique_name('t');
+    Module m1("a", t), m2("a", t), m3("a", t);
+    m1.append(LoweredFunc("f", args, make_loop(t1, t2), LoweredFunc::External));
+    m2.append(LoweredFunc("f", args, make_loop(t3, t4), LoweredFunc::External));
+    m3.append(LoweredFunc("f", args, make_loop(t1, t1), LoweredFunc::External));
+    internal_assert(compilation_cache_key(m1) == compilation_cache_key(m2));
+    internal_assert(compilation_cache_key(m1) != compilation_cache_key(m3));
+
+    string key = compilation_cache_key(a);
+    {
+        std::ofstream f("compilation_cache_src.tmp");
+        f << "a123b";
+    }
+    internal_assert(!compilation_cache_fetch(".", key, "test", "compilation_cache_dst.tmp"));
+    compilation_cache_store(".", key, "test", "compilation_cache_src.tmp");
+    internal_assert(compilation_cache_fetch(".", key, "test", "compilation_cache_dst.tmp"));
+    std::ifstream f("compilation_cache_dst.tmp");
+    std::ostringstream contents;
+    contents << f.rdbuf();
+    internal_assert(contents.str() == "a123b") << contents.str() << "\n";
+
+    internal_assert(compilation_cache_lookup(".", key, "test") == entry_path(".", key, "test"));
+    internal_assert(compilation_cache_lookup(".", key, "test2").empty());
+    compilation_cache_store_data(".", key, "test2", "xyz", 3);
+    internal_assert(file_exists(compilation_cache_lookup(".", key, "test2")));
+    file_unlink(entry_path(".", key, "test2"));
+
+    file_unlink("compilation_cache_src.tmp");
+    file_unlink("compilation_cache_dst.tmp");
+    file_unlink(entry_path(".", key, "test"));
+
+    std::cout << "Compilation cache test passed" << std::endl;
+}
+
+}
+}
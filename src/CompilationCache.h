@@ -0,0 +1,82 @@
+#ifndef HALIDE_COMPILATION_CACHE_H
+#define HALIDE_COMPILATION_CACHE_H
+
+/** \file
+ * Defines a content-addressed cache of compiled outputs on disk, keyed
+ * by a hash of a lowered Module. This lets repeated builds of an
+ * unchanged pipeline skip code generation in llvm.
+ */
+
+#include <memory>
+#include <string>
+
+#include "Module.h"
+
+namespace Halide {
+namespace Internal {
+
+/** The directory holding the compilation cache, taken from the
+ * HL_COMPILE_CACHE_DIR environment variable. Returns an empty string
+ * if the cache is disabled. */
+std::string compilation_cache_dir();
+
+/** Compute a key that identifies everything affecting the code
+ * generated for a Module: the lowered functions and their arguments,
+ * any embedded buffers, the Target, and the builds of Halide and llvm
+ * doing the compiling. */
+EXPORT std::string compilation_cache_key(const Module &module);
+
+/** The path of the entry of the given kind stored under a key, or an
+ * empty string if there is no such entry. */
+EXPORT std::string compilation_cache_lookup(const std::string &dir, const std::string &key,
+                                            const std::string &kind);
+
+/** Copy the entry of the given kind (e.g. "o" or "bc") stored under a
+ * key to the file dst. Returns false if there is no such entry. */
+EXPORT bool compilation_cache_fetch(const std::string &dir, const std::string &key,
+                                    const std::string &kind, const std::string &dst);
+
+/** Store a copy of the file src as the entry of the given kind under
+ * a key. The entry is written to a temporary file and renamed into
+ * place, so concurrent builds never see a partial entry. */
+EXPORT void compilation_cache_store(const std::string &dir, const std::string &key,
+                                    const std::string &kind, const std::string &src);
+
+/** Store size bytes of data as the entry of the given kind under a
+ * key, in the same way as compilation_cache_store. */
+EXPORT void compilation_cache_store_data(const std::string &dir, const std::string &key,
+                                         const std::string &kind, const char *data, size_t size);
+
+/** A hash of some IR, computed in the same way as the keys of the
+ * compilation cache, for keying other caches on the code whose
+ * results they hold. IR that differs only in the names made by
+ * unique_name gets the same key. */
+class IRKey {
+    struct Contents;
+    std::unique_ptr<Contents> contents;
+public:
+    EXPORT IRKey();
+    EXPORT ~IRKey();
+
+    /** Add the structure and constants of some IR to the key. */
+    EXPORT void add(const Expr &e);
+
+    /** Add a name, canonicalized as it would be in some IR. */
+    EXPORT void add_name(const std::string &name);
+
+    /** Add a string or a type verbatim. */
+    // @{
+    EXPORT void add(const std::string &s);
+    EXPORT void add(const Type &t);
+    // @}
+
+    /** The key so far, as 32 hex digits. */
+    EXPORT std::string hex() const;
+};
+
+EXPORT void compilation_cache_test();
+
+}
+}
+
+#endif
@@ -1352,6 +1352,12 @@ Func &Func::trace_realizations() {
     return *this;
 }
 
+Func &Func::trace_store_regions() {
+    invalidate_cache();
+    func.trace_store_regions();
+    return *this;
+}
+
 void Func::debug_to_file(const string &filename) {
     invalidate_cache();
     func.debug_file() = filename;
@@ -1610,6 +1610,13 @@ public:
      * halide_trace. */
     EXPORT Func &trace_realizations();
 
+    /** Trace each region of this Func that gets produced, whether a
+     * tile or a scanline, as a single halide_trace_store_region event
+     * carrying a pointer to the values, rather than tracing each store
+     * separately. This is much cheaper than trace_stores for large
+     * Funcs. If the Func is inlined, this has no effect. */
+    EXPORT Func &trace_store_regions();
+
     /** Get a handle on the internal halide function that this Func
      * represents. Useful if you want to do introspection on Halide
      * functions */
@@ -50,13 +50,14 @@ struct FunctionContents {
     std::string extern_function_name;
     bool extern_is_c_plus_plus;
 
-    bool trace_loads, trace_stores, trace_realizations;
+    bool trace_loads, trace_stores, trace_realizations, trace_store_regions;
 
     bool frozen;
 
     bool lambda, boundary;
     FunctionContents() : extern_is_c_plus_plus(false), trace_loads(false),
                          trace_stores(false), trace_realizations(false),
+                         trace_store_regions(false),
                          frozen(false), lambda(false), boundary(false) {}
 
     void accept(IRVisitor *visitor) const {
@@ -370,6 +371,7 @@ void deep_copy_function_contents_helper(const IntrusivePtr<FunctionContents> &sr
     dst->trace_loads = src->trace_loads;
     dst->trace_stores = src->trace_stores;
     dst->trace_realizations = src->trace_realizations;
+    dst->trace_store_regions = src->trace_store_regions;
     dst->frozen = src->frozen;
     dst->output_buffers = src->output_buffers;
 
@@ -835,6 +837,9 @@ void Function::trace_stores() {
 void Function::trace_realizations() {
     contents->trace_realizations = true;
 }
+void Function::trace_store_regions() {
+    contents->trace_store_regions = true;
+}
 bool Function::is_tracing_loads() const {
     return contents->trace_loads;
 }
@@ -844,6 +849,9 @@ bool Function::is_tracing_stores() const {
 bool Function::is_tracing_realizations() const {
     return contents->trace_realizations;
 }
+bool Function::is_tracing_store_regions() const {
+    return contents->trace_store_regions;
+}
 
 void Function::freeze() {
     contents->frozen = true;
@@ -4,6 +4,7 @@
 #include <set>
 
 #include "CodeGen_Internal.h"
+#include "CompilationCache.h"
 #include "JITModule.h"
 #include "LLVM_Headers.h"
 #include "LLVM_Runtime_Linker.h"
@@ -200,6 +201,86 @@ public:
     }
 };
 
+#if LLVM_VERSION >= 36
+// Keeps the object code for jitted pipelines in the compilation
+// cache. Alongside each object, the cache holds a stub llvm module,
+// which carries the target options of the original, and defines the
+// entrypoints as stubs so that MCJIT knows which module to ask for
+// them. When MCJIT compiles the stub module, this supplies the cached
+// object code in its place.
+class JITObjectCache : public llvm::ObjectCache {
+    string dir, key;
+    std::unique_ptr<llvm::MemoryBuffer> object;
+    string stub_bitcode;
+
+public:
+    JITObjectCache(const string &dir, const string &key) : dir(dir), key(key) {}
+
+    // Load the stub module and object code from the cache, if they
+    // are there.
+    std::unique_ptr<llvm::Module> load(llvm::LLVMContext &context) {
+        string stub_path = compilation_cache_lookup(dir, key, "jit.bc");
+        string object_path = compilation_cache_lookup(dir, key, "jit.o");
+        if (stub_path.empty() || object_path.empty()) {
+            return nullptr;
+        }
+
+        auto stub_buffer = llvm::MemoryBuffer::getFile(stub_path);
+        auto object_buffer = llvm::MemoryBuffer::getFile(object_path);
+        if (!stub_buffer || !object_buffer) {
+            return nullptr;
+        }
+
+        auto stub = llvm::parseBitcodeFile((*stub_buffer)->getMemBufferRef(), context);
+        if (!stub) {
+            debug(1) << "Could not parse " << stub_path << "\n";
+            return nullptr;
+        }
+
+        object = std::move(*object_buffer);
+        return std::unique_ptr<llvm::Module>(std::move(*stub));
+    }
+
+    // Make the stub module to store alongside the object code that
+    // llvm will compile from the given module.
+    void make_stub(const llvm::Module &m, const std::vector<string> &entrypoints) {
+        llvm::Module stub(m.getModuleIdentifier(), m.getContext());
+        clone_target_options(m, stub);
+        #if LLVM_VERSION >= 37
+        stub.setDataLayout(m.getDataLayout());
+        #else
+        stub.setDataLayout(m.getDataLayoutStr());
+        #endif
+        for (const string &name : entrypoints) {
+            llvm::Function *fn = m.getFunction(name);
+            internal_assert(fn) << "Could not find " << name << " in module\n";
+            llvm::Function *stub_fn =
+                llvm::Function::Create(fn->getFunctionType(), llvm::GlobalValue::ExternalLinkage, name, &stub);
+            llvm::BasicBlock *block = llvm::BasicBlock::Create(m.getContext(), "entry", stub_fn);
+            new llvm::UnreachableInst(m.getContext(), block);
+        }
+
+        llvm::raw_string_ostream out(stub_bitcode);
+        llvm::WriteBitcodeToFile(&stub, out);
+        out.flush();
+    }
+
+    void notifyObjectCompiled(const llvm::Module *, llvm::MemoryBufferRef obj) override {
+        if (stub_bitcode.empty()) return;
+        // Store the stub first, so that anyone who finds the object
+        // code will also find the stub.
+        compilation_cache_store_data(dir, key, "jit.bc", stub_bitcode.data(), stub_bitcode.size());
+        compilation_cache_store_data(dir, key, "jit.o", obj.getBufferStart(), obj.getBufferSize());
+    }
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *) override {
+        if (!object) return nullptr;
+        debug(1) << "Using cached object code for " << key << "\n";
+        return llvm::MemoryBuffer::getMemBufferCopy(object->getBuffer());
+    }
+};
+#endif
+
 }
 
 JITModule::JITModule() {
@@ -209,16 +290,39 @@ JITModule::JITModule() {
 JITModule::JITModule(const Module &m, const LoweredFunc &fn,
                      const std::vector<JITModule> &dependencies) {
     jit_module = new JITModuleContents();
-    std::unique_ptr<llvm::Module> llvm_module(compile_module_to_llvm_module(m, jit_module->context));
+
+    std::unique_ptr<llvm::Module> llvm_module;
+    llvm::ObjectCache *object_cache = nullptr;
+    #if LLVM_VERSION >= 36
+    std::unique_ptr<JITObjectCache> jit_object_cache;
+    string cache_dir = compilation_cache_dir();
+    if (!cache_dir.empty()) {
+        jit_object_cache.reset(new JITObjectCache(cache_dir, compilation_cache_key(m)));
+        llvm_module = jit_object_cache->load(jit_module->context);
+        object_cache = jit_object_cache.get();
+    }
+    #endif
+
+    if (!llvm_module) {
+        llvm_module = compile_module_to_llvm_module(m, jit_module->context);
+        #if LLVM_VERSION >= 36
+        if (jit_object_cache) {
+            jit_object_cache->make_stub(*llvm_module, {fn.name, fn.name + "_argv"});
+        }
+        #endif
+    }
+
     std::vector<JITModule> deps_with_runtime = dependencies;
     std::vector<JITModule> shared_runtime = JITSharedRuntime::get(llvm_module.get(), m.target());
     deps_with_runtime.insert(deps_with_runtime.end(), shared_runtime.begin(), shared_runtime.end());
-    compile_module(std::move(llvm_module), fn.name, m.target(), deps_with_runtime);
+    compile_module(std::move(llvm_module), fn.name, m.target(), deps_with_runtime,
+                   std::vector<std::string>(), object_cache);
 }
 
 void JITModule::compile_module(std::unique_ptr<llvm::Module> m, const string &function_name, const Target &target,
                                const std::vector<JITModule> &dependencies,
-                               const std::vector<std::string> &requested_exports) {
+                               const std::vector<std::string> &requested_exports,
+                               llvm::ObjectCache *object_cache) {
 
     // Make the execution engine
     debug(2) << "Creating new execution engine\n";
@@ -283,6 +387,14 @@ void JITModule::compile_module(std::unique_ptr<llvm::Module> m, const string &fu
     if (!ee) std::cerr << error_string << "\n";
     internal_assert(ee) << "Couldn't create execution engine\n";
 
+    #if LLVM_VERSION >= 36
+    if (object_cache) {
+        ee->setObjectCache(object_cache);
+    }
+    #else
+    internal_assert(!object_cache) << "Object caching requires llvm 3.6 or later\n";
+    #endif
+
     #ifdef __arm__
     start = end = nullptr;
     #endif
@@ -347,6 +459,11 @@ void JITModule::compile_module(std::unique_ptr<llvm::Module> m, const string &fu
     // TODO: I don't think this is necessary, we shouldn't have any static constructors
     ee->runStaticConstructorsDestructors(false);
 
+    #if LLVM_VERSION >= 36
+    // The object cache needn't outlive this call.
+    ee->setObjectCache(nullptr);
+    #endif
+
     // Stash the various objects that need to stay alive behind a reference-counted pointer.
     jit_module->exports = exports;
     jit_module->execution_engine = ee;
@@ -456,6 +573,14 @@ void JITModule::memoization_cache_set_size(int64_t size) const {
     }
 }
 
+void JITModule::malloc_pool_set_size(size_t size) const {
+    std::map<std::string, Symbol>::const_iterator f =
+        exports().find("halide_malloc_pool_set_size");
+    if (f != exports().end()) {
+        return (reinterpret_bits<void (*)(size_t)>(f->second.address))(size);
+    }
+}
+
 bool JITModule::compiled() const {
   return jit_module->execution_engine != nullptr;
 }
@@ -466,6 +591,7 @@ JITHandlers runtime_internal_handlers;
 JITHandlers default_handlers;
 JITHandlers active_handlers;
 int64_t default_cache_size;
+size_t default_malloc_pool_size;
 
 void merge_handlers(JITHandlers &base, const JITHandlers &addins) {
     if (addins.custom_print) {
@@ -705,6 +831,10 @@ JITModule &make_module(llvm::Module *for_module, Target target,
                 shared_runtimes(MainShared).memoization_cache_set_size(default_cache_size);
             }
 
+            if (default_malloc_pool_size != 0) {
+                shared_runtimes(MainShared).malloc_pool_set_size(default_malloc_pool_size);
+            }
+
             runtime.jit_module->name = "MainShared";
         } else {
             runtime.jit_module->name = "GPU";
@@ -810,5 +940,14 @@ void JITSharedRuntime::memoization_cache_set_size(int64_t size) {
     }
 }
 
+void JITSharedRuntime::malloc_pool_set_size(size_t size) {
+    std::lock_guard<std::mutex> lock(shared_runtimes_mutex);
+
+    if (size != default_malloc_pool_size) {
+        default_malloc_pool_size = size;
+        shared_runtimes(MainShared).malloc_pool_set_size(size);
+    }
+}
+
 }
 }
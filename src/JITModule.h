@@ -15,6 +15,7 @@
 
 namespace llvm {
 class Module;
+class ObjectCache;
 class Type;
 }
 
@@ -56,6 +57,12 @@ struct JITModule {
     };
 
     EXPORT JITModule();
+    /** Compile a lowered function in a Module. If the
+     * HL_COMPILE_CACHE_DIR environment variable names a compilation
+     * cache, and it holds object code for the same Module compiled
+     * by an earlier run, that object code is linked instead of
+     * generating and compiling llvm ir. Otherwise the object code
+     * compiled is added to the cache. */
     EXPORT JITModule(const Module &m, const LoweredFunc &fn,
                      const std::vector<JITModule> &dependencies = std::vector<JITModule>());
     /** The exports map of a JITModule contains all symbols which are
@@ -122,17 +129,22 @@ struct JITModule {
     EXPORT Symbol find_symbol_by_name(const std::string &) const;
 
     /** Take an llvm module and compile it. The requested exports will
-        be available via the exports method. */
+        be available via the exports method. If an object cache is
+        given, it may supply the object code for the module instead of
+        llvm compiling it, and is told about any object code llvm
+        does compile. */
     EXPORT void compile_module(std::unique_ptr<llvm::Module> mod,
                                const std::string &function_name, const Target &target,
                                const std::vector<JITModule> &dependencies = std::vector<JITModule>(),
-                               const std::vector<std::string> &requested_exports = std::vector<std::string>());
+                               const std::vector<std::string> &requested_exports = std::vector<std::string>(),
+                               llvm::ObjectCache *object_cache = nullptr);
 
     /** Encapsulate device (GPU) and buffer interactions. */
     EXPORT int copy_to_device(struct buffer_t *buf) const;
     EXPORT int copy_to_host(struct buffer_t *buf) const;
     EXPORT int device_free(struct buffer_t *buf) const;
     EXPORT void memoization_cache_set_size(int64_t size) const;
+    EXPORT void malloc_pool_set_size(size_t size) const;
 
     /** Return true if compile_module has been called on this module. */
     EXPORT bool compiled() const;
@@ -172,6 +184,13 @@ public:
      */
     EXPORT static void memoization_cache_set_size(int64_t size);
 
+    /** Set the most memory that each pool of freed blocks kept by the
+     * default allocator may hold. Zero turns pooling off. If you are
+     * compiling statically, you should include HalideRuntime.h and
+     * call halide_malloc_pool_set_size() instead.
+     */
+    EXPORT static void malloc_pool_set_size(size_t size);
+
     EXPORT static void release_all();
 };
 
@@ -18,6 +18,9 @@
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/ExecutionEngine/JITEventListener.h>
+#if LLVM_VERSION >= 36
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#endif
 
 #if LLVM_VERSION < 35
 #include <llvm/Analysis/Verifier.h>
@@ -55,6 +58,9 @@
 #include <llvm/Transforms/Utils/ModuleUtils.h>
 #include <llvm/ADT/StringMap.h>
 #include <llvm/Object/ObjectFile.h>
+#if LLVM_VERSION >= 38
+#include <llvm/CodeGen/ParallelCG.h>
+#endif
 
 // Temporary affordance to compile with both llvm 3.2 and 3.3+
 // Protected as at least one installation of llvm elides version macros.
@@ -3,9 +3,12 @@
 #include "CodeGen_LLVM.h"
 #include "CodeGen_C.h"
 #include "CodeGen_Internal.h"
+#include "StaticLibrary.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <thread>
 
 namespace Halide {
 
@@ -122,6 +125,148 @@ void compile_llvm_module_to_assembly(llvm::Module &module, Internal::LLVMOStream
     emit_file(module, out, llvm::TargetMachine::CGFT_AssemblyFile);
 }
 
+namespace {
+
+int default_codegen_partitions(const llvm::Module &module) {
+    size_t read = 0;
+    std::string threads_var = Internal::get_env_variable("HL_NUM_CODEGEN_THREADS", read);
+    int threads = read ? atoi(threads_var.c_str()) : (int)std::thread::hardware_concurrency();
+    // There's no point in more partitions than there are functions to put in them.
+    int functions = 0;
+    for (const llvm::Function &f : module) {
+        if (!f.isDeclaration()) {
+            functions++;
+        }
+    }
+    return std::max(1, std::min(threads, functions));
+}
+
+// Get the global symbols an object defines, for the symbol table of
+// an archive.
+std::vector<std::string> defined_symbols(const llvm::SmallVector<char, 0> &object) {
+    std::vector<std::string> symbols;
+    llvm::MemoryBufferRef buffer(llvm::StringRef(object.data(), object.size()), "object");
+
+    // The API to do this keeps changing.
+    #if LLVM_VERSION >= 39
+    llvm::Expected<std::unique_ptr<llvm::object::ObjectFile>> obj =
+        llvm::object::ObjectFile::createObjectFile(buffer);
+    if (!obj) {
+        consumeError(obj.takeError());
+        internal_error << "Could not read the symbols of a generated object\n";
+    }
+    #else
+    llvm::ErrorOr<std::unique_ptr<llvm::object::ObjectFile>> obj =
+        llvm::object::ObjectFile::createObjectFile(buffer);
+    internal_assert(obj) << "Could not read the symbols of a generated object\n";
+    #endif
+
+    for (const llvm::object::SymbolRef &symbol : (*obj)->symbols()) {
+        uint32_t flags = symbol.getFlags();
+        if (!(flags & llvm::object::SymbolRef::SF_Global) ||
+            (flags & llvm::object::SymbolRef::SF_Undefined)) {
+            continue;
+        }
+        #if LLVM_VERSION >= 39
+        llvm::Expected<llvm::StringRef> name = symbol.getName();
+        if (!name) {
+            consumeError(name.takeError());
+            continue;
+        }
+        symbols.push_back(name->str());
+        #elif LLVM_VERSION >= 38
+        llvm::ErrorOr<llvm::StringRef> name = symbol.getName();
+        if (name) {
+            symbols.push_back(name->str());
+        }
+        #else
+        llvm::StringRef name;
+        if (!symbol.getName(name)) {
+            symbols.push_back(name.str());
+        }
+        #endif
+    }
+    return symbols;
+}
+
+}
+
+void compile_llvm_module_to_static_library(std::unique_ptr<llvm::Module> module,
+                                           const std::string &filename,
+                                           int num_partitions) {
+    if (num_partitions <= 0) {
+        num_partitions = default_codegen_partitions(*module);
+    }
+    std::string member_prefix = Internal::base_name(filename, '/');
+    member_prefix = member_prefix.substr(0, member_prefix.rfind('.'));
+
+    std::vector<llvm::SmallVector<char, 0>> objects(num_partitions);
+    bool is_darwin = llvm::Triple(module->getTargetTriple()).isOSDarwin();
+
+#if LLVM_VERSION >= 38
+    Internal::debug(1) << "Compiling to native code in " << num_partitions << " partitions...\n";
+
+    // Inline the always-inline runtime functions first, so that
+    // they stay with their callers when the module is split.
+    llvm::legacy::PassManager pass_manager;
+    pass_manager.add(llvm::createAlwaysInlinerPass());
+    pass_manager.run(*module);
+
+    llvm::TargetOptions options;
+    std::string mcpu = "";
+    std::string mattrs = "";
+    Internal::get_target_options(*module, options, mcpu, mattrs);
+
+    std::vector<std::unique_ptr<llvm::raw_svector_ostream>> streams;
+    std::vector<llvm::raw_pwrite_stream *> outs;
+    for (int i = 0; i < num_partitions; i++) {
+        streams.emplace_back(new llvm::raw_svector_ostream(objects[i]));
+        outs.push_back(streams.back().get());
+    }
+
+    // Each partition is cloned into its own context and handed to
+    // its own thread for code generation.
+    #if LLVM_VERSION >= 39
+    // Each thread makes its own target machine. The module has been
+    // given away by then, so look up the target first.
+    std::string triple = module->getTargetTriple();
+    std::string error_string;
+    const llvm::Target *target = llvm::TargetRegistry::lookupTarget(triple, error_string);
+    internal_assert(target) << "Could not create target for " << triple << ": " << error_string << "\n";
+    auto target_machine_factory = [&]() {
+        return std::unique_ptr<llvm::TargetMachine>(
+            target->createTargetMachine(triple, mcpu, mattrs, options,
+                                        llvm::Reloc::PIC_, llvm::CodeModel::Default,
+                                        llvm::CodeGenOpt::Aggressive));
+    };
+    llvm::splitCodeGen(std::move(module), outs, {}, target_machine_factory,
+                       llvm::TargetMachine::CGFT_ObjectFile);
+    #else
+    llvm::splitCodeGen(std::move(module), outs, mcpu, mattrs, options,
+                       llvm::Reloc::PIC_, llvm::CodeModel::Default,
+                       llvm::CodeGenOpt::Aggressive, llvm::TargetMachine::CGFT_ObjectFile);
+    #endif
+    streams.clear();
+#else
+    objects.resize(1);
+    {
+        llvm::raw_svector_ostream out(objects[0]);
+        compile_llvm_module_to_object(*module, out);
+    }
+#endif
+
+    std::vector<Internal::ArInput> members;
+    for (size_t i = 0; i < objects.size(); i++) {
+        Internal::ArInput member;
+        member.name = member_prefix + "_" + std::to_string(i) + ".o";
+        member.data.assign(objects[i].begin(), objects[i].end());
+        member.symbols = defined_symbols(objects[i]);
+        members.push_back(member);
+    }
+    // Darwin's linker only reads the BSD format of symbol table.
+    Internal::create_ar_file(members, filename, is_darwin);
+}
+
 void compile_llvm_module_to_llvm_bitcode(llvm::Module &module, Internal::LLVMOStream& out) {
     WriteBitcodeToFile(&module, out);
 }
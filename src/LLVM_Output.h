@@ -38,6 +38,17 @@ EXPORT void compile_llvm_module_to_object(llvm::Module &module, Internal::LLVMOS
 EXPORT void compile_llvm_module_to_assembly(llvm::Module &module, Internal::LLVMOStream& out);
 // @}
 
+/** Compile an LLVM module to a static library of native objects. The
+ * module is split by function into up to num_partitions pieces,
+ * which are compiled to objects concurrently, one thread per piece. If num_partitions is zero,
+ * it is taken from the HL_NUM_CODEGEN_THREADS environment variable,
+ * or the number of hardware threads. The archive has a symbol table,
+ * so it can be linked without running ranlib. Splitting requires llvm
+ * 3.8 or later; earlier versions emit a single object. */
+EXPORT void compile_llvm_module_to_static_library(std::unique_ptr<llvm::Module> module,
+                                                  const std::string &filename,
+                                                  int num_partitions = 0);
+
 /** Compile an LLVM module to LLVM targets (bitcode, LLVM assembly). */
 // @{
 EXPORT void compile_llvm_module_to_llvm_bitcode(llvm::Module &module, Internal::LLVMOStream& out);
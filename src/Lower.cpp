@@ -26,6 +26,7 @@
 #include "IRMutator.h"
 #include "IROperator.h"
 #include "IRPrinter.h"
+#include "LoweringCache.h"
 #include "Memoization.h"
 #include "PartitionLoops.h"
 #include "Profiling.h"
@@ -63,7 +64,8 @@ using std::map;
 
 Stmt lower(vector<Function> &outputs, const string &pipeline_name,
            const Target &t, const vector<IRMutator *> &custom_passes,
-           bool auto_schedule, bool no_vec) {
+           bool auto_schedule, bool no_vec, LoweringCache *lowering_cache,
+           map<string, FuncCostEstimate> *cost_estimates) {
 
     // Compute an environment
     map<string, Function> env;
@@ -81,7 +83,11 @@ Stmt lower(vector<Function> &outputs, const string &pipeline_name,
     // Compute the maximum and minimum possible value of each
     // function. Used in later bounds inference passes.
     debug(1) << "Computing bounds of each function's value\n";
-    FuncValueBounds func_bounds = compute_function_value_bounds(order, env);
+    FuncValueBounds func_bounds = compute_function_value_bounds(order, env, lowering_cache);
+
+    // The bounds passes below ask for the bounds of many of the same
+    // call sites, so they share a cache of the answers.
+    BoundsCache bounds_cache(func_bounds);
 
     if (auto_schedule) {
         bool root_default = true;
@@ -93,7 +99,8 @@ Stmt lower(vector<Function> &outputs, const string &pipeline_name,
                                         std::chrono::high_resolution_clock::now();
 
         schedule_advisor(outputs, order, env, func_bounds, t,
-                         root_default, auto_inline, auto_par, auto_vec);
+                         root_default, auto_inline, auto_par, auto_vec,
+                         &bounds_cache, cost_estimates);
 
         std::chrono::high_resolution_clock::time_point t2 =
                                         std::chrono::high_resolution_clock::now();
@@ -108,7 +115,7 @@ Stmt lower(vector<Function> &outputs, const string &pipeline_name,
     bool any_memoized = false;
 
     debug(1) << "Creating initial loop nests...\n";
-    Stmt s = schedule_functions(outputs, order, env, t, any_memoized);
+    Stmt s = schedule_functions(outputs, order, env, t, any_memoized, lowering_cache);
     debug(2) << "Lowering after creating initial loop nests:\n" << s << '\n';
 
     if (any_memoized) {
@@ -132,14 +139,14 @@ Stmt lower(vector<Function> &outputs, const string &pipeline_name,
     // The checks will be in terms of the symbols defined by bounds
     // inference.
     debug(1) << "Adding checks for images\n";
-    s = add_image_checks(s, outputs, t, order, env, func_bounds);
+    s = add_image_checks(s, outputs, t, order, env, func_bounds, &bounds_cache);
     debug(2) << "Lowering after injecting image checks:\n" << s << '\n';
 
     // This pass injects nested definitions of variable names, so we
     // can't simplify statements from here until we fix them up. (We
     // can still simplify Exprs).
     debug(1) << "Performing computation bounds inference...\n";
-    s = bounds_inference(s, outputs, order, env, func_bounds);
+    s = bounds_inference(s, outputs, order, env, func_bounds, &bounds_cache);
     debug(2) << "Lowering after computation bounds inference:\n" << s << '\n';
 
     debug(1) << "Performing sliding window optimization...\n";
@@ -147,8 +154,16 @@ Stmt lower(vector<Function> &outputs, const string &pipeline_name,
     debug(2) << "Lowering after sliding window:\n" << s << '\n';
 
     debug(1) << "Performing allocation bounds inference...\n";
-    s = allocation_bounds_inference(s, env, func_bounds);
+    s = allocation_bounds_inference(s, env, func_bounds, &bounds_cache);
     debug(2) << "Lowering after allocation bounds inference:\n" << s << '\n';
+    debug(2) << "Bounds cache: " << bounds_cache.num_hits() << " hits, "
+             << bounds_cache.num_misses() << " misses\n";
+
+    if (lowering_cache) {
+        debug(2) << "Lowering cache: " << lowering_cache->num_hits() << " hits, "
+                 << lowering_cache->num_misses() << " misses\n";
+        lowering_cache->sweep();
+    }
 
     debug(1) << "Removing code that depends on undef values...\n";
     s = remove_undef(s);
@@ -7,6 +7,8 @@
  * Halide function using its schedule.
  */
 
+#include <map>
+
 #include "IR.h"
 #include "Target.h"
 
@@ -14,13 +16,21 @@ namespace Halide {
 namespace Internal {
 
 class IRMutator;
+class LoweringCache;
+struct FuncCostEstimate;
 
 /** Given a halide function with a schedule, create a statement that
  * evaluates it. Automatically pulls in all the functions f depends
- * on. Some stages of lowering may be target-specific. */
+ * on. Some stages of lowering may be target-specific. If a
+ * LoweringCache is given, the results of earlier lowerings of the
+ * same pipeline are reused for Functions that haven't changed. If
+ * auto-scheduling, its cost estimates are stored in cost_estimates,
+ * if given. */
 EXPORT Stmt lower(std::vector<Function> &outputs, const std::string &pipeline_name, const Target &t,
                   const std::vector<IRMutator *> &custom_passes = std::vector<IRMutator *>(),
-                  bool auto_schedule = false, bool no_vec = false);
+                  bool auto_schedule = false, bool no_vec = false,
+                  LoweringCache *lowering_cache = nullptr,
+                  std::map<std::string, FuncCostEstimate> *cost_estimates = nullptr);
 
 void lower_test();
 
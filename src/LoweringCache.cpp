@@ -0,0 +1,339 @@
+#include <iostream>
+
+#include "LoweringCache.h"
+#include "Debug.h"
+#include "IRMutator.h"
+#include "IROperator.h"
+#include "IRVisitor.h"
+#include "Schedule.h"
+#include "Var.h"
+
+namespace Halide {
+namespace Internal {
+
+using std::map;
+using std::pair;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace {
+
+// Flattens the parts of a Function into a key. Every list is
+// preceded by its length, so that different structures can't
+// flatten to the same key.
+class KeyBuilder {
+    vector<ExprWithCompareCache> &exprs;
+    vector<string> &names;
+    IRCompareCache *cache;
+
+public:
+    KeyBuilder(vector<ExprWithCompareCache> &e, vector<string> &n, IRCompareCache *c) :
+        exprs(e), names(n), cache(c) {}
+
+    void add(const string &s) {
+        names.push_back(s);
+    }
+
+    void add(int i) {
+        names.push_back(std::to_string(i));
+    }
+
+    void add(Expr e) {
+        exprs.push_back(ExprWithCompareCache(e, cache));
+    }
+
+    void add(const vector<Expr> &es) {
+        add((int)es.size());
+        for (Expr e : es) {
+            add(e);
+        }
+    }
+
+    void add(const vector<string> &ss) {
+        add((int)ss.size());
+        for (const string &s : ss) {
+            add(s);
+        }
+    }
+
+    void add(const LoopLevel &l) {
+        add(l.func);
+        add(l.var);
+        add(l.is_index ? l.index : -1);
+    }
+
+    void add(const ReductionDomain &rdom) {
+        if (!rdom.defined()) {
+            add(-1);
+            return;
+        }
+        add((int)rdom.domain().size());
+        for (const ReductionVariable &rv : rdom.domain()) {
+            add(rv.var);
+            add(rv.min);
+            add(rv.extent);
+        }
+        add(rdom.predicate());
+    }
+
+    void add(const Schedule &s) {
+        add((int)s.splits().size());
+        for (const Split &split : s.splits()) {
+            add(split.old_var);
+            add(split.outer);
+            add(split.inner);
+            add(split.factor);
+            add((int)split.exact);
+            add((int)split.tail);
+            add((int)split.split_type);
+        }
+        add((int)s.dims().size());
+        for (const Dim &d : s.dims()) {
+            add(d.var);
+            add((int)d.for_type);
+            add((int)d.device_api);
+            add((int)d.pure);
+        }
+        add((int)s.storage_dims().size());
+        for (const StorageDim &d : s.storage_dims()) {
+            add(d.var);
+            add(d.alignment);
+        }
+        add((int)s.bounds().size());
+        for (const Bound &b : s.bounds()) {
+            add(b.var);
+            add(b.min);
+            add(b.extent);
+        }
+        add(s.reduction_domain());
+        add(s.store_level());
+        add(s.compute_level());
+        add((int)s.memoized());
+        add((int)s.allow_race_conditions());
+        add((int)s.specializations().size());
+        for (const Specialization &spec : s.specializations()) {
+            add(spec.condition);
+            add(Schedule(spec.schedule));
+        }
+    }
+};
+
+// Find the values of other Functions an Expr calls.
+class FindCalledValues : public IRGraphVisitor {
+    using IRGraphVisitor::visit;
+
+    void visit(const Call *op) {
+        IRGraphVisitor::visit(op);
+        if (op->call_type == Call::Halide) {
+            calls.insert(std::make_pair(op->name, op->value_index));
+        }
+    }
+
+public:
+    set<pair<string, int>> calls;
+};
+
+// Point calls to other Functions at the copies in the current
+// environment, rather than those of the lowering that built a cached
+// Stmt.
+class RebindCalls : public IRMutator {
+    const map<string, Function> &env;
+
+    using IRMutator::visit;
+
+    void visit(const Call *op) {
+        IRMutator::visit(op);
+        op = expr.as<Call>();
+        internal_assert(op);
+        if (op->call_type == Call::Halide && op->func.defined()) {
+            map<string, Function>::const_iterator iter = env.find(op->name);
+            if (iter != env.end() && !iter->second.get_contents().same_as(op->func)) {
+                expr = Call::make(iter->second, op->args, op->value_index);
+            }
+        }
+    }
+
+public:
+    RebindCalls(const map<string, Function> &e) : env(e) {}
+};
+
+}
+
+bool LoweringCache::Key::operator<(const Key &other) const {
+    if (names != other.names) {
+        return names < other.names;
+    }
+    if (exprs.size() != other.exprs.size()) {
+        return exprs.size() < other.exprs.size();
+    }
+    for (size_t i = 0; i < exprs.size(); i++) {
+        if (exprs[i] < other.exprs[i]) {
+            return true;
+        } else if (other.exprs[i] < exprs[i]) {
+            return false;
+        }
+    }
+    return false;
+}
+
+LoweringCache::Key LoweringCache::production_key(const Function &f) {
+    Key key;
+    KeyBuilder b(key.exprs, key.names, &compare_cache);
+    b.add(f.name());
+    b.add(f.args());
+    b.add(f.values());
+    b.add(f.schedule());
+    b.add((int)f.updates().size());
+    for (const UpdateDefinition &u : f.updates()) {
+        b.add(u.args);
+        b.add(u.values);
+        b.add(u.domain);
+        b.add(u.schedule);
+    }
+    return key;
+}
+
+LoweringCache::Key LoweringCache::value_bounds_key(const Function &f, int idx,
+                                                   const FuncValueBounds &fb) {
+    // The bounds of a value depend on its definition, and on the
+    // value bounds of the Functions it calls.
+    Expr value = f.values()[idx];
+    FindCalledValues finder;
+    value.accept(&finder);
+
+    Key key;
+    KeyBuilder b(key.exprs, key.names, &compare_cache);
+    b.add(f.args());
+    b.add(value);
+    for (const pair<string, int> &call : finder.calls) {
+        b.add(call.first);
+        b.add(call.second);
+        FuncValueBounds::const_iterator iter = fb.find(call);
+        if (iter == fb.end()) {
+            b.add(0);
+        } else {
+            b.add(1);
+            b.add(iter->second.min);
+            b.add(iter->second.max);
+        }
+    }
+    return key;
+}
+
+bool LoweringCache::find_production(const Function &f, const map<string, Function> &env,
+                                    pair<Stmt, Stmt> &production) {
+    if (f.has_extern_definition()) {
+        return false;
+    }
+    map<Key, Entry<pair<Stmt, Stmt>>>::iterator iter = productions.find(production_key(f));
+    if (iter == productions.end()) {
+        debug(3) << "Lowering cache miss for production of " << f.name() << "\n";
+        misses++;
+        return false;
+    }
+    debug(3) << "Lowering cache hit for production of " << f.name() << "\n";
+    hits++;
+    iter->second.generation = generation;
+    RebindCalls rebind(env);
+    production.first = rebind.mutate(iter->second.value.first);
+    if (iter->second.value.second.defined()) {
+        production.second = rebind.mutate(iter->second.value.second);
+    } else {
+        production.second = Stmt();
+    }
+    return true;
+}
+
+void LoweringCache::add_production(const Function &f, const pair<Stmt, Stmt> &production) {
+    if (f.has_extern_definition()) {
+        return;
+    }
+    Entry<pair<Stmt, Stmt>> entry = {production, generation};
+    productions[production_key(f)] = entry;
+}
+
+bool LoweringCache::find_value_bounds(const Function &f, int idx, const FuncValueBounds &fb,
+                                      Interval &result) {
+    map<Key, Entry<Interval>>::iterator iter = value_bounds.find(value_bounds_key(f, idx, fb));
+    if (iter == value_bounds.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    iter->second.generation = generation;
+    result = iter->second.value;
+    return true;
+}
+
+void LoweringCache::add_value_bounds(const Function &f, int idx, const FuncValueBounds &fb,
+                                     const Interval &result) {
+    Entry<Interval> entry = {result, generation};
+    value_bounds[value_bounds_key(f, idx, fb)] = entry;
+}
+
+namespace {
+template<typename Table>
+void sweep_table(Table &table, int generation) {
+    for (typename Table::iterator iter = table.begin(); iter != table.end(); ) {
+        if (iter->second.generation != generation) {
+            iter = table.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+}
+
+void LoweringCache::sweep() {
+    sweep_table(productions, generation);
+    sweep_table(value_bounds, generation);
+    generation++;
+    // Start afresh, so that the compare cache doesn't keep Exprs from
+    // dropped entries alive.
+    compare_cache = IRCompareCache(8);
+}
+
+void lowering_cache_test() {
+    Var x("x"), y("y");
+
+    // Two Functions with the same definition and schedule.
+    Function f1("f"), f2("f");
+    f1.define({"x", "y"}, {x + y});
+    f2.define({"x", "y"}, {x + y});
+
+    LoweringCache cache;
+    map<string, Function> env;
+    pair<Stmt, Stmt> p(Evaluate::make(1), Stmt()), q;
+    internal_assert(!cache.find_production(f1, env, q));
+    cache.add_production(f1, p);
+    internal_assert(cache.find_production(f2, env, q));
+    internal_assert(q.first.same_as(p.first) && !q.second.defined());
+
+    // Changing the schedule of one makes it miss.
+    f2.schedule().dims()[0].for_type = ForType::Parallel;
+    internal_assert(!cache.find_production(f2, env, q));
+
+    // Value bounds depend on the bounds of called Functions.
+    Function g("g");
+    g.define({"x"}, {Call::make(f1, {x, x}) + 1});
+    FuncValueBounds fb;
+    fb[std::make_pair("f", 0)] = Interval(0, 10);
+    Interval i(1, 11);
+    cache.add_value_bounds(g, 0, fb, i);
+    internal_assert(cache.find_value_bounds(g, 0, fb, i));
+    fb[std::make_pair("f", 0)] = Interval(0, 20);
+    internal_assert(!cache.find_value_bounds(g, 0, fb, i));
+
+    // Entries used since the last sweep survive the next.
+    cache.sweep();
+    cache.find_production(f1, env, q);
+    cache.sweep();
+    internal_assert(cache.find_production(f1, env, q));
+    internal_assert(!cache.find_value_bounds(g, 0, fb, i));
+
+    std::cout << "Lowering cache test passed" << std::endl;
+}
+
+}
+}
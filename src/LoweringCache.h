@@ -0,0 +1,94 @@
+#ifndef HALIDE_LOWERING_CACHE_H
+#define HALIDE_LOWERING_CACHE_H
+
+/** \file
+ * Defines a cache of the parts of lowering that depend only on the
+ * definition and schedule of a single Function, which persists
+ * across lowerings of the same pipeline.
+ */
+
+#include <map>
+
+#include "Bounds.h"
+#include "Function.h"
+
+namespace Halide {
+namespace Internal {
+
+/** Each time a pipeline's schedule changes, the whole pipeline is
+ * lowered again from scratch. Much of the work done depends only on
+ * the definition and schedule of one Function, so if only a few
+ * Functions have changed, the rest of the results can be reused. A
+ * LoweringCache keeps those results from one lowering to the next.
+ * Entries are keyed on the parts of the Functions that they depend
+ * on, compared by value, because each lowering works on a fresh deep
+ * copy of the Functions. Entries not used by a lowering are dropped
+ * at the end of it. */
+class LoweringCache {
+public:
+    LoweringCache() : compare_cache(8), generation(0), hits(0), misses(0) {}
+
+    // The keys point into compare_cache, so a cache can't be copied.
+    LoweringCache(const LoweringCache &) = delete;
+    LoweringCache &operator=(const LoweringCache &) = delete;
+
+    /** Find the produce and update steps built for a Function with
+     * the same definition and schedule by an earlier lowering. Calls
+     * to other Functions are rebound to those in env. Returns false
+     * if there are none. Functions with extern definitions are never
+     * cached. */
+    EXPORT bool find_production(const Function &f, const std::map<std::string, Function> &env,
+                                std::pair<Stmt, Stmt> &production);
+
+    /** Record the produce and update steps built for a Function. */
+    EXPORT void add_production(const Function &f, const std::pair<Stmt, Stmt> &production);
+
+    /** Find the bounds of a value of a Function computed by an earlier
+     * lowering in which it had the same definition, and in which the
+     * Functions it calls had the same value bounds. */
+    EXPORT bool find_value_bounds(const Function &f, int idx, const FuncValueBounds &fb,
+                                  Interval &result);
+
+    /** Record the bounds of a value of a Function. */
+    EXPORT void add_value_bounds(const Function &f, int idx, const FuncValueBounds &fb,
+                                 const Interval &result);
+
+    /** Drop all entries that haven't been used since the last call
+     * to this. Called at the end of each lowering. */
+    EXPORT void sweep();
+
+    /** The number of lookups answered from and missing from the
+     * cache. */
+    // @{
+    int num_hits() const {return hits;}
+    int num_misses() const {return misses;}
+    // @}
+
+private:
+    struct Key {
+        std::vector<ExprWithCompareCache> exprs;
+        std::vector<std::string> names;
+        bool operator<(const Key &other) const;
+    };
+
+    template<typename T>
+    struct Entry {
+        T value;
+        int generation;
+    };
+
+    Key production_key(const Function &f);
+    Key value_bounds_key(const Function &f, int idx, const FuncValueBounds &fb);
+
+    IRCompareCache compare_cache;
+    std::map<Key, Entry<std::pair<Stmt, Stmt>>> productions;
+    std::map<Key, Entry<Interval>> value_bounds;
+    int generation, hits, misses;
+};
+
+EXPORT void lowering_cache_test();
+
+}
+}
+
+#endif
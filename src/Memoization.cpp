@@ -1,4 +1,5 @@
 #include "Memoization.h"
+#include "CompilationCache.h"
 #include "Error.h"
 #include "IRMutator.h"
 #include "IROperator.h"
@@ -8,6 +9,7 @@
 #include "Var.h"
 
 #include <map>
+#include <set>
 
 namespace Halide {
 namespace Internal {
@@ -141,6 +143,74 @@ public:
     std::map<DependencyKey, DependencyInfo> dependency_info;
 };
 
+// Hashes the definitions of a Function and of every Function it
+// calls, so that Functions that compute different things never share
+// cache entries, even if they have the same name.
+class HashDefinitions : public IRGraphVisitor {
+    IRKey &key;
+    std::set<std::string> done;
+
+    void add_exprs(const std::vector<Expr> &exprs) {
+        key.add(std::to_string(exprs.size()));
+        for (const Expr &e : exprs) {
+            key.add(e);
+        }
+    }
+
+    using IRGraphVisitor::visit;
+
+    void visit(const Call *call) {
+        if (call->func.defined()) {
+            hash_function(Function(call->func));
+        }
+        IRGraphVisitor::visit(call);
+    }
+
+public:
+    HashDefinitions(IRKey &key) : key(key) {}
+
+    void hash_function(const Function &function) {
+        if (!done.insert(function.name()).second) {
+            return;
+        }
+        key.add_name(function.name());
+        key.add(std::to_string(function.args().size()));
+        for (const std::string &arg : function.args()) {
+            key.add_name(arg);
+        }
+        add_exprs(function.values());
+        key.add(std::to_string(function.updates().size()));
+        for (const UpdateDefinition &update : function.updates()) {
+            add_exprs(update.values);
+            add_exprs(update.args);
+            if (update.domain.defined()) {
+                for (const ReductionVariable &rv : update.domain.domain()) {
+                    key.add_name(rv.var);
+                    key.add(rv.min);
+                    key.add(rv.extent);
+                }
+                key.add(update.domain.predicate());
+            }
+        }
+        if (function.has_extern_definition()) {
+            key.add(function.extern_function_name());
+            for (const ExternFuncArgument &arg : function.extern_arguments()) {
+                if (arg.is_func()) {
+                    key.add_name(Function(arg.func).name());
+                    hash_function(Function(arg.func));
+                } else if (arg.is_expr()) {
+                    key.add(arg.expr);
+                } else if (arg.is_buffer()) {
+                    key.add_name(arg.buffer.name());
+                } else if (arg.is_image_param()) {
+                    key.add_name(arg.image_param.name());
+                }
+            }
+        }
+        function.accept(this);
+    }
+};
+
 typedef std::pair<FindParameterDependencies::DependencyKey, FindParameterDependencies::DependencyInfo> DependencyKeyInfoPair;
 
 class KeyInfo {
@@ -148,6 +218,7 @@ class KeyInfo {
     Expr key_size_expr;
     const std::string &top_level_name;
     const std::string &function_name;
+    std::string definition_hash;
 
     size_t parameters_alignment() {
         int32_t max_alignment = 0;
@@ -166,20 +237,6 @@ class KeyInfo {
         return (size_t)(1 << i);
     }
 
-// Using the full names in the key results in a (hopefully incredibly
-// slight) performance difference based on how one names filters and
-// functions. It is arguably a little easier to debug if something
-// goes wrong as one doesn't need to destructure the cache key by hand
-// in the debugger. Also, if a pointer is used, a counter must also be
-// put in the cache key to avoid aliasing on reuse of the address in
-// JIT situations where code is regenerated into the same region of
-// memory.
-//
-// There is a plan to change the hash function used in the cache and
-// after that happens, we'll measure performance again and maybe decide
-// to choose one path or the other here and remove the #ifdef.
-#define USE_FULL_NAMES_IN_KEY 0
-#if USE_FULL_NAMES_IN_KEY
     Stmt call_copy_memory(const std::string &key_name, const std::string &value, Expr index) {
         Expr dest = Call::make(Handle(), Call::address_of,
                                {Load::make(UInt(8), key_name, index, Buffer(), Parameter())},
@@ -190,21 +247,29 @@ class KeyInfo {
         return Evaluate::make(Call::make(UInt(8), Call::copy_memory,
                                          {dest, src, copy_size}, Call::Intrinsic));
     }
-#endif
+
+    static size_t round_up_4(size_t x) {
+        return (x + 3) & ~3;
+    }
 
 public:
   KeyInfo(const Function &function, const std::string &name)
         : top_level_name(name), function_name(function.name())
     {
         dependencies.visit_function(function);
+
+        IRKey key;
+        HashDefinitions(key).hash_function(function);
+        for (const DependencyKeyInfoPair &i : dependencies.dependency_info) {
+            key.add(i.second.type);
+        }
+        definition_hash = key.hex();
+
         size_t size_so_far = 0;
 
-#if USE_FULL_NAMES_IN_KEY
-        size_so_far = 4 + (int32_t)((top_level_name.size() + 3) & ~3);
-        size_so_far += 4 + function_name.size();
-#else
-        size_so_far += Handle().bytes() + 4;
-#endif
+        size_so_far += 4 + round_up_4(top_level_name.size());
+        size_so_far += 4 + round_up_4(function_name.size());
+        size_so_far += round_up_4(definition_hash.size());
 
         size_t needed_alignment = parameters_alignment();
         if (needed_alignment > 1) {
@@ -224,60 +289,43 @@ public:
     // Code to fill in the Allocation named key_name with the byte of
     // the key. The Allocation is guaranteed to be 1d, of type uint8_t
     // and of the size returned from key_size
+    //
+    // The key starts with the names of the pipeline and the Function,
+    // rather than a pointer to them, so that it means the same thing
+    // in every process that runs the same code, which lets the cache
+    // keep results in a file shared between processes. A hash of the
+    // definitions of the Function and of everything it calls, and of
+    // the types of the parameters it depends on, follows them, because
+    // Functions in two pipelines JIT compiled by the same process may
+    // have the same names. Then come the values of the parameters.
     Stmt generate_key(std::string key_name) {
         std::vector<Stmt> writes;
         Expr index = Expr(0);
 
-#if USE_FULL_NAMES_IN_KEY
         // In code below, casts to vec type is done because stores to
         // the buffer can be unaligned.
-
-        Expr top_level_name_size = (int32_t)top_level_name.size();
-        writes.push_back(Store::make(key_name,
-                                     Cast::make(Int(32), top_level_name_size),
-                                     (index / Int(32).bytes()), Parameter()));
-        index += 4;
-        writes.push_back(call_copy_memory(key_name, top_level_name, index));
-        // Align to four byte boundary again.
-        index += top_level_name_size;
-        size_t alignment = 4 + top_level_name.size();
-        while (alignment % 4) {
-            writes.push_back(Store::make(key_name, Cast::make(UInt(8), 0), index, Parameter()));
-            index = index + 1;
-            alignment++;
+        size_t alignment = 0;
+        for (const std::string &name : {top_level_name, function_name}) {
+            Expr name_size = (int32_t)name.size();
+            writes.push_back(Store::make(key_name,
+                                         Cast::make(Int(32), name_size),
+                                         (index / Int(32).bytes()), Parameter()));
+            index += 4;
+            writes.push_back(call_copy_memory(key_name, name, index));
+            index += name_size;
+            // Align to four byte boundary again.
+            alignment += 4 + name.size();
+            while (alignment % 4) {
+                writes.push_back(Store::make(key_name, Cast::make(UInt(8), 0), index, Parameter()));
+                index = index + 1;
+                alignment++;
+            }
         }
 
-        Expr name_size = (int32_t)function_name.size();
-        writes.push_back(Store::make(key_name,
-                                     Cast::make(Int(32), name_size),
-                                     (index / Int(32).bytes())));
-        index += 4;
-        writes.push_back(call_copy_memory(key_name, function_name, index));
-        index += name_size;
-        alignment += 4 + function_name.size();
-#else
-        // Store a pointer to a string identifying the filter and
-        // function. Assume this will be unique due to CSE. This can
-        // break with loading and unloading of code, though the name
-        // mechanism can also break in those conditions. For JIT, a
-        // counter is needed as the address may be reused. This isn't
-        // a problem when using full names as the function names
-        // already are uniquefied by a counter.
-        writes.push_back(Store::make(key_name,
-                                     StringImm::make(std::to_string(top_level_name.size()) + ":" + top_level_name +
-                                                     std::to_string(function_name.size()) + ":" + function_name),
-                                     (index / Handle().bytes()), Parameter()));
-        size_t alignment = Handle().bytes();
-        index += Handle().bytes();
-
-        // Halide compilation is not threadsafe anyway...
-        static std::atomic<int> memoize_instance {0};
-        writes.push_back(Store::make(key_name,
-                                     memoize_instance++,
-                                     (index / Int(32).bytes()), Parameter()));
-        alignment += 4;
-        index += 4;
-#endif
+        // The hash is 32 hex digits, so this leaves the key aligned.
+        writes.push_back(call_copy_memory(key_name, definition_hash, index));
+        index += (int32_t)definition_hash.size();
+        alignment += definition_hash.size();
 
         size_t needed_alignment = parameters_alignment();
         if (needed_alignment > 1) {
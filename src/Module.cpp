@@ -3,6 +3,7 @@
 #include <fstream>
 
 #include "CodeGen_C.h"
+#include "CompilationCache.h"
 #include "Debug.h"
 #include "LLVM_Headers.h"
 #include "LLVM_Output.h"
@@ -20,6 +21,7 @@ struct ModuleContents {
     Target target;
     std::vector<Buffer> buffers;
     std::vector<Internal::LoweredFunc> functions;
+    std::map<std::string, Internal::FuncCostEstimate> cost_estimates;
 };
 
 template<>
@@ -64,8 +66,17 @@ void Module::append(const Internal::LoweredFunc &function) {
     contents->functions.push_back(function);
 }
 
+const std::map<std::string, Internal::FuncCostEstimate> &Module::cost_estimates() const {
+    return contents->cost_estimates;
+}
+
+void Module::set_cost_estimates(const std::map<std::string, Internal::FuncCostEstimate> &estimates) {
+    contents->cost_estimates = estimates;
+}
+
 Module link_modules(const std::string &name, const std::vector<Module> &modules) {
     Module output(name, modules.front().target());
+    std::map<std::string, Internal::FuncCostEstimate> cost_estimates;
 
     for (size_t i = 0; i < modules.size(); i++) {
         const Module &input = modules[i];
@@ -85,14 +96,41 @@ Module link_modules(const std::string &name, const std::vector<Module> &modules)
         for (const auto &f : input.functions()) {
             output.append(f);
         }
+        cost_estimates.insert(input.cost_estimates().begin(), input.cost_estimates().end());
     }
+    output.set_cost_estimates(cost_estimates);
 
     return output;
 }
 
-void Module::compile(const Outputs &output_files) const {
+void Module::compile(const Outputs &requested_files) const {
+    Outputs output_files = requested_files;
+
+    // The outputs that llvm produces can be served from the
+    // compilation cache, if it's enabled. Clear the name of each one
+    // that hits, so that only the misses get compiled below. Static
+    // libraries aren't cached, because the names of their members
+    // come from the name of the library.
+    std::vector<std::pair<std::string, std::string *>> cacheable_files = {
+        {"o", &output_files.object_name},
+        {"s", &output_files.assembly_name},
+        {"bc", &output_files.bitcode_name},
+        {"ll", &output_files.llvm_assembly_name}};
+    std::string cache_dir = Internal::compilation_cache_dir();
+    std::string cache_key;
+    if (!cache_dir.empty()) {
+        cache_key = Internal::compilation_cache_key(*this);
+        for (auto &file : cacheable_files) {
+            if (!file.second->empty() &&
+                Internal::compilation_cache_fetch(cache_dir, cache_key, file.first, *file.second)) {
+                file.second->clear();
+            }
+        }
+    }
+
     if (!output_files.object_name.empty() || !output_files.assembly_name.empty() ||
-        !output_files.bitcode_name.empty() || !output_files.llvm_assembly_name.empty()) {
+        !output_files.bitcode_name.empty() || !output_files.llvm_assembly_name.empty() ||
+        !output_files.static_library_name.empty()) {
         llvm::LLVMContext context;
         std::unique_ptr<llvm::Module> llvm_module(compile_module_to_llvm_module(*this, context));
 
@@ -120,6 +158,20 @@ void Module::compile(const Outputs &output_files) const {
             auto out = make_raw_fd_ostream(output_files.llvm_assembly_name);
             compile_llvm_module_to_llvm_assembly(*llvm_module, *out);
         }
+        if (!output_files.static_library_name.empty()) {
+            // This consumes the llvm module, so it must come last.
+            user_assert(target().arch != Target::PNaCl)
+                << "Static libraries are not supported for PNaCl targets.\n";
+            compile_llvm_module_to_static_library(std::move(llvm_module),
+                                                  output_files.static_library_name);
+        }
+        if (!cache_key.empty()) {
+            for (auto &file : cacheable_files) {
+                if (!file.second->empty()) {
+                    Internal::compilation_cache_store(cache_dir, cache_key, file.first, *file.second);
+                }
+            }
+        }
     }
     if (!output_files.c_header_name.empty()) {
         std::ofstream file(output_files.c_header_name.c_str());
@@ -6,6 +6,8 @@
  * Defines Module, an IR container that fully describes a Halide program.
  */
 
+#include <map>
+
 #include "IR.h"
 #include "Buffer.h"
 #include "Outputs.h"
@@ -39,6 +41,39 @@ struct LoweredFunc {
         : name(name), args(args), body(body), linkage(linkage) {}
 };
 
+/** The auto-scheduler's estimate of the cost of computing a Func,
+ * and of the group of Funcs it was fused into. */
+struct FuncCostEstimate {
+    /** The group the Func was placed in, named after its output. */
+    std::string group;
+
+    /** Estimated number of arithmetic operations to compute the Func
+     * over its whole region, or -1 if the region is unknown. */
+    long long ops;
+
+    /** Estimated number of points in the region of the Func, or -1 if
+     * it's unknown. */
+    long long size;
+
+    /** Estimated number of arithmetic operations and loads to compute
+     * the values of the Func over its whole region once, not counting
+     * the Funcs inlined into it, or -1 if the region is unknown. The
+     * sum of these over a pipeline is the work of its algorithm,
+     * whatever the schedule. */
+    long long value_ops;
+    long long value_loads;
+
+    /** Estimated memory accesses saved, extra arithmetic introduced,
+     * and overall benefit of fusing the group, as computed by the
+     * grouping. All zero for a group of one Func. */
+    float saved_mem;
+    float redundant_work;
+    float benefit;
+
+    FuncCostEstimate() : ops(0), size(0), value_ops(0), value_loads(0),
+                         saved_mem(0), redundant_work(0), benefit(0) {}
+};
+
 }
 
 namespace Internal {
@@ -71,8 +106,19 @@ public:
     EXPORT void append(const Internal::LoweredFunc &function);
     // @}
 
+    /** The auto-scheduler's cost estimates for the Funcs in this
+     * module, keyed by Func name. Empty unless it was
+     * auto-scheduled. Shown in HTML stmt output. */
+    // @{
+    EXPORT const std::map<std::string, Internal::FuncCostEstimate> &cost_estimates() const;
+    EXPORT void set_cost_estimates(const std::map<std::string, Internal::FuncCostEstimate> &estimates);
+    // @}
+
     /** Compile a halide Module to variety of outputs, depending on 
-     * the fields set in output_files. */
+     * the fields set in output_files. If the HL_COMPILE_CACHE_DIR
+     * environment variable names a directory, the outputs produced by
+     * llvm, other than static libraries, are fetched from and added to
+     * a compilation cache there. */
     EXPORT void compile(const Outputs &output_files) const;
 };
 
@@ -46,6 +46,12 @@ struct Outputs {
      * output is desired. */
     std::string stmt_html_name;
 
+    /** The name of the emitted static library file. Empty if no
+     * static library should be produced. The module is compiled to
+     * several objects in parallel, which are collected into this
+     * archive. */
+    std::string static_library_name;
+
     /** Make a new Outputs struct that emits everything this one does
      * and also an object file with the given name. */
     Outputs object(const std::string &object_name) {
@@ -109,6 +115,14 @@ struct Outputs {
         updated.stmt_html_name = stmt_html_name;
         return updated;
     }
+
+    /** Make a new Outputs struct that emits everything this one does
+     * and also a static library with the given name. */
+    Outputs static_library(const std::string &static_library_name) {
+        Outputs updated = *this;
+        updated.static_library_name = static_library_name;
+        return updated;
+    }
 };
 
 }
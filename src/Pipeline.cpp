@@ -7,6 +7,7 @@
 #include "LLVM_Headers.h"
 #include "LLVM_Output.h"
 #include "Lower.h"
+#include "LoweringCache.h"
 #include "Outputs.h"
 #include "PrintLoopNest.h"
 
@@ -57,6 +58,11 @@ struct PipelineContents {
     JITModule jit_module;
     Target jit_target;
 
+    // Parts of the last lowering that can be reused by the next
+    // one. This is keyed on the definitions and schedules of the
+    // Functions involved, so it survives invalidate_cache.
+    LoweringCache lowering_cache;
+
     /** Clear all cached state */
     void invalidate_cache() {
         module = Module("", Target());
@@ -517,6 +523,7 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
     // attempt to directly access any of the fields of the buffer.
 
     Stmt private_body;
+    std::map<string, Internal::FuncCostEstimate> cost_estimates;
 
     const Module &old_module = contents->module;
     if (!old_module.functions().empty() &&
@@ -526,6 +533,7 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
         // from the old module. We expect two functions in the old
         // module: the private one then the public one.
         private_body = old_module.functions().front().body;
+        cost_estimates = old_module.cost_estimates();
         debug(2) << "Reusing old module\n";
     } else {
         vector<IRMutator *> custom_passes;
@@ -534,7 +542,8 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
         }
 
         private_body = lower(contents.get()->outputs, fn_name, target,
-                             custom_passes, auto_schedule, no_vec);
+                             custom_passes, auto_schedule, no_vec,
+                             &contents->lowering_cache, &cost_estimates);
     }
 
     std::vector<std::string> namespaces;
@@ -548,6 +557,7 @@ Module Pipeline::compile_to_module(const vector<Argument> &args,
 
     // Create a module with all the global images in it.
     Module module(simple_new_fn_name, target);
+    module.set_cost_estimates(cost_estimates);
 
     // Add all the global images to the module, and add the global
     // images used to the private argument list.
@@ -184,7 +184,11 @@ public:
      * wish to avoid including the time taken to compile a pipeline,
      * then you can call this ahead of time. Returns the raw function
      * pointer to the compiled pipeline. Default is to use the Target
-     * returned from Halide::get_jit_target_from_environment()
+     * returned from Halide::get_jit_target_from_environment(). If the
+     * HL_COMPILE_CACHE_DIR environment variable is set, object code
+     * is shared through that directory with other processes jitting
+     * the same pipeline for the same Target, which then skip llvm
+     * code generation.
      */
      EXPORT void *compile_jit(const Target &target = get_jit_target_from_environment(),
                               bool auto_schedule = false);
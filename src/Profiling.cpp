@@ -10,6 +10,7 @@
 #include "Scope.h"
 #include "Simplify.h"
 #include "Util.h"
+#include "runtime/HalideRuntime.h"
 
 namespace Halide {
 namespace Internal {
@@ -24,24 +25,41 @@ public:
 
     vector<int> stack; // What produce nodes are we currently inside of.
 
+    // The profiler slots of the threads running the code we're
+    // currently inside of. Each parallel task claims its own.
+    vector<string> slots;
+
     string pipeline_name;
 
     InjectProfiling(const string &pipeline_name) : pipeline_name(pipeline_name) {
         indices["overhead"] = 0;
         stack.push_back(0);
+        slots.push_back("profiler_slot");
     }
 
     map<int, int> func_stack_current; // map from func id -> current stack allocation
     map<int, int> func_stack_peak; // map from func id -> peak stack allocation
 
+    struct AllocSite {
+        string name;
+        string loop;     // The innermost loop around the allocation
+        int func;
+        int stack_bytes; // Zero if the allocation is on the heap
+    };
+    vector<AllocSite> alloc_sites;
+
 private:
     using IRMutator::visit;
 
     struct AllocSize {
         bool on_stack;
         Expr size;
+        int site;
     };
 
+    // The loops we're currently inside of.
+    vector<string> loops;
+
     Scope<AllocSize> func_alloc_sizes;
 
     // Strip down the tuple name, e.g. f.0 into f
@@ -112,7 +130,18 @@ private:
 
         bool on_stack;
         Expr size = compute_allocation_size(new_extents, condition, op->type, op->name, on_stack);
-        func_alloc_sizes.push(op->name, {on_stack, size});
+
+        // Each allocation that happens gets a site of its own, so that
+        // allocations of the same Func in different places can be
+        // told apart.
+        int site = -1;
+        if (!is_zero(size)) {
+            site = (int)alloc_sites.size();
+            const int64_t *int_size = as_const_int(size);
+            int stack_bytes = on_stack ? (int)*int_size : 0;
+            alloc_sites.push_back({op->name, loops.empty() ? "root" : loops.back(), idx, stack_bytes});
+        }
+        func_alloc_sizes.push(op->name, {on_stack, size, site});
 
         // compute_allocation_size() might return a zero size, if the allocation is
         // always conditionally false. remove_dead_allocations() is called after
@@ -144,7 +173,7 @@ private:
             Expr profiler_pipeline_state = Variable::make(Handle(), "profiler_pipeline_state");
             debug(3) << "  Allocation on heap: " << op->name << "(" << size << ") in pipeline " << pipeline_name << "\n";
             Expr set_task = Call::make(Int(32), "halide_profiler_memory_allocate",
-                                       {profiler_pipeline_state, idx, size}, Call::Extern);
+                                       {profiler_pipeline_state, idx, site, size}, Call::Extern);
             stmt = Block::make(Evaluate::make(set_task), stmt);
         }
     }
@@ -163,7 +192,7 @@ private:
             if (!alloc.on_stack) {
                 debug(3) << "  Free on heap: " << op->name << "(" << alloc.size << ") in pipeline " << pipeline_name << "\n";
                 Expr set_task = Call::make(Int(32), "halide_profiler_memory_free",
-                                           {profiler_pipeline_state, idx, alloc.size}, Call::Extern);
+                                           {profiler_pipeline_state, idx, alloc.site, alloc.size}, Call::Extern);
                 stmt = Block::make(Evaluate::make(set_task), stmt);
             } else {
                 const int64_t *int_size = as_const_int(alloc.size);
@@ -187,16 +216,16 @@ private:
         Stmt consume = mutate(op->consume);
 
         Expr profiler_token = Variable::make(Int(32), "profiler_token");
-        Expr profiler_state = Variable::make(Handle(), "profiler_state");
+        Expr profiler_slot = Variable::make(Handle(), slots.back());
 
         // This call gets inlined and becomes a single store instruction.
         Expr set_task = Call::make(Int(32), "halide_profiler_set_current_func",
-                                   {profiler_state, profiler_token, idx}, Call::Extern);
+                                   {profiler_slot, profiler_token, idx}, Call::Extern);
 
         // At the beginning of the consume step, set the current task
         // back to the outer one.
         Expr set_outer_task = Call::make(Int(32), "halide_profiler_set_current_func",
-                                         {profiler_state, profiler_token, stack.back()}, Call::Extern);
+                                         {profiler_slot, profiler_token, stack.back()}, Call::Extern);
 
         produce = Block::make(Evaluate::make(set_task), produce);
         consume = Block::make(Evaluate::make(set_outer_task), consume);
@@ -206,12 +235,59 @@ private:
 
     void visit(const For *op) {
         // We profile by storing a token to global memory, so don't enter GPU loops
-        if (op->device_api == DeviceAPI::None ||
-            op->device_api == DeviceAPI::Host) {
-            IRMutator::visit(op);
-        } else {
+        if (op->device_api != DeviceAPI::None &&
+            op->device_api != DeviceAPI::Host) {
             stmt = op;
+            return;
+        }
+        if (op->for_type != ForType::Parallel) {
+            loops.push_back(op->name);
+            IRMutator::visit(op);
+            loops.pop_back();
+            return;
         }
+
+        // Each parallel task claims a slot of its own to report the
+        // current Func in, and releases it when done.
+        Expr profiler_token = Variable::make(Int(32), "profiler_token");
+        Expr profiler_state = Variable::make(Handle(), "profiler_state");
+        Expr profiler_pipeline_state = Variable::make(Handle(), "profiler_pipeline_state");
+        Expr outer_slot = Variable::make(Handle(), slots.back());
+        string slot_name = unique_name("profiler_slot");
+        Expr slot = Variable::make(Handle(), slot_name);
+
+        slots.push_back(slot_name);
+        loops.push_back(op->name);
+        Stmt body = mutate(op->body);
+        loops.pop_back();
+        slots.pop_back();
+
+        Expr acquire = Call::make(Handle(), "halide_profiler_acquire_slot",
+                                  {profiler_state, outer_slot, profiler_pipeline_state}, Call::Extern);
+        Expr set_task = Call::make(Int(32), "halide_profiler_set_current_func",
+                                   {slot, profiler_token, stack.back()}, Call::Extern);
+        Expr release = Call::make(Int(32), "halide_profiler_release_slot",
+                                  {slot}, Call::Extern);
+        body = Block::make(Evaluate::make(set_task), Block::make(body, Evaluate::make(release)));
+        body = LetStmt::make(slot_name, acquire, body);
+        stmt = For::make(op->name, mutate(op->min), mutate(op->extent),
+                         op->for_type, op->device_api, body);
+
+        // The tasks are billed to this loop, along with the time the
+        // thread pool spends waiting while they run.
+        Expr begin = Call::make(Int(32), "halide_profiler_par_for_begin",
+                                {profiler_pipeline_state, outer_slot, op->name}, Call::Extern);
+        Expr end = Call::make(Int(32), "halide_profiler_par_for_end",
+                              {outer_slot}, Call::Extern);
+        stmt = Block::make(Evaluate::make(begin), Block::make(stmt, Evaluate::make(end)));
+
+        // The thread launching the tasks is idle until they're done,
+        // apart from running some of them in slots of their own.
+        Expr set_idle = Call::make(Int(32), "halide_profiler_set_current_func",
+                                   {outer_slot, halide_profiler_outside_of_halide, 0}, Call::Extern);
+        Expr set_outer_task = Call::make(Int(32), "halide_profiler_set_current_func",
+                                         {outer_slot, profiler_token, stack.back()}, Call::Extern);
+        stmt = Block::make(Evaluate::make(set_idle), Block::make(stmt, Evaluate::make(set_outer_task)));
     }
 };
 
@@ -224,8 +300,21 @@ Stmt inject_profiling(Stmt s, string pipeline_name) {
     Expr func_names_buf = Load::make(Handle(), "profiling_func_names", 0, Buffer(), Parameter());
     func_names_buf = Call::make(Handle(), Call::address_of, {func_names_buf}, Call::Intrinsic);
 
+    // The buffer and loop names of each allocation site go in one
+    // array, and the func id and stack size of each in another.
+    int num_alloc_sites = (int)(profiling.alloc_sites.size());
+    Expr alloc_site_names_buf = Call::make(Handle(), Call::null_handle, vector<Expr>(), Call::PureIntrinsic);
+    Expr alloc_site_info_buf = alloc_site_names_buf;
+    if (num_alloc_sites) {
+        alloc_site_names_buf = Load::make(Handle(), "profiling_alloc_site_names", 0, Buffer(), Parameter());
+        alloc_site_names_buf = Call::make(Handle(), Call::address_of, {alloc_site_names_buf}, Call::Intrinsic);
+        alloc_site_info_buf = Load::make(Int(32), "profiling_alloc_site_info", 0, Buffer(), Parameter());
+        alloc_site_info_buf = Call::make(Handle(), Call::address_of, {alloc_site_info_buf}, Call::Intrinsic);
+    }
+
     Expr start_profiler = Call::make(Int(32), "halide_profiler_pipeline_start",
-                                     {pipeline_name, num_funcs, func_names_buf}, Call::Extern);
+                                     {pipeline_name, num_funcs, func_names_buf,
+                                      num_alloc_sites, alloc_site_names_buf, alloc_site_info_buf}, Call::Extern);
 
     Expr get_state = Call::make(Handle(), "halide_profiler_get_state", {}, Call::Extern);
 
@@ -233,20 +322,28 @@ Stmt inject_profiling(Stmt s, string pipeline_name) {
 
     Expr profiler_token = Variable::make(Int(32), "profiler_token");
 
+    Expr profiler_state = Variable::make(Handle(), "profiler_state");
+    Expr profiler_pipeline_state = Variable::make(Handle(), "profiler_pipeline_state");
+    Expr null_handle = Call::make(Handle(), Call::null_handle, vector<Expr>(), Call::PureIntrinsic);
+    Expr acquire_slot = Call::make(Handle(), "halide_profiler_acquire_slot",
+                                   {profiler_state, null_handle, profiler_pipeline_state}, Call::Extern);
+
+    Expr profiler_slot = Variable::make(Handle(), "profiler_slot");
     Expr stop_profiler = Call::make(Int(32), Call::register_destructor,
-                                    {Expr("halide_profiler_pipeline_end"), get_state}, Call::Intrinsic);
+                                    {Expr("halide_profiler_pipeline_end"), profiler_slot}, Call::Intrinsic);
 
     bool no_stack_alloc = profiling.func_stack_peak.empty();
     if (!no_stack_alloc) {
         Expr func_stack_peak_buf = Load::make(Handle(), "profiling_func_stack_peak_buf", 0, Buffer(), Parameter());
         func_stack_peak_buf = Call::make(Handle(), Call::address_of, {func_stack_peak_buf}, Call::Intrinsic);
 
-        Expr profiler_pipeline_state = Variable::make(Handle(), "profiler_pipeline_state");
         Stmt update_stack = Evaluate::make(Call::make(Int(32), "halide_profiler_stack_peak_update",
                                            {profiler_pipeline_state, func_stack_peak_buf}, Call::Extern));
         s = Block::make(update_stack, s);
     }
 
+    s = Block::make(Evaluate::make(stop_profiler), s);
+    s = LetStmt::make("profiler_slot", acquire_slot, s);
     s = LetStmt::make("profiler_pipeline_state", get_pipeline_state, s);
     s = LetStmt::make("profiler_state", get_state, s);
     // If there was a problem starting the profiler, it will call an
@@ -263,13 +360,26 @@ Stmt inject_profiling(Stmt s, string pipeline_name) {
         s = Allocate::make("profiling_func_stack_peak_buf", Int(32), {num_funcs}, const_true(), s);
     }
 
+    if (num_alloc_sites) {
+        for (int i = num_alloc_sites - 1; i >= 0; --i) {
+            const InjectProfiling::AllocSite &site = profiling.alloc_sites[i];
+            s = Block::make(Store::make("profiling_alloc_site_names", site.name, 2 * i, Parameter()), s);
+            s = Block::make(Store::make("profiling_alloc_site_names", site.loop, 2 * i + 1, Parameter()), s);
+            s = Block::make(Store::make("profiling_alloc_site_info", site.func, 2 * i, Parameter()), s);
+            s = Block::make(Store::make("profiling_alloc_site_info", site.stack_bytes, 2 * i + 1, Parameter()), s);
+        }
+        s = Block::make(s, Free::make("profiling_alloc_site_info"));
+        s = Allocate::make("profiling_alloc_site_info", Int(32), {2 * num_alloc_sites}, const_true(), s);
+        s = Block::make(s, Free::make("profiling_alloc_site_names"));
+        s = Allocate::make("profiling_alloc_site_names", Handle(), {2 * num_alloc_sites}, const_true(), s);
+    }
+
     for (std::pair<string, int> p : profiling.indices) {
         s = Block::make(Store::make("profiling_func_names", p.first, p.second, Parameter()), s);
     }
 
     s = Block::make(s, Free::make("profiling_func_names"));
     s = Allocate::make("profiling_func_names", Handle(), {num_funcs}, const_true(), s);
-    s = Block::make(Evaluate::make(stop_profiler), s);
 
     return s;
 }
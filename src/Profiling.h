@@ -11,9 +11,29 @@
  * <pipeline_name>
  *  <total time spent in this pipeline> <# of samples taken> <# of runs> <avg time/run>
  *  <# of heap allocations> <peak heap allocation>
+ *  (<median run time> <90th percentile run time> <99th percentile run time>)?
  *   <func_name> <total time spent in this func> <percentage of time spent>
  *     (<peak heap alloc by this func> <num of allocs> <average alloc size> |
  *      <worst-case peak stack alloc by this func>)?
+ *     (<cycles/run> <instructions per cycle> <cache misses/run> <vector instructions/run>)?
+ *  (allocations:
+ *   (<buffer_name> at <innermost loop name or root>
+ *     (<peak heap alloc by this site> <num of allocs> <average alloc size> |
+ *      <stack alloc by this site>))+)?
+ *  (parallel loops:
+ *   (<loop_name> <tasks/run> <median task time> <99th percentile task time>
+ *     <thread pool lock wait/run> <thread pool idle time/run>)+)?
+ * threads: <average fraction of threads busy> <time profiled>
+ *
+ * The hardware counters on each func's line (cycles, instructions
+ * per cycle, cache misses and vector instructions) only appear if
+ * HL_PROFILER_COUNTERS is set, in which case they are read whenever a
+ * thread starts or stops computing a Func (Linux on x86 only). The
+ * allocations group only appears if some allocation site of the
+ * pipeline allocated something, and the parallel loops group only if
+ * some parallel loop of it ran. Idle time is the time threads that
+ * have run out of tasks of a parallel loop wait for the others to
+ * finish theirs.
  *
  * Sample output:
  * memory_profiler_mandelbrot
@@ -10,6 +10,8 @@
 #include "Inline.h"
 #include "CodeGen_GPU_Dev.h"
 #include "IRPrinter.h"
+#include "LoweringCache.h"
+#include "Module.h"
 
 #include "FindCalls.h"
 #include "ParallelRVar.h"
@@ -735,18 +737,27 @@ public:
     const Function &func;
     bool is_output, found_store_level, found_compute_level;
     const Target &target;
+    const map<string, Function> &env;
+    LoweringCache *lowering_cache;
 
-    InjectRealization(const Function &f, bool o, const Target &t) :
+    InjectRealization(const Function &f, bool o, const Target &t,
+                      const map<string, Function> &env, LoweringCache *c) :
         func(f), is_output(o),
         found_store_level(false), found_compute_level(false),
-        target(t) {}
+        target(t), env(env), lowering_cache(c) {}
 
 private:
 
     string producing;
 
     Stmt build_pipeline(Stmt s) {
-        pair<Stmt, Stmt> realization = build_production(func);
+        pair<Stmt, Stmt> realization;
+        if (!lowering_cache || !lowering_cache->find_production(func, env, realization)) {
+            realization = build_production(func);
+            if (lowering_cache) {
+                lowering_cache->add_production(func, realization);
+            }
+        }
 
         return ProducerConsumer::make(func.name(), realization.first, realization.second, s);
     }
@@ -1251,7 +1262,8 @@ Stmt schedule_functions(const vector<Function> &outputs,
                         const vector<string> &order,
                         const map<string, Function> &env,
                         const Target &target,
-                        bool &any_memoized) {
+                        bool &any_memoized,
+                        LoweringCache *lowering_cache) {
 
     string root_var = LoopLevel::root().func + "." + LoopLevel::root().var;
     Stmt s = For::make(root_var, 0, 1, ForType::Serial, DeviceAPI::Host, Evaluate::make(0));
@@ -1275,7 +1287,7 @@ Stmt schedule_functions(const vector<Function> &outputs,
             s = inline_function(s, f);
         } else {
             debug(1) << "Injecting realization of " << order[i-1] << '\n';
-            InjectRealization injector(f, is_output, target);
+            InjectRealization injector(f, is_output, target, env, lowering_cache);
             s = injector.mutate(s);
             internal_assert(injector.found_store_level && injector.found_compute_level);
         }
@@ -1581,7 +1593,8 @@ map<string, Box> regions_required(Function f, const vector<string> &update_args,
                                   const vector< pair<Expr, Expr> > &sym_bounds,
                                   const map<string, Function> &env,
                                   const FuncValueBounds &func_val_bounds,
-                                  bool include_self = false){
+                                  bool include_self = false,
+                                  BoundsCache *bounds_cache = nullptr){
     // Define the bounds for each variable of the function
     std::vector<Interval> bounds;
     unsigned int num_args = f.args().size();
@@ -1617,7 +1630,7 @@ map<string, Box> regions_required(Function f, const vector<string> &update_args,
                 curr_scope.push(arg, simple_bounds);
                 interval_index++;
             }
-            curr_regions = boxes_required(val, curr_scope, func_val_bounds);
+            curr_regions = boxes_required(val, curr_scope, func_val_bounds, bounds_cache);
             // Each function will only appear once in curr_regions
             for (auto& reg: curr_regions) {
                 // Merge region with an existing region for the function in
@@ -1683,7 +1696,7 @@ map<string, Box> regions_required(Function f, const vector<string> &update_args,
                 }
 
                 for (auto &e: exprs) {
-                    curr_regions = boxes_required(e, curr_scope, func_val_bounds);
+                    curr_regions = boxes_required(e, curr_scope, func_val_bounds, bounds_cache);
                     for (auto& reg: curr_regions) {
                         // Merge region with an existing region for the function in
                         // the global map
@@ -1720,10 +1733,11 @@ map<string, Box> redundant_regions(Function f, int dir,
                                    const vector<string> &update_args,
                                    const vector<pair<Expr, Expr>> &sym_bounds,
                                    const map<string, Function> &env,
-                                   const FuncValueBounds &func_val_bounds){
+                                   const FuncValueBounds &func_val_bounds,
+                                   BoundsCache *bounds_cache = nullptr){
 
     map<string, Box> regions = regions_required(f, update_args, sym_bounds, env,
-                                                func_val_bounds, true);
+                                                func_val_bounds, true, bounds_cache);
     vector<pair<Expr, Expr>> shifted_bounds;
     int num_pure_args = f.args().size();
     for (int arg = 0; arg < num_pure_args; arg++) {
@@ -1752,7 +1766,7 @@ map<string, Box> redundant_regions(Function f, int dir,
 
     map<string, Box> regions_shifted = regions_required(f, update_args, shifted_bounds,
                                                         env, func_val_bounds,
-                                                        true);
+                                                        true, bounds_cache);
 
     map<string, Box> overalps;
     for (auto& reg: regions) {
@@ -1970,6 +1984,7 @@ struct DependenceAnalysis {
 
     map<string, Function> &env;
     const FuncValueBounds &func_val_bounds;
+    BoundsCache *bounds_cache;
     map<string, map<string, Box> > func_dep_regions;
     map<string, map<string, Box> > func_partial_dep_regions;
     map<string, vector< map<string, Box> > > func_overlaps;
@@ -1980,9 +1995,11 @@ struct DependenceAnalysis {
 
     DependenceAnalysis(map<string, Function> &_env,
                        const FuncValueBounds &_func_val_bounds,
+                       BoundsCache *_bounds_cache,
                        set<string> &_reductions,
                        map<string, vector<string> > &_update_args):
                        env(_env), func_val_bounds(_func_val_bounds),
+                       bounds_cache(_bounds_cache),
                        reductions(_reductions), update_args(_update_args) {
         for (auto& kv : env) {
             // For each argument create a variables which will serve as the lower
@@ -2001,7 +2018,8 @@ struct DependenceAnalysis {
 
             vector<string> u_args;
             map<string, Box> regions = regions_required(kv.second, u_args, sym_bounds,
-                                                        env, func_val_bounds);
+                                                        env, func_val_bounds,
+                                                        false, bounds_cache);
             assert(func_dep_regions.find(kv.first) == func_dep_regions.end());
             func_dep_regions[kv.first] = regions;
 
@@ -2015,7 +2033,7 @@ struct DependenceAnalysis {
             for (unsigned int arg = 0; arg < args.size(); arg++) {
                 map<string, Box> overlaps = redundant_regions(kv.second, arg,
                                                               u_args, sym_bounds, env,
-                                                              func_val_bounds);
+                                                              func_val_bounds, bounds_cache);
                 func_overlaps[kv.first].push_back(overlaps);
 
                 /*
@@ -2042,7 +2060,8 @@ struct DependenceAnalysis {
                 }
 
                 map<string, Box> regions = regions_required(kv.second, u_args, sym_bounds,
-                                                            env, func_val_bounds);
+                                                            env, func_val_bounds,
+                                                            false, bounds_cache);
                 assert(func_partial_dep_regions.find(kv.first) ==
                        func_partial_dep_regions.end());
                 func_partial_dep_regions[kv.first] = regions;
@@ -2060,7 +2079,7 @@ struct DependenceAnalysis {
                 for (unsigned int arg = 0; arg < num_args; arg++) {
                     map<string, Box> overlaps = redundant_regions(kv.second, arg,
                                                                   u_args, sym_bounds, env,
-                                                                  func_val_bounds);
+                                                                  func_val_bounds, bounds_cache);
                     func_partial_overlaps[kv.first].push_back(overlaps);
 
                     /*
@@ -5613,7 +5632,9 @@ void schedule_advisor(const vector<Function> &outputs,
                       const FuncValueBounds &func_val_bounds,
                       const Target &target,
                       bool root_default, bool auto_inline,
-                      bool auto_par, bool auto_vec) {
+                      bool auto_par, bool auto_vec,
+                      BoundsCache *bounds_cache,
+                      map<string, FuncCostEstimate> *cost_estimates) {
 
     const char *random_seed_var = getenv("HL_AUTO_RANDOM_SEED");
     int random_seed = 0;
@@ -5783,7 +5804,7 @@ void schedule_advisor(const vector<Function> &outputs,
     // For each function compute all the regions of upstream functions
     // required to compute a region of the function
 
-    DependenceAnalysis analy(env, func_val_bounds, reductions, update_args);
+    DependenceAnalysis analy(env, func_val_bounds, bounds_cache, reductions, update_args);
 
     /*
     for (auto &reg: analy.func_dep_regions) {
@@ -5858,6 +5879,10 @@ void schedule_advisor(const vector<Function> &outputs,
         gpu_schedule = true;
     }
 
+    // The partitioner adds the cost of inlined Funcs to the Funcs they
+    // are inlined into, so keep the cost of each Func on its own.
+    std::map<string, pair<long long, long long> > value_cost = func_cost;
+
     Partitioner part(pipeline_bounds, inlines, analy, func_cost, outputs,
                      gpu_schedule, random_seed, debug_info);
 
@@ -5917,6 +5942,31 @@ void schedule_advisor(const vector<Function> &outputs,
         }
     }
 
+    if (cost_estimates) {
+        for (auto &g: part.groups) {
+            const Partitioner::GroupSched &sched = part.group_sched[g.first];
+            for (auto &m: g.second) {
+                FuncCostEstimate &e = (*cost_estimates)[m.name()];
+                e.group = g.first;
+                e.ops = part.func_op[m.name()];
+                e.saved_mem = sched.saved_mem;
+                e.redundant_work = sched.redundant_work;
+                e.benefit = sched.benefit;
+            }
+        }
+        // Funcs inlined before grouping aren't in any group, but still
+        // count towards the work of the pipeline.
+        for (auto &f: value_cost) {
+            FuncCostEstimate &e = (*cost_estimates)[f.first];
+            if (e.group.empty()) {
+                e.ops = part.func_op[f.first];
+            }
+            e.size = part.func_size[f.first];
+            e.value_ops = e.size == -1 ? -1 : f.second.first * e.size;
+            e.value_loads = e.size == -1 ? -1 : f.second.second * e.size;
+        }
+    }
+
     //if (root_default || auto_vec || auto_par || auto_inline)
     //    disp_schedule_and_storage_mapping(env);
 
@@ -20,24 +20,35 @@ namespace Internal {
 
 class Function;
 
+class LoweringCache;
+struct FuncCostEstimate;
+
 /** Build loop nests and inject Function realizations at the
  * appropriate places using the schedule. Returns a flag indicating
- * whether memoization passes need to be run. */
+ * whether memoization passes need to be run. The loop nests of
+ * Functions whose definition and schedule are unchanged since an
+ * earlier lowering are reused from the given cache, if any. */
 Stmt schedule_functions(const std::vector<Function> &outputs,
                         const std::vector<std::string> &order,
                         const std::map<std::string, Function> &env,
                         const Target &target,
-                        bool &any_memoized);
+                        bool &any_memoized,
+                        LoweringCache *lowering_cache = nullptr);
 
 
-/** Gives advise on scheduling decisions. */
+/** Gives advise on scheduling decisions. The region analysis
+ * memoizes bounds queries in the given cache, if any. The cost the
+ * grouping estimated for each Func is stored in cost_estimates, if
+ * given. */
 void schedule_advisor(const std::vector<Function> &outputs,
                       const std::vector<std::string> &order,
                       std::map<std::string, Function> &env,
                       const FuncValueBounds &func_val_bounds,
                       const Target &target,
                       bool root_default, bool auto_inline,
-                      bool auto_par, bool auto_vec);
+                      bool auto_par, bool auto_vec,
+                      BoundsCache *bounds_cache = nullptr,
+                      std::map<std::string, FuncCostEstimate> *cost_estimates = nullptr);
 
 }
 }
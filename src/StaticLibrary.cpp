@@ -70,6 +70,77 @@ void append_ar_file(std::ofstream &ar, const std::string &src_path, const FileSt
     ar << src_data.rdbuf();
 }
 
+// The number of bytes append_ar_file writes for a member, not counting
+// any padding before it.
+size_t ar_member_size(const std::string &src_path, size_t data_size) {
+    std::string src_name = base_name(src_path, '/');
+    return 60 + (src_name.size() > 16 ? src_name.size() : 0) + data_size;
+}
+
+void append_uint32(std::string &s, uint32_t value, bool big_endian) {
+    for (int i = 0; i < 4; i++) {
+        int shift = big_endian ? 24 - 8 * i : 8 * i;
+        s += (char)((value >> shift) & 0xff);
+    }
+}
+
+// Write a symbol table mapping each symbol defined by the members to
+// the offset of the member's header, as the first member of the
+// archive. GNU ar calls this member "/", and BSD ar "__.SYMDEF".
+void append_symbol_table(std::ofstream &ar, const std::vector<ArInput> &src_files, bool bsd) {
+    size_t num_symbols = 0, names_size = 0;
+    for (const ArInput &input : src_files) {
+        num_symbols += input.symbols.size();
+        for (const std::string &symbol : input.symbols) {
+            names_size += symbol.size() + 1;
+        }
+    }
+
+    // The size of the table doesn't depend on the offsets in it, so
+    // the offsets of the members can be worked out first.
+    size_t table_size = bsd ? 8 + 8 * num_symbols + names_size : 4 + 4 * num_symbols + names_size;
+    size_t offset = 8 + ar_member_size("", table_size);
+    std::vector<uint32_t> member_offsets;
+    for (const ArInput &input : src_files) {
+        offset += offset & 1;
+        member_offsets.push_back(offset);
+        offset += ar_member_size(input.name, input.data.size());
+    }
+    user_assert(offset <= 0xffffffff) << "Archive too large for a symbol table.\n";
+
+    std::string table, names;
+    if (bsd) {
+        append_uint32(table, num_symbols * 8, false);
+        for (size_t i = 0; i < src_files.size(); i++) {
+            for (const std::string &symbol : src_files[i].symbols) {
+                append_uint32(table, names.size(), false);
+                append_uint32(table, member_offsets[i], false);
+                names += symbol + '\0';
+            }
+        }
+        append_uint32(table, names.size(), false);
+    } else {
+        append_uint32(table, num_symbols, true);
+        for (size_t i = 0; i < src_files.size(); i++) {
+            for (const std::string &symbol : src_files[i].symbols) {
+                append_uint32(table, member_offsets[i], true);
+                names += symbol + '\0';
+            }
+        }
+    }
+    table += names;
+    internal_assert(table.size() == table_size);
+
+    ar << pad_right(bsd ? "__.SYMDEF" : "/", 16);
+    ar << decimal_string(0, 12);  // mod time
+    ar << decimal_string(0, 6);  // user id
+    ar << decimal_string(0, 6);  // group id
+    ar << octal_string(bsd ? 0644 : 0, 8);  // mode
+    ar << decimal_string(table.size(), 10);  // filesize
+    ar << "\x60\x0A";  // magic
+    ar << table;
+}
+
 void write_to(const char *path, const char *data) {
     std::ofstream a(path, std::ofstream::out);
     a << data;
@@ -106,9 +177,16 @@ void create_ar_file(const std::vector<std::string> &src_files,
 }
 
 void create_ar_file(const std::vector<ArInput> &src_files, 
-                    const std::string &dst_file) {
+                    const std::string &dst_file,
+                    bool bsd_symbol_table) {
     std::ofstream ar(dst_file, std::ofstream::out | std::ofstream::binary);
     ar << "!<arch>\x0A";
+    for (const ArInput &input : src_files) {
+        if (!input.symbols.empty()) {
+            append_symbol_table(ar, src_files, bsd_symbol_table);
+            break;
+        }
+    }
     for (const ArInput &input : src_files) {
         FileStat src_stat = { input.data.size(), 0, 0, 0, 0644 };
         vector_istreambuf<uint8_t> streambuf(input.data);
@@ -156,6 +234,33 @@ e789f)literal";
 
     file_unlink("arfile2.a");
 
+    // Test the symbol tables
+    std::vector<ArInput> with_symbols = {
+        ArInput{ "a.o", {'a', '1', '2'}, {"f", "gh"} },
+        ArInput{ "b.o", {'c', '4'}, {"i"} }
+    };
+    const std::string gnu_table(
+        "/               0           0     0     0       23        `\n"
+        "\0\0\0\x03\0\0\0\x5c\0\0\0\x5c\0\0\0\x9c" "f\0gh\0i\0", 60 + 23);
+    const std::string bsd_table(
+        "__.SYMDEF       0           0     0     644     39        `\n"
+        "\x18\0\0\0"
+        "\0\0\0\0\x6c\0\0\0" "\x02\0\0\0\x6c\0\0\0" "\x05\0\0\0\xac\0\0\0"
+        "\x07\0\0\0" "f\0gh\0i\0", 60 + 39);
+    const std::string members =
+        "\na.o             0           0     0     644     3         `\na12"
+        "\nb.o             0           0     0     644     2         `\nc4";
+    create_ar_file(with_symbols, "arfile3.a");
+    std::string actual3 = read_from("arfile3.a");
+    internal_assert(actual3 == "!<arch>\n" + gnu_table + members)
+        << "GNU symbol table wrong:(" << actual3 << ")\n";
+    create_ar_file(with_symbols, "arfile4.a", true);
+    std::string actual4 = read_from("arfile4.a");
+    internal_assert(actual4 == "!<arch>\n" + bsd_table + members)
+        << "BSD symbol table wrong:(" << actual4 << ")\n";
+    file_unlink("arfile3.a");
+    file_unlink("arfile4.a");
+
     debug(0) << "static_library_test passed\n";
 }
 
@@ -25,14 +25,19 @@ EXPORT void create_ar_file(const std::vector<std::string> &src_files,
 /**
  * Given a list of "files" (really, names and data), create an ar file.
  * This always emits 0 for all GID/UID/timestamps, and 0644 for
- * all modes (equivalent to the ar -D option). 
+ * all modes (equivalent to the ar -D option). If any of the files
+ * list the symbols they define, the archive starts with a symbol
+ * table (equivalent to running ranlib), in the format of BSD ar if
+ * bsd_symbol_table is true, and of GNU ar otherwise.
  */
 struct ArInput {
     std::string name;
     std::vector<uint8_t> data;
+    std::vector<std::string> symbols;
 };
 EXPORT void create_ar_file(const std::vector<ArInput> &src_files, 
-                           const std::string &dst_file);
+                           const std::string &dst_file,
+                           bool bsd_symbol_table = false);
 
 EXPORT void static_library_test();
 
@@ -7,7 +7,10 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <map>
+#include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 namespace Halide {
 namespace Internal {
@@ -22,6 +25,139 @@ std::string to_string(T value) {
     return os.str() ;
 }
 
+// A value of the json the profiler writes (see HL_PROFILER_JSON).
+struct JsonValue {
+    enum Kind {Null, Number, String, Array, Object};
+    Kind kind;
+    double number;
+    string str;
+    std::vector<JsonValue> array;
+    std::map<string, JsonValue> object;
+
+    JsonValue() : kind(Null), number(0) {}
+
+    // Missing fields read as null, so that absent stats are zero.
+    const JsonValue &operator[](const string &key) const {
+        static const JsonValue null_value;
+        auto it = object.find(key);
+        return it == object.end() ? null_value : it->second;
+    }
+};
+
+// Just enough of a json parser to read the profiler's stats.
+class JsonParser {
+    const string &text;
+    size_t pos;
+
+    void skip_space() {
+        while (pos < text.size() && isspace((unsigned char)text[pos])) pos++;
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_string(string &s) {
+        if (!consume('"')) return false;
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size()) {
+                pos++;
+                char c = text[pos++];
+                switch (c) {
+                case 'n': s += '\n'; break;
+                case 't': s += '\t'; break;
+                case 'r': s += '\r'; break;
+                case 'b': s += '\b'; break;
+                case 'f': s += '\f'; break;
+                case 'u': {
+                    // The profiler escapes control characters as
+                    // \u00XX. Others are written out as utf-8.
+                    if (pos + 4 > text.size()) return false;
+                    long code = strtol(text.substr(pos, 4).c_str(), nullptr, 16);
+                    pos += 4;
+                    if (code < 0x80) {
+                        s += (char)code;
+                    } else if (code < 0x800) {
+                        s += (char)(0xc0 | (code >> 6));
+                        s += (char)(0x80 | (code & 0x3f));
+                    } else {
+                        s += (char)(0xe0 | (code >> 12));
+                        s += (char)(0x80 | ((code >> 6) & 0x3f));
+                        s += (char)(0x80 | (code & 0x3f));
+                    }
+                    break;
+                }
+                default:
+                    // '"', '\\' and '/' stand for themselves.
+                    s += c;
+                }
+                continue;
+            }
+            s += text[pos++];
+        }
+        return pos++ < text.size();
+    }
+
+public:
+    JsonParser(const string &text) : text(text), pos(0) {}
+
+    bool parse(JsonValue &v) {
+        skip_space();
+        if (pos >= text.size()) return false;
+        if (consume('{')) {
+            v.kind = JsonValue::Object;
+            if (consume('}')) return true;
+            do {
+                string key;
+                if (!parse_string(key) || !consume(':') || !parse(v.object[key])) return false;
+            } while (consume(','));
+            return consume('}');
+        } else if (consume('[')) {
+            v.kind = JsonValue::Array;
+            if (consume(']')) return true;
+            do {
+                v.array.push_back(JsonValue());
+                if (!parse(v.array.back())) return false;
+            } while (consume(','));
+            return consume(']');
+        } else if (text[pos] == '"') {
+            v.kind = JsonValue::String;
+            return parse_string(v.str);
+        } else if (isalpha((unsigned char)text[pos])) {
+            // true, false or null. Only numbers and strings matter.
+            while (pos < text.size() && isalpha((unsigned char)text[pos])) pos++;
+            return true;
+        } else {
+            const char *start = text.c_str() + pos;
+            char *end = nullptr;
+            v.kind = JsonValue::Number;
+            v.number = strtod(start, &end);
+            pos += end - start;
+            return end != start;
+        }
+    }
+};
+
+// Format a number of nanoseconds as milliseconds.
+string format_ms(double ns) {
+    std::ostringstream os;
+    os.precision(3);
+    os << std::fixed << ns / 1e6 << "ms";
+    return os.str();
+}
+
+string format_percent(double fraction) {
+    std::ostringstream os;
+    os.precision(1);
+    os << std::fixed << fraction * 100 << "%";
+    return os.str();
+}
+
 class StmtToHtml : public IRVisitor {
 
     static const std::string css, js;
@@ -32,6 +168,132 @@ class StmtToHtml : public IRVisitor {
 private:
     std::ofstream stream;
 
+    // The auto-scheduler's estimates for each Func, and the stats of
+    // each pipeline from a profiled run, shown next to the Funcs,
+    // loops and allocations they describe.
+    std::map<string, FuncCostEstimate> estimates;
+    JsonValue profile;
+
+    // The stats of the pipeline being printed, if it was profiled.
+    const JsonValue *pipeline_stats;
+    std::map<string, const JsonValue *> func_stats, loop_stats, alloc_stats;
+    double total_est_ops, total_func_time;
+
+    // The loops we're currently inside of.
+    std::vector<string> loops;
+
+    // Index the stats of the profiled pipeline that a function was
+    // lowered from. The pipeline lives in a private function with a
+    // leading "__".
+    void find_pipeline_stats(const string &fn_name) {
+        pipeline_stats = nullptr;
+        func_stats.clear();
+        loop_stats.clear();
+        alloc_stats.clear();
+        total_func_time = 0;
+        for (const JsonValue &p : profile["pipelines"].array) {
+            const string &name = p["name"].str;
+            if (name == fn_name || "__" + name == fn_name) {
+                pipeline_stats = &p;
+            }
+        }
+        if (!pipeline_stats) return;
+        const JsonValue &p = *pipeline_stats;
+        for (const JsonValue &f : p["funcs"].array) {
+            func_stats[f["name"].str] = &f;
+            total_func_time += f["time_ns"].number;
+        }
+        for (const JsonValue &l : p["parallel_loops"].array) {
+            loop_stats[l["name"].str] = &l;
+        }
+        for (const JsonValue &a : p["allocations"].array) {
+            alloc_stats[a["name"].str + " " + a["loop"].str] = &a;
+        }
+    }
+
+    // The estimated and measured cost of a Func. The estimate is
+    // flagged when the Func's share of the estimated work and its
+    // share of the measured time differ by more than 2x.
+    string func_cost(const string &name) {
+        std::ostringstream s;
+        double est_share = -1, measured_share = -1;
+        auto est = estimates.find(name);
+        if (est != estimates.end()) {
+            const FuncCostEstimate &e = est->second;
+            s << "est: ";
+            if (e.ops >= 0 && total_est_ops > 0) {
+                est_share = e.ops / total_est_ops;
+                s << e.ops << " ops (" << format_percent(est_share) << ")";
+            } else {
+                s << "unknown ops";
+            }
+            if (!e.group.empty()) {
+                s << " group: " << e.group
+                  << " saved_mem: " << e.saved_mem
+                  << " redundant_work: " << e.redundant_work;
+            }
+        }
+        auto measured = func_stats.find(name);
+        if (measured != func_stats.end()) {
+            const JsonValue &f = *measured->second;
+            double runs = std::max(1.0, (*pipeline_stats)["runs"].number);
+            if (est != estimates.end()) s << " | ";
+            s << "measured: " << format_ms(f["time_ns"].number / runs) << "/run";
+            if (total_func_time > 0) {
+                measured_share = f["time_ns"].number / total_func_time;
+                s << " (" << format_percent(measured_share) << ")";
+            }
+            if (f["memory_peak"].number > 0) {
+                s << " heap peak: " << f["memory_peak"].number;
+            }
+            if (f["stack_peak"].number > 0) {
+                s << " stack: " << f["stack_peak"].number;
+            }
+        }
+        if (s.str().empty()) {
+            return "";
+        }
+        bool mispredicted =
+            est_share >= 0 && measured_share >= 0 &&
+            std::max(est_share, measured_share) > 0.05 &&
+            std::max(est_share, measured_share) > 2 * std::min(est_share, measured_share);
+        return " " + span(mispredicted ? "Cost Mispredicted" : "Cost", s.str());
+    }
+
+    // The measured efficiency of a parallel loop.
+    string loop_cost(const string &name) {
+        auto measured = loop_stats.find(name);
+        if (measured == loop_stats.end()) {
+            return "";
+        }
+        const JsonValue &l = *measured->second;
+        double runs = std::max(1.0, l["runs"].number);
+        std::ostringstream s;
+        s << "measured: " << l["tasks"].number / runs << " tasks/run"
+          << " task p50: " << format_ms(l["task_time_p50_ns"].number)
+          << " p99: " << format_ms(l["task_time_p99_ns"].number)
+          << " idle: " << format_ms(l["idle_ns"].number / runs) << "/run"
+          << " lock wait: " << format_ms(l["lock_wait_ns"].number / runs) << "/run";
+        return " " + span("Cost", s.str());
+    }
+
+    // The measured memory use of an allocation site.
+    string alloc_cost(const string &name) {
+        auto measured = alloc_stats.find(name + " " + (loops.empty() ? "root" : loops.back()));
+        if (measured == alloc_stats.end()) {
+            return "";
+        }
+        const JsonValue &a = *measured->second;
+        std::ostringstream s;
+        if (a["stack_bytes"].number > 0) {
+            s << "measured: stack " << a["stack_bytes"].number;
+        } else {
+            s << "measured: heap peak " << a["memory_peak"].number
+              << " allocs: " << a["num_allocs"].number;
+        }
+        return " " + span("Cost", s.str());
+    }
+
     int unique_id() { return ++id_count; }
 
     // All spans and divs will have an id of the form "x-y", where x
@@ -354,7 +616,8 @@ private:
         stream << keyword("produce") << " ";
         stream << var(op->name);
         stream << close_expand_button() << " {";
-        stream << close_span();;
+        stream << close_span();
+        stream << func_cost(op->name);
         stream << open_div("ProduceBody Indent", produce_id);
         print(op->produce);
         stream << close_div();
@@ -403,8 +666,11 @@ private:
         stream << matched(")");
         stream << close_expand_button();
         stream << " " << matched("{");
+        stream << loop_cost(op->name);
         stream << open_div("ForBody Indent", id);
+        loops.push_back(op->name);
         print(op->body);
+        loops.pop_back();
         stream << close_div();
         stream << matched("}");
 
@@ -471,6 +737,7 @@ private:
             stream << keyword("custom_delete") << "{ " << op->free_function << "(); ";
             stream << matched("}");
         }
+        stream << alloc_cost(op->name);
 
         stream << open_div("AllocateBody");
         print(op->body);
@@ -590,6 +857,7 @@ public:
     }
 
     void print(const LoweredFunc &op) {
+        find_pipeline_stats(op.name);
         scope.push(op.name, unique_id());
         stream << open_div("Function");
 
@@ -623,7 +891,18 @@ public:
         stream << close_div();
     }
 
-    StmtToHtml(string filename) : id_count(0), context_stack(1, 0) {
+    // Show the given cost estimates and profiler stats in the output.
+    void set_costs(const std::map<string, FuncCostEstimate> &e, const JsonValue &p) {
+        estimates = e;
+        profile = p;
+        total_est_ops = 0;
+        for (const auto &i : estimates) {
+            if (i.second.ops > 0) total_est_ops += i.second.ops;
+        }
+    }
+
+    StmtToHtml(string filename) : id_count(0), pipeline_stats(nullptr),
+                                  total_est_ops(0), total_func_time(0), context_stack(1, 0) {
         stream.open(filename.c_str());
         stream << "<head>";
         stream << "<style type='text/css'>" << css << "</style>\n";
@@ -664,6 +943,8 @@ span.IntImm { color: #099; }\n \
 span.FloatImm { color: #099; }\n \
 b.Highlight { font-weight: bold; background-color: #DDD; }\n \
 span.Highlight { font-weight: bold; background-color: #FF0; }\n \
+span.Cost { color: #777; font-style: italic; margin-left: 2em; }\n \
+span.Mispredicted { color: #c00; }\n \
 ";
 
 const std::string StmtToHtml::js = "\n \
@@ -690,7 +971,25 @@ void print_to_html(string filename, Stmt s) {
 }
 
 void print_to_html(string filename, const Module &m) {
+    const char *profile_file = getenv("HL_STMT_HTML_PROFILE");
+    print_to_html(filename, m, profile_file ? profile_file : "");
+}
+
+void print_to_html(string filename, const Module &m, const string &profile_file) {
+    JsonValue profile;
+    if (!profile_file.empty()) {
+        std::ifstream f(profile_file.c_str());
+        std::stringstream text;
+        text << f.rdbuf();
+        string json = text.str();
+        if (!f || !JsonParser(json).parse(profile)) {
+            user_warning << "Could not read profiler stats from " << profile_file << "\n";
+            profile = JsonValue();
+        }
+    }
+
     StmtToHtml sth(filename);
+    sth.set_costs(m.cost_estimates(), profile);
     for (const auto &b : m.buffers()) {
         sth.print(b);
     }
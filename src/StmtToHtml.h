@@ -15,9 +15,20 @@ namespace Internal {
  */
 EXPORT void print_to_html(std::string filename, Stmt s);
 
-/** Dump an HTML-formatted print of a Module to filename. */
+/** Dump an HTML-formatted print of a Module to filename. If the
+ * module was auto-scheduled, each Func is annotated with the
+ * auto-scheduler's estimate of its cost. If the
+ * HL_STMT_HTML_PROFILE environment variable names a file written by
+ * the profiler (see HL_PROFILER_JSON), Funcs, parallel loops and
+ * allocations are also annotated with their measured costs, and
+ * Funcs whose estimated and measured share of the pipeline differ by
+ * more than 2x are highlighted. */
 EXPORT void print_to_html(std::string filename, const Module &m);
 
+/** Dump an HTML-formatted print of a Module to filename, annotated
+ * with the profiler stats in profile_file, if it isn't empty. */
+EXPORT void print_to_html(std::string filename, const Module &m, const std::string &profile_file);
+
 }}
 
 #endif
@@ -167,7 +167,7 @@ private:
             new_body = Block::make(new_body, Evaluate::make(call_after));
             new_body = LetStmt::make(op->name + ".trace_id", call_before, new_body);
             stmt = Realize::make(op->name, op->types, op->bounds, op->condition, new_body);
-        } else if (f.is_tracing_stores() || f.is_tracing_loads()) {
+        } else if (f.is_tracing_stores() || f.is_tracing_loads() || f.is_tracing_store_regions()) {
             // We need a trace id defined to pass to the loads and stores
             Stmt new_body = op->body;
             new_body = LetStmt::make(op->name + ".trace_id", 0, new_body);
@@ -184,6 +184,49 @@ private:
         map<string, Function>::const_iterator iter = env.find(op->name);
         if (iter == env.end()) return;
         Function f = iter->second;
+
+        // The region of the pure step
+        vector<Expr> region;
+        for (int i = 0; i < f.dimensions(); i++) {
+            Expr min = Variable::make(Int(32), f.name() + ".s0." + f.args()[i] + ".min");
+            Expr max = Variable::make(Int(32), f.name() + ".s0." + f.args()[i] + ".max");
+            Expr extent = (max + 1) - min;
+            region.push_back(min);
+            region.push_back(extent);
+        }
+
+        Stmt produce = op->produce, update = op->update;
+        if (f.is_tracing_store_regions()) {
+            // Once the region has been produced, report all of it in
+            // one event per value, giving the runtime the buffer to
+            // read it from.
+            Stmt trace_regions;
+            for (size_t i = 0; i < f.output_types().size(); i++) {
+                string buffer_name = f.name();
+                if (f.output_types().size() > 1) {
+                    buffer_name += '.' + std::to_string(i);
+                }
+                Type t = f.output_types()[i];
+                vector<Expr> args;
+                args.push_back(op->name);
+                args.push_back(halide_trace_store_region);
+                args.push_back(Variable::make(Int(32), op->name + ".trace_id"));
+                args.push_back((int)i);
+                args.push_back(Variable::make(type_of<struct buffer_t *>(), buffer_name + ".buffer"));
+                args.insert(args.end(), region.begin(), region.end());
+                args.push_back((int)t.code());
+                args.push_back(t.bits());
+                Expr call = Call::make(Int(32), Call::trace, args, Call::Intrinsic);
+                Stmt s = Evaluate::make(call);
+                trace_regions = trace_regions.defined() ? Block::make(trace_regions, s) : s;
+            }
+            if (update.defined()) {
+                update = Block::make(update, trace_regions);
+            } else {
+                produce = Block::make(produce, trace_regions);
+            }
+        }
+
         if (f.is_tracing_realizations() || global_level > 0) {
             // Throw a tracing call around each pipeline event
             vector<Expr> args;
@@ -194,21 +237,13 @@ private:
             args.push_back(0); // value
 
             // Use the size of the pure step
-
-            for (int i = 0; i < f.dimensions(); i++) {
-                Expr min = Variable::make(Int(32), f.name() + ".s0." + f.args()[i] + ".min");
-                Expr max = Variable::make(Int(32), f.name() + ".s0." + f.args()[i] + ".max");
-                Expr extent = (max + 1) - min;
-                args.push_back(min);
-                args.push_back(extent);
-            }
+            args.insert(args.end(), region.begin(), region.end());
 
             Expr call;
-            Stmt new_update;
-            if (op->update.defined()) {
+            if (update.defined()) {
                 args[1] = halide_trace_update;
                 call = Call::make(Int(32), Call::trace, args, Call::Intrinsic);
-                new_update = Block::make(Evaluate::make(call), op->update);
+                update = Block::make(Evaluate::make(call), update);
             }
 
             args[1] = halide_trace_consume;
@@ -219,11 +254,13 @@ private:
             call = Call::make(Int(32), Call::trace, args, Call::Intrinsic);
             new_consume = Block::make(new_consume, Evaluate::make(call));
 
-            stmt = ProducerConsumer::make(op->name, op->produce, new_update, new_consume);
+            stmt = ProducerConsumer::make(op->name, produce, update, new_consume);
 
             args[1] = halide_trace_produce;
             call = Call::make(Int(32), Call::trace, args, Call::Intrinsic);
             stmt = LetStmt::make(f.name() + ".trace_id", call, stmt);
+        } else if (f.is_tracing_store_regions()) {
+            stmt = ProducerConsumer::make(op->name, produce, update, op->consume);
         }
 
     }
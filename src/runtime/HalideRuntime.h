@@ -129,6 +129,71 @@ extern void halide_spawn_thread(void *user_context, void (*f)(void *), void *clo
  * routine, shuts down and then reinitializes the thread pool. */
 extern void halide_set_num_threads(int n);
 
+/** Pin worker i of Halide's thread pool to cpus[i % num_cpus]. The
+ * thread that calls into a pipeline also works on its parallel loops
+ * as thread 0, but isn't pinned, so cpus[0] is best left for it. When
+ * the workers are pinned, each parallel loop is split into one range
+ * of iterations per thread, and each thread starts on its own range,
+ * so consecutive loops of the same size keep sending the same
+ * iterations to the same cpu. Pass NULL to let the workers run
+ * anywhere. Overrides the HL_THREAD_AFFINITY environment
+ * variable. No effect on OS X, iOS or Windows. If called after the
+ * first use of a parallel Halide routine, shuts down and then
+ * reinitializes the thread pool. */
+extern void halide_set_thread_affinity(const int *cpus, int num_cpus);
+
+/** Set how long, in microseconds, idle threads of Halide's thread
+ * pool keep looking for work before going to sleep. They yield the
+ * cpu while they look. Waking a sleeping thread takes tens of
+ * microseconds, so this speeds up pipelines made of many small
+ * parallel loops, at the cost of some cpu time while idle. Zero
+ * makes idle threads sleep straight away. Defaults to the value of
+ * the HL_THREAD_SPIN_US environment variable, or zero. Around 50
+ * is enough to cover the wakeup latency. No effect on OS X, iOS or
+ * Windows. */
+extern void halide_set_thread_spin_time(int microseconds);
+
+/** While hot is non-zero, idle threads of Halide's thread pool never
+ * go to sleep, so a run of consecutive pipeline calls never waits
+ * for threads to wake up. Call again with zero afterwards to stop
+ * them burning cpu. No effect on OS X, iOS or Windows. */
+extern void halide_set_thread_pool_hot(int hot);
+
+/** Set how many iterations of a parallel loop a thread claims at a
+ * time. By default, chunks are guided: they start large, and shrink
+ * as the loop nears its end, which keeps the number of claims low
+ * while still balancing the load across threads at the end. A
+ * positive chunk size claims that many iterations at a time instead,
+ * which suits loops whose iterations vary wildly in cost. Zero goes
+ * back to guided chunks. No effect on OS X, iOS or Windows. */
+extern void halide_set_task_chunk_size(int chunk);
+
+/** An opaque handle to a thread pool made by
+ * halide_create_thread_pool. */
+struct halide_thread_pool;
+
+/** Create a thread pool separate from the default one. num_threads
+ * counts the thread that calls into the pipeline, which also does
+ * work, so num_threads - 1 workers are started. If cpu_mask is not
+ * NULL, the workers may only run on the cpus whose bits are set in
+ * it, where cpu i is bit i % 64 of cpu_mask[i / 64]. Returns NULL
+ * if the pool can't be made. Only the posix thread pool supports
+ * this; elsewhere it always returns NULL. */
+extern struct halide_thread_pool *halide_create_thread_pool(void *user_context, int num_threads,
+                                                            const uint64_t *cpu_mask,
+                                                            int cpu_mask_words);
+
+/** Shut down the threads of a pool made by halide_create_thread_pool
+ * and free it. No pipeline may be using it. Any user_contexts bound
+ * to it go back to using the default pool. */
+extern void halide_destroy_thread_pool(struct halide_thread_pool *pool);
+
+/** Run the parallel loops of pipelines called with this user_context
+ * on the given pool, rather than the default one. Pass NULL to go
+ * back to the default pool. Has no effect if a custom do_par_for is
+ * set. */
+extern void halide_bind_thread_pool(void *user_context, struct halide_thread_pool *pool);
+
 /** Halide calls these functions to allocate and free memory. To
  * replace in AOT code, use the halide_set_custom_malloc and
  * halide_set_custom_free, or (on platforms that support weak
@@ -151,6 +216,54 @@ extern halide_malloc_t halide_set_custom_malloc(halide_malloc_t user_malloc);
 extern halide_free_t halide_set_custom_free(halide_free_t user_free);
 //@}
 
+/** Set the most memory, in bytes, that the default halide_malloc
+ * keeps for reuse in each of its pools of freed blocks. Pooled
+ * blocks are rounded up to one of a set of size classes, and freed
+ * blocks are kept on per-size-class lists that are shared by few
+ * threads, so pipelines that repeatedly allocate the same sized
+ * buffers (for example inside parallel loops) skip the system
+ * allocator. When a pool grows past this size, its largest blocks
+ * are released until it is half full. The default, zero, turns
+ * pooling off, and setting a smaller size releases memory that is
+ * over it. The pools are emptied when the runtime is released (for
+ * example by JIT modules being destroyed) or the process exits. Has
+ * no effect if a custom malloc is set. */
+extern void halide_malloc_pool_set_size(size_t size);
+
+/** Make the default halide_malloc map allocations of at least this
+ * many bytes directly from the OS, in huge pages (reserved ones
+ * until mapping them first fails, then transparent huge pages), so
+ * that large buffers take fewer TLB entries. Each such allocation is
+ * rounded up to a whole number of 2MB pages, and costs an mmap and a
+ * munmap rather than reusing freed memory, so the threshold should be
+ * a few megabytes or more. Zero turns this off. The default is read
+ * from the HL_HUGE_PAGE_THRESHOLD environment variable, and is
+ * otherwise zero. Only supported on Linux and Android; elsewhere
+ * halide_malloc falls back to the system allocator. */
+extern void halide_set_huge_page_threshold(size_t size);
+
+/** Where the memory of allocations mapped by halide_malloc (see
+ * halide_set_huge_page_threshold) is placed on machines with more
+ * than one numa node. */
+enum halide_numa_policy_t {
+    /** Use the process's policy, which unless set otherwise puts each
+     * page on the node of the thread that first touches it. */
+    halide_numa_default = 0,
+
+    /** Spread the pages evenly across all nodes. */
+    halide_numa_interleave = 1,
+
+    /** Put each page on the node of the thread that first touches it,
+     * whatever the process's policy is. */
+    halide_numa_local = 2
+};
+
+/** Set the halide_numa_policy_t used for allocations mapped by
+ * halide_malloc. The default is read from the HL_NUMA_POLICY
+ * environment variable, which may be "interleave" or "local", and is
+ * otherwise halide_numa_default. Needs libnuma to be installed. */
+extern void halide_set_numa_policy(int policy);
+
 /** Called when debug_to_file is used inside %Halide code.  See
  * Func::debug_to_file for how this is called
  *
@@ -170,7 +283,8 @@ enum halide_trace_event_code {halide_trace_load = 0,
                               halide_trace_consume = 6,
                               halide_trace_end_consume = 7,
                               halide_trace_begin_pipeline = 8,
-                              halide_trace_end_pipeline = 9};
+                              halide_trace_end_pipeline = 9,
+                              halide_trace_store_region = 10};
 
 // TODO: Update to use halide_type_t
 // Tracking issue filed here: https://github.com/halide/Halide/issues/980
@@ -192,11 +306,47 @@ struct halide_trace_event {
 /** Called when Funcs are marked as trace_load, trace_store, or
  * trace_realization. See Func::set_custom_trace. The default
  * implementation either prints events via halide_printf, or if
- * HL_TRACE_FILE is defined, dumps the trace to that file in a
- * yet-to-be-documented binary format (see src/runtime/tracing.cpp to
- * reverse engineer the format). If the trace is going to be large,
- * you may want to make the file a named pipe, and then read from that
- * pipe into gzip.
+ * HL_TRACE_FILE is defined, dumps the trace to that file in the
+ * binary format below. If the trace is going to be large, you may
+ * want to make the file a named pipe, and then read from that pipe
+ * into gzip.
+ *
+ * The binary format is version 2. All values are little-endian. Each
+ * run of records written to a file starts with two uint32s: the magic
+ * number 0x43525448 ("HTRC") and the version. Each record then starts
+ * with a 24-byte header:
+ *
+ *    uint32 size         the size of the whole record, a multiple of 4
+ *    int32 id            the id returned by halide_trace
+ *    int32 parent_id
+ *    uint32 func_id
+ *    uint8 event, type_code, bits, vector_width
+ *    uint8 value_index, dimensions
+ *    uint16 padding
+ *
+ * followed by vector_width values, each stored in the next power of
+ * two bytes at least bits wide, then dimensions int32 coordinates,
+ * then zeros up to size. A record with event 255 instead gives the
+ * name of the func with id func_id, as a zero-terminated string after
+ * the header. It comes before any other record that uses the id.
+ * Vector widths and dimensions over 255 are clamped.
+ *
+ * Funcs marked with Func::trace_store_regions report each region they
+ * produce as a single halide_trace_store_region event, instead of an
+ * event per store. The value of the event points to the buffer_t *
+ * of the func, and the coordinates are the min and extent of each
+ * dimension of the region, followed by the type code and bits of its
+ * values. In the binary format, these records have the type and bits
+ * of the values in their header, and the min and extent of each
+ * dimension before the values, which are packed with the first
+ * dimension innermost. They are written straight to the file, and can
+ * be much larger than other records. If a region isn't on the host,
+ * it is copied there first.
+ *
+ * Records are buffered per thread and written out in large blocks,
+ * so the records of different threads interleave in blocks, but an
+ * event always comes after the event it names as its parent. All
+ * records of a pipeline have been written when it returns.
  *
  * halide_trace returns a unique ID which will be passed to future
  * events that "belong" to the earlier event as the parent id. The
@@ -207,6 +357,7 @@ struct halide_trace_event {
  *      store
  *      update
  *      load/store
+ *      store_region
  *      consume
  *      load
  *      end_consume
@@ -245,6 +396,24 @@ extern int halide_get_trace_file(void *user_context);
  * (flushing the trace). Returns zero on success. */
 extern int halide_shutdown_trace();
 
+/** Set the file descriptor that Halide should write a timeline of
+ * pipeline execution to, in the Chrome trace event format (load it
+ * in chrome://tracing). The timeline has a span for each produce,
+ * update and consume of each traced Func, and for each parallel task,
+ * on the thread that ran it. Funcs are traced as by
+ * Func::trace_realizations or HL_TRACE=1, and while a timeline is
+ * being written their events go to it instead of to the trace. If
+ * never called, Halide checks for an environment variable called
+ * HL_TIMELINE_FILE and writes to that file. Pass -1 to stop
+ * recording. At most 256 threads can record at once; the events of
+ * any more are left out, and a warning at shutdown says how many. */
+extern void halide_set_timeline_file(int fd);
+
+/** If a timeline is being written, finish it, and close the file if
+ * it came from HL_TIMELINE_FILE. Returns zero on success. Also
+ * happens at process exit. */
+extern int halide_shutdown_timeline();
+
 /** All Halide GPU or device backend implementations much provide an interface
  * to be used with halide_device_malloc, etc.
  */
@@ -298,6 +467,23 @@ extern int halide_get_gpu_device(void *user_context);
  */
 extern void halide_memoization_cache_set_size(int64_t size);
 
+/** The ways the memoization cache can choose which results to evict
+ * when it is full. */
+enum halide_memoization_eviction_policy_t {
+    /** Evict the least recently used results first. */
+    halide_memoization_evict_lru = 0,
+
+    /** Evict the results that took the least time to compute per
+     * byte of memory they use first, while letting results that are
+     * no longer used age out (GreedyDual-Size). This is the
+     * default. */
+    halide_memoization_evict_cost_aware = 1
+};
+
+/** Set how the memoization cache chooses which results to evict,
+ * using one of the values of halide_memoization_eviction_policy_t. */
+extern void halide_memoization_cache_set_eviction_policy(int policy);
+
 /** Given a cache key for a memoized result, currently constructed
  *  from the Func name and top-level Func name plus the arguments of
  *  the computation, determine if the result is in the cache and
@@ -352,6 +538,53 @@ extern int halide_memoization_cache_store(void *user_context, const uint8_t *cac
   */
 extern void halide_memoization_cache_release(void *user_context, void *host);
 
+/** Also keep memoized results in a memory mapped file at path, of
+ * size bytes, which other processes using the same file share, and
+ * which outlives the process. Results that aren't in memory are
+ * looked for in the file, and results stored in memory are written
+ * to it too, overwriting the oldest ones once it is full. The cache
+ * keys hold the names of the pipeline and Function, a hash of the
+ * definitions of the Function and of everything it calls, and the
+ * values of the parameters, so processes share results for Functions
+ * defined the same way, whatever order they compile them in. The code
+ * of extern stages isn't part of the keys, so change version whenever
+ * it changes. If the file was made with a different
+ * version or size, it is cleared. Pass NULL to stop using a
+ * file. Returns zero on success. Only supported on Linux and Android;
+ * elsewhere it always fails. */
+extern int halide_memoization_cache_set_file(void *user_context, const char *path,
+                                             int64_t size, uint64_t version);
+
+/** Counts of what the memoization cache has done, as returned by
+ * halide_memoization_cache_get_stats. Sizes are in bytes. */
+struct halide_memoization_cache_stats {
+    /** The number of calls to halide_memoization_cache_lookup, and
+     * the number of those that found their key. */
+    uint64_t lookups, hits;
+
+    /** The number of results added to the cache, and the number
+     * removed to keep it within its size. */
+    uint64_t stores, evictions;
+
+    /** The number of results in the cache. */
+    uint64_t entries;
+
+    /** The memory used by the results in the cache, and the limit set
+     * by halide_memoization_cache_set_size. */
+    int64_t current_size, max_size;
+
+    /** The number of lookups that missed in memory but were found in
+     * the file set by halide_memoization_cache_set_file, and the
+     * number of results written to that file. */
+    uint64_t file_hits, file_stores;
+};
+
+/** Fill in stats with the counts of lookups, hits, stores and
+ * evictions since the process started or last called
+ * halide_memoization_cache_cleanup, and the current state of the
+ * memoization cache. */
+extern void halide_memoization_cache_get_stats(struct halide_memoization_cache_stats *stats);
+
 /** Free all memory and resources associated with the memoization cache.
  * Must be called at a time when no other threads are accessing the cache.
  */
@@ -796,6 +1029,20 @@ extern int halide_enumerate_registered_filters(void *user_context, void* enumera
  * the -profile target flag, which runs a sampling profiler thread
  * alongside the pipeline. */
 
+/** The hardware performance counters the profiler can read at each
+ * Func boundary. They are only read on Linux on x86, if the
+ * HL_PROFILER_COUNTERS environment variable is set when the profiler
+ * starts. What counts as a vector instruction varies from cpu to cpu,
+ * so it is a raw event given by HL_PROFILER_VECTOR_EVENT, and isn't
+ * counted if that isn't set. */
+enum halide_profiler_counter_t {
+    halide_profiler_cycles = 0,
+    halide_profiler_instructions,
+    halide_profiler_cache_misses,
+    halide_profiler_vector_instructions,
+    halide_profiler_num_counters
+};
+
 /** Per-Func state tracked by the sampling profiler. */
 struct halide_profiler_func_stats {
     /** Total time taken evaluating this Func (in nanoseconds). */
@@ -818,6 +1065,81 @@ struct halide_profiler_func_stats {
 
     /** The peak stack allocation of this Func threads. */
     int stack_peak;
+
+    /** The hardware counts of this Func, summed over all threads,
+     * indexed by halide_profiler_counter_t. Zero for counters that
+     * weren't read. */
+    uint64_t counters[halide_profiler_num_counters];
+};
+
+/** Per-allocation state tracked by the sampling profiler, for each
+ * place in a pipeline that allocates a buffer. */
+struct halide_profiler_alloc_site_stats {
+    /** The name of the buffer allocated. A global constant string. */
+    const char *name;
+
+    /** The name of the innermost loop around the allocation, or
+     * "root" if it's outside of all loops. A global constant
+     * string. */
+    const char *loop;
+
+    /** The index of the Func the buffer belongs to in the funcs of
+     * the pipeline. */
+    int func;
+
+    /** The size of the allocation if it's on the stack, or zero if
+     * it's on the heap. Allocations on the stack are sized when the
+     * pipeline is compiled, and aren't counted when it runs. */
+    int stack_bytes;
+
+    /** The current heap allocation of this site. */
+    int memory_current;
+
+    /** The peak heap allocation of this site, including concurrent
+     * allocations by different threads. */
+    int memory_peak;
+
+    /** The total number of heap allocations by this site. */
+    int num_allocs;
+
+    /** The total heap allocation of this site. */
+    uint64_t memory_total;
+};
+
+/** The number of buckets in the histogram of the run times of a
+ * pipeline. Each power of two is split into eight buckets, so
+ * percentiles of the run time are accurate to within 7%. */
+enum {halide_profiler_run_time_buckets = 496};
+
+/** Per-parallel-loop state tracked by the sampling profiler. These
+ * exist in a linked list for each pipeline. */
+struct halide_profiler_par_for_stats {
+    /** The name of the loop variable. A global constant string. */
+    const char *name;
+
+    /** The next par_for_stats pointer. */
+    void *next;
+
+    /** The number of times this loop has been run. */
+    int runs;
+
+    /** The total number of tasks run, and the total time taken by
+     * them (in nanoseconds). */
+    uint64_t tasks;
+    uint64_t task_time;
+
+    /** The time threads of the thread pool spent waiting for its
+     * locks, and waiting for other threads to finish their tasks,
+     * while this loop ran (in nanoseconds). These are measured over
+     * the whole thread pool, so they include the waits of any other
+     * parallel loops running at the same time. */
+    uint64_t lock_wait;
+    uint64_t idle;
+
+    /** How many tasks took each range of wall clock times. Uses the
+     * same buckets as the run time histogram of a pipeline. Use
+     * halide_profiler_task_time_percentile to read it. */
+    uint32_t task_time_histogram[halide_profiler_run_time_buckets];
 };
 
 /** Per-pipeline state tracked by the sampling profiler. These exist
@@ -832,6 +1154,17 @@ struct halide_profiler_pipeline_stats {
     /** An array containing states for each Func in this pipeline. */
     halide_profiler_func_stats *funcs;
 
+    /** A linked list of states for each parallel loop in this
+     * pipeline that has been run. */
+    halide_profiler_par_for_stats *par_fors;
+
+    /** An array containing states for each allocation site in this
+     * pipeline. */
+    halide_profiler_alloc_site_stats *alloc_sites;
+
+    /** The number of allocation sites in this pipeline. */
+    int num_alloc_sites;
+
     /** The next pipeline_stats pointer. It's a void * because types
      * in the Halide runtime may not currently be recursive. */
     void *next;
@@ -859,8 +1192,46 @@ struct halide_profiler_pipeline_stats {
 
     /** The total number of memory allocation of funcs in this pipeline. */
     int num_allocs;
+
+    /** The number of runs of this pipeline that are in progress. The
+     * stats of a pipeline with runs in progress are kept by
+     * halide_profiler_reset. */
+    int active_runs;
+
+    /** How many runs of this pipeline took each range of wall clock
+     * times. Use halide_profiler_run_time_percentile to read it. */
+    uint32_t run_time_histogram[halide_profiler_run_time_buckets];
 };
 
+/** The state of one thread running Halide code, as sampled by the
+ * profiler. A pipeline claims one of these when it starts, and each
+ * parallel task claims one while it runs, so that the profiler can
+ * see what every thread is computing. Threads tend to claim the same
+ * slot each time, so a slot mostly follows a single thread. */
+struct halide_profiler_thread_state {
+    /** The id of the Func this thread is computing, or
+     * halide_profiler_outside_of_halide. Set by the pipeline, read
+     * periodically by the profiler thread. */
+    int current_func;
+
+    /** The index plus one of the slot of the pipeline run this slot
+     * belongs to, or zero if the slot is free. */
+    int owner;
+
+    /** Non-zero if the hardware counters are read in this slot
+     * whenever current_func changes. */
+    int counters;
+
+    /** Total time spent computing Funcs in this slot (in
+     * nanoseconds). */
+    uint64_t time;
+};
+
+/** The number of threads the profiler can tell apart. Any further
+ * threads running at the same time share one extra slot, which the
+ * profiler doesn't sample. */
+enum {halide_profiler_max_threads = 256};
+
 /** The global state of the profiler. */
 struct halide_profiler_state {
     /** Guards access to the fields below. If not locked, the sampling
@@ -878,17 +1249,24 @@ struct halide_profiler_state {
     /** An internal id used for bookkeeping. */
     int first_free_id;
 
-    /** The id of the current running Func. Set by the pipeline, read
-     * periodically by the profiler thread. */
+    /** Set to halide_profiler_please_stop to stop the profiler
+     * thread. The Funcs being computed are in threads. */
     int current_func;
 
     /** Is the profiler thread running. */
     bool started;
+
+    /** Total time the profiler has been sampling (in nanoseconds). */
+    uint64_t time;
+
+    /** The state of each thread running Halide code. */
+    halide_profiler_thread_state threads[halide_profiler_max_threads + 1];
 };
 
 /** Profiler func ids with special meanings. */
 enum {
-    /// current_func takes on this value when not inside Halide code
+    /// A thread's current_func takes on this value when not inside
+    /// Halide code
     halide_profiler_outside_of_halide = -1,
     /// Set current_func to this value to tell the profiling thread to
     /// halt. It will start up again next time you run a pipeline with
@@ -904,17 +1282,64 @@ extern halide_profiler_state *halide_profiler_get_state();
  * This function grabs the global profiler state's lock on entry. */
 extern halide_profiler_pipeline_stats *halide_profiler_get_pipeline_state(const char *pipeline_name);
 
-/** Reset all profiler state.
- * WARNING: Do NOT call this method while any halide pipeline is
- * running; halide_profiler_memory_allocate/free and
- * halide_profiler_stack_peak_update update the profiler pipeline's
- * state without grabbing the global profiler state's lock. */
+/** Reset all profiler state, apart from the stats of pipelines that
+ * are running, which are still in use by them. They are reset by the
+ * first call after their runs end. */
 extern void halide_profiler_reset();
 
 /** Print out timing statistics for everything run since the last
- * reset. Also happens at process exit. */
+ * reset, including how busy each thread was. Func times are summed
+ * over all the threads computing them. Also happens at process
+ * exit. */
 extern void halide_profiler_report(void *user_context);
 
+/** halide_profiler_enumerate_func_t is a callback for
+ * halide_profiler_enumerate_pipelines; it is called once per pipeline
+ * that has been run since the last reset. Return 0 to continue the
+ * enumeration, or nonzero to terminate it. */
+typedef int (*halide_profiler_enumerate_func_t)(void *enumerate_context,
+                                                const halide_profiler_pipeline_stats *pipeline);
+
+/** Call func with the stats of each pipeline the profiler has seen
+ * run, while holding the profiler's lock. Returns zero, or the first
+ * nonzero value func returns. */
+extern int halide_profiler_enumerate_pipelines(void *user_context, void *enumerate_context,
+                                               halide_profiler_enumerate_func_t func);
+
+/** Get the wall clock time (in nanoseconds) that the given fraction
+ * of the runs of a pipeline took at most, e.g. 0.5 for the median
+ * run time or 0.99 for the 99th percentile. Returns zero if the
+ * pipeline hasn't finished a run. */
+extern uint64_t halide_profiler_run_time_percentile(const halide_profiler_pipeline_stats *pipeline,
+                                                    float fraction);
+
+/** Get the wall clock time (in nanoseconds) that the given fraction
+ * of the tasks of a parallel loop took at most. Returns zero if the
+ * loop hasn't run a task. */
+extern uint64_t halide_profiler_task_time_percentile(const halide_profiler_par_for_stats *par_for,
+                                                     float fraction);
+
+/** The formats halide_profiler_write_stats can write. */
+enum halide_profiler_format_t {
+    /** One line per Func of each pipeline, appended to the file. A
+     * header is written first if the file is new. The columns are
+     * pipeline, func, runs, time_ns, memory_peak, memory_total,
+     * num_allocs, stack_peak, cycles, instructions, cache_misses,
+     * vector_instructions, run_time_p50_ns, run_time_p90_ns and
+     * run_time_p99_ns. Any new columns will be added at the end. */
+    halide_profiler_format_csv = 0,
+    /** A single object containing an array of pipelines, each with an
+     * array of Funcs. Replaces the file. */
+    halide_profiler_format_json = 1
+};
+
+/** Write the stats of each pipeline and Func run since the last
+ * reset to a file, for other tools to read. Also happens whenever the
+ * report is printed, to the files named by the HL_PROFILER_CSV and
+ * HL_PROFILER_JSON environment variables. */
+extern int halide_profiler_write_stats(void *user_context, const char *file_name,
+                                       halide_profiler_format_t format);
+
 /// \name "Float16" functions
 /// These functions operate of bits (``uint16_t``) representing a half
 /// precision floating point number (IEEE-754 2008 binary16).
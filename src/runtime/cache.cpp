@@ -2,12 +2,13 @@
 #include "printer.h"
 #include "scoped_mutex_lock.h"
 
-// This is temporary code. In particular, the hash table is stupid and
-// currently thread safety is accomplished via large granularity spin
-// locks. It is mainly intended to prove the programming model and
-// runtime interface for memoization. We'll improve the implementation
-// later. In the meantime, on some platforms it can be replaced by a
-// platform specific LRU cache such as libcache from Apple.
+// The cache is split into shards, each with its own lock, hash table
+// and LRU list, so that threads looking up different keys rarely wait
+// on each other. The size limit applies to the cache as a whole: a
+// store first evicts from its own shard, and then from the others if
+// that wasn't enough. On some platforms the whole thing can be
+// replaced by a platform specific LRU cache such as libcache from
+// Apple.
 
 namespace Halide { namespace Runtime { namespace Internal {
 
@@ -57,6 +58,7 @@ WEAK void debug_print_key(void *user_context, const char *msg, const uint8_t *ca
 }
 #endif
 
+
 WEAK size_t full_extent(const buffer_t &buf) {
     size_t result = 1;
     for (int i = 0; i < 4; i++) {
@@ -92,12 +94,14 @@ WEAK bool bounds_equal(const buffer_t &buf1, const buffer_t &buf2) {
 }
 
 // Each host block has extra space to store a header just before the contents.
-// 16 is chosen to keep that alignment.
-// The header holds the cache key hash and pointer to the hash entry.
+// 32 is chosen to keep that alignment.
+// The header holds the cache key hash, pointer to the hash entry, and
+// the time of the lookup that missed, which gives the cost of computing
+// the contents when they're stored.
 //
 // This is an optimization the number of cycles it takes for the cache
 // to operate.
-const size_t extra_bytes_host_bytes = 16;
+const size_t extra_bytes_host_bytes = 32;
 
 struct CacheEntry {
     CacheEntry *next;
@@ -105,24 +109,31 @@ struct CacheEntry {
     CacheEntry *less_recent;
     size_t key_size;
     uint8_t *key;
-    uint32_t hash;
+    uint64_t hash;
     uint32_t in_use_count; // 0 if none returned from halide_cache_lookup
     uint32_t tuple_count;
+    // The time it took to compute the entry, in nanoseconds, and its
+    // priority for eviction. See prune_shard.
+    int64_t cost;
+    double priority;
     buffer_t computed_bounds;
     buffer_t buf[1];
     // ADDITIONAL buffer_t STRUCTS HERE
 
     bool init(const uint8_t *cache_key, size_t cache_key_size,
-              uint32_t key_hash, const buffer_t &computed_buf,
+              uint64_t key_hash, const buffer_t &computed_buf,
               int32_t tuples, buffer_t **tuple_buffers);
     void destroy();
     buffer_t &buffer(int32_t i);
-
+    bool matches(const uint8_t *cache_key, size_t cache_key_size, uint64_t key_hash,
+                 const buffer_t &computed_buf, int32_t tuples, buffer_t **tuple_buffers);
+    size_t size_in_bytes();
 };
 
 struct CacheBlockHeader {
     CacheEntry *entry;
-    uint32_t hash;
+    uint64_t hash;
+    int64_t start_time;
 };
 
 WEAK CacheBlockHeader *get_pointer_to_header(uint8_t * host) {
@@ -130,7 +141,7 @@ WEAK CacheBlockHeader *get_pointer_to_header(uint8_t * host) {
 }
 
 WEAK bool CacheEntry::init(const uint8_t *cache_key, size_t cache_key_size,
-                           uint32_t key_hash, const buffer_t &computed_buf,
+                           uint64_t key_hash, const buffer_t &computed_buf,
                            int32_t tuples, buffer_t **tuple_buffers) {
     next = NULL;
     more_recent = NULL;
@@ -139,6 +150,8 @@ WEAK bool CacheEntry::init(const uint8_t *cache_key, size_t cache_key_size,
     hash = key_hash;
     in_use_count = 0;
     tuple_count = tuples;
+    cost = 0;
+    priority = 0;
 
     key = (uint8_t *)halide_malloc(NULL, key_size);
     if (key == NULL) {
@@ -169,63 +182,238 @@ WEAK buffer_t &CacheEntry::buffer(int32_t i) {
     return buf_ptr[i];
 }
 
-WEAK uint32_t djb_hash(const uint8_t *key, size_t key_size)  {
-    uint32_t h = 5381;
-    for (size_t i = 0; i < key_size; i++) {
-      h = (h << 5) + h + key[i];
+WEAK bool CacheEntry::matches(const uint8_t *cache_key, size_t cache_key_size, uint64_t key_hash,
+                              const buffer_t &computed_buf, int32_t tuples, buffer_t **tuple_buffers) {
+    if (hash != key_hash || key_size != cache_key_size ||
+        tuple_count != (uint32_t)tuples ||
+        !keys_equal(key, cache_key, key_size) ||
+        !bounds_equal(computed_bounds, computed_buf)) {
+        return false;
+    }
+    for (int32_t i = 0; i < tuples; i++) {
+        if (!bounds_equal(buffer(i), *tuple_buffers[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+WEAK size_t CacheEntry::size_in_bytes() {
+    size_t result = 0;
+    for (uint32_t i = 0; i < tuple_count; i++) {
+        result += full_extent(buffer(i)) * buffer(i).elem_size;
+    }
+    return result;
+}
+
+// Hash the key eight bytes at a time. Keys are made of the scalar
+// arguments of the Func, so they're short, and the hash has to be
+// cheaper than the memcmp that confirms a match. The computed bounds
+// are hashed too, because a Func memoized inside a loop stores the
+// same key once for each iteration. The final mix spreads the bits,
+// because the top ones pick the shard and the bottom ones the bucket.
+const uint64_t kHashMultiplier = 0x9e3779b97f4a7c15ULL;
+
+WEAK uint64_t hash_word(uint64_t h, uint64_t word) {
+    h = (h ^ word) * kHashMultiplier;
+    return h ^ (h >> 32);
+}
+
+WEAK uint64_t hash_bytes(uint64_t h, const uint8_t *data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = hash_word(h, word);
+    }
+    if (i < size) {
+        uint64_t word = 0;
+        memcpy(&word, data + i, size - i);
+        h = hash_word(h, word);
     }
     return h;
 }
 
-WEAK halide_mutex memoization_lock;
+WEAK uint64_t finish_hash(uint64_t h) {
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return h;
+}
 
-const size_t kHashTableSize = 256;
+WEAK uint64_t hash_key(const uint8_t *key, size_t key_size, const buffer_t &computed_bounds) {
+    uint64_t h = hash_bytes(key_size * kHashMultiplier, key, key_size);
+    for (int d = 0; d < 4; d++) {
+        h = hash_word(h, ((uint64_t)(uint32_t)computed_bounds.min[d] << 32) | (uint32_t)computed_bounds.extent[d]);
+    }
+    return finish_hash(h);
+}
 
-WEAK CacheEntry *cache_entries[kHashTableSize];
+#define CACHE_SHARD_BITS 4
+const int kNumShards = 1 << CACHE_SHARD_BITS;
+
+// A shard's hash table starts with this many buckets, and doubles
+// whenever it holds more entries than buckets.
+const size_t kInitialBuckets = 16;
+
+struct CacheShard {
+    halide_mutex lock;
+    CacheEntry **buckets;
+    size_t num_buckets, num_entries;
+    CacheEntry *most_recently_used;
+    CacheEntry *least_recently_used;
+    int64_t size;
+    uint64_t lookups, hits, stores, evictions;
+    // The priority of the last entry evicted by the cost aware
+    // policy. New priorities are counted up from here, so entries
+    // that stop being used age relative to those that are.
+    double inflation;
+};
 
-WEAK CacheEntry *most_recently_used = NULL;
-WEAK CacheEntry *least_recently_used = NULL;
+WEAK CacheShard cache_shards[kNumShards];
+
+WEAK int eviction_policy = halide_memoization_evict_cost_aware;
+
+// The cost aware policy evicts the entry with the lowest priority
+// among this many of the least recently used entries that aren't in
+// use, rather than keeping the entries of a shard in a heap.
+const int kEvictionCandidates = 8;
 
 const uint64_t kDefaultCacheSize = 1 << 20;
 WEAK int64_t max_cache_size = kDefaultCacheSize;
+// The sum of the sizes of all the shards. Only changed with atomic
+// adds, while holding the lock of the shard whose size changed.
 WEAK int64_t current_cache_size = 0;
 
+// The cost of an entry is the time it took to compute, which needs
+// the clock to have been started (on OS X and Windows it divides by
+// the clock frequency). It is started on the first miss.
+WEAK bool cache_clock_started = false;
+WEAK halide_mutex cache_clock_lock;
+
+WEAK void start_cache_clock(void *user_context) {
+    if (__atomic_load_n(&cache_clock_started, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    ScopedMutexLock lock(&cache_clock_lock);
+    if (!cache_clock_started) {
+        halide_start_clock(user_context);
+        __atomic_store_n(&cache_clock_started, true, __ATOMIC_RELEASE);
+    }
+}
+
+WEAK CacheShard *shard_for(uint64_t h) {
+    return &cache_shards[h >> (64 - CACHE_SHARD_BITS)];
+}
+
+WEAK CacheEntry **bucket_for(CacheShard *shard, uint64_t h) {
+    return &shard->buckets[h & (shard->num_buckets - 1)];
+}
+
+// GreedyDual-Size: an entry is worth keeping in proportion to the
+// time it saves per byte it takes up.
+WEAK void update_priority(CacheShard *shard, CacheEntry *entry) {
+    size_t size = entry->size_in_bytes();
+    entry->priority = shard->inflation + (double)entry->cost / (double)(size ? size : 1);
+}
+
+WEAK bool over_budget() {
+    return __atomic_load_n(&current_cache_size, __ATOMIC_RELAXED) >
+        __atomic_load_n(&max_cache_size, __ATOMIC_RELAXED);
+}
+
+// Make room for one more entry in the hash table of a shard. Returns
+// false if there's no table and one can't be allocated. If a bigger
+// table can't be allocated, the chains just get longer.
+WEAK bool grow_table(CacheShard *shard) {
+    if (shard->buckets != NULL && shard->num_entries < shard->num_buckets) {
+        return true;
+    }
+    size_t new_size = shard->buckets ? shard->num_buckets * 2 : kInitialBuckets;
+    CacheEntry **new_buckets = (CacheEntry **)halide_malloc(NULL, new_size * sizeof(CacheEntry *));
+    if (new_buckets == NULL) {
+        return shard->buckets != NULL;
+    }
+    memset(new_buckets, 0, new_size * sizeof(CacheEntry *));
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        CacheEntry *entry = shard->buckets[i];
+        while (entry != NULL) {
+            CacheEntry *next = entry->next;
+            CacheEntry **bucket = &new_buckets[entry->hash & (new_size - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    if (shard->buckets != NULL) {
+        halide_free(NULL, shard->buckets);
+    }
+    shard->buckets = new_buckets;
+    shard->num_buckets = new_size;
+    return true;
+}
+
+WEAK void unlink_from_lru(CacheShard *shard, CacheEntry *entry) {
+    if (entry->less_recent != NULL) {
+        entry->less_recent->more_recent = entry->more_recent;
+    } else {
+        shard->least_recently_used = entry->more_recent;
+    }
+    if (entry->more_recent != NULL) {
+        entry->more_recent->less_recent = entry->less_recent;
+    } else {
+        shard->most_recently_used = entry->less_recent;
+    }
+    entry->more_recent = NULL;
+    entry->less_recent = NULL;
+}
+
+WEAK void push_most_recent(CacheShard *shard, CacheEntry *entry) {
+    entry->more_recent = NULL;
+    entry->less_recent = shard->most_recently_used;
+    if (shard->most_recently_used != NULL) {
+        shard->most_recently_used->more_recent = entry;
+    }
+    shard->most_recently_used = entry;
+    if (shard->least_recently_used == NULL) {
+        shard->least_recently_used = entry;
+    }
+}
+
 #if CACHE_DEBUGGING
-WEAK void validate_cache() {
-    print(NULL) << "validating cache, "
-                << "current size " << current_cache_size
-                << " of maximum " << max_cache_size << "\n";
+WEAK void validate_shard(CacheShard *shard) {
     int entries_in_hash_table = 0;
-    for (int i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
+    for (size_t i = 0; i < shard->num_buckets; i++) {
+        CacheEntry *entry = shard->buckets[i];
         while (entry != NULL) {
             entries_in_hash_table++;
-            if (entry->more_recent == NULL && entry != most_recently_used) {
+            if (entry->more_recent == NULL && entry != shard->most_recently_used) {
                 halide_print(NULL, "cache invalid case 1\n");
                 __builtin_trap();
             }
-            if (entry->less_recent == NULL && entry != least_recently_used) {
+            if (entry->less_recent == NULL && entry != shard->least_recently_used) {
                 halide_print(NULL, "cache invalid case 2\n");
                 __builtin_trap();
             }
+            if (shard_for(entry->hash) != shard) {
+                halide_print(NULL, "cache invalid case 5\n");
+                __builtin_trap();
+            }
             entry = entry->next;
         }
     }
     int entries_from_mru = 0;
-    CacheEntry *mru_chain = most_recently_used;
+    CacheEntry *mru_chain = shard->most_recently_used;
     while (mru_chain != NULL) {
         entries_from_mru++;
         mru_chain = mru_chain->less_recent;
     }
     int entries_from_lru = 0;
-    CacheEntry *lru_chain = least_recently_used;
+    CacheEntry *lru_chain = shard->least_recently_used;
     while (lru_chain != NULL) {
         entries_from_lru++;
         lru_chain = lru_chain->more_recent;
     }
-    print(NULL) << "hash entries " << entries_in_hash_table
-                << ", mru entries " << entries_from_mru
-                << ", lru entries " << entries_from_lru << "\n";
     if (entries_in_hash_table != entries_from_mru) {
         halide_print(NULL, "cache invalid case 3\n");
         __builtin_trap();
@@ -237,62 +425,394 @@ WEAK void validate_cache() {
 }
 #endif
 
-WEAK void prune_cache() {
+// Evict entries of a shard that aren't in use, until the cache as a
+// whole fits. The LRU policy evicts the least recently used entry
+// first. The cost aware policy evicts the one with the lowest
+// priority among the least recently used few. Must hold the shard's
+// lock.
+WEAK void prune_shard(CacheShard *shard) {
 #if CACHE_DEBUGGING
-    validate_cache();
+    validate_shard(shard);
 #endif
-    CacheEntry *prune_candidate = least_recently_used;
-    while (current_cache_size > max_cache_size &&
-           prune_candidate != NULL) {
-        CacheEntry *more_recent = prune_candidate->more_recent;
-
-        if (prune_candidate->in_use_count == 0) {
-            uint32_t h = prune_candidate->hash;
-            uint32_t index = h % kHashTableSize;
-
-            // Remove from hash table
-            CacheEntry *prev_hash_entry = cache_entries[index];
-            if (prev_hash_entry == prune_candidate) {
-                cache_entries[index] = prune_candidate->next;
-            } else {
-                while (prev_hash_entry != NULL && prev_hash_entry->next != prune_candidate) {
-                    prev_hash_entry = prev_hash_entry->next;
+    bool cost_aware = eviction_policy == halide_memoization_evict_cost_aware;
+    int max_candidates = cost_aware ? kEvictionCandidates : 1;
+    while (over_budget()) {
+        CacheEntry *prune_candidate = NULL;
+        int candidates = 0;
+        for (CacheEntry *entry = shard->least_recently_used;
+             entry != NULL && candidates < max_candidates;
+             entry = entry->more_recent) {
+            if (entry->in_use_count == 0) {
+                candidates++;
+                if (prune_candidate == NULL || entry->priority < prune_candidate->priority) {
+                    prune_candidate = entry;
                 }
-                halide_assert(NULL, prev_hash_entry != NULL);
-                prev_hash_entry->next = prune_candidate->next;
             }
+        }
+        if (prune_candidate == NULL) {
+            break;
+        }
+        if (cost_aware) {
+            shard->inflation = prune_candidate->priority;
+        }
 
-            // Remove from less recent chain.
-            if (least_recently_used == prune_candidate) {
-                least_recently_used = more_recent;
-            }
-            if (more_recent != NULL) {
-                more_recent->less_recent = prune_candidate->less_recent;
+        // Remove from hash table
+        CacheEntry **prev = bucket_for(shard, prune_candidate->hash);
+        while (*prev != NULL && *prev != prune_candidate) {
+            prev = &(*prev)->next;
+        }
+        halide_assert(NULL, *prev != NULL);
+        *prev = prune_candidate->next;
+        shard->num_entries--;
+
+        unlink_from_lru(shard, prune_candidate);
+
+        // Decrease cache used amount.
+        int64_t freed = prune_candidate->size_in_bytes();
+        shard->size -= freed;
+        __sync_fetch_and_add(&current_cache_size, -freed);
+        shard->evictions++;
+
+        // Deallocate the entry.
+        prune_candidate->destroy();
+        halide_free(NULL, prune_candidate);
+    }
+#if CACHE_DEBUGGING
+    validate_shard(shard);
+#endif
+}
+
+// Prune the shards in turn until the cache fits, skipping one whose
+// lock is already held by the caller.
+WEAK void prune_cache(CacheShard *skip) {
+    for (int i = 0; i < kNumShards && over_budget(); i++) {
+        CacheShard *shard = &cache_shards[i];
+        if (shard == skip) continue;
+        ScopedMutexLock lock(&shard->lock);
+        prune_shard(shard);
+    }
+}
+
+
+// An optional second level of the cache, kept in a memory mapped file
+// that other processes can share. The file holds a FileHeader, then
+// an index of num_buckets * kFileWays FileSlots, then the records,
+// which are written one after another and wrap around to the start
+// of the record area when they reach its end, so the oldest records
+// are the first to be overwritten. Each record is a RecordHeader,
+// followed by the key, then the shapes of the computed bounds and of
+// each buffer, then the contents of each buffer, with every part
+// padded to 8 bytes.
+//
+// Nothing removes the index slots of records that have been
+// overwritten. Instead, a slot is only trusted if the record it
+// points at has the same hash, sequence number and size, and a valid
+// checksum. The checksum also catches records left half written by a
+// crash. Processes take turns with flock, and the threads of one
+// process with cache_file.lock.
+const uint64_t kFileMagic = 0x454843414d454c48ULL; // "HLMEMCHE"
+const uint32_t kFileFormatVersion = 1;
+const uint32_t kFileWays = 4;
+// One index slot for every this many bytes of the file.
+const uint64_t kFileBytesPerSlot = 1024;
+
+struct FileHeader {
+    uint64_t magic;
+    uint32_t format_version, num_buckets;
+    uint64_t user_version, file_size;
+    uint64_t records_offset, records_size;
+    // Where the next record goes, relative to records_offset, and its
+    // sequence number. Sequence numbers start at one, so a slot with
+    // a sequence number of zero is empty.
+    uint64_t next_record, next_seq;
+};
+
+struct FileSlot {
+    uint64_t hash, seq, offset, size;
+};
+
+struct RecordHeader {
+    uint64_t hash, seq, size;
+    // Of everything in the record after the header.
+    uint64_t checksum;
+    int64_t cost;
+    int32_t key_size, tuple_count;
+};
+
+struct RecordShape {
+    int32_t min[4], extent[4], stride[4];
+    int32_t elem_size, padding;
+};
+
+struct CacheFile {
+    halide_mutex lock;
+    uint8_t *base;
+    size_t size;
+    int fd;
+    // The version the file was opened with.
+    uint64_t user_version;
+    uint64_t hits, stores;
+};
+
+WEAK CacheFile cache_file;
+
+WEAK size_t round_up_8(size_t x) {
+    return (x + 7) & ~7;
+}
+
+WEAK size_t record_size(int32_t key_size, int32_t tuple_count, buffer_t **tuple_buffers) {
+    size_t result = sizeof(RecordHeader) + round_up_8(key_size) + (1 + tuple_count) * sizeof(RecordShape);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        result += round_up_8(full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size);
+    }
+    return result;
+}
+
+WEAK void write_shape(RecordShape *shape, const buffer_t &buf) {
+    for (int i = 0; i < 4; i++) {
+        shape->min[i] = buf.min[i];
+        shape->extent[i] = buf.extent[i];
+        shape->stride[i] = buf.stride[i];
+    }
+    shape->elem_size = buf.elem_size;
+    shape->padding = 0;
+}
+
+WEAK bool shape_equal(const RecordShape *shape, const buffer_t &buf) {
+    if (shape->elem_size != buf.elem_size) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (shape->min[i] != buf.min[i] ||
+            shape->extent[i] != buf.extent[i] ||
+            shape->stride[i] != buf.stride[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+WEAK FileSlot *file_bucket(FileHeader *header, uint64_t h) {
+    FileSlot *slots = (FileSlot *)(header + 1);
+    return &slots[(h % header->num_buckets) * kFileWays];
+}
+
+// Returns the header of the file if it can be used. Another process
+// may have reset it to a different size, format or version than this
+// one opened it with.
+WEAK FileHeader *usable_file_header() {
+    FileHeader *header = (FileHeader *)cache_file.base;
+    if (header == NULL ||
+        header->magic != kFileMagic ||
+        header->format_version != kFileFormatVersion ||
+        header->user_version != cache_file.user_version ||
+        header->file_size != cache_file.size) {
+        return NULL;
+    }
+    return header;
+}
+
+// Look for a result in the cache file, and copy it into the buffers
+// if it's there. Must hold cache_file.lock.
+WEAK bool lookup_in_file(const uint8_t *cache_key, int32_t size, const buffer_t &computed_bounds,
+                         int32_t tuple_count, buffer_t **tuple_buffers, uint64_t h, int64_t *cost) {
+    FileHeader *header = usable_file_header();
+    if (header == NULL) {
+        return false;
+    }
+    size_t expected_size = record_size(size, tuple_count, tuple_buffers);
+    FileSlot *bucket = file_bucket(header, h);
+    for (uint32_t w = 0; w < kFileWays; w++) {
+        FileSlot slot = bucket[w];
+        if (slot.seq == 0 || slot.hash != h || slot.size != expected_size ||
+            slot.offset > header->records_size ||
+            slot.size > header->records_size - slot.offset) {
+            continue;
+        }
+        uint8_t *record = cache_file.base + header->records_offset + slot.offset;
+        RecordHeader *rh = (RecordHeader *)record;
+        if (rh->hash != h || rh->seq != slot.seq || rh->size != slot.size ||
+            rh->key_size != size || rh->tuple_count != tuple_count) {
+            continue;
+        }
+        uint8_t *ptr = record + sizeof(RecordHeader);
+        if (!keys_equal(ptr, cache_key, size)) {
+            continue;
+        }
+        ptr += round_up_8(size);
+        RecordShape *shapes = (RecordShape *)ptr;
+        bool all_shapes_equal = shape_equal(&shapes[0], computed_bounds);
+        for (int32_t i = 0; all_shapes_equal && i < tuple_count; i++) {
+            all_shapes_equal = shape_equal(&shapes[i + 1], *tuple_buffers[i]);
+        }
+        if (!all_shapes_equal) {
+            continue;
+        }
+        uint64_t checksum = hash_bytes(rh->seq, record + sizeof(RecordHeader), rh->size - sizeof(RecordHeader));
+        if (finish_hash(checksum) != rh->checksum) {
+            continue;
+        }
+        ptr += (1 + tuple_count) * sizeof(RecordShape);
+        for (int32_t i = 0; i < tuple_count; i++) {
+            size_t bytes = full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size;
+            memcpy(tuple_buffers[i]->host, ptr, bytes);
+            ptr += round_up_8(bytes);
+        }
+        *cost = rh->cost;
+        return true;
+    }
+    return false;
+}
+
+// Write a result to the cache file, overwriting the oldest records if
+// need be. Must hold cache_file.lock.
+WEAK void store_in_file(const uint8_t *cache_key, int32_t size, const buffer_t &computed_bounds,
+                        int32_t tuple_count, buffer_t **tuple_buffers, uint64_t h, int64_t cost) {
+    FileHeader *header = usable_file_header();
+    if (header == NULL) {
+        return;
+    }
+    size_t rsize = record_size(size, tuple_count, tuple_buffers);
+    if (rsize > header->records_size) {
+        return;
+    }
+    if (header->next_record > header->records_size - rsize) {
+        header->next_record = 0;
+    }
+    uint64_t offset = header->next_record;
+    uint64_t seq = header->next_seq++;
+    header->next_record += rsize;
+
+    uint8_t *record = cache_file.base + header->records_offset + offset;
+    uint8_t *ptr = record + sizeof(RecordHeader);
+    memcpy(ptr, cache_key, size);
+    memset(ptr + size, 0, round_up_8(size) - size);
+    ptr += round_up_8(size);
+    RecordShape *shapes = (RecordShape *)ptr;
+    write_shape(&shapes[0], computed_bounds);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        write_shape(&shapes[i + 1], *tuple_buffers[i]);
+    }
+    ptr += (1 + tuple_count) * sizeof(RecordShape);
+    for (int32_t i = 0; i < tuple_count; i++) {
+        size_t bytes = full_extent(*tuple_buffers[i]) * tuple_buffers[i]->elem_size;
+        memcpy(ptr, tuple_buffers[i]->host, bytes);
+        memset(ptr + bytes, 0, round_up_8(bytes) - bytes);
+        ptr += round_up_8(bytes);
+    }
+
+    RecordHeader *rh = (RecordHeader *)record;
+    rh->hash = h;
+    rh->seq = seq;
+    rh->size = rsize;
+    rh->cost = cost;
+    rh->key_size = size;
+    rh->tuple_count = tuple_count;
+    rh->checksum = finish_hash(hash_bytes(seq, record + sizeof(RecordHeader), rsize - sizeof(RecordHeader)));
+
+    // Replace an empty slot in the bucket, or else the oldest.
+    FileSlot *bucket = file_bucket(header, h);
+    FileSlot *slot = &bucket[0];
+    for (uint32_t w = 1; w < kFileWays; w++) {
+        if (bucket[w].seq < slot->seq) {
+            slot = &bucket[w];
+        }
+    }
+    slot->hash = h;
+    slot->offset = offset;
+    slot->size = rsize;
+    slot->seq = seq;
+    cache_file.stores++;
+}
+
+// Whether there's a cache file, checked before taking its lock, so
+// that processes without one don't pay for the lock.
+WEAK bool file_in_use() {
+    return __atomic_load_n(&cache_file.base, __ATOMIC_ACQUIRE) != NULL;
+}
+
+WEAK void close_cache_file() {
+    if (cache_file.base != NULL) {
+        halide_unmap_file(cache_file.base, cache_file.size, cache_file.fd);
+        __atomic_store_n(&cache_file.base, (uint8_t *)NULL, __ATOMIC_RELEASE);
+        cache_file.size = 0;
+        cache_file.fd = -1;
+    }
+}
+
+// Add the result of a computation to the in-memory cache, and
+// record in the headers of its buffers which entry holds them.
+WEAK void store_in_memory(void *user_context, const uint8_t *cache_key, int32_t size,
+                          buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers,
+                          uint64_t h, int64_t cost) {
+    CacheShard *shard = shard_for(h);
+
+    {
+        ScopedMutexLock lock(&shard->lock);
+
+        CacheEntry *entry = shard->buckets ? *bucket_for(shard, h) : NULL;
+        while (entry != NULL) {
+            if (entry->matches(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers)) {
+                for (int32_t i = 0; i < tuple_count; i++) {
+                    halide_assert(user_context, entry->buffer(i).host != tuple_buffers[i]->host);
+                }
+                // This entry is still in use by the caller. Mark it as having no cache entry
+                // so halide_memoization_cache_release can free the buffer.
+                for (int32_t i = 0; i < tuple_count; i++) {
+                    get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
+                }
+                return;
             }
+            entry = entry->next;
+        }
 
-            // Remove from more recent chain.
-            if (most_recently_used == prune_candidate) {
-                most_recently_used = prune_candidate->less_recent;
+        void *entry_storage = NULL;
+        if (grow_table(shard)) {
+            entry_storage = halide_malloc(NULL, sizeof(CacheEntry) + sizeof(buffer_t) * (tuple_count - 1));
+        }
+        CacheEntry *new_entry = (CacheEntry *)entry_storage;
+        if (new_entry == NULL ||
+            !new_entry->init(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers)) {
+            // This entry is still in use by the caller. Mark it as having no cache entry
+            // so halide_memoization_cache_release can free the buffer.
+            for (int32_t i = 0; i < tuple_count; i++) {
+                get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
             }
-            if (prune_candidate->less_recent != NULL) {
-                prune_candidate->less_recent = more_recent;
+            if (new_entry != NULL) {
+                halide_free(user_context, new_entry);
             }
+            return;
+        }
 
-            // Decrease cache used amount.
-            for (uint32_t i = 0; i < prune_candidate->tuple_count; i++) {
-                current_cache_size -= full_extent(prune_candidate->buffer(i));
-            }
+        // Make room before adding the new entry, so it can't be
+        // evicted straight away.
+        int64_t added_size = new_entry->size_in_bytes();
+        shard->size += added_size;
+        __sync_fetch_and_add(&current_cache_size, added_size);
+        prune_shard(shard);
+
+        CacheEntry **bucket = bucket_for(shard, h);
+        new_entry->next = *bucket;
+        *bucket = new_entry;
+        shard->num_entries++;
+        push_most_recent(shard, new_entry);
+        new_entry->cost = cost;
+        update_priority(shard, new_entry);
+        shard->stores++;
 
-            // Deallocate the entry.
-            prune_candidate->destroy();
-            halide_free(NULL, prune_candidate);
+        new_entry->in_use_count = tuple_count;
+
+        for (int32_t i = 0; i < tuple_count; i++) {
+            get_pointer_to_header(tuple_buffers[i]->host)->entry = new_entry;
         }
 
-        prune_candidate = more_recent;
-    }
 #if CACHE_DEBUGGING
-    validate_cache();
+        validate_shard(shard);
 #endif
+    }
+
+    // If this shard didn't have enough to evict, take from the others.
+    prune_cache(shard);
 }
 
 }}} // namespace Halide::Runtime::Internal
@@ -304,18 +824,73 @@ WEAK void halide_memoization_cache_set_size(int64_t size) {
         size = kDefaultCacheSize;
     }
 
-    ScopedMutexLock lock(&memoization_lock);
+    __atomic_store_n(&max_cache_size, size, __ATOMIC_RELAXED);
+    prune_cache(NULL);
+}
 
-    max_cache_size = size;
-    prune_cache();
+WEAK void halide_memoization_cache_set_eviction_policy(int policy) {
+    eviction_policy = policy;
+}
+
+WEAK int halide_memoization_cache_set_file(void *user_context, const char *path, int64_t size, uint64_t version) {
+    ScopedMutexLock lock(&cache_file.lock);
+
+    close_cache_file();
+    if (path == NULL) {
+        return 0;
+    }
+
+    uint64_t num_buckets = size / (kFileBytesPerSlot * kFileWays);
+    uint64_t records_offset = round_up_8(sizeof(FileHeader) + num_buckets * kFileWays * sizeof(FileSlot));
+    if (num_buckets == 0 || records_offset >= (uint64_t)size) {
+        error(user_context) << "Memoization cache file " << path << " is too small: " << size << " bytes\n";
+        return halide_error_code_generic_error;
+    }
+
+    int fd = -1;
+    uint8_t *base = (uint8_t *)halide_map_file(user_context, path, size, &fd);
+    if (base == NULL) {
+        error(user_context) << "Could not map memoization cache file " << path << "\n";
+        return halide_error_code_generic_error;
+    }
+    cache_file.size = size;
+    cache_file.fd = fd;
+    cache_file.user_version = version;
+    __atomic_store_n(&cache_file.base, base, __ATOMIC_RELEASE);
+
+    if (halide_lock_file(fd, true) != 0) {
+        close_cache_file();
+        error(user_context) << "Could not lock memoization cache file " << path << "\n";
+        return halide_error_code_generic_error;
+    }
+    FileHeader *header = (FileHeader *)base;
+    if (header->magic != kFileMagic ||
+        header->format_version != kFileFormatVersion ||
+        header->user_version != version ||
+        header->file_size != (uint64_t)size) {
+        // Start afresh. Write the magic number last, so that a crash
+        // part way through leaves a file that will be reset again.
+        debug(user_context) << "Resetting memoization cache file " << path << "\n";
+        header->magic = 0;
+        memset(base, 0, records_offset);
+        header->format_version = kFileFormatVersion;
+        header->num_buckets = (uint32_t)num_buckets;
+        header->user_version = version;
+        header->file_size = size;
+        header->records_offset = records_offset;
+        header->records_size = size - records_offset;
+        header->next_record = 0;
+        header->next_seq = 1;
+        header->magic = kFileMagic;
+    }
+    halide_unlock_file(fd);
+    return 0;
 }
 
 WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cache_key, int32_t size,
                                          buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
-    uint32_t h = djb_hash(cache_key, size);
-    uint32_t index = h % kHashTableSize;
-
-    ScopedMutexLock lock(&memoization_lock);
+    uint64_t h = hash_key(cache_key, size, *computed_bounds);
+    CacheShard *shard = shard_for(h);
 
 #if CACHE_DEBUGGING
     debug_print_key(user_context, "halide_memoization_cache_lookup", cache_key, size);
@@ -330,40 +905,16 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
     }
 #endif
 
-    CacheEntry *entry = cache_entries[index];
-    while (entry != NULL) {
-        if (entry->hash == h && entry->key_size == (size_t)size &&
-            keys_equal(entry->key, cache_key, size) &&
-            bounds_equal(entry->computed_bounds, *computed_bounds) &&
-            entry->tuple_count == (uint32_t)tuple_count) {
-
-            bool all_bounds_equal = true;
-
-            {
-                for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
-                    buffer_t *buf = tuple_buffers[i];
-                    all_bounds_equal = bounds_equal(entry->buffer(i), *buf);
-                }
-            }
+    {
+        ScopedMutexLock lock(&shard->lock);
 
-            if (all_bounds_equal) {
-                if (entry != most_recently_used) {
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    if (entry->less_recent != NULL) {
-                        entry->less_recent->more_recent = entry->more_recent;
-                    } else {
-                        halide_assert(user_context, least_recently_used == entry);
-                        least_recently_used = entry->more_recent;
-                    }
-                    halide_assert(user_context, entry->more_recent != NULL);
-                    entry->more_recent->less_recent = entry->less_recent;
-
-                    entry->more_recent = NULL;
-                    entry->less_recent = most_recently_used;
-                    if (most_recently_used != NULL) {
-                        most_recently_used->more_recent = entry;
-                    }
-                    most_recently_used = entry;
+        shard->lookups++;
+        CacheEntry *entry = shard->buckets ? *bucket_for(shard, h) : NULL;
+        while (entry != NULL) {
+            if (entry->matches(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers)) {
+                if (entry != shard->most_recently_used) {
+                    unlink_from_lru(shard, entry);
+                    push_most_recent(shard, entry);
                 }
 
                 for (int32_t i = 0; i < tuple_count; i++) {
@@ -372,13 +923,16 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
                 }
 
                 entry->in_use_count += tuple_count;
+                update_priority(shard, entry);
+                shard->hits++;
 
                 return 0;
             }
+            entry = entry->next;
         }
-        entry = entry->next;
     }
 
+    // Allocating the buffers for a miss doesn't need the lock.
     for (int32_t i = 0; i < tuple_count; i++) {
         buffer_t *buf = tuple_buffers[i];
         size_t buffer_size = full_extent(*buf);
@@ -397,10 +951,28 @@ WEAK int halide_memoization_cache_lookup(void *user_context, const uint8_t *cach
         header->hash = h;
         header->entry = NULL;
     }
-
-#if CACHE_DEBUGGING
-    validate_cache();
-#endif
+    start_cache_clock(user_context);
+    get_pointer_to_header(tuple_buffers[0]->host)->start_time = halide_current_time_ns(user_context);
+
+    if (file_in_use()) {
+        bool found = false;
+        int64_t cost = 0;
+        {
+            ScopedMutexLock lock(&cache_file.lock);
+            if (cache_file.base != NULL && halide_lock_file(cache_file.fd, false) == 0) {
+                found = lookup_in_file(cache_key, size, *computed_bounds, tuple_count, tuple_buffers, h, &cost);
+                halide_unlock_file(cache_file.fd);
+            }
+            if (found) {
+                cache_file.hits++;
+            }
+        }
+        if (found) {
+            // Keep it in memory too, as if it had just been computed.
+            store_in_memory(user_context, cache_key, size, computed_bounds, tuple_count, tuple_buffers, h, cost);
+            return 0;
+        }
+    }
 
     return 1;
 }
@@ -409,11 +981,9 @@ WEAK int halide_memoization_cache_store(void *user_context, const uint8_t *cache
                                         buffer_t *computed_bounds, int32_t tuple_count, buffer_t **tuple_buffers) {
     debug(user_context) << "halide_memoization_cache_store\n";
 
-    uint32_t h = get_pointer_to_header(tuple_buffers[0]->host)->hash;
-
-    uint32_t index = h % kHashTableSize;
-
-    ScopedMutexLock lock(&memoization_lock);
+    CacheBlockHeader *first_header = get_pointer_to_header(tuple_buffers[0]->host);
+    uint64_t h = first_header->hash;
+    int64_t cost = halide_current_time_ns(user_context) - first_header->start_time;
 
 #if CACHE_DEBUGGING
     debug_print_key(user_context, "halide_memoization_cache_store", cache_key, size);
@@ -428,95 +998,16 @@ WEAK int halide_memoization_cache_store(void *user_context, const uint8_t *cache
     }
 #endif
 
-    CacheEntry *entry = cache_entries[index];
-    while (entry != NULL) {
-        if (entry->hash == h && entry->key_size == (size_t)size &&
-            keys_equal(entry->key, cache_key, size) &&
-            bounds_equal(entry->computed_bounds, *computed_bounds) &&
-            entry->tuple_count == (uint32_t)tuple_count) {
-
-            bool all_bounds_equal = true;
-            bool no_host_pointers_equal = true;
-            {
-                for (int32_t i = 0; all_bounds_equal && i < tuple_count; i++) {
-                    buffer_t *buf = tuple_buffers[i];
-                    all_bounds_equal = bounds_equal(entry->buffer(i), *buf);
-                    if (entry->buffer(i).host == buf->host) {
-                        no_host_pointers_equal = false;
-                    }
-                }
-            }
-            if (all_bounds_equal) {
-                halide_assert(user_context, no_host_pointers_equal);
-                // This entry is still in use by the caller. Mark it as having no cache entry
-                // so halide_memoization_cache_release can free the buffer.
-                for (int32_t i = 0; i < tuple_count; i++) {
-                    get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
-
-                }
-                return 0;
-            }
-        }
-        entry = entry->next;
-    }
-
-    uint64_t added_size = 0;
-    {
-        for (int32_t i = 0; i < tuple_count; i++) {
-            buffer_t *buf = tuple_buffers[i];
-            added_size += full_extent(*buf);
-        }
-    }
-    current_cache_size += added_size;
-    prune_cache();
-
-    void *entry_storage = halide_malloc(NULL, sizeof(CacheEntry) + sizeof(buffer_t) * (tuple_count - 1));
-    if (entry_storage == NULL) {
-        current_cache_size -= added_size;
-
-        // This entry is still in use by the caller. Mark it as having no cache entry
-        // so halide_memoization_cache_release can free the buffer.
-        for (int32_t i = 0; i < tuple_count; i++) {
-            get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
-        }
-        return 0;
-    }
-
-    CacheEntry *new_entry = (CacheEntry *)entry_storage;
-    bool inited = new_entry->init(cache_key, size, h, *computed_bounds, tuple_count, tuple_buffers);
-    if (!inited) {
-        current_cache_size -= added_size;
+    store_in_memory(user_context, cache_key, size, computed_bounds, tuple_count, tuple_buffers, h, cost);
 
-        // This entry is still in use by the caller. Mark it as having no cache entry
-        // so halide_memoization_cache_release can free the buffer.
-        for (int32_t i = 0; i < tuple_count; i++) {
-            get_pointer_to_header(tuple_buffers[i]->host)->entry = NULL;
+    if (file_in_use()) {
+        ScopedMutexLock lock(&cache_file.lock);
+        if (cache_file.base != NULL && halide_lock_file(cache_file.fd, true) == 0) {
+            store_in_file(cache_key, size, *computed_bounds, tuple_count, tuple_buffers, h, cost);
+            halide_unlock_file(cache_file.fd);
         }
-
-        halide_free(user_context, new_entry);
-        return 0;
     }
 
-    new_entry->next = cache_entries[index];
-    new_entry->less_recent = most_recently_used;
-    if (most_recently_used != NULL) {
-        most_recently_used->more_recent = new_entry;
-    }
-    most_recently_used = new_entry;
-    if (least_recently_used == NULL) {
-        least_recently_used = new_entry;
-    }
-    cache_entries[index] = new_entry;
-
-    new_entry->in_use_count = tuple_count;
-
-    for (int32_t i = 0; i < tuple_count; i++) {
-        get_pointer_to_header(tuple_buffers[i]->host)->entry = new_entry;
-    }
-
-#if CACHE_DEBUGGING
-    validate_cache();
-#endif
     debug(user_context) << "Exiting halide_memoization_cache_store\n";
 
     return 0;
@@ -530,32 +1021,63 @@ WEAK void halide_memoization_cache_release(void *user_context, void *host) {
     if (entry == NULL) {
         halide_free(user_context, header);
     } else {
-        ScopedMutexLock lock(&memoization_lock);
+        CacheShard *shard = shard_for(header->hash);
+        ScopedMutexLock lock(&shard->lock);
 
         halide_assert(user_context, entry->in_use_count > 0);
         entry->in_use_count--;
 #if CACHE_DEBUGGING
-        validate_cache();
+        validate_shard(shard);
 #endif
     }
 
     debug(user_context) << "Exited halide_memoization_cache_release.\n";
 }
 
+WEAK void halide_memoization_cache_get_stats(halide_memoization_cache_stats *stats) {
+    memset(stats, 0, sizeof(halide_memoization_cache_stats));
+    for (int i = 0; i < kNumShards; i++) {
+        CacheShard *shard = &cache_shards[i];
+        ScopedMutexLock lock(&shard->lock);
+        stats->lookups += shard->lookups;
+        stats->hits += shard->hits;
+        stats->stores += shard->stores;
+        stats->evictions += shard->evictions;
+        stats->entries += shard->num_entries;
+        stats->current_size += shard->size;
+    }
+    stats->max_size = __atomic_load_n(&max_cache_size, __ATOMIC_RELAXED);
+    {
+        ScopedMutexLock lock(&cache_file.lock);
+        stats->file_hits = cache_file.hits;
+        stats->file_stores = cache_file.stores;
+    }
+}
+
 WEAK void halide_memoization_cache_cleanup() {
     debug(NULL) << "halide_memoization_cache_cleanup\n";
-    for (size_t i = 0; i < kHashTableSize; i++) {
-        CacheEntry *entry = cache_entries[i];
-        cache_entries[i] = NULL;
-        while (entry != NULL) {
-            CacheEntry *next = entry->next;
-            entry->destroy();
-            halide_free(NULL, entry);
-            entry = next;
+    for (int s = 0; s < kNumShards; s++) {
+        CacheShard *shard = &cache_shards[s];
+        for (size_t i = 0; i < shard->num_buckets; i++) {
+            CacheEntry *entry = shard->buckets[i];
+            while (entry != NULL) {
+                CacheEntry *next = entry->next;
+                entry->destroy();
+                halide_free(NULL, entry);
+                entry = next;
+            }
+        }
+        if (shard->buckets != NULL) {
+            halide_free(NULL, shard->buckets);
         }
+        halide_mutex_cleanup(&shard->lock);
+        memset(shard, 0, sizeof(CacheShard));
     }
     current_cache_size = 0;
-    halide_mutex_cleanup(&memoization_lock);
+    close_cache_file();
+    cache_file.hits = 0;
+    cache_file.stores = 0;
+    halide_mutex_cleanup(&cache_file.lock);
 }
 
 namespace {
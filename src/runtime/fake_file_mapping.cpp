@@ -0,0 +1,21 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+WEAK void *halide_map_file(void *user_context, const char *path, size_t size, int *fd) {
+    // Files can't be mapped on this platform.
+    return NULL;
+}
+
+WEAK void halide_unmap_file(void *addr, size_t size, int fd) {
+}
+
+WEAK int halide_lock_file(int fd, bool exclusive) {
+    return -1;
+}
+
+WEAK int halide_unlock_file(int fd) {
+    return -1;
+}
+
+}
@@ -0,0 +1,14 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+WEAK void *halide_map_pages(void *user_context, size_t *size, int numa_policy) {
+    // Pages can't be mapped directly on this platform, so halide_malloc
+    // falls back to the system allocator.
+    return NULL;
+}
+
+WEAK void halide_unmap_pages(void *addr, size_t size) {
+}
+
+}
@@ -0,0 +1,28 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+WEAK int halide_open_perf_counters(uint64_t vector_event, int *which, int *fds) {
+    for (int i = 0; i < halide_profiler_num_counters; i++) {
+        which[i] = -1;
+        fds[i] = -1;
+    }
+    return -1;
+}
+
+WEAK int halide_read_perf_counters(int fd, uint64_t *values, int n) {
+    return -1;
+}
+
+WEAK void halide_close_perf_counters(const int *fds) {
+}
+
+WEAK int halide_current_thread_id() {
+    // There's no portable thread id, so use the address of the
+    // thread's stack. Threads' stacks are at least half a megabyte
+    // apart, so this tells threads apart, but a thread's id can change
+    // if its stack grows past a half megabyte boundary.
+    return (int)((uintptr_t)__builtin_frame_address(0) >> 19) + 1;
+}
+
+}
@@ -0,0 +1,10 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+WEAK int halide_pin_current_thread(const uint64_t *cpu_mask, int cpu_mask_words) {
+    // Threads can't be pinned on this platform.
+    return -1;
+}
+
+}
@@ -24,6 +24,9 @@ extern long dispatch_semaphore_wait(dispatch_semaphore_t dsema, dispatch_time_t
 extern long dispatch_semaphore_signal(dispatch_semaphore_t dsema);
 extern void dispatch_release(void *object);
 
+typedef struct _opaque_pthread_t *pthread_t;
+extern pthread_t pthread_self();
+
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure);
@@ -34,6 +37,10 @@ WEAK void halide_spawn_thread(void *user_context, void (*f)(void *), void *closu
     dispatch_async_f(dispatch_get_global_queue(0, 0), closure, f);
 }
 
+WEAK uintptr_t halide_current_thread() {
+    return (uintptr_t)pthread_self();
+}
+
 namespace Halide { namespace Runtime { namespace Internal {
 
 struct gcd_mutex {
@@ -112,6 +119,37 @@ WEAK void halide_shutdown_thread_pool() {
 WEAK void halide_set_num_threads(int) {
 }
 
+WEAK void halide_set_thread_spin_time(int) {
+}
+
+WEAK void halide_set_thread_pool_hot(int) {
+}
+
+WEAK void halide_thread_pool_collect_wait_times(bool) {
+}
+
+WEAK void halide_thread_pool_wait_times(uint64_t *lock_wait_ns, uint64_t *idle_ns) {
+    *lock_wait_ns = 0;
+    *idle_ns = 0;
+}
+
+WEAK void halide_set_task_chunk_size(int) {
+}
+
+WEAK void halide_set_thread_affinity(const int *cpus, int num_cpus) {
+}
+
+WEAK halide_thread_pool *halide_create_thread_pool(void *user_context, int threads,
+                                                   const uint64_t *cpu_mask, int cpu_mask_words) {
+    return NULL;
+}
+
+WEAK void halide_destroy_thread_pool(halide_thread_pool *pool) {
+}
+
+WEAK void halide_bind_thread_pool(void *user_context, halide_thread_pool *pool) {
+}
+
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
     halide_do_task_t result = custom_do_task;
     custom_do_task = f;
@@ -126,6 +164,9 @@ WEAK halide_do_par_for_t halide_set_custom_do_par_for(halide_do_par_for_t f) {
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure) {
+    if (halide_timeline_enabled()) {
+        return halide_timeline_do_task(user_context, custom_do_task, f, idx, closure);
+    }
     return (*custom_do_task)(user_context, f, idx, closure);
 }
 
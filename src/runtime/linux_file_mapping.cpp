@@ -0,0 +1,57 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+// off_t is a long on linux, unless _FILE_OFFSET_BITS is 64.
+extern int ftruncate(int fd, long length);
+extern long lseek(int fd, long offset, int whence);
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+extern int munmap(void *addr, size_t length);
+extern int flock(int fd, int operation);
+
+#define O_RDWR 2
+#define O_CREAT 64
+#define SEEK_END 2
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_SHARED 1
+#define MAP_FAILED ((void *)-1)
+#define LOCK_SH 1
+#define LOCK_EX 2
+#define LOCK_UN 8
+
+WEAK void *halide_map_file(void *user_context, const char *path, size_t size, int *fd) {
+    int f = open(path, O_RDWR | O_CREAT, 0644);
+    if (f < 0) {
+        return NULL;
+    }
+    // Grow the file if need be, but never shrink it, because other
+    // processes may have more of it mapped.
+    long current_size = lseek(f, 0, SEEK_END);
+    if (current_size < 0 || ((size_t)current_size < size && ftruncate(f, size) != 0)) {
+        close(f);
+        return NULL;
+    }
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (addr == MAP_FAILED) {
+        close(f);
+        return NULL;
+    }
+    *fd = f;
+    return addr;
+}
+
+WEAK void halide_unmap_file(void *addr, size_t size, int fd) {
+    munmap(addr, size);
+    close(fd);
+}
+
+WEAK int halide_lock_file(int fd, bool exclusive) {
+    return flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+}
+
+WEAK int halide_unlock_file(int fd) {
+    return flock(fd, LOCK_UN);
+}
+
+}
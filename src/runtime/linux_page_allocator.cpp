@@ -0,0 +1,111 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+extern void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+extern int munmap(void *addr, size_t length);
+extern int madvise(void *addr, size_t length, int advice);
+
+// These are the values on x86 and ARM.
+#define PROT_READ 1
+#define PROT_WRITE 2
+#define MAP_PRIVATE 2
+#define MAP_ANONYMOUS 0x20
+#define MAP_HUGETLB 0x40000
+#define MAP_FAILED ((void *)-1)
+#define MADV_HUGEPAGE 14
+#define MPOL_INTERLEAVE 3
+#define MPOL_LOCAL 4
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+const size_t huge_page_size = 2 * 1024 * 1024;
+
+typedef long (*mbind_fn)(void *addr, unsigned long len, int mode,
+                         const unsigned long *nodemask, unsigned long maxnode, unsigned flags);
+
+// There's no libc wrapper for mbind, and the system call number
+// depends on the architecture, so get it from libnuma if it's
+// there. -1 means we've looked and it isn't.
+WEAK mbind_fn mbind_ptr = NULL;
+
+WEAK mbind_fn get_mbind() {
+    mbind_fn f = __atomic_load_n(&mbind_ptr, __ATOMIC_ACQUIRE);
+    if (f == NULL) {
+        f = (mbind_fn)halide_get_library_symbol(NULL, "mbind");
+        const char *lib_names[] = {"libnuma.so.1", "libnuma.so"};
+        for (size_t i = 0; f == NULL && i < sizeof(lib_names) / sizeof(lib_names[0]); i++) {
+            void *lib = halide_load_library(lib_names[i]);
+            if (lib) {
+                f = (mbind_fn)halide_get_library_symbol(lib, "mbind");
+            }
+        }
+        if (f == NULL) {
+            f = (mbind_fn)-1;
+        }
+        __atomic_store_n(&mbind_ptr, f, __ATOMIC_RELEASE);
+    }
+    return f == (mbind_fn)-1 ? NULL : f;
+}
+
+// Set once mapping reserved huge pages has failed, so that later
+// allocations don't keep trying. Few machines reserve any.
+WEAK bool hugetlb_failed = false;
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK void *halide_map_pages(void *user_context, size_t *size, int numa_policy) {
+    size_t length = (*size + huge_page_size - 1) & ~(huge_page_size - 1);
+
+    // Use reserved huge pages if there are any. Otherwise map a huge
+    // page aligned range and ask for transparent huge pages.
+    uint8_t *addr = (uint8_t *)MAP_FAILED;
+    if (!__atomic_load_n(&hugetlb_failed, __ATOMIC_RELAXED)) {
+        addr = (uint8_t *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if ((void *)addr == MAP_FAILED) {
+            __atomic_store_n(&hugetlb_failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    if ((void *)addr == MAP_FAILED) {
+        addr = (uint8_t *)mmap(NULL, length + huge_page_size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ((void *)addr == MAP_FAILED) {
+            return NULL;
+        }
+        size_t head = (huge_page_size - ((uintptr_t)addr & (huge_page_size - 1))) & (huge_page_size - 1);
+        if (head) {
+            munmap(addr, head);
+        }
+        munmap(addr + head + length, huge_page_size - head);
+        addr += head;
+        madvise(addr, length, MADV_HUGEPAGE);
+    }
+
+    // Nothing has touched the pages yet, so this decides where all of
+    // them go.
+    if (numa_policy != halide_numa_default) {
+        mbind_fn mbind = get_mbind();
+        if (mbind) {
+            unsigned long all_nodes = ~0UL;
+            if (numa_policy == halide_numa_interleave) {
+                mbind(addr, length, MPOL_INTERLEAVE, &all_nodes, sizeof(all_nodes) * 8, 0);
+            } else if (numa_policy == halide_numa_local) {
+                mbind(addr, length, MPOL_LOCAL, NULL, 0, 0);
+            }
+        }
+    }
+
+    *size = length;
+    return addr;
+}
+
+WEAK void halide_unmap_pages(void *addr, size_t size) {
+    munmap(addr, size);
+}
+
+}
@@ -0,0 +1,121 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+extern int syscall(int num, ...);
+extern ssize_t read(int fd, void *buf, size_t count);
+extern int close(int fd);
+
+// The syscall numbers for perf_event_open and gettid vary across
+// platforms. These are the x86 ones.
+#ifdef BITS_64
+#define SYS_PERF_EVENT_OPEN 298
+#define SYS_GETTID 186
+#endif
+
+#ifdef BITS_32
+#define SYS_PERF_EVENT_OPEN 336
+#define SYS_GETTID 224
+#endif
+
+#define PERF_TYPE_HARDWARE 0
+#define PERF_TYPE_RAW 4
+#define PERF_COUNT_HW_CPU_CYCLES 0
+#define PERF_COUNT_HW_INSTRUCTIONS 1
+#define PERF_COUNT_HW_CACHE_MISSES 3
+#define PERF_FORMAT_GROUP 8
+
+// The first version of perf_event_attr, which every kernel accepts.
+struct perf_event_attr {
+    uint32_t type;
+    uint32_t size;
+    uint64_t config;
+    uint64_t sample_period;
+    uint64_t sample_type;
+    uint64_t read_format;
+    uint64_t flags;
+    uint32_t wakeup_events;
+    uint32_t bp_type;
+    uint64_t config1;
+};
+
+// Bits of perf_event_attr::flags
+#define PERF_ATTR_EXCLUDE_KERNEL (1 << 5)
+#define PERF_ATTR_EXCLUDE_HV (1 << 6)
+
+}
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+WEAK int open_perf_event(uint32_t type, uint64_t config, int group_fd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    // Only count the pipeline's own code, which also lets unprivileged
+    // processes count.
+    attr.flags = PERF_ATTR_EXCLUDE_KERNEL | PERF_ATTR_EXCLUDE_HV;
+    return syscall(SYS_PERF_EVENT_OPEN, &attr, 0, -1, group_fd, 0);
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK int halide_open_perf_counters(uint64_t vector_event, int *which, int *fds) {
+    const uint32_t types[halide_profiler_num_counters] =
+        {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_RAW};
+    const uint64_t configs[halide_profiler_num_counters] =
+        {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, vector_event};
+
+    // Open the counters as a group, so that they can all be read at
+    // once. Counters the cpu doesn't have are left out.
+    int group_fd = -1;
+    int n = 0;
+    for (int i = 0; i < halide_profiler_num_counters; i++) {
+        which[i] = -1;
+        fds[i] = -1;
+        if (types[i] == PERF_TYPE_RAW && vector_event == 0) {
+            continue;
+        }
+        int fd = open_perf_event(types[i], configs[i], group_fd);
+        if (fd < 0) {
+            continue;
+        }
+        if (group_fd < 0) {
+            group_fd = fd;
+        }
+        fds[i] = fd;
+        which[i] = n++;
+    }
+    return group_fd;
+}
+
+WEAK int halide_read_perf_counters(int fd, uint64_t *values, int n) {
+    // A group is read as the number of counters, then their values.
+    uint64_t buf[halide_profiler_num_counters + 1];
+    ssize_t bytes = read(fd, buf, (n + 1) * sizeof(uint64_t));
+    if (bytes != (ssize_t)((n + 1) * sizeof(uint64_t)) || buf[0] != (uint64_t)n) {
+        return -1;
+    }
+    memcpy(values, buf + 1, n * sizeof(uint64_t));
+    return 0;
+}
+
+WEAK void halide_close_perf_counters(const int *fds) {
+    // Closing the group leader doesn't close the rest of the group, so
+    // close each of them.
+    for (int i = 0; i < halide_profiler_num_counters; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+WEAK int halide_current_thread_id() {
+    return syscall(SYS_GETTID);
+}
+
+}
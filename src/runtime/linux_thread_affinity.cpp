@@ -0,0 +1,12 @@
+#include "HalideRuntime.h"
+
+extern "C" {
+
+extern int sched_setaffinity(int pid, size_t cpusetsize, const void *mask);
+
+WEAK int halide_pin_current_thread(const uint64_t *cpu_mask, int cpu_mask_words) {
+    // A pid of zero means the calling thread.
+    return sched_setaffinity(0, cpu_mask_words * sizeof(uint64_t), cpu_mask);
+}
+
+}
@@ -1,4 +1,5 @@
 #include "HalideRuntime.h"
+#include "scoped_spin_lock.h"
 
 extern "C" {
 
@@ -9,22 +10,197 @@ extern void free(void *);
 
 namespace Halide { namespace Runtime { namespace Internal {
 
+// Blocks returned by default_malloc are preceded by two words: the
+// size class of the block plus one, or zero if it isn't pooled, and
+// the pointer returned by malloc. Blocks mapped directly from the OS
+// have mapped_block in place of the size class, and are also preceded
+// by the length of the mapping.
+const size_t alignment = 128;
+const size_t mapped_block = ~(size_t)0;
+
+// Size classes go up in steps of alternately 1.5x and 1.33x, from
+// 128 bytes to 1.5GB, so that at most a third of a pooled block is
+// wasted.
+const int kNumSizeClasses = 48;
+
+// Freed blocks are kept in a number of pools. Each thread uses one of
+// them, so that threads rarely contend for the same pool.
+const int kPoolBits = 5;
+const int kNumPools = 1 << kPoolBits;
+
+struct BlockPool {
+    volatile int lock;
+    size_t cached_bytes;
+    void *free_blocks[kNumSizeClasses];
+} __attribute__((aligned(64)));
+
+WEAK BlockPool block_pools[kNumPools];
+
+// The most memory each pool keeps for reuse. Zero turns pooling off.
+WEAK size_t pool_size = 0;
+
+// Allocations of at least this many bytes are mapped directly from
+// the OS, in huge pages, and placed on numa nodes as numa_policy
+// says. Zero turns this off. Both are read from the environment on
+// the first allocation, unless they have been set already.
+WEAK size_t huge_page_threshold = 0;
+WEAK int numa_policy = halide_numa_default;
+WEAK volatile int page_policy_lock = 0;
+WEAK bool page_policy_initialized = false;
+
+WEAK void init_page_policy() {
+    ScopedSpinLock lock(&page_policy_lock);
+    if (page_policy_initialized) {
+        return;
+    }
+    const char *threshold = getenv("HL_HUGE_PAGE_THRESHOLD");
+    if (threshold) {
+        __atomic_store_n(&huge_page_threshold, (size_t)atoi(threshold), __ATOMIC_RELAXED);
+    }
+    const char *numa = getenv("HL_NUMA_POLICY");
+    if (numa && strcmp(numa, "interleave") == 0) {
+        __atomic_store_n(&numa_policy, (int)halide_numa_interleave, __ATOMIC_RELAXED);
+    } else if (numa && strcmp(numa, "local") == 0) {
+        __atomic_store_n(&numa_policy, (int)halide_numa_local, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&page_policy_initialized, true, __ATOMIC_RELEASE);
+}
+
+WEAK void *map_block(void *user_context, size_t x) {
+    // Leave room after the end of the block, so that it's safe to
+    // read past it.
+    size_t length = x + 2 * alignment;
+    uint8_t *base = (uint8_t *)halide_map_pages(user_context, &length,
+                                                __atomic_load_n(&numa_policy, __ATOMIC_RELAXED));
+    if (base == NULL) {
+        return NULL;
+    }
+    void *ptr = base + alignment;
+    ((void **)ptr)[-1] = base;
+    ((size_t *)ptr)[-2] = mapped_block;
+    ((size_t *)ptr)[-3] = length;
+    return ptr;
+}
+
+WEAK size_t class_size(int c) {
+    return (size_t)(2 + (c & 1)) << (6 + c / 2);
+}
+
+WEAK int size_class(size_t x) {
+    if (x <= 128) {
+        return 0;
+    }
+    int b = 63 - __builtin_clzll((uint64_t)(x - 1));
+    if (x <= ((size_t)3 << (b - 1))) {
+        return 2 * (b - 7) + 1;
+    } else {
+        return 2 * (b - 6);
+    }
+}
+
+WEAK BlockPool *current_pool() {
+    // There is no thread local storage in the runtime, so the pool is
+    // picked from the address of the calling thread's stack. Thread
+    // stacks are megabytes apart, so different threads usually get
+    // different pools, and a thread usually gets the same one.
+    uint64_t h = ((uint64_t)(uintptr_t)__builtin_frame_address(0) >> 20) * UINT64_C(0x9E3779B97F4A7C15);
+    return &block_pools[h >> (64 - kPoolBits)];
+}
+
+// Unlink the blocks of the largest size classes from a pool until it
+// holds at most target bytes. Returns the unlinked blocks as a list,
+// so that they can be freed after the pool is unlocked.
+WEAK void *trim_pool(BlockPool *pool, size_t target) {
+    void *trimmed = NULL;
+    for (int c = kNumSizeClasses - 1; c >= 0 && pool->cached_bytes > target; c--) {
+        while (pool->free_blocks[c] && pool->cached_bytes > target) {
+            void *block = pool->free_blocks[c];
+            pool->free_blocks[c] = *(void **)block;
+            pool->cached_bytes -= class_size(c);
+            *(void **)block = trimmed;
+            trimmed = block;
+        }
+    }
+    return trimmed;
+}
+
+WEAK void free_blocks(void *blocks) {
+    while (blocks) {
+        void *next = *(void **)blocks;
+        free(((void **)blocks)[-1]);
+        blocks = next;
+    }
+}
+
 WEAK void *default_malloc(void *user_context, size_t x) {
+    if (!__atomic_load_n(&page_policy_initialized, __ATOMIC_ACQUIRE)) {
+        init_page_policy();
+    }
+    size_t threshold = __atomic_load_n(&huge_page_threshold, __ATOMIC_RELAXED);
+    if (threshold && x >= threshold) {
+        void *ptr = map_block(user_context, x);
+        if (ptr) {
+            return ptr;
+        }
+    }
+
+    size_t limit = __atomic_load_n(&pool_size, __ATOMIC_RELAXED);
+    size_t pooled_class = 0;
+    if (limit) {
+        int c = size_class(x);
+        if (c < kNumSizeClasses && class_size(c) <= limit) {
+            BlockPool *pool = current_pool();
+            {
+                ScopedSpinLock lock(&pool->lock);
+                void *block = pool->free_blocks[c];
+                if (block) {
+                    pool->free_blocks[c] = *(void **)block;
+                    pool->cached_bytes -= class_size(c);
+                    return block;
+                }
+            }
+            x = class_size(c);
+            pooled_class = c + 1;
+        }
+    }
+
     // Allocate enough space for aligning the pointer we return.
-    const size_t alignment = 128;
     void *orig = malloc(x + alignment);
     if (orig == NULL) {
         // Will result in a failed assertion and a call to halide_error
         return NULL;
     }
     // We want to store the original pointer prior to the pointer we return.
-    void *ptr = (void *)(((size_t)orig + alignment + sizeof(void*) - 1) & ~(alignment - 1));
+    void *ptr = (void *)(((size_t)orig + alignment + 2 * sizeof(void*) - 1) & ~(alignment - 1));
     ((void **)ptr)[-1] = orig;
+    ((size_t *)ptr)[-2] = pooled_class;
     return ptr;
 }
 
 WEAK void default_free(void *user_context, void *ptr) {
-    free(((void**)ptr)[-1]);
+    size_t pooled_class = ((size_t *)ptr)[-2];
+    if (pooled_class == mapped_block) {
+        halide_unmap_pages(((void **)ptr)[-1], ((size_t *)ptr)[-3]);
+        return;
+    }
+    size_t limit = __atomic_load_n(&pool_size, __ATOMIC_RELAXED);
+    if (pooled_class == 0 || class_size(pooled_class - 1) > limit) {
+        free(((void**)ptr)[-1]);
+        return;
+    }
+
+    BlockPool *pool = current_pool();
+    void *trimmed;
+    {
+        ScopedSpinLock lock(&pool->lock);
+        *(void **)ptr = pool->free_blocks[pooled_class - 1];
+        pool->free_blocks[pooled_class - 1] = ptr;
+        pool->cached_bytes += class_size(pooled_class - 1);
+        // Once the pool goes over its size, trim it to half its size,
+        // rather than freeing a block every time.
+        trimmed = (pool->cached_bytes > limit) ? trim_pool(pool, limit / 2) : NULL;
+    }
+    free_blocks(trimmed);
 }
 
 WEAK halide_malloc_t custom_malloc = default_malloc;
@@ -54,4 +230,38 @@ WEAK void halide_free(void *user_context, void *ptr) {
     custom_free(user_context, ptr);
 }
 
+WEAK void halide_malloc_pool_set_size(size_t size) {
+    __atomic_store_n(&pool_size, size, __ATOMIC_RELAXED);
+    for (int i = 0; i < kNumPools; i++) {
+        void *trimmed;
+        {
+            ScopedSpinLock lock(&block_pools[i].lock);
+            trimmed = trim_pool(&block_pools[i], size);
+        }
+        free_blocks(trimmed);
+    }
+}
+
+WEAK void halide_set_huge_page_threshold(size_t size) {
+    ScopedSpinLock lock(&page_policy_lock);
+    __atomic_store_n(&huge_page_threshold, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&page_policy_initialized, true, __ATOMIC_RELEASE);
+}
+
+WEAK void halide_set_numa_policy(int policy) {
+    ScopedSpinLock lock(&page_policy_lock);
+    __atomic_store_n(&numa_policy, policy, __ATOMIC_RELAXED);
+    __atomic_store_n(&page_policy_initialized, true, __ATOMIC_RELEASE);
+}
+
+}
+
+namespace {
+__attribute__((destructor))
+WEAK void halide_posix_allocator_cleanup() {
+    // Free the pooled blocks when the runtime is released, and send
+    // blocks freed after this (e.g. by other cleanup functions)
+    // straight back to the system.
+    halide_malloc_pool_set_size(0);
+}
 }
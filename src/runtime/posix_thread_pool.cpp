@@ -1,4 +1,6 @@
 #include "HalideRuntime.h"
+#include "printer.h"
+#include "scoped_spin_lock.h"
 
 // TODO: This code currently doesn't work on OS X (Darwin) as we do
 // not initialize the pthread_mutex_t using PTHREAD_MUTEX_INITIALIZER
@@ -35,19 +37,24 @@ typedef long pthread_mutexattr_t;
 extern int pthread_create(pthread_t *thread, pthread_attr_t const * attr,
                           void *(*start_routine)(void *), void * arg);
 extern int pthread_join(pthread_t thread, void **retval);
+extern pthread_t pthread_self();
 extern int pthread_cond_init(pthread_cond_t *cond, const pthread_condattr_t *attr);
 extern int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 extern int pthread_cond_broadcast(pthread_cond_t *cond);
+extern int pthread_cond_signal(pthread_cond_t *cond);
 extern int pthread_cond_destroy(pthread_cond_t *cond);
 extern int pthread_mutex_init(pthread_mutex_t *mutex, const pthread_mutexattr_t *attr);
 extern int pthread_mutex_lock(pthread_mutex_t *mutex);
+extern int pthread_mutex_trylock(pthread_mutex_t *mutex);
 extern int pthread_mutex_unlock(pthread_mutex_t *mutex);
 extern int pthread_mutex_destroy(pthread_mutex_t *mutex);
 
 extern char *getenv(const char *);
 extern int atoi(const char *);
+extern int sched_yield();
 
 extern int halide_host_cpu_count();
+extern int halide_pin_current_thread(const uint64_t *cpu_mask, int cpu_mask_words);
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure);
@@ -59,137 +66,539 @@ namespace Halide { namespace Runtime { namespace Internal {
 WEAK int num_threads;
 WEAK bool thread_pool_initialized = false;
 
+// The cpus to pin the workers of the default pool to, from
+// halide_set_thread_affinity or HL_THREAD_AFFINITY. Worker i runs on
+// thread_affinity[i % thread_affinity_size].
+WEAK int *thread_affinity = NULL;
+WEAK int thread_affinity_size = 0;
+WEAK bool thread_affinity_initialized = false;
+
+// How long idle threads keep looking for work before going to sleep,
+// in microseconds. Waking a sleeping thread takes a while, so this
+// cuts the latency of parallel loops that follow each other closely,
+// at the cost of some cpu time. Spinning steals cpu time from other
+// processes on a shared machine, so it is off unless asked for.
+// Negative until it has been read from HL_THREAD_SPIN_US.
+WEAK int thread_spin_us = -1;
+
+// While this is non-zero, idle threads never go to sleep.
+WEAK int thread_pool_hot = 0;
+
+// The time threads of all pools have spent waiting for locks, and
+// waiting for the other threads working on a job to finish it, in
+// nanoseconds. Only counted while collect_wait_times, the number of
+// halide_thread_pool_collect_wait_times calls turning counting on less
+// those turning it off, is positive.
+WEAK int collect_wait_times = 0;
+WEAK uint64_t total_lock_wait_ns = 0;
+WEAK uint64_t total_idle_ns = 0;
+
+// Part of the tasks of a job. Tasks are claimed a chunk at a time by
+// atomically advancing next, so threads sharing a job never wait on
+// each other to take a task. Padded to a cache line, because each
+// range is mostly claimed from by a different thread.
+struct task_range {
+    int next, end;
+    int padding[14];
+};
+
 struct work {
-    work *next_job;
     int (*f)(void *, int, uint8_t *);
     void *user_context;
-    int next, max;
+    // Thread i starts by claiming tasks from ranges[i % num_ranges],
+    // and only takes tasks from the other ranges when that runs
+    // out. With one range per thread, consecutive jobs of the same
+    // size send the same tasks to the same threads whenever the load
+    // is balanced.
+    task_range *ranges;
+    int num_ranges;
+    // If chunk is non-zero, tasks are claimed that many at a time.
+    // Otherwise each claim takes 1/divisor of the tasks left in the
+    // range, so chunks start big and shrink towards the end.
+    int chunk, divisor;
+    // Set once some thread has found every range empty.
+    int exhausted;
     uint8_t *closure;
+    // The number of threads other than the owner that have joined
+    // this job and not yet left it. Only incremented while holding
+    // the lock of the deque the job is on, so once the owner has
+    // taken the job off its deque, it can only go down.
     int active_workers;
     int exit_status;
-    bool running() { return next < max || active_workers > 0; }
+    // If collect_wait_times was set when the job was made, the sum of
+    // the times at which each thread working on it ran out of tasks,
+    // and the number of such threads.
+    bool collect_wait_times;
+    uint64_t finish_time_sum;
+    int finishers;
+    bool has_tasks() { return !__atomic_load_n(&exhausted, __ATOMIC_ACQUIRE); }
+};
+
+// Each thread pushes the jobs it creates onto its own deque. Threads
+// look for work at the newest end of their own deque first, which
+// keeps nested parallel loops on the thread that made them, and steal
+// from the oldest end of the others, which holds the biggest jobs.
+#define MAX_DEQUE_JOBS 64
+struct job_deque {
+    volatile int lock;
+    int size;
+    work *jobs[MAX_DEQUE_JOBS];
 };
 
-// The work queue and thread pool is weak, so one big work queue is shared by all halide functions
-#define MAX_THREADS 64
+// Claiming tasks in chunks cuts down the number of atomic operations
+// on a job. By default the chunks are guided: each claim takes this
+// many times fewer than an even share of the tasks left, for each of
+// the threads that may be claiming from the same range. The last few
+// claims are of single tasks, which balances the load at the end.
+#define GUIDED_CHUNKS_PER_THREAD 2
+
+// If positive, claim this many tasks at a time instead.
+WEAK int task_chunk_size = 0;
+
+struct work_queue_t;
+
+struct worker {
+    pthread_t thread;
+    work_queue_t *queue;
+    int index;
+};
+
+// A thread pool and the jobs it's working on. The default one is
+// weak, so one big work queue is shared by all halide functions that
+// aren't bound to a pool of their own.
 struct work_queue_t {
-    // all fields are protected by this mutex.
+    // Protects thread pool startup and shutdown, and sleeping. Not
+    // held while finding or claiming work.
     pthread_mutex_t mutex;
 
-    // Singly linked list for job stack
-    work *jobs;
+    // The number of threads working on jobs, including the one that
+    // called do_par_for.
+    int num_threads;
 
-    // Worker threads are divided into an 'A' team and a 'B' team. The
-    // B team sleeps on the wakeup_b_team condition variable. The A
-    // team does work. Threads transition to the B team if they wake
-    // up and find that a_team_size > target_a_team_size.  Threads
-    // move into the A team whenever they wake up and find that
-    // a_team_size < target_a_team_size.
-    int a_team_size, target_a_team_size;
+    // Worker i takes its work from deques[i]. Threads outside the
+    // pool that call do_par_for share deques[0], so workers[0] is
+    // unused. Both have num_threads entries.
+    job_deque *deques;
+    worker *workers;
 
-    // Broadcast when a job completes.
-    pthread_cond_t wakeup_owners;
+    // If not NULL, the workers may only run on the cpus whose bits
+    // are set in this.
+    uint64_t *cpu_mask;
+    int cpu_mask_words;
+
+    // If not NULL, worker i is pinned to cpus[i % num_cpus], and jobs
+    // are split into one range of tasks per thread. Not owned by the
+    // pool.
+    int *cpus;
+    int num_cpus;
+
+    // Bumped whenever a job is pushed, so that a worker about to go
+    // to sleep can tell whether it missed one.
+    int generation;
 
-    // Broadcast whenever items are added to the work queue.
-    pthread_cond_t wakeup_a_team;
+    // The number of workers sleeping on wakeup_workers. Only changed
+    // with the mutex held.
+    int sleepers;
 
-    // May also be broadcast when items are added to the work queue if
-    // more threads are required than are currently in the A team.
-    pthread_cond_t wakeup_b_team;
+    // Broadcast when the last worker leaves a job.
+    pthread_cond_t wakeup_owners;
 
-    // Keep track of threads so they can be joined at shutdown
-    pthread_t threads[MAX_THREADS];
+    // Signalled when jobs are pushed and workers are asleep.
+    pthread_cond_t wakeup_workers;
 
     // Global flag indicating
     bool shutdown;
 
     bool running() {
-        return !shutdown;
+        return !__atomic_load_n(&shutdown, __ATOMIC_ACQUIRE);
     }
 
 };
 WEAK work_queue_t work_queue;
 
+// Pipelines called with a user_context bound to a pool with
+// halide_bind_thread_pool run their parallel loops on that pool.
+struct pool_binding {
+    void *user_context;
+    work_queue_t *queue;
+    pool_binding *next;
+};
+WEAK pool_binding *pool_bindings = NULL;
+WEAK volatile int pool_bindings_lock = 0;
+
+// Locks that only look at the clock if they have to wait, so that
+// counting lock wait times costs nothing when the locks aren't
+// contended.
+WEAK void count_lock_wait(int64_t start) {
+    __sync_add_and_fetch(&total_lock_wait_ns, (uint64_t)(halide_current_time_ns(NULL) - start));
+}
+
+struct ScopedDequeLock {
+    volatile int *lock;
+
+    ScopedDequeLock(volatile int *l) __attribute__((always_inline)) : lock(l) {
+        if (__sync_lock_test_and_set(lock, 1)) {
+            int64_t start = collect_wait_times > 0 ? halide_current_time_ns(NULL) : 0;
+            while (__sync_lock_test_and_set(lock, 1)) { }
+            if (start) count_lock_wait(start);
+        }
+    }
+
+    ~ScopedDequeLock() __attribute__((always_inline)) {
+        __sync_lock_release(lock);
+    }
+};
+
+WEAK void lock_queue(work_queue_t *q) {
+    if (pthread_mutex_trylock(&q->mutex) != 0) {
+        int64_t start = collect_wait_times > 0 ? halide_current_time_ns(NULL) : 0;
+        pthread_mutex_lock(&q->mutex);
+        if (start) count_lock_wait(start);
+    }
+}
+
+// Note that the calling thread has run out of tasks in a job. Must be
+// called before it leaves the job.
+WEAK void finish_job(work *job) {
+    if (job->collect_wait_times) {
+        __sync_add_and_fetch(&job->finish_time_sum, (uint64_t)halide_current_time_ns(NULL));
+        __sync_add_and_fetch(&job->finishers, 1);
+    }
+}
+
 WEAK int default_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure) {
     return f(user_context, idx, closure);
 }
 
-WEAK void *worker_thread(void *void_arg) {
-    work *owned_job = (work *)void_arg;
+WEAK bool push_job(job_deque *d, work *job) {
+    ScopedDequeLock lock(&d->lock);
+    if (d->size == MAX_DEQUE_JOBS) {
+        return false;
+    }
+    d->jobs[d->size] = job;
+    // The size is also read without the lock, by join_job.
+    __atomic_store_n(&d->size, d->size + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-    // Grab the lock
-    pthread_mutex_lock(&work_queue.mutex);
+WEAK void remove_job(job_deque *d, work *job) {
+    ScopedDequeLock lock(&d->lock);
+    for (int i = 0; i < d->size; i++) {
+        if (d->jobs[i] == job) {
+            for (int j = i + 1; j < d->size; j++) {
+                d->jobs[j - 1] = d->jobs[j];
+            }
+            __atomic_store_n(&d->size, d->size - 1, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
 
-    // If I'm a job owner, then I was the thread that called
-    // do_par_for, and I should only stay in this function until my
-    // job is complete. If I'm a lowly worker thread, I should stay in
-    // this function as long as the work queue is running.
-    while (owned_job != NULL ? owned_job->running()
-           : work_queue.running()) {
-
-        if (work_queue.jobs == NULL) {
-            if (owned_job) {
-                // There are no jobs pending. Wait for the last worker
-                // to signal that the job is finished.
-                pthread_cond_wait(&work_queue.wakeup_owners, &work_queue.mutex);
-            } else if (work_queue.a_team_size <= work_queue.target_a_team_size) {
-                // There are no jobs pending. Wait until more jobs are enqueued.
-                pthread_cond_wait(&work_queue.wakeup_a_team, &work_queue.mutex);
+// Find a job on a deque with tasks left and join it. The caller must
+// call leave_job when it's done with it.
+WEAK work *join_job(job_deque *d, bool newest_first) {
+    if (__atomic_load_n(&d->size, __ATOMIC_ACQUIRE) == 0) {
+        return NULL;
+    }
+    ScopedDequeLock lock(&d->lock);
+    for (int i = 0; i < d->size; i++) {
+        work *job = d->jobs[newest_first ? d->size - 1 - i : i];
+        if (job->has_tasks()) {
+            __sync_add_and_fetch(&job->active_workers, 1);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+WEAK void leave_job(work_queue_t *q, work *job) {
+    // The owner may return as soon as this hits zero, so job must
+    // not be touched afterwards.
+    finish_job(job);
+    if (__sync_sub_and_fetch(&job->active_workers, 1) == 0) {
+        lock_queue(q);
+        pthread_cond_broadcast(&q->wakeup_owners);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+// Claim and run tasks from a job until there are none left, starting
+// with the range belonging to thread me.
+WEAK void run_tasks(work *job, int me) {
+    // Everyone claiming tasks is writing to the job, so read the rest
+    // of it just once.
+    halide_task_t f = job->f;
+    void *user_context = job->user_context;
+    uint8_t *closure = job->closure;
+    int num_ranges = job->num_ranges, chunk = job->chunk, divisor = job->divisor;
+    for (int i = 0; i < num_ranges; i++) {
+        task_range *r = &job->ranges[(me + i) % num_ranges];
+        int max = r->end;
+        while (true) {
+            int idx, end;
+            if (chunk) {
+                idx = __sync_fetch_and_add(&r->next, chunk);
+                if (idx >= max) break;
+                end = idx + chunk < max ? idx + chunk : max;
             } else {
-                // There are no jobs pending, and there are too many
-                // threads in the A team. Transition to the B team
-                // until the wakeup_b_team condition is fired.
-                work_queue.a_team_size--;
-                pthread_cond_wait(&work_queue.wakeup_b_team, &work_queue.mutex);
-                work_queue.a_team_size++;
+                // The size of the claim depends on where the range is
+                // up to, so it has to be a compare and swap.
+                idx = __atomic_load_n(&r->next, __ATOMIC_RELAXED);
+                if (idx >= max) break;
+                end = idx + (max - idx) / divisor;
+                if (end == idx) {
+                    end = idx + 1;
+                }
+                if (!__sync_bool_compare_and_swap(&r->next, idx, end)) continue;
             }
-        } else {
-            // Grab the next job.
-            work *job = work_queue.jobs;
+            for (; idx < end; idx++) {
+                int result = halide_do_task(user_context, f, idx, closure);
+                // If this task failed, set the exit status on the job.
+                if (result) {
+                    job->exit_status = result;
+                }
+            }
+        }
+    }
+    __atomic_store_n(&job->exhausted, 1, __ATOMIC_RELEASE);
+}
 
-            // Claim a task from it.
-            work myjob = *job;
-            job->next++;
+// Join a job on this thread's own deque, or steal one from another.
+WEAK work *find_job(work_queue_t *q, int me) {
+    work *job = join_job(&q->deques[me], true);
+    // Start at the next deque along, so that thieves spread out.
+    for (int i = 1; job == NULL && i < q->num_threads; i++) {
+        job = join_job(&q->deques[(me + i) % q->num_threads], false);
+    }
+    return job;
+}
 
-            // If there were no more tasks pending for this job,
-            // remove it from the stack.
-            if (job->next == job->max) {
-                work_queue.jobs = job->next_job;
-            }
+// The index of the calling thread in the pool, or zero if it isn't
+// one of the workers.
+WEAK int current_worker(work_queue_t *q) {
+    pthread_t self = pthread_self();
+    for (int i = 1; i < q->num_threads; i++) {
+        if (q->workers[i].thread == self) {
+            return i;
+        }
+    }
+    return 0;
+}
 
-            // Increment the active_worker count so that other threads
-            // are aware that this job is still in progress even
-            // though there are no outstanding tasks for it.
-            job->active_workers++;
+WEAK void pin_current_thread_to(int cpu) {
+    // Enough for the 1024 cpus glibc supports.
+    uint64_t mask[16];
+    if (cpu < 0 || cpu >= 16 * 64) {
+        return;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / 64] = (uint64_t)1 << (cpu % 64);
+    halide_pin_current_thread(mask, cpu / 64 + 1);
+}
+
+// Whether an idle thread should keep looking for work rather than go
+// to sleep. idle_since is when it ran out of work, or negative if it
+// has only just done so.
+WEAK bool keep_spinning(int64_t *idle_since) {
+    if (__atomic_load_n(&thread_pool_hot, __ATOMIC_RELAXED)) {
+        return true;
+    }
+    if (thread_spin_us <= 0) {
+        return false;
+    }
+    int64_t now = halide_current_time_ns(NULL);
+    if (*idle_since < 0) {
+        *idle_since = now;
+    }
+    return now - *idle_since < (int64_t)thread_spin_us * 1000;
+}
 
-            // Release the lock and do the task.
-            pthread_mutex_unlock(&work_queue.mutex);
-            int result = halide_do_task(myjob.user_context, myjob.f, myjob.next,
-                                        myjob.closure);
-            pthread_mutex_lock(&work_queue.mutex);
+WEAK void *worker_thread(void *void_arg) {
+    worker *w = (worker *)void_arg;
+    work_queue_t *q = w->queue;
+    int me = w->index;
+
+    if (q->cpus) {
+        pin_current_thread_to(q->cpus[me % q->num_cpus]);
+    } else if (q->cpu_mask) {
+        halide_pin_current_thread(q->cpu_mask, q->cpu_mask_words);
+    }
 
-            // If this task failed, set the exit status on the job.
-            if (result) {
-                job->exit_status = result;
-            }
+    int64_t idle_since = -1;
+    while (q->running()) {
+        int generation = __atomic_load_n(&q->generation, __ATOMIC_ACQUIRE);
 
-            // We are no longer active on this job
-            job->active_workers--;
+        work *job = find_job(q, me);
+        if (job) {
+            run_tasks(job, me);
+            leave_job(q, job);
+            idle_since = -1;
+            continue;
+        }
 
-            // If the job is done and I'm not the owner of it, wake up
-            // the owner.
-            if (!job->running() && job != owned_job) {
-                pthread_cond_broadcast(&work_queue.wakeup_owners);
+        // There's nothing to do. Watch for more jobs for a while,
+        // yielding the cpu in between.
+        if (keep_spinning(&idle_since)) {
+            while (q->running() &&
+                   __atomic_load_n(&q->generation, __ATOMIC_ACQUIRE) == generation &&
+                   keep_spinning(&idle_since)) {
+                sched_yield();
             }
+            continue;
         }
+
+        // Sleep until more jobs are pushed, unless one was pushed
+        // since we started looking.
+        idle_since = -1;
+        lock_queue(q);
+        __sync_add_and_fetch(&q->sleepers, 1);
+        if (q->running() &&
+            __atomic_load_n(&q->generation, __ATOMIC_ACQUIRE) == generation) {
+            pthread_cond_wait(&q->wakeup_workers, &q->mutex);
+        }
+        __sync_sub_and_fetch(&q->sleepers, 1);
+        pthread_mutex_unlock(&q->mutex);
     }
-    pthread_mutex_unlock(&work_queue.mutex);
     return NULL;
 }
 
-WEAK int default_do_par_for(void *user_context, halide_task_t f,
-                            int min, int size, uint8_t *closure) {
+// Allocate the deques and start the workers of a pool. Must be
+// called with the pool's mutex held. Returns false if it's out of
+// memory.
+WEAK bool start_threads(work_queue_t *q, int threads) {
+    if (thread_spin_us < 0) {
+        char *spin_str = getenv("HL_THREAD_SPIN_US");
+        thread_spin_us = spin_str ? atoi(spin_str) : 0;
+    }
+
+    q->shutdown = false;
+    q->sleepers = 0;
+    q->num_threads = 1;
+    pthread_cond_init(&q->wakeup_owners, NULL);
+    pthread_cond_init(&q->wakeup_workers, NULL);
+
+    q->deques = (job_deque *)malloc(threads * sizeof(job_deque));
+    q->workers = (worker *)malloc(threads * sizeof(worker));
+    if (!q->deques || !q->workers) {
+        free(q->deques);
+        free(q->workers);
+        q->deques = NULL;
+        q->workers = NULL;
+        return false;
+    }
+    memset(q->deques, 0, threads * sizeof(job_deque));
+    memset(q->workers, 0, threads * sizeof(worker));
+
+    // Workers read num_threads, so it must be set before any start.
+    q->num_threads = threads;
+    for (int i = 1; i < threads; i++) {
+        //fprintf(stderr, "Creating thread %d\n", i);
+        q->workers[i].queue = q;
+        q->workers[i].index = i;
+        pthread_create(&q->workers[i].thread, NULL, worker_thread, &q->workers[i]);
+    }
+    return true;
+}
+
+WEAK void stop_threads(work_queue_t *q) {
+    // Wake everyone up and tell them the party's over and it's time
+    // to go home
+    pthread_mutex_lock(&q->mutex);
+    __atomic_store_n(&q->shutdown, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&q->wakeup_owners);
+    pthread_cond_broadcast(&q->wakeup_workers);
+    pthread_mutex_unlock(&q->mutex);
+
+    // Wait until they leave
+    for (int i = 1; i < q->num_threads; i++) {
+        //fprintf(stderr, "Waiting for thread %d to exit\n", i);
+        void *retval;
+        pthread_join(q->workers[i].thread, &retval);
+    }
+
+    //fprintf(stderr, "All threads have quit. Destroying mutex and condition variable.\n");
+    // Tidy up
+    pthread_cond_destroy(&q->wakeup_owners);
+    pthread_cond_destroy(&q->wakeup_workers);
+    free(q->deques);
+    free(q->workers);
+    q->deques = NULL;
+    q->workers = NULL;
+}
+
+// Parse a list of cpus like "0,2,4-7" into cpus, if it's not NULL.
+// Returns the number of cpus in the list, or zero if it's malformed.
+WEAK int parse_cpu_list(const char *str, int *cpus) {
+    int count = 0;
+    while (*str) {
+        if (*str < '0' || *str > '9') {
+            return 0;
+        }
+        int first = atoi(str), last = first;
+        while (*str >= '0' && *str <= '9') str++;
+        if (*str == '-') {
+            str++;
+            if (*str < '0' || *str > '9') {
+                return 0;
+            }
+            last = atoi(str);
+            while (*str >= '0' && *str <= '9') str++;
+        }
+        for (int c = first; c <= last; c++) {
+            if (cpus) {
+                cpus[count] = c;
+            }
+            count++;
+        }
+        if (*str == ',') {
+            str++;
+        } else if (*str) {
+            return 0;
+        }
+    }
+    return count;
+}
+
+// Set thread_affinity from HL_THREAD_AFFINITY, for a pool of the
+// given size. "compact" pins the threads to consecutive cpus, and
+// "scatter" spreads them out evenly over all of them. Anything else
+// is a list of cpus.
+WEAK void read_thread_affinity(int threads) {
+    thread_affinity_initialized = true;
+    const char *str = getenv("HL_THREAD_AFFINITY");
+    if (!str || !*str) {
+        return;
+    }
+
+    int host_cpus = halide_host_cpu_count();
+    bool compact = strcmp(str, "compact") == 0;
+    bool scatter = strcmp(str, "scatter") == 0;
+    int size;
+    if (compact || scatter) {
+        size = threads < host_cpus ? threads : host_cpus;
+    } else {
+        size = parse_cpu_list(str, NULL);
+    }
+    if (size < 1) {
+        return;
+    }
+
+    thread_affinity = (int *)malloc(size * sizeof(int));
+    if (!thread_affinity) {
+        return;
+    }
+    if (compact || scatter) {
+        for (int i = 0; i < size; i++) {
+            thread_affinity[i] = compact ? i : (int)(((int64_t)i * host_cpus) / size);
+        }
+    } else {
+        parse_cpu_list(str, thread_affinity);
+    }
+    thread_affinity_size = size;
+}
+
+WEAK void start_default_thread_pool() {
     // Grab the lock. If it hasn't been initialized yet, then the
     // field will be zero-initialized because it's a static
     // global. pthreads helpfully interprets zero-valued mutex objects
@@ -197,12 +606,6 @@ WEAK int default_do_par_for(void *user_context, halide_task_t f,
     pthread_mutex_lock(&work_queue.mutex);
 
     if (!thread_pool_initialized) {
-        work_queue.shutdown = false;
-        pthread_cond_init(&work_queue.wakeup_owners, NULL);
-        pthread_cond_init(&work_queue.wakeup_a_team, NULL);
-        pthread_cond_init(&work_queue.wakeup_b_team, NULL);
-        work_queue.jobs = NULL;
-
         if (!num_threads) {
             char *threads_str = getenv("HL_NUM_THREADS");
             if (!threads_str) {
@@ -216,61 +619,147 @@ WEAK int default_do_par_for(void *user_context, halide_task_t f,
                 // halide_printf(user_context, "HL_NUM_THREADS not defined. Defaulting to %d threads.\n", num_threads);
             }
         }
-        if (num_threads > MAX_THREADS) {
-            num_threads = MAX_THREADS;
-        } else if (num_threads < 1) {
+        if (num_threads < 1) {
             num_threads = 1;
         }
-        for (int i = 0; i < num_threads-1; i++) {
-            //fprintf(stderr, "Creating thread %d\n", i);
-            pthread_create(work_queue.threads + i, NULL, worker_thread, NULL);
+        if (!thread_affinity_initialized) {
+            read_thread_affinity(num_threads);
+        }
+        work_queue.cpus = thread_affinity;
+        work_queue.num_cpus = thread_affinity_size;
+        if (!start_threads(&work_queue, num_threads)) {
+            // Do everything on the calling thread instead.
+            start_threads(&work_queue, 1);
+        }
+
+        __atomic_store_n(&thread_pool_initialized, true, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&work_queue.mutex);
+}
+
+WEAK void wake_workers(work_queue_t *q, int count) {
+    // Bumping the generation before checking for sleepers means that
+    // a worker either sees the new generation before it sleeps, or is
+    // counted here and gets woken.
+    __sync_add_and_fetch(&q->generation, 1);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    lock_queue(q);
+    if (count >= q->sleepers) {
+        pthread_cond_broadcast(&q->wakeup_workers);
+    } else {
+        for (int i = 0; i < count; i++) {
+            pthread_cond_signal(&q->wakeup_workers);
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// The pool bound to a user_context, or NULL if there isn't one.
+WEAK work_queue_t *bound_work_queue(void *user_context) {
+    if (!__atomic_load_n(&pool_bindings, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    ScopedSpinLock lock(&pool_bindings_lock);
+    for (pool_binding *b = pool_bindings; b; b = b->next) {
+        if (b->user_context == user_context) {
+            return b->queue;
         }
-        // Everyone starts on the a team.
-        work_queue.a_team_size = num_threads;
+    }
+    return NULL;
+}
 
-        thread_pool_initialized = true;
+WEAK int default_do_par_for(void *user_context, halide_task_t f,
+                            int min, int size, uint8_t *closure) {
+    work_queue_t *q = bound_work_queue(user_context);
+    if (!q) {
+        if (!__atomic_load_n(&thread_pool_initialized, __ATOMIC_ACQUIRE)) {
+            start_default_thread_pool();
+        }
+        q = &work_queue;
     }
 
     // Make the job.
     work job;
+    task_range range;
     job.f = f;               // The job should call this function. It takes an index and a closure.
     job.user_context = user_context;
-    job.next = min;          // Start at this index.
-    job.max  = min + size;   // Keep going until one less than this index.
+    if (q->cpus && size >= q->num_threads) {
+        // The workers are pinned, so keep each part of the job on the
+        // same cpu from one job to the next.
+        job.num_ranges = q->num_threads;
+        job.ranges = (task_range *)__builtin_alloca(job.num_ranges * sizeof(task_range));
+        for (int i = 0; i < job.num_ranges; i++) {
+            job.ranges[i].next = min + (int)(((int64_t)size * i) / job.num_ranges);
+            job.ranges[i].end = min + (int)(((int64_t)size * (i + 1)) / job.num_ranges);
+        }
+    } else {
+        job.num_ranges = 1;
+        job.ranges = &range;
+        range.next = min;        // Start at this index.
+        range.end = min + size;  // Keep going until one less than this index.
+    }
+    job.chunk = task_chunk_size > 0 ? task_chunk_size : 0;
+    job.divisor = (q->num_threads / job.num_ranges) * GUIDED_CHUNKS_PER_THREAD;
+    job.exhausted = 0;
     job.closure = closure;   // Use this closure.
     job.exit_status = 0;     // The job hasn't failed yet
     job.active_workers = 0;  // Nobody is working on this yet
-
-    if (!work_queue.jobs && size < num_threads) {
-        // If there's no nested parallelism happening and there are
-        // fewer tasks to do than threads, then set the target A team
-        // size so that some threads will put themselves to sleep
-        // until a larger job arrives.
-        work_queue.target_a_team_size = size;
-    } else {
-        work_queue.target_a_team_size = num_threads;
+    job.collect_wait_times = __atomic_load_n(&collect_wait_times, __ATOMIC_RELAXED) > 0;
+    job.finish_time_sum = 0;
+    job.finishers = 0;
+
+    int me = current_worker(q);
+    job_deque *deque = &q->deques[me];
+
+    // If there's nobody to share the job with, or this thread already
+    // has too many jobs outstanding, just do it all here.
+    if (q->num_threads == 1 || size < 2 || !push_job(deque, &job)) {
+        run_tasks(&job, me);
+        return job.exit_status;
     }
 
-    // If there are more tasks than threads in the A team, we should
-    // wake up everyone.
-    bool wake_b_team = size > work_queue.a_team_size;
-
-    // Push the job onto the stack.
-    job.next_job = work_queue.jobs;
-    work_queue.jobs = &job;
-
-    pthread_mutex_unlock(&work_queue.mutex);
-
-    // Wake up our A team.
-    pthread_cond_broadcast(&work_queue.wakeup_a_team);
+    // We'll do one of the tasks ourselves.
+    wake_workers(q, size - 1);
 
-    if (wake_b_team) {
-        // We need the B team too.
-        pthread_cond_broadcast(&work_queue.wakeup_b_team);
+    // Do some work myself.
+    run_tasks(&job, me);
+    finish_job(&job);
+
+    // All the tasks have been claimed. Take the job off the deque so
+    // nobody else joins it, then wait for the ones that did to
+    // finish, helping with other jobs in the meantime.
+    remove_job(deque, &job);
+    int64_t idle_since = -1;
+    while (__atomic_load_n(&job.active_workers, __ATOMIC_ACQUIRE) > 0) {
+        work *other = find_job(q, me);
+        if (other) {
+            run_tasks(other, me);
+            leave_job(q, other);
+            idle_since = -1;
+            continue;
+        }
+        if (keep_spinning(&idle_since)) {
+            sched_yield();
+            continue;
+        }
+        lock_queue(q);
+        if (__atomic_load_n(&job.active_workers, __ATOMIC_ACQUIRE) > 0) {
+            pthread_cond_wait(&q->wakeup_owners, &q->mutex);
+        }
+        pthread_mutex_unlock(&q->mutex);
     }
 
-    // Do some work myself.
-    worker_thread((void *)(&job));
+    // Every thread that ran out of tasks before the job was done was
+    // idle as far as this job is concerned, even if it found other
+    // work to do.
+    if (job.collect_wait_times) {
+        uint64_t end = halide_current_time_ns(NULL);
+        uint64_t idle = end * job.finishers - job.finish_time_sum;
+        __sync_add_and_fetch(&total_idle_ns, idle);
+    }
 
     // Return zero if the job succeeded, otherwise return the exit
     // status of one of the failing jobs (whichever one failed last).
@@ -310,6 +799,10 @@ WEAK void halide_spawn_thread(void *user_context, void (*f)(void *), void *closu
     pthread_create(&thread, NULL, spawn_thread_helper, t);
 }
 
+WEAK uintptr_t halide_current_thread() {
+    return (uintptr_t)pthread_self();
+}
+
 WEAK void halide_mutex_cleanup(halide_mutex *mutex_arg) {
     pthread_mutex_t *mutex = (pthread_mutex_t *)mutex_arg;
     pthread_mutex_destroy(mutex);
@@ -330,33 +823,140 @@ WEAK void halide_mutex_unlock(halide_mutex *mutex_arg) {
 WEAK void halide_shutdown_thread_pool() {
     if (!thread_pool_initialized) return;
 
-    // Wake everyone up and tell them the party's over and it's time
-    // to go home
-    pthread_mutex_lock(&work_queue.mutex);
-    work_queue.shutdown = true;
-    pthread_cond_broadcast(&work_queue.wakeup_owners);
-    pthread_cond_broadcast(&work_queue.wakeup_a_team);
-    pthread_cond_broadcast(&work_queue.wakeup_b_team);
-    pthread_mutex_unlock(&work_queue.mutex);
+    stop_threads(&work_queue);
 
-    // Wait until they leave
-    for (int i = 0; i < num_threads-1; i++) {
-        //fprintf(stderr, "Waiting for thread %d to exit\n", i);
-        void *retval;
-        pthread_join(work_queue.threads[i], &retval);
-    }
-
-    //fprintf(stderr, "All threads have quit. Destroying mutex and condition variable.\n");
-    // Tidy up
     pthread_mutex_destroy(&work_queue.mutex);
     // Reinitialize in case we call another do_par_for
     pthread_mutex_init(&work_queue.mutex, NULL);
-    pthread_cond_destroy(&work_queue.wakeup_owners);
-    pthread_cond_destroy(&work_queue.wakeup_a_team);
-    pthread_cond_destroy(&work_queue.wakeup_b_team);
     thread_pool_initialized = false;
 }
 
+WEAK void halide_set_thread_spin_time(int microseconds) {
+    thread_spin_us = microseconds < 0 ? 0 : microseconds;
+}
+
+WEAK void halide_set_thread_pool_hot(int hot) {
+    __atomic_store_n(&thread_pool_hot, hot, __ATOMIC_RELAXED);
+}
+
+WEAK void halide_thread_pool_collect_wait_times(bool collect) {
+    // The waits are measured with halide_current_time_ns, which jumps
+    // when the clock is first started.
+    halide_start_clock(NULL);
+    __atomic_add_fetch(&collect_wait_times, collect ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+WEAK void halide_thread_pool_wait_times(uint64_t *lock_wait_ns, uint64_t *idle_ns) {
+    *lock_wait_ns = __atomic_load_n(&total_lock_wait_ns, __ATOMIC_RELAXED);
+    *idle_ns = __atomic_load_n(&total_idle_ns, __ATOMIC_RELAXED);
+}
+
+WEAK void halide_set_task_chunk_size(int chunk) {
+    task_chunk_size = chunk < 0 ? 0 : chunk;
+}
+
+WEAK void halide_set_thread_affinity(const int *cpus, int num_cpus) {
+    if (thread_pool_initialized) {
+        halide_shutdown_thread_pool();
+    }
+
+    free(thread_affinity);
+    thread_affinity = NULL;
+    thread_affinity_size = 0;
+    thread_affinity_initialized = true;
+    if (cpus && num_cpus > 0) {
+        thread_affinity = (int *)malloc(num_cpus * sizeof(int));
+        if (thread_affinity) {
+            memcpy(thread_affinity, cpus, num_cpus * sizeof(int));
+            thread_affinity_size = num_cpus;
+        }
+    }
+}
+
+WEAK halide_thread_pool *halide_create_thread_pool(void *user_context, int threads,
+                                                   const uint64_t *cpu_mask, int cpu_mask_words) {
+    work_queue_t *q = (work_queue_t *)malloc(sizeof(work_queue_t));
+    if (!q) {
+        error(user_context) << "Out of memory creating a thread pool\n";
+        return NULL;
+    }
+    memset(q, 0, sizeof(work_queue_t));
+    if (cpu_mask && cpu_mask_words > 0) {
+        q->cpu_mask = (uint64_t *)malloc(cpu_mask_words * sizeof(uint64_t));
+        if (!q->cpu_mask) {
+            free(q);
+            error(user_context) << "Out of memory creating a thread pool\n";
+            return NULL;
+        }
+        memcpy(q->cpu_mask, cpu_mask, cpu_mask_words * sizeof(uint64_t));
+        q->cpu_mask_words = cpu_mask_words;
+    }
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_mutex_lock(&q->mutex);
+    bool ok = start_threads(q, threads < 1 ? 1 : threads);
+    pthread_mutex_unlock(&q->mutex);
+    if (!ok) {
+        pthread_mutex_destroy(&q->mutex);
+        free(q->cpu_mask);
+        free(q);
+        error(user_context) << "Out of memory creating a thread pool\n";
+        return NULL;
+    }
+    return (halide_thread_pool *)q;
+}
+
+WEAK void halide_destroy_thread_pool(halide_thread_pool *pool) {
+    if (!pool) return;
+    work_queue_t *q = (work_queue_t *)pool;
+
+    // Drop any bindings to it.
+    {
+        ScopedSpinLock lock(&pool_bindings_lock);
+        pool_binding **b = &pool_bindings;
+        while (*b) {
+            if ((*b)->queue == q) {
+                pool_binding *dead = *b;
+                *b = dead->next;
+                free(dead);
+            } else {
+                b = &(*b)->next;
+            }
+        }
+    }
+
+    stop_threads(q);
+    pthread_mutex_destroy(&q->mutex);
+    free(q->cpu_mask);
+    free(q);
+}
+
+WEAK void halide_bind_thread_pool(void *user_context, halide_thread_pool *pool) {
+    ScopedSpinLock lock(&pool_bindings_lock);
+    pool_binding **b = &pool_bindings;
+    while (*b && (*b)->user_context != user_context) {
+        b = &(*b)->next;
+    }
+    if (*b) {
+        if (pool) {
+            (*b)->queue = (work_queue_t *)pool;
+        } else {
+            pool_binding *dead = *b;
+            *b = dead->next;
+            free(dead);
+        }
+    } else if (pool) {
+        pool_binding *binding = (pool_binding *)malloc(sizeof(pool_binding));
+        if (!binding) {
+            error(user_context) << "Out of memory binding a thread pool\n";
+            return;
+        }
+        binding->user_context = user_context;
+        binding->queue = (work_queue_t *)pool;
+        binding->next = pool_bindings;
+        __atomic_store_n(&pool_bindings, binding, __ATOMIC_RELEASE);
+    }
+}
+
 namespace {
 __attribute__((destructor))
 WEAK void halide_posix_thread_pool_cleanup() {
@@ -390,6 +990,9 @@ WEAK halide_do_par_for_t halide_set_custom_do_par_for(halide_do_par_for_t f) {
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure) {
+    if (halide_timeline_enabled()) {
+        return halide_timeline_do_task(user_context, custom_do_task, f, idx, closure);
+    }
     return (*custom_do_task)(user_context, f, idx, closure);
 }
 
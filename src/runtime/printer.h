@@ -84,6 +84,36 @@ public:
         return *this;
     }
 
+    // Write a string in quotes, escaping the characters json doesn't
+    // allow in strings as they are.
+    Printer & write_json_string(const char *arg) {
+        const char *hex = "0123456789abcdef";
+        char esc[7];
+        dst = halide_string_to_string(dst, end, "\"");
+        for (const char *c = arg; *c; c++) {
+            unsigned char ch = (unsigned char)*c;
+            if (ch == '"' || ch == '\\') {
+                esc[0] = '\\';
+                esc[1] = ch;
+                esc[2] = 0;
+            } else if (ch < 0x20) {
+                esc[0] = '\\';
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[ch >> 4];
+                esc[5] = hex[ch & 15];
+                esc[6] = 0;
+            } else {
+                esc[0] = ch;
+                esc[1] = 0;
+            }
+            dst = halide_string_to_string(dst, end, esc);
+        }
+        dst = halide_string_to_string(dst, end, "\"");
+        return *this;
+    }
+
     // Use it like a stringstream.
     const char *str() {
         return buf;
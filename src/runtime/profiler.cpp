@@ -16,7 +16,9 @@ WEAK halide_profiler_state *halide_profiler_get_state() {
 
 namespace Halide { namespace Runtime { namespace Internal {
 
-WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipeline_name, int num_funcs, const uint64_t *func_names) {
+WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipeline_name, int num_funcs, const uint64_t *func_names,
+                                                             int num_alloc_sites, const uint64_t *alloc_site_names,
+                                                             const int *alloc_site_info) {
     halide_profiler_state *s = halide_profiler_get_state();
 
     for (halide_profiler_pipeline_stats *p = s->pipelines; p;
@@ -24,7 +26,8 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
         // The same pipeline will deliver the same global constant
         // string, so they can be compared by pointer.
         if (p->name == pipeline_name &&
-            p->num_funcs == num_funcs) {
+            p->num_funcs == num_funcs &&
+            p->num_alloc_sites == num_alloc_sites) {
             return p;
         }
     }
@@ -43,6 +46,12 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
     p->memory_peak = 0;
     p->memory_total = 0;
     p->num_allocs = 0;
+    p->active_runs = 0;
+    p->par_fors = NULL;
+    p->num_alloc_sites = num_alloc_sites;
+    for (int i = 0; i < halide_profiler_run_time_buckets; i++) {
+        p->run_time_histogram[i] = 0;
+    }
     p->funcs = (halide_profiler_func_stats *)malloc(num_funcs * sizeof(halide_profiler_func_stats));
     if (!p->funcs) {
         free(p);
@@ -56,13 +65,36 @@ WEAK halide_profiler_pipeline_stats *find_or_create_pipeline(const char *pipelin
         p->funcs[i].memory_total = 0;
         p->funcs[i].num_allocs = 0;
         p->funcs[i].stack_peak = 0;
+        for (int j = 0; j < halide_profiler_num_counters; j++) {
+            p->funcs[i].counters[j] = 0;
+        }
+    }
+    p->alloc_sites = NULL;
+    if (num_alloc_sites) {
+        p->alloc_sites = (halide_profiler_alloc_site_stats *)malloc(num_alloc_sites * sizeof(halide_profiler_alloc_site_stats));
+        if (!p->alloc_sites) {
+            free(p->funcs);
+            free(p);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < num_alloc_sites; i++) {
+        halide_profiler_alloc_site_stats *a = &p->alloc_sites[i];
+        a->name = (const char *)(alloc_site_names[2 * i]);
+        a->loop = (const char *)(alloc_site_names[2 * i + 1]);
+        a->func = alloc_site_info[2 * i];
+        a->stack_bytes = alloc_site_info[2 * i + 1];
+        a->memory_current = 0;
+        a->memory_peak = 0;
+        a->num_allocs = 0;
+        a->memory_total = 0;
     }
     s->first_free_id += num_funcs;
     s->pipelines = p;
     return p;
 }
 
-WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time) {
+WEAK halide_profiler_pipeline_stats *bill_func(halide_profiler_state *s, int func_id, uint64_t time) {
     halide_profiler_pipeline_stats *p_prev = NULL;
     for (halide_profiler_pipeline_stats *p = s->pipelines; p;
          p = (halide_profiler_pipeline_stats *)(p->next)) {
@@ -74,13 +106,261 @@ WEAK void bill_func(halide_profiler_state *s, int func_id, uint64_t time) {
                 s->pipelines = p;
             }
             p->funcs[func_id - p->first_func_id].time += time;
-            p->time += time;
-            p->samples++;
-            return;
+            return p;
         }
         p_prev = p;
     }
     // Someone must have called reset_state while a kernel was running. Do nothing.
+    return NULL;
+}
+
+// Bill the time since the last sample to the Func each thread is
+// computing. Each pipeline with any thread inside it is billed the
+// time once, and so is the profiler as a whole, so that thread
+// utilization only counts time spent in pipelines.
+WEAK void bill_threads(halide_profiler_state *s, uint64_t time) {
+    halide_profiler_pipeline_stats *billed[halide_profiler_max_threads + 1];
+    int num_billed = 0;
+    bool any_busy = false;
+    for (int i = 0; i <= halide_profiler_max_threads; i++) {
+        halide_profiler_thread_state *t = &s->threads[i];
+        int func = __atomic_load_n(&t->current_func, __ATOMIC_RELAXED);
+        if (func < 0 || __atomic_load_n(&t->owner, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        t->time += time;
+        any_busy = true;
+        halide_profiler_pipeline_stats *p = bill_func(s, func, time);
+        if (!p) {
+            continue;
+        }
+        bool already_billed = false;
+        for (int j = 0; j < num_billed && !already_billed; j++) {
+            already_billed = (billed[j] == p);
+        }
+        if (!already_billed) {
+            p->time += time;
+            p->samples++;
+            billed[num_billed++] = p;
+        }
+    }
+    if (any_busy) {
+        s->time += time;
+    }
+}
+
+// The hardware counters read in each slot. They are opened by the
+// first thread to claim the slot, and reopened whenever another
+// thread claims it.
+struct SlotCounters {
+    halide_profiler_pipeline_stats *pipeline;
+    bool opened;
+    // The group, and the counters in it.
+    int fd;
+    int fds[halide_profiler_num_counters];
+    int thread_id;
+    // The Func the counts since the last read belong to.
+    int func;
+    int num_values;
+    int which[halide_profiler_num_counters];
+    uint64_t last[halide_profiler_num_counters];
+};
+
+WEAK SlotCounters slot_counters[halide_profiler_max_threads];
+
+// The pipeline run each slot claimed by a pipeline (rather than by a
+// parallel task) belongs to, and when it started, so that the run
+// time can be measured and the run ended when it returns.
+struct SlotRun {
+    halide_profiler_pipeline_stats *pipeline;
+    uint64_t start;
+};
+
+WEAK SlotRun slot_runs[halide_profiler_max_threads];
+
+// The number of runs in progress that got the shared extra slot, and
+// so can't tell which pipeline they belong to when they end. Nothing
+// is freed by halide_profiler_reset while there are any. Guarded by
+// the profiler's lock.
+WEAK int shared_slot_runs = 0;
+
+// Run times are binned by their top four bits: eight buckets for each
+// power of two, and one for each time below eight nanoseconds.
+WEAK int run_time_bucket(uint64_t t) {
+    if (t < 8) {
+        return (int)t;
+    }
+    int b = 63 - __builtin_clzll(t);
+    return (b - 2) * 8 + (int)((t >> (b - 3)) & 7);
+}
+
+WEAK uint64_t run_time_bucket_min(int bucket) {
+    if (bucket < 8) {
+        return bucket;
+    }
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+}
+
+// Find the bucket of the time with the given rank in a histogram of
+// run times, and return the middle of it.
+WEAK uint64_t histogram_percentile(const uint32_t *histogram, float fraction) {
+    uint64_t total = 0;
+    for (int i = 0; i < halide_profiler_run_time_buckets; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // Ranks count from one.
+    uint64_t rank = (uint64_t)(fraction * total + 0.999f);
+    if (rank < 1) rank = 1;
+    if (rank > total) rank = total;
+    uint64_t count = 0;
+    int i = 0;
+    for (; i < halide_profiler_run_time_buckets - 1; i++) {
+        count += histogram[i];
+        if (count >= rank) break;
+    }
+    uint64_t width = (i < 8) ? 0 : ((uint64_t)1 << (i / 8 - 1));
+    return run_time_bucket_min(i) + width / 2;
+}
+
+// The parallel loop state of each slot: the loop the task running in
+// the slot belongs to and when the task started, and the loop the
+// slot is launching tasks of, with the thread pool's wait times when
+// it was launched.
+struct SlotParFor {
+    halide_profiler_par_for_stats *task_site;
+    uint64_t task_start;
+    halide_profiler_par_for_stats *launched_site;
+    uint64_t lock_wait;
+    uint64_t idle;
+};
+
+WEAK SlotParFor slot_par_fors[halide_profiler_max_threads];
+
+// The slot each region of stack last claimed, plus one. A thread
+// looks there first, so that one that lost its first choice of slot
+// to another thread goes straight back to the one it got instead,
+// rather than scanning for it again on every task.
+const int kSlotHintBits = 10;
+WEAK int slot_hints[1 << kSlotHintBits];
+
+WEAK halide_profiler_par_for_stats *find_par_for(halide_profiler_par_for_stats *first,
+                                                 const char *name) {
+    for (halide_profiler_par_for_stats *f = first; f;
+         f = (halide_profiler_par_for_stats *)(f->next)) {
+        // Compilations of the same pipeline name the loop with
+        // different strings, so compare them too.
+        if (f->name == name || strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Find the stats of a parallel loop of a pipeline, or make them if
+// it hasn't run before. The list is only added to at the front, so it
+// can be searched without the profiler's lock.
+WEAK halide_profiler_par_for_stats *find_or_create_par_for(halide_profiler_pipeline_stats *p,
+                                                           const char *name) {
+    halide_profiler_par_for_stats *f = find_par_for(__atomic_load_n(&p->par_fors, __ATOMIC_ACQUIRE), name);
+    if (f) {
+        return f;
+    }
+
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    // Someone else may have made it in the meantime.
+    f = find_par_for(p->par_fors, name);
+    if (f) {
+        return f;
+    }
+    f = (halide_profiler_par_for_stats *)malloc(sizeof(halide_profiler_par_for_stats));
+    if (!f) return NULL;
+    f->name = name;
+    f->next = p->par_fors;
+    f->runs = 0;
+    f->tasks = 0;
+    f->task_time = 0;
+    f->lock_wait = 0;
+    f->idle = 0;
+    for (int i = 0; i < halide_profiler_run_time_buckets; i++) {
+        f->task_time_histogram[i] = 0;
+    }
+    __atomic_store_n(&p->par_fors, f, __ATOMIC_RELEASE);
+    return f;
+}
+
+// Whether to read the hardware counters, and the raw event to count
+// as vector instructions. Both are read from the environment when the
+// profiler starts.
+WEAK bool counters_enabled = false;
+WEAK uint64_t vector_event = 0;
+
+WEAK uint64_t parse_hex(const char *str) {
+    if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        str += 2;
+    }
+    uint64_t result = 0;
+    for (; *str; str++) {
+        char c = *str | 0x20;
+        if (*str >= '0' && *str <= '9') {
+            result = result * 16 + (*str - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            result = result * 16 + (c - 'a' + 10);
+        } else {
+            break;
+        }
+    }
+    return result;
+}
+
+// Get the counters of a slot ready to bill the Funcs of a pipeline
+// run. Returns false if there are no counters to read.
+WEAK bool start_slot_counters(int idx, halide_profiler_pipeline_stats *p) {
+    SlotCounters *c = &slot_counters[idx];
+    int thread_id = halide_current_thread_id();
+    if (!c->opened || c->thread_id != thread_id) {
+        if (c->opened && c->fd >= 0) {
+            halide_close_perf_counters(c->fds);
+        }
+        c->fd = halide_open_perf_counters(vector_event, c->which, c->fds);
+        c->num_values = 0;
+        for (int i = 0; i < halide_profiler_num_counters; i++) {
+            if (c->which[i] >= 0) c->num_values++;
+        }
+        c->thread_id = thread_id;
+        c->opened = true;
+    }
+    if (c->fd < 0 || p == NULL) {
+        return false;
+    }
+    c->pipeline = p;
+    c->func = halide_profiler_outside_of_halide;
+    return halide_read_perf_counters(c->fd, c->last, c->num_values) == 0;
+}
+
+// Close the counters of the slots no pipeline is using, so that their
+// file descriptors aren't leaked. Each slot is claimed, with an owner
+// no pipeline run has, while its counters are closed, so that no
+// thread reopens or reads them at the same time. The next thread to
+// claim the slot reopens them.
+WEAK void close_slot_counters(halide_profiler_state *s) {
+    for (int i = 0; i < halide_profiler_max_threads; i++) {
+        halide_profiler_thread_state *t = &s->threads[i];
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&t->owner, &expected, -1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        SlotCounters *c = &slot_counters[i];
+        if (c->opened && c->fd >= 0) {
+            halide_close_perf_counters(c->fds);
+        }
+        c->opened = false;
+        __atomic_store_n(&t->owner, 0, __ATOMIC_RELEASE);
+    }
 }
 
 WEAK void sampling_profiler_thread(void *) {
@@ -95,14 +375,12 @@ WEAK void sampling_profiler_thread(void *) {
         uint64_t t = t1;
         while (1) {
             uint64_t t_now = halide_current_time_ns(NULL);
-            int func = s->current_func;
-            if (func == halide_profiler_please_stop) {
+            if (s->current_func == halide_profiler_please_stop) {
                 break;
-            } else if (func >= 0) {
-                // Assume all time since I was last awake is due to
-                // the currently running func.
-                bill_func(s, func, t_now - t);
             }
+            // Assume all time since I was last awake is due to the
+            // funcs currently running.
+            bill_threads(s, t_now - t);
             t = t_now;
 
             // Release the lock, sleep, reacquire.
@@ -158,28 +436,207 @@ WEAK halide_profiler_pipeline_stats *halide_profiler_get_pipeline_state(const ch
 WEAK int halide_profiler_pipeline_start(void *user_context,
                                         const char *pipeline_name,
                                         int num_funcs,
-                                        const uint64_t *func_names) {
+                                        const uint64_t *func_names,
+                                        int num_alloc_sites,
+                                        const uint64_t *alloc_site_names,
+                                        const int *alloc_site_info) {
     halide_profiler_state *s = halide_profiler_get_state();
 
     ScopedMutexLock lock(&s->lock);
 
     if (!s->started) {
+        const char *counters = getenv("HL_PROFILER_COUNTERS");
+        counters_enabled = counters && atoi(counters);
+        const char *event = getenv("HL_PROFILER_VECTOR_EVENT");
+        vector_event = event ? parse_hex(event) : 0;
+
+        // Mark the slots nobody has claimed yet as idle.
+        for (int i = 0; i <= halide_profiler_max_threads; i++) {
+            if (s->threads[i].owner == 0) {
+                s->threads[i].current_func = halide_profiler_outside_of_halide;
+            }
+        }
         halide_start_clock(user_context);
         halide_spawn_thread(user_context, sampling_profiler_thread, NULL);
         s->started = true;
     }
 
     halide_profiler_pipeline_stats *p =
-        find_or_create_pipeline(pipeline_name, num_funcs, func_names);
+        find_or_create_pipeline(pipeline_name, num_funcs, func_names,
+                                num_alloc_sites, alloc_site_names, alloc_site_info);
     if (!p) {
         // Allocating space to track the statistics failed.
         return halide_error_out_of_memory(user_context);
     }
     p->runs++;
+    p->active_runs++;
 
     return p->first_func_id;
 }
 
+// Claim a slot for the calling thread to report the Func it is
+// computing in. Slots claimed by parallel tasks belong to the same
+// pipeline run as the slot of the code that launched them, so that
+// they can all be released when the pipeline returns.
+WEAK void *halide_profiler_acquire_slot(void *state, void *parent_slot, void *pipeline_state) {
+    halide_profiler_state *s = (halide_profiler_state *)state;
+    halide_profiler_thread_state *shared = &s->threads[halide_profiler_max_threads];
+    int owner = 0;
+    if (parent_slot == shared) {
+        // The tasks of a run that got the shared slot share it too,
+        // as they couldn't be released with the run otherwise.
+        return shared;
+    } else if (parent_slot) {
+        owner = ((halide_profiler_thread_state *)parent_slot)->owner;
+    }
+
+    // Start looking from the slot this thread's stack got last time,
+    // or one picked from its address, so that a thread tends to get
+    // the same slot each time.
+    uint64_t h = ((uint64_t)(uintptr_t)__builtin_frame_address(0) >> 20) * UINT64_C(0x9E3779B97F4A7C15);
+    int *hint = &slot_hints[h >> (64 - kSlotHintBits)];
+    int start = __atomic_load_n(hint, __ATOMIC_RELAXED) - 1;
+    if (start < 0) {
+        start = (int)((h >> 32) % halide_profiler_max_threads);
+    }
+    for (int i = 0; i < halide_profiler_max_threads; i++) {
+        int idx = (start + i) % halide_profiler_max_threads;
+        halide_profiler_thread_state *t = &s->threads[idx];
+        int expected = 0;
+        int new_owner = owner ? owner : idx + 1;
+        if (__atomic_load_n(&t->owner, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&t->owner, &expected, new_owner, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            if (i != 0) {
+                __atomic_store_n(hint, idx + 1, __ATOMIC_RELAXED);
+            }
+            t->counters = counters_enabled &&
+                start_slot_counters(idx, (halide_profiler_pipeline_stats *)pipeline_state);
+            if (!parent_slot) {
+                slot_runs[idx].pipeline = (halide_profiler_pipeline_stats *)pipeline_state;
+                slot_runs[idx].start = halide_current_time_ns(NULL);
+            }
+            // A task of a parallel loop is timed from here until it
+            // releases the slot.
+            SlotParFor *pf = &slot_par_fors[idx];
+            if (pf->launched_site) {
+                // A loop launched from here never ended, because its
+                // pipeline failed.
+                halide_thread_pool_collect_wait_times(false);
+            }
+            pf->launched_site = NULL;
+            pf->task_site = NULL;
+            int parent_idx = parent_slot ?
+                (halide_profiler_thread_state *)parent_slot - s->threads : halide_profiler_max_threads;
+            if (parent_idx < halide_profiler_max_threads) {
+                pf->task_site = __atomic_load_n(&slot_par_fors[parent_idx].launched_site, __ATOMIC_RELAXED);
+                if (pf->task_site) {
+                    pf->task_start = halide_current_time_ns(NULL);
+                }
+            }
+            return t;
+        }
+    }
+
+    // All the slots are taken. Share the extra one, which nobody owns,
+    // so that the profiler doesn't sample it, and which doesn't read
+    // the counters.
+    if (!parent_slot && pipeline_state) {
+        // The run won't know its pipeline when it ends, so keep all
+        // the stats until it does.
+        ScopedMutexLock lock(&s->lock);
+        ((halide_profiler_pipeline_stats *)pipeline_state)->active_runs--;
+        shared_slot_runs++;
+    }
+    return shared;
+}
+
+WEAK void halide_profiler_release_slot(void *slot) {
+    halide_profiler_thread_state *t = (halide_profiler_thread_state *)slot;
+    __atomic_store_n(&t->current_func, (int)halide_profiler_outside_of_halide, __ATOMIC_RELAXED);
+    if (t->counters) {
+        halide_profiler_switch_counters(t, halide_profiler_outside_of_halide);
+        t->counters = 0;
+    }
+    halide_profiler_state *s = halide_profiler_get_state();
+    if (t != &s->threads[halide_profiler_max_threads]) {
+        SlotParFor *pf = &slot_par_fors[t - s->threads];
+        if (halide_profiler_par_for_stats *f = pf->task_site) {
+            uint64_t time = halide_current_time_ns(NULL) - pf->task_start;
+            __sync_add_and_fetch(&f->tasks, 1);
+            __sync_add_and_fetch(&f->task_time, time);
+            __sync_add_and_fetch(&f->task_time_histogram[run_time_bucket(time)], 1);
+            pf->task_site = NULL;
+        }
+        __atomic_store_n(&t->owner, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Called before the tasks of a parallel loop are launched from a
+// slot. The tasks are timed as they claim and release slots of their
+// own, and the time the thread pool spends waiting while they run is
+// billed to the loop by halide_profiler_par_for_end.
+WEAK int halide_profiler_par_for_begin(void *pipeline_state, void *slot, const char *name) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    int idx = (halide_profiler_thread_state *)slot - s->threads;
+    if (idx >= halide_profiler_max_threads || pipeline_state == NULL) {
+        return 0;
+    }
+    SlotParFor *pf = &slot_par_fors[idx];
+    pf->launched_site = find_or_create_par_for((halide_profiler_pipeline_stats *)pipeline_state, name);
+    if (pf->launched_site) {
+        halide_thread_pool_collect_wait_times(true);
+        halide_thread_pool_wait_times(&pf->lock_wait, &pf->idle);
+    }
+    return 0;
+}
+
+WEAK int halide_profiler_par_for_end(void *slot) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    int idx = (halide_profiler_thread_state *)slot - s->threads;
+    if (idx >= halide_profiler_max_threads) {
+        return 0;
+    }
+    SlotParFor *pf = &slot_par_fors[idx];
+    halide_profiler_par_for_stats *f = pf->launched_site;
+    if (f) {
+        uint64_t lock_wait, idle;
+        halide_thread_pool_wait_times(&lock_wait, &idle);
+        halide_thread_pool_collect_wait_times(false);
+        __sync_add_and_fetch(&f->runs, 1);
+        __sync_add_and_fetch(&f->lock_wait, lock_wait - pf->lock_wait);
+        __sync_add_and_fetch(&f->idle, idle - pf->idle);
+        pf->launched_site = NULL;
+    }
+    return 0;
+}
+
+// Called when the Func a slot is computing changes, if the slot reads
+// the counters. Bills the counts since the last change to the Func
+// the slot was computing.
+WEAK void halide_profiler_switch_counters(void *slot, int func) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    SlotCounters *c = &slot_counters[(halide_profiler_thread_state *)slot - s->threads];
+    uint64_t values[halide_profiler_num_counters];
+    if (halide_read_perf_counters(c->fd, values, c->num_values) != 0) {
+        return;
+    }
+    halide_profiler_pipeline_stats *p = c->pipeline;
+    int f = c->func - p->first_func_id;
+    if (f >= 0 && f < p->num_funcs) {
+        for (int i = 0; i < halide_profiler_num_counters; i++) {
+            int w = c->which[i];
+            if (w >= 0) {
+                __sync_add_and_fetch(&p->funcs[f].counters[i], values[w] - c->last[w]);
+            }
+        }
+    }
+    for (int i = 0; i < c->num_values; i++) {
+        c->last[i] = values[i];
+    }
+    c->func = func;
+}
+
 WEAK void halide_profiler_stack_peak_update(void *user_context,
                                             void *pipeline_state,
                                             int *f_values) {
@@ -203,6 +660,7 @@ WEAK void halide_profiler_stack_peak_update(void *user_context,
 WEAK void halide_profiler_memory_allocate(void *user_context,
                                           void *pipeline_state,
                                           int func_id,
+                                          int site,
                                           int incr) {
     // It's possible to have 'incr' equal to zero if the allocation is not
     // executed conditionally.
@@ -214,8 +672,11 @@ WEAK void halide_profiler_memory_allocate(void *user_context,
     halide_assert(user_context, p_stats != NULL);
     halide_assert(user_context, func_id >= 0);
     halide_assert(user_context, func_id < p_stats->num_funcs);
+    halide_assert(user_context, site >= 0);
+    halide_assert(user_context, site < p_stats->num_alloc_sites);
 
     halide_profiler_func_stats *f_stats = &p_stats->funcs[func_id];
+    halide_profiler_alloc_site_stats *a_stats = &p_stats->alloc_sites[site];
 
     // Note: Update to the counter is done without grabbing the state's lock to
     // reduce lock contention. One potential issue is that other call that frees the
@@ -223,6 +684,12 @@ WEAK void halide_profiler_memory_allocate(void *user_context,
     // current desctructor (called on profiler shutdown) does not free the structs
     // unless user specifically calls halide_profiler_reset().
 
+    // Update per-site memory stats
+    __sync_add_and_fetch(&a_stats->num_allocs, 1);
+    __sync_add_and_fetch(&a_stats->memory_total, (uint64_t)incr);
+    int a_mem_current = __sync_add_and_fetch(&a_stats->memory_current, incr);
+    sync_compare_max_and_swap(&a_stats->memory_peak, a_mem_current);
+
     // Update per-pipeline memory stats
     __sync_add_and_fetch(&p_stats->num_allocs, 1);
     __sync_add_and_fetch(&p_stats->memory_total, incr);
@@ -239,6 +706,7 @@ WEAK void halide_profiler_memory_allocate(void *user_context,
 WEAK void halide_profiler_memory_free(void *user_context,
                                       void *pipeline_state,
                                       int func_id,
+                                      int site,
                                       int decr) {
     // It's possible to have 'decr' equal to zero if the allocation is not
     // executed conditionally.
@@ -250,6 +718,8 @@ WEAK void halide_profiler_memory_free(void *user_context,
     halide_assert(user_context, p_stats != NULL);
     halide_assert(user_context, func_id >= 0);
     halide_assert(user_context, func_id < p_stats->num_funcs);
+    halide_assert(user_context, site >= 0);
+    halide_assert(user_context, site < p_stats->num_alloc_sites);
 
     halide_profiler_func_stats *f_stats = &p_stats->funcs[func_id];
 
@@ -259,6 +729,9 @@ WEAK void halide_profiler_memory_free(void *user_context,
     // current desctructor (called on profiler shutdown) does not free the structs
     // unless user specifically calls halide_profiler_reset().
 
+    // Update per-site memory stats
+    __sync_sub_and_fetch(&p_stats->alloc_sites[site].memory_current, decr);
+
     // Update per-pipeline memory stats
     __sync_sub_and_fetch(&p_stats->memory_current, decr);
 
@@ -266,6 +739,187 @@ WEAK void halide_profiler_memory_free(void *user_context,
     __sync_sub_and_fetch(&f_stats->memory_current, decr);
 }
 
+WEAK uint64_t halide_profiler_run_time_percentile(const halide_profiler_pipeline_stats *p, float fraction) {
+    return histogram_percentile(p->run_time_histogram, fraction);
+}
+
+WEAK uint64_t halide_profiler_task_time_percentile(const halide_profiler_par_for_stats *f, float fraction) {
+    return histogram_percentile(f->task_time_histogram, fraction);
+}
+
+WEAK int halide_profiler_enumerate_pipelines(void *user_context, void *enumerate_context,
+                                             halide_profiler_enumerate_func_t func) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    for (halide_profiler_pipeline_stats *p = s->pipelines; p;
+         p = (halide_profiler_pipeline_stats *)(p->next)) {
+        if (!p->runs) continue;
+        int r = (*func)(enumerate_context, p);
+        if (r != 0) return r;
+    }
+    return 0;
+}
+
+WEAK void halide_profiler_write_csv(halide_profiler_state *s, int fd, bool header,
+                                    Printer<StringStreamPrinter, 1024> &sstr) {
+    if (header) {
+        sstr.clear();
+        // New columns go at the end, so that readers of older files
+        // keep working.
+        sstr << "pipeline,func,runs,time_ns,memory_peak,memory_total,num_allocs,stack_peak,"
+             << "cycles,instructions,cache_misses,vector_instructions,"
+             << "run_time_p50_ns,run_time_p90_ns,run_time_p99_ns\n";
+        write(fd, sstr.str(), sstr.size());
+    }
+    for (halide_profiler_pipeline_stats *p = s->pipelines; p;
+         p = (halide_profiler_pipeline_stats *)(p->next)) {
+        if (!p->runs) continue;
+        uint64_t p50 = halide_profiler_run_time_percentile(p, 0.5f);
+        uint64_t p90 = halide_profiler_run_time_percentile(p, 0.9f);
+        uint64_t p99 = halide_profiler_run_time_percentile(p, 0.99f);
+        for (int i = 0; i < p->num_funcs; i++) {
+            halide_profiler_func_stats *fs = p->funcs + i;
+            sstr.clear();
+            sstr << p->name << "," << fs->name << "," << p->runs << "," << fs->time << ","
+                 << fs->memory_peak << "," << fs->memory_total << "," << fs->num_allocs << ","
+                 << fs->stack_peak;
+            for (int j = 0; j < halide_profiler_num_counters; j++) {
+                sstr << "," << fs->counters[j];
+            }
+            sstr << "," << p50 << "," << p90 << "," << p99 << "\n";
+            write(fd, sstr.str(), sstr.size());
+        }
+    }
+}
+
+WEAK void halide_profiler_write_json(halide_profiler_state *s, int fd,
+                                     Printer<StringStreamPrinter, 1024> &sstr) {
+    const char *counter_names[halide_profiler_num_counters] =
+        {"cycles", "instructions", "cache_misses", "vector_instructions"};
+    sstr.clear();
+    sstr << "{\"pipelines\": [";
+    write(fd, sstr.str(), sstr.size());
+    bool first_pipeline = true;
+    for (halide_profiler_pipeline_stats *p = s->pipelines; p;
+         p = (halide_profiler_pipeline_stats *)(p->next)) {
+        if (!p->runs) continue;
+        sstr.clear();
+        sstr << (first_pipeline ? "\n" : ",\n") << " {\"name\": ";
+        sstr.write_json_string(p->name);
+        sstr << ", \"runs\": " << p->runs
+             << ", \"time_ns\": " << p->time
+             << ", \"samples\": " << p->samples
+             << ", \"memory_peak\": " << p->memory_peak
+             << ", \"memory_total\": " << p->memory_total
+             << ", \"num_allocs\": " << p->num_allocs
+             << ", \"run_time_ns\": {\"p50\": " << halide_profiler_run_time_percentile(p, 0.5f)
+             << ", \"p90\": " << halide_profiler_run_time_percentile(p, 0.9f)
+             << ", \"p99\": " << halide_profiler_run_time_percentile(p, 0.99f) << "}"
+             << ", \"funcs\": [";
+        write(fd, sstr.str(), sstr.size());
+        first_pipeline = false;
+        for (int i = 0; i < p->num_funcs; i++) {
+            halide_profiler_func_stats *fs = p->funcs + i;
+            sstr.clear();
+            sstr << (i == 0 ? "\n" : ",\n") << "  {\"name\": ";
+            sstr.write_json_string(fs->name);
+            sstr << ", \"time_ns\": " << fs->time
+                 << ", \"memory_peak\": " << fs->memory_peak
+                 << ", \"memory_total\": " << fs->memory_total
+                 << ", \"num_allocs\": " << fs->num_allocs
+                 << ", \"stack_peak\": " << fs->stack_peak;
+            for (int j = 0; j < halide_profiler_num_counters; j++) {
+                sstr << ", \"" << counter_names[j] << "\": " << fs->counters[j];
+            }
+            sstr << "}";
+            write(fd, sstr.str(), sstr.size());
+        }
+        sstr.clear();
+        sstr << "], \"allocations\": [";
+        write(fd, sstr.str(), sstr.size());
+        for (int i = 0; i < p->num_alloc_sites; i++) {
+            halide_profiler_alloc_site_stats *a = p->alloc_sites + i;
+            sstr.clear();
+            sstr << (i == 0 ? "\n" : ",\n") << "  {\"name\": ";
+            sstr.write_json_string(a->name);
+            sstr << ", \"func\": ";
+            sstr.write_json_string(p->funcs[a->func].name);
+            sstr << ", \"loop\": ";
+            sstr.write_json_string(a->loop);
+            sstr << ", \"stack_bytes\": " << a->stack_bytes
+                 << ", \"memory_peak\": " << a->memory_peak
+                 << ", \"memory_total\": " << a->memory_total
+                 << ", \"num_allocs\": " << a->num_allocs << "}";
+            write(fd, sstr.str(), sstr.size());
+        }
+        sstr.clear();
+        sstr << "], \"parallel_loops\": [";
+        write(fd, sstr.str(), sstr.size());
+        for (halide_profiler_par_for_stats *f = p->par_fors; f;
+             f = (halide_profiler_par_for_stats *)(f->next)) {
+            sstr.clear();
+            sstr << (f == p->par_fors ? "\n" : ",\n") << "  {\"name\": ";
+            sstr.write_json_string(f->name);
+            sstr << ", \"runs\": " << f->runs
+                 << ", \"tasks\": " << f->tasks
+                 << ", \"task_time_ns\": " << f->task_time
+                 << ", \"task_time_p50_ns\": " << halide_profiler_task_time_percentile(f, 0.5f)
+                 << ", \"task_time_p99_ns\": " << halide_profiler_task_time_percentile(f, 0.99f)
+                 << ", \"lock_wait_ns\": " << f->lock_wait
+                 << ", \"idle_ns\": " << f->idle << "}";
+            write(fd, sstr.str(), sstr.size());
+        }
+        sstr.clear();
+        sstr << "]}";
+        write(fd, sstr.str(), sstr.size());
+    }
+    sstr.clear();
+    sstr << "]}\n";
+    write(fd, sstr.str(), sstr.size());
+}
+
+#define O_APPEND 1024
+#define O_CREAT 64
+#define O_EXCL 128
+#define O_TRUNC 512
+#define O_WRONLY 1
+WEAK int halide_profiler_write_stats_unlocked(void *user_context, halide_profiler_state *s,
+                                              const char *file_name, halide_profiler_format_t format) {
+    int fd;
+    bool created = false;
+    if (format == halide_profiler_format_csv) {
+        // Write the header only if the file is new.
+        fd = open(file_name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        created = (fd >= 0);
+        if (fd < 0) {
+            fd = open(file_name, O_APPEND | O_WRONLY, 0644);
+        }
+    } else {
+        fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    }
+    if (fd < 0) {
+        halide_error(user_context, "Failed to open profiler stats file\n");
+        return halide_error_code_generic_error;
+    }
+
+    char line_buf[1024];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(user_context, line_buf);
+    if (format == halide_profiler_format_csv) {
+        halide_profiler_write_csv(s, fd, created, sstr);
+    } else {
+        halide_profiler_write_json(s, fd, sstr);
+    }
+    close(fd);
+    return 0;
+}
+
+WEAK int halide_profiler_write_stats(void *user_context, const char *file_name,
+                                     halide_profiler_format_t format) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    ScopedMutexLock lock(&s->lock);
+    return halide_profiler_write_stats_unlocked(user_context, s, file_name, format);
+}
+
 WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_state *s) {
 
     char line_buf[1024];
@@ -280,13 +934,26 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
         if (p->num_allocs != 0) {
             alloc_avg = p->memory_total/p->num_allocs;
         }
+        // Func times are summed over threads, so they can add up to
+        // more than the time spent in the pipeline.
+        uint64_t func_time = 0;
+        for (int i = 0; i < p->num_funcs; i++) {
+            func_time += p->funcs[i].time;
+        }
+        float threads = p->time ? (float)func_time / p->time : 0.0f;
         sstr << p->name << "\n"
              << " total time: " << t << " ms"
              << "  samples: " << p->samples
              << "  runs: " << p->runs
-             << "  time/run: " << t / p->runs << " ms\n"
+             << "  time/run: " << t / p->runs << " ms"
+             << "  average threads: " << threads << "\n"
              << " heap allocations: " << p->num_allocs
              << "  peak heap usage: " << p->memory_peak << " bytes\n";
+        if (uint64_t p50 = halide_profiler_run_time_percentile(p, 0.5f)) {
+            sstr << " run time p50: " << p50 / 1000000.0f << " ms"
+                 << "  p90: " << halide_profiler_run_time_percentile(p, 0.9f) / 1000000.0f << " ms"
+                 << "  p99: " << halide_profiler_run_time_percentile(p, 0.99f) / 1000000.0f << " ms\n";
+        }
         halide_print(user_context, sstr.str());
 
         bool print_f_states = p->time || p->memory_total;
@@ -317,8 +984,8 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
                 while (sstr.size() < 40) sstr << " ";
 
                 int percent = 0;
-                if (p->time != 0) {
-                    percent = fs->time / (p->time / 100);
+                if (func_time >= 100) {
+                    percent = fs->time / (func_time / 100);
                 }
                 sstr << "(" << percent << "%)";
                 while (sstr.size() < 50) sstr << " ";
@@ -338,11 +1005,104 @@ WEAK void halide_profiler_report_unlocked(void *user_context, halide_profiler_st
                 if (fs->stack_peak > 0) {
                     sstr << " stack: " << fs->stack_peak;
                 }
+
+                // Hardware counts per run, if they were read.
+                const uint64_t *counts = fs->counters;
+                if (counts[halide_profiler_cycles] && counts[halide_profiler_instructions]) {
+                    while (sstr.size() < 95) sstr << " ";
+                    sstr << " cycles: " << counts[halide_profiler_cycles] / p->runs
+                         << " ipc: " << (float)counts[halide_profiler_instructions] / counts[halide_profiler_cycles];
+                }
+                if (counts[halide_profiler_cache_misses]) {
+                    sstr << " cache misses: " << counts[halide_profiler_cache_misses] / p->runs;
+                }
+                if (counts[halide_profiler_vector_instructions]) {
+                    sstr << " vector: " << counts[halide_profiler_vector_instructions] / p->runs;
+                }
                 sstr << "\n";
 
                 halide_print(user_context, sstr.str());
             }
         }
+
+        // Each allocation site, on the stack or the heap. Heap peaks
+        // include allocations by different threads at the same time.
+        bool print_alloc_sites = false;
+        for (int i = 0; i < p->num_alloc_sites; i++) {
+            print_alloc_sites |= (p->alloc_sites[i].stack_bytes || p->alloc_sites[i].num_allocs);
+        }
+        if (print_alloc_sites) {
+            halide_print(user_context, " allocations:\n");
+        }
+        for (int i = 0; print_alloc_sites && i < p->num_alloc_sites; i++) {
+            halide_profiler_alloc_site_stats *a = p->alloc_sites + i;
+            if (!a->stack_bytes && !a->num_allocs) continue;
+            sstr.clear();
+            sstr << "  " << a->name << " at " << a->loop << ": ";
+            while (sstr.size() < 40) sstr << " ";
+            if (a->stack_bytes) {
+                sstr << " stack: " << a->stack_bytes << "\n";
+            } else {
+                sstr << " peak: " << a->memory_peak;
+                while (sstr.size() < 65) sstr << " ";
+                sstr << " num: " << a->num_allocs;
+                while (sstr.size() < 80) sstr << " ";
+                sstr << " avg: " << a->memory_total / a->num_allocs << "\n";
+            }
+            halide_print(user_context, sstr.str());
+        }
+
+        // Per run averages for each parallel loop. Tasks that finish
+        // at different times leave the threads that finished first
+        // idle.
+        if (p->par_fors) {
+            halide_print(user_context, " parallel loops:\n");
+        }
+        for (halide_profiler_par_for_stats *f = p->par_fors; f;
+             f = (halide_profiler_par_for_stats *)(f->next)) {
+            if (!f->runs) continue;
+            sstr.clear();
+            sstr << "  " << f->name << ": ";
+            while (sstr.size() < 25) sstr << " ";
+            sstr << "tasks: " << f->tasks / f->runs;
+            while (sstr.size() < 40) sstr << " ";
+            sstr << " task p50: " << halide_profiler_task_time_percentile(f, 0.5f) / 1000000.0f << "ms"
+                 << " p99: " << halide_profiler_task_time_percentile(f, 0.99f) / 1000000.0f << "ms"
+                 << " lock wait: " << f->lock_wait / (f->runs * 1000000.0f) << "ms"
+                 << " idle: " << f->idle / (f->runs * 1000000.0f) << "ms\n";
+            halide_print(user_context, sstr.str());
+        }
+    }
+
+    if (s->time) {
+        uint64_t busy = 0;
+        for (int i = 0; i <= halide_profiler_max_threads; i++) {
+            busy += s->threads[i].time;
+        }
+        sstr.clear();
+        sstr << "threads: " << (float)busy / s->time << " busy on average over "
+             << s->time / 1000000.0f << " ms\n";
+        halide_print(user_context, sstr.str());
+        for (int i = 0; i <= halide_profiler_max_threads; i++) {
+            halide_profiler_thread_state *ts = s->threads + i;
+            if (!ts->time) continue;
+            sstr.clear();
+            sstr << "  thread " << i << ": ";
+            while (sstr.size() < 15) sstr << " ";
+            sstr << ts->time / 1000000.0f << "ms";
+            while (sstr.size() < 30) sstr << " ";
+            sstr << "(" << (int)(ts->time / (s->time / 100 + 1)) << "% busy)\n";
+            halide_print(user_context, sstr.str());
+        }
+    }
+
+    const char *csv_file_name = getenv("HL_PROFILER_CSV");
+    if (csv_file_name) {
+        halide_profiler_write_stats_unlocked(user_context, s, csv_file_name, halide_profiler_format_csv);
+    }
+    const char *json_file_name = getenv("HL_PROFILER_JSON");
+    if (json_file_name) {
+        halide_profiler_write_stats_unlocked(user_context, s, json_file_name, halide_profiler_format_json);
     }
 }
 
@@ -354,21 +1114,43 @@ WEAK void halide_profiler_report(void *user_context) {
 
 
 WEAK void halide_profiler_reset() {
-    // WARNING: Do not call this method while any other halide
-    // pipeline is running; halide_profiler_memory_allocate/free and
-    // halide_profiler_stack_peak_update update the profiler pipeline's
-    // state without grabbing the global profiler state's lock.
+    // This may be called while pipelines are running.
     halide_profiler_state *s = halide_profiler_get_state();
 
     ScopedMutexLock lock(&s->lock);
 
+    // Running pipelines update their stats without the lock (e.g. in
+    // halide_profiler_memory_allocate/free and
+    // halide_profiler_stack_peak_update), so keep those.
+    halide_profiler_pipeline_stats *kept = NULL;
+    int first_free_id = 0;
     while (s->pipelines) {
         halide_profiler_pipeline_stats *p = s->pipelines;
         s->pipelines = (halide_profiler_pipeline_stats *)(p->next);
+        if (p->active_runs || shared_slot_runs) {
+            p->next = kept;
+            kept = p;
+            if (p->first_func_id + p->num_funcs > first_free_id) {
+                first_free_id = p->first_func_id + p->num_funcs;
+            }
+            continue;
+        }
+        while (p->par_fors) {
+            halide_profiler_par_for_stats *f = p->par_fors;
+            p->par_fors = (halide_profiler_par_for_stats *)(f->next);
+            free(f);
+        }
         free(p->funcs);
+        free(p->alloc_sites);
         free(p);
     }
-    s->first_free_id = 0;
+    s->pipelines = kept;
+    s->first_free_id = first_free_id;
+    s->time = 0;
+    for (int i = 0; i <= halide_profiler_max_threads; i++) {
+        s->threads[i].time = 0;
+    }
+    close_slot_counters(s);
 }
 
 namespace {
@@ -388,14 +1170,39 @@ WEAK void halide_profiler_shutdown() {
     // down the thread.
     halide_profiler_report_unlocked(NULL, s);
 
+    close_slot_counters(s);
+
     // Leak the memory. Not all implementations of ScopedMutexLock may
     // be safe to use at static destruction time (windows).
     // halide_profiler_reset();
 }
 }
 
-WEAK void halide_profiler_pipeline_end(void *user_context, void *state) {
-    ((halide_profiler_state *)state)->current_func = halide_profiler_outside_of_halide;
+// Called when a pipeline returns, with the slot it claimed when it
+// started. Releases that slot, and any slots of its parallel tasks
+// that weren't released because the tasks failed.
+WEAK void halide_profiler_pipeline_end(void *user_context, void *slot) {
+    halide_profiler_state *s = halide_profiler_get_state();
+    int idx = (halide_profiler_thread_state *)slot - s->threads;
+    if (idx < halide_profiler_max_threads && slot_runs[idx].pipeline) {
+        halide_profiler_pipeline_stats *p = slot_runs[idx].pipeline;
+        uint64_t t = halide_current_time_ns(user_context) - slot_runs[idx].start;
+        __sync_add_and_fetch(&p->run_time_histogram[run_time_bucket(t)], 1);
+        slot_runs[idx].pipeline = NULL;
+        ScopedMutexLock lock(&s->lock);
+        p->active_runs--;
+    } else if (idx == halide_profiler_max_threads) {
+        ScopedMutexLock lock(&s->lock);
+        shared_slot_runs--;
+    }
+    int owner = ((halide_profiler_thread_state *)slot)->owner;
+    for (int i = 0; owner && i < halide_profiler_max_threads; i++) {
+        halide_profiler_thread_state *t = &s->threads[i];
+        if (t != slot && __atomic_load_n(&t->owner, __ATOMIC_RELAXED) == owner) {
+            halide_profiler_release_slot(t);
+        }
+    }
+    halide_profiler_release_slot(slot);
 }
 
 }
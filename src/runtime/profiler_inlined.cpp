@@ -2,13 +2,16 @@
 
 extern "C" {
 
-WEAK __attribute__((always_inline)) int halide_profiler_set_current_func(halide_profiler_state *state, int tok, int t) {
+WEAK __attribute__((always_inline)) int halide_profiler_set_current_func(halide_profiler_thread_state *slot, int tok, int t) {
     // Use empty volatile asm blocks to prevent code motion. Otherwise
     // llvm reorders or elides the stores.
-    volatile int *ptr = &(state->current_func);
+    volatile int *ptr = &(slot->current_func);
     asm volatile ("":::);
     *ptr = tok + t;
     asm volatile ("":::);
+    if (slot->counters) {
+        halide_profiler_switch_counters(slot, tok + t);
+    }
     return 0;
 }
 
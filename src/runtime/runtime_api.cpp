@@ -14,8 +14,10 @@
 // cat src/runtime/runtime_internal.h src/runtime/HalideRuntime*.h | grep "^[^ ][^(]*halide_[^ ]*(" | grep -v '#define' | sed "s/[^(]*halide/halide/" | sed "s/(.*//" | sed "s/^h/    \(void *)\&h/" | sed "s/$/,/" | sort | uniq
 
 extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
+    (void *)&halide_bind_thread_pool,
     (void *)&halide_copy_to_device,
     (void *)&halide_copy_to_host,
+    (void *)&halide_create_thread_pool,
     (void *)&halide_cuda_detach_device_ptr,
     (void *)&halide_cuda_device_interface,
     (void *)&halide_cuda_get_device_ptr,
@@ -24,6 +26,7 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_cuda_wrap_device_ptr,
     (void *)&halide_current_time_ns,
     (void *)&halide_debug_to_file,
+    (void *)&halide_destroy_thread_pool,
     (void *)&halide_device_free,
     (void *)&halide_device_free_as_destructor,
     (void *)&halide_device_malloc,
@@ -62,10 +65,14 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_int64_to_string,
     (void *)&halide_load_library,
     (void *)&halide_malloc,
+    (void *)&halide_malloc_pool_set_size,
     (void *)&halide_matlab_call_pipeline,
     (void *)&halide_memoization_cache_cleanup,
+    (void *)&halide_memoization_cache_get_stats,
     (void *)&halide_memoization_cache_lookup,
     (void *)&halide_memoization_cache_release,
+    (void *)&halide_memoization_cache_set_eviction_policy,
+    (void *)&halide_memoization_cache_set_file,
     (void *)&halide_memoization_cache_set_size,
     (void *)&halide_memoization_cache_store,
     (void *)&halide_metal_acquire_context,
@@ -104,23 +111,40 @@ extern "C" __attribute__((used)) void *halide_runtime_api_functions[] = {
     (void *)&halide_openglcompute_run,
     (void *)&halide_pointer_to_string,
     (void *)&halide_print,
+    (void *)&halide_profiler_acquire_slot,
+    (void *)&halide_profiler_enumerate_pipelines,
     (void *)&halide_profiler_get_state,
     (void *)&halide_profiler_get_pipeline_state,
     (void *)&halide_profiler_memory_allocate,
     (void *)&halide_profiler_memory_free,
+    (void *)&halide_profiler_par_for_begin,
+    (void *)&halide_profiler_par_for_end,
     (void *)&halide_profiler_pipeline_start,
+    (void *)&halide_profiler_release_slot,
     (void *)&halide_profiler_report,
     (void *)&halide_profiler_reset,
+    (void *)&halide_profiler_run_time_percentile,
     (void *)&halide_profiler_stack_peak_update,
+    (void *)&halide_profiler_switch_counters,
+    (void *)&halide_profiler_task_time_percentile,
+    (void *)&halide_profiler_write_stats,
     (void *)&halide_release_jit_module,
     (void *)&halide_renderscript_device_interface,
     (void *)&halide_renderscript_initialize_kernels,
     (void *)&halide_renderscript_run,
     (void *)&halide_runtime_internal_register_metadata,
     (void *)&halide_set_gpu_device,
+    (void *)&halide_set_huge_page_threshold,
     (void *)&halide_set_num_threads,
+    (void *)&halide_set_numa_policy,
+    (void *)&halide_set_task_chunk_size,
+    (void *)&halide_set_thread_affinity,
+    (void *)&halide_set_thread_pool_hot,
+    (void *)&halide_set_thread_spin_time,
+    (void *)&halide_set_timeline_file,
     (void *)&halide_set_trace_file,
     (void *)&halide_shutdown_thread_pool,
+    (void *)&halide_shutdown_timeline,
     (void *)&halide_shutdown_trace,
     (void *)&halide_sleep_ms,
     (void *)&halide_spawn_thread,
@@ -98,6 +98,58 @@ WEAK void *halide_load_library(const char *name);
 // If lib is NULL, this call should be equivalent to halide_get_symbol(name).
 WEAK void *halide_get_library_symbol(void *lib, const char *name);
 
+// Platform specific implementations of shared memory mapped files.
+// halide_map_file makes the file at least size bytes long, and
+// returns NULL if it can't be mapped, or if this platform doesn't
+// support it. The lock functions return zero on success.
+WEAK void *halide_map_file(void *user_context, const char *path, size_t size, int *fd);
+WEAK void halide_unmap_file(void *addr, size_t size, int fd);
+WEAK int halide_lock_file(int fd, bool exclusive);
+WEAK int halide_unlock_file(int fd);
+
+// Platform specific implementations of allocating memory directly
+// from the OS. halide_map_pages rounds size up to a whole number of
+// huge pages, aligns the memory to a huge page, and places it on numa
+// nodes as the halide_numa_policy_t says. It returns NULL if it can't
+// map memory, in which case the caller should use malloc.
+WEAK void *halide_map_pages(void *user_context, size_t *size, int numa_policy);
+WEAK void halide_unmap_pages(void *addr, size_t size);
+
+// Platform specific implementations of hardware performance counters
+// for the calling thread. halide_open_perf_counters opens a group of
+// the counters in halide_profiler_counter_t, sets which[i] to the
+// position of counter i in the values read, or -1 if the cpu doesn't
+// have it, sets fds[i] to the file descriptor of counter i, or -1, and
+// returns the group, or -1 if there are no
+// counters. halide_read_perf_counters returns zero on
+// success. halide_close_perf_counters closes all the counters of a
+// group.
+WEAK int halide_open_perf_counters(uint64_t vector_event, int *which, int *fds);
+WEAK int halide_read_perf_counters(int fd, uint64_t *values, int n);
+WEAK void halide_close_perf_counters(const int *fds);
+// Returns a non-zero id for the calling thread.
+WEAK int halide_current_thread_id();
+// Returns a handle of the calling thread from the threading library,
+// which no other running thread has. Unlike halide_current_thread_id,
+// it never changes while the thread runs.
+WEAK uintptr_t halide_current_thread();
+
+// Records of the execution of pipelines for halide_set_timeline_file.
+WEAK bool halide_timeline_enabled();
+WEAK void halide_timeline_record(const char *name, int event, int arg);
+WEAK int halide_timeline_do_task(void *user_context,
+                                 int (*do_task)(void *, int (*)(void *, int, uint8_t *), int, uint8_t *),
+                                 int (*f)(void *, int, uint8_t *), int idx, uint8_t *closure);
+
+// The total time the threads of the thread pool have spent waiting
+// for its locks, and waiting for the other threads working on a
+// parallel loop to finish it, in nanoseconds. They are only counted
+// while there have been more calls to
+// halide_thread_pool_collect_wait_times turning counting on than
+// turning it off. Thread pools that can't count these return zeros.
+WEAK void halide_thread_pool_collect_wait_times(bool collect);
+WEAK void halide_thread_pool_wait_times(uint64_t *lock_wait_ns, uint64_t *idle_ns);
+
 WEAK int halide_start_clock(void *user_context);
 WEAK int64_t halide_current_time_ns(void *user_context);
 WEAK void halide_sleep_ms(void *user_context, int ms);
@@ -111,15 +163,27 @@ WEAK void halide_profiler_stack_peak_update(void *user_context,
 WEAK void halide_profiler_memory_allocate(void *user_context,
                                           void *pipeline_state,
                                           int func_id,
+                                          int site,
                                           int incr);
 WEAK void halide_profiler_memory_free(void *user_context,
                                       void *pipeline_state,
                                       int func_id,
+                                      int site,
                                       int incr);
+// alloc_site_names holds the buffer name and loop name of each
+// allocation site, and alloc_site_info its func id and stack bytes.
 WEAK int halide_profiler_pipeline_start(void *user_context,
                                         const char *pipeline_name,
                                         int num_funcs,
-                                        const uint64_t *func_names);
+                                        const uint64_t *func_names,
+                                        int num_alloc_sites,
+                                        const uint64_t *alloc_site_names,
+                                        const int *alloc_site_info);
+WEAK void *halide_profiler_acquire_slot(void *state, void *parent_slot, void *pipeline_state);
+WEAK void halide_profiler_release_slot(void *slot);
+WEAK void halide_profiler_switch_counters(void *slot, int func);
+WEAK int halide_profiler_par_for_begin(void *pipeline_state, void *slot, const char *name);
+WEAK int halide_profiler_par_for_end(void *slot);
 
 struct halide_filter_metadata_t;
 struct _halide_runtime_internal_registered_filter_t {
@@ -0,0 +1,294 @@
+#include "HalideRuntime.h"
+#include "printer.h"
+#include "scoped_spin_lock.h"
+
+namespace Halide { namespace Runtime { namespace Internal {
+
+// An event on the timeline of one thread: a trace event code, or one
+// of the task events below.
+struct TimelineEvent {
+    uint64_t time;
+    const char *name;
+    int32_t event;
+    int32_t arg;
+};
+
+const int32_t timeline_begin_task = -1;
+const int32_t timeline_end_task = -2;
+
+// Each thread records its events in a buffer of its own, claimed by
+// its thread handle, so that the events of a thread stay in order and
+// threads never contend for a buffer. The buffers are written to the
+// timeline file when they fill up and at the end of each pipeline, and
+// a buffer with no spans left open is then given up, so that threads
+// that have exited don't keep theirs. In the timeline, the threads are
+// numbered by their buffers.
+const int kMaxTimelineThreads = 256;
+const int kTimelineBufferEvents = 4096;
+
+struct TimelineBuffer {
+    uintptr_t thread;
+    volatile int lock;
+    int used;
+    // The number of spans begun in the file and not yet ended.
+    int open;
+    TimelineEvent *events;
+} __attribute__((aligned(64)));
+
+WEAK TimelineBuffer timeline_buffers[kMaxTimelineThreads];
+
+// The events not recorded because more threads than there are buffers
+// were recording at once.
+WEAK int timeline_dropped_events = 0;
+
+WEAK int timeline_file = -1;
+WEAK bool timeline_file_internally_opened = false;
+WEAK bool timeline_initialized = false;
+WEAK volatile int timeline_file_lock = 0;
+// Whether an event has been written to the file yet, as each later
+// one needs a comma before it.
+WEAK bool timeline_any_written = false;
+// Timestamps are written relative to when the timeline was opened.
+WEAK uint64_t timeline_start = 0;
+
+WEAK void open_timeline_locked(int fd) {
+    timeline_file = fd;
+    timeline_any_written = false;
+    if (fd >= 0) {
+        halide_start_clock(NULL);
+        timeline_start = halide_current_time_ns(NULL);
+        write(fd, "[", 1);
+    }
+}
+
+#define O_CREAT 64
+#define O_TRUNC 512
+#define O_WRONLY 1
+WEAK int get_timeline_file() {
+    if (!__atomic_load_n(&timeline_initialized, __ATOMIC_ACQUIRE)) {
+        ScopedSpinLock lock(&timeline_file_lock);
+        if (!timeline_initialized) {
+            const char *file_name = getenv("HL_TIMELINE_FILE");
+            int fd = -1;
+            if (file_name) {
+                fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+                timeline_file_internally_opened = (fd >= 0);
+            }
+            open_timeline_locked(fd);
+            __atomic_store_n(&timeline_initialized, true, __ATOMIC_RELEASE);
+        }
+    }
+    return timeline_file;
+}
+
+WEAK TimelineBuffer *current_timeline_buffer(uintptr_t thread) {
+    uint32_t h = (uint32_t)(((uint64_t)thread * UINT64_C(0x9E3779B97F4A7C15)) >> 32);
+    for (int i = 0; i < kMaxTimelineThreads; i++) {
+        TimelineBuffer *b = &timeline_buffers[(h + i) % kMaxTimelineThreads];
+        uintptr_t owner = __atomic_load_n(&b->thread, __ATOMIC_ACQUIRE);
+        if (owner == thread) {
+            return b;
+        }
+        uintptr_t expected = 0;
+        if (owner == 0 &&
+            __atomic_compare_exchange_n(&b->thread, &expected, thread, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return b;
+        }
+        if (expected == thread) {
+            return b;
+        }
+    }
+    // More threads than buffers.
+    return NULL;
+}
+
+// Write the events of a buffer to the timeline file as trace event
+// objects. Produce, update and consume each begin a span that ends at
+// the next of them, or at the end of the consume. An end with no span
+// open is left out, so that the spans of each thread balance. The
+// caller must hold the buffer's lock.
+WEAK void flush_timeline_buffer(TimelineBuffer *b) {
+    if (b->used == 0) {
+        return;
+    }
+    ScopedSpinLock lock(&timeline_file_lock);
+    int fd = timeline_file;
+    if (fd < 0) {
+        b->used = 0;
+        return;
+    }
+
+    int tid = (int)(b - timeline_buffers) + 1;
+    char out[16 * 1024];
+    size_t out_used = 0;
+    char line_buf[512];
+    Printer<StringStreamPrinter, sizeof(line_buf)> sstr(NULL, line_buf);
+    for (int i = 0; i < b->used; i++) {
+        const TimelineEvent &e = b->events[i];
+        // Timestamps are in microseconds. Print them with a fixed
+        // point, as floating point would lose nanoseconds in long
+        // timelines.
+        uint64_t t = e.time > timeline_start ? e.time - timeline_start : 0;
+        char ts_buf[32];
+        Printer<StringStreamPrinter, sizeof(ts_buf)> ts(NULL, ts_buf);
+        uint64_t frac = t % 1000;
+        ts << t / 1000 << (frac < 10 ? ".00" : frac < 100 ? ".0" : ".") << frac;
+        const char *cat = NULL;
+        bool ends = false, begins = true;
+        switch (e.event) {
+        case halide_trace_begin_pipeline: cat = "pipeline"; break;
+        case halide_trace_end_pipeline: cat = "pipeline"; ends = true; begins = false; break;
+        case halide_trace_produce: cat = "produce"; break;
+        case halide_trace_update: cat = "update"; ends = true; break;
+        case halide_trace_consume: cat = "consume"; ends = true; break;
+        case halide_trace_end_consume: cat = "consume"; ends = true; begins = false; break;
+        case timeline_begin_task: cat = "task"; break;
+        case timeline_end_task: cat = "task"; ends = true; begins = false; break;
+        default: continue;
+        }
+
+        sstr.clear();
+        if (ends && b->open > 0) {
+            sstr << (timeline_any_written ? ",\n" : "\n")
+                 << "{\"ph\": \"E\", \"pid\": 0, \"tid\": " << tid
+                 << ", \"ts\": " << ts.str() << "}";
+            timeline_any_written = true;
+            b->open--;
+        }
+        if (begins) {
+            sstr << (timeline_any_written ? ",\n" : "\n")
+                 << "{\"ph\": \"B\", \"pid\": 0, \"tid\": " << tid
+                 << ", \"ts\": " << ts.str() << ", \"name\": ";
+            sstr.write_json_string(e.name);
+            sstr << ", \"cat\": \"" << cat << "\"";
+            if (e.event == timeline_begin_task) {
+                sstr << ", \"args\": {\"index\": " << e.arg << "}";
+            }
+            sstr << "}";
+            timeline_any_written = true;
+            b->open++;
+        }
+        if (out_used + sstr.size() > sizeof(out)) {
+            write(fd, out, out_used);
+            out_used = 0;
+        }
+        memcpy(out + out_used, sstr.str(), sstr.size());
+        out_used += sstr.size();
+    }
+    write(fd, out, out_used);
+    b->used = 0;
+}
+
+WEAK void flush_timeline_buffers() {
+    for (int i = 0; i < kMaxTimelineThreads; i++) {
+        TimelineBuffer *b = &timeline_buffers[i];
+        if (__atomic_load_n(&b->thread, __ATOMIC_ACQUIRE) == 0) continue;
+        ScopedSpinLock lock(&b->lock);
+        flush_timeline_buffer(b);
+        // Give the buffer up. If its thread records again, it claims a
+        // buffer again.
+        if (b->open == 0) {
+            __atomic_store_n(&b->thread, 0, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+}}} // namespace Halide::Runtime::Internal
+
+extern "C" {
+
+WEAK bool halide_timeline_enabled() {
+    return get_timeline_file() >= 0;
+}
+
+WEAK void halide_timeline_record(const char *name, int event, int arg) {
+    uint64_t t = halide_current_time_ns(NULL);
+    uintptr_t thread = halide_current_thread();
+    while (true) {
+        TimelineBuffer *b = current_timeline_buffer(thread);
+        if (b == NULL) {
+            __atomic_fetch_add(&timeline_dropped_events, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        ScopedSpinLock lock(&b->lock);
+        if (__atomic_load_n(&b->thread, __ATOMIC_ACQUIRE) != thread) {
+            // The buffer was given up before we locked it.
+            continue;
+        }
+        if (b->events == NULL) {
+            b->events = (TimelineEvent *)malloc(kTimelineBufferEvents * sizeof(TimelineEvent));
+            if (b->events == NULL) {
+                __atomic_fetch_add(&timeline_dropped_events, 1, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+        if (b->used == kTimelineBufferEvents) {
+            flush_timeline_buffer(b);
+        }
+        TimelineEvent *e = b->events + b->used++;
+        e->time = t;
+        e->name = name;
+        e->event = event;
+        e->arg = arg;
+        break;
+    }
+
+    // Make the whole timeline of a pipeline visible once it returns.
+    if (event == halide_trace_end_pipeline) {
+        flush_timeline_buffers();
+    }
+}
+
+WEAK int halide_timeline_do_task(void *user_context, halide_do_task_t do_task,
+                                 halide_task_t f, int idx, uint8_t *closure) {
+    halide_timeline_record("task", timeline_begin_task, idx);
+    int result = do_task(user_context, f, idx, closure);
+    halide_timeline_record("task", timeline_end_task, idx);
+    return result;
+}
+
+WEAK void halide_set_timeline_file(int fd) {
+    halide_shutdown_timeline();
+    // Spans still open belong to the old file.
+    for (int i = 0; i < kMaxTimelineThreads; i++) {
+        ScopedSpinLock lock(&timeline_buffers[i].lock);
+        timeline_buffers[i].open = 0;
+    }
+    ScopedSpinLock lock(&timeline_file_lock);
+    open_timeline_locked(fd);
+    __atomic_store_n(&timeline_initialized, true, __ATOMIC_RELEASE);
+}
+
+WEAK int halide_shutdown_timeline() {
+    flush_timeline_buffers();
+    ScopedSpinLock lock(&timeline_file_lock);
+    int ret = 0;
+    int dropped = __atomic_exchange_n(&timeline_dropped_events, 0, __ATOMIC_RELAXED);
+    if (dropped > 0 && timeline_file >= 0) {
+        print(NULL) << "Warning: the timeline is missing " << dropped
+                    << " events of threads beyond the first " << kMaxTimelineThreads
+                    << " to record at once\n";
+    }
+    if (timeline_file >= 0) {
+        write(timeline_file, "\n]\n", 3);
+        if (timeline_file_internally_opened) {
+            ret = close(timeline_file);
+        }
+    }
+    // Don't look at HL_TIMELINE_FILE again, which would overwrite the
+    // timeline just written.
+    timeline_file = -1;
+    timeline_file_internally_opened = false;
+    __atomic_store_n(&timeline_initialized, true, __ATOMIC_RELEASE);
+    return ret;
+}
+
+namespace {
+__attribute__((destructor))
+WEAK void halide_timeline_cleanup() {
+    halide_shutdown_timeline();
+}
+}
+
+}
@@ -15,15 +15,334 @@ WEAK int halide_trace_file_lock = 0;
 WEAK bool halide_trace_file_initialized = false;
 WEAK bool halide_trace_file_internally_opened = false;
 
+// The binary trace format is described in HalideRuntime.h.
+const uint32_t trace_magic = 0x43525448; // "HTRC"
+const uint32_t trace_format_version = 2;
+const uint8_t trace_func_name_record = 255;
+
+struct TraceRecordHeader {
+    uint32_t size;
+    int32_t id;
+    int32_t parent_id;
+    uint32_t func_id;
+    uint8_t event, type_code, bits, vector_width;
+    uint8_t value_index, dimensions;
+    uint16_t padding;
+};
+
+// Records are gathered in a number of buffers, and written to the
+// trace file when a buffer fills up. Each thread uses one of the
+// buffers, picked from the address of its stack, so that threads
+// rarely contend for the same one.
+const int kTraceBufferBits = 5;
+const int kNumTraceBuffers = 1 << kTraceBufferBits;
+const uint32_t kTraceBufferSize = 64 * 1024;
+
+// Each buffer remembers the ids of the last few funcs it saw, so
+// that most events don't need to look in the shared func table. Names
+// too long to keep in the cache are always looked up in the table.
+const int kFuncCacheSize = 16;
+const int kCachedNameSize = 48;
+
+// An entry of the shared func table, which owns a copy of the name.
+struct FuncId {
+    char *func;
+    int fd;
+    uint32_t hash;
+    uint32_t id;
+};
+
+struct CachedFuncId {
+    char func[kCachedNameSize];
+    int fd;
+    uint32_t id;
+};
+
+struct TraceBuffer {
+    volatile int lock;
+    int fd;
+    uint32_t used;
+    uint8_t *data;
+    CachedFuncId func_cache[kFuncCacheSize];
+} __attribute__((aligned(64)));
+
+WEAK TraceBuffer trace_buffers[kNumTraceBuffers];
+
+// Func names are written to each trace file once, and then referred
+// to by id. The table maps the names to their ids by contents, not by
+// address, as a pipeline that is compiled again may have a different
+// name where an old one was. Ids are never reused, so the table can be
+// emptied when it fills up.
+const int kFuncTableSize = 4096;
+WEAK FuncId func_table[kFuncTableSize];
+WEAK int func_table_entries = 0;
+WEAK uint32_t next_func_id = 1;
+WEAK volatile int func_table_lock = 0;
+
+// The trace file the stream header was last written to.
+WEAK int trace_header_fd = -1;
+
+WEAK uint32_t func_hash(const char *func, int fd) {
+    uint64_t h = UINT64_C(0xcbf29ce484222325);
+    for (const char *c = func; *c; c++) {
+        h = (h ^ (uint8_t)*c) * UINT64_C(0x100000001b3);
+    }
+    return (uint32_t)((h ^ (uint64_t)fd) * UINT64_C(0x9E3779B97F4A7C15) >> 32);
+}
+
+// The caller must hold the func table lock.
+WEAK void clear_func_table() {
+    for (int i = 0; i < kFuncTableSize; i++) {
+        free(func_table[i].func);
+    }
+    memset(func_table, 0, sizeof(func_table));
+    func_table_entries = 0;
+}
+
+// The caller must hold the trace file lock.
+WEAK void write_trace_data_locked(void *user_context, int fd, const void *data, size_t size) {
+    if (fd != trace_header_fd) {
+        // Start each run of records written to a file with the stream
+        // header, so that a reader can tell the format apart from the
+        // old one, even when traces are appended to the same file.
+        uint32_t header[2] = {trace_magic, trace_format_version};
+        ssize_t written = write(fd, header, sizeof(header));
+        halide_assert(user_context, written == (ssize_t)sizeof(header) && "Can't write to trace file");
+        trace_header_fd = fd;
+    }
+    ssize_t written = write(fd, data, size);
+    halide_assert(user_context, written == (ssize_t)size && "Can't write to trace file");
+}
+
+WEAK void write_trace_data(void *user_context, int fd, const void *data, size_t size) {
+    ScopedSpinLock lock(&halide_trace_file_lock);
+    write_trace_data_locked(user_context, fd, data, size);
+}
+
+// The caller must hold the buffer's lock.
+WEAK void flush_trace_buffer(void *user_context, TraceBuffer *b) {
+    if (b->used) {
+        write_trace_data(user_context, b->fd, b->data, b->used);
+        b->used = 0;
+    }
+}
+
+WEAK void flush_trace_buffers(void *user_context) {
+    for (int i = 0; i < kNumTraceBuffers; i++) {
+        ScopedSpinLock lock(&trace_buffers[i].lock);
+        flush_trace_buffer(user_context, &trace_buffers[i]);
+    }
+}
+
+// Flush all the buffers, and forget all func ids, as they're about to
+// refer to a different file.
+WEAK void reset_trace_buffers(void *user_context) {
+    for (int i = 0; i < kNumTraceBuffers; i++) {
+        TraceBuffer *b = &trace_buffers[i];
+        ScopedSpinLock lock(&b->lock);
+        flush_trace_buffer(user_context, b);
+        memset(b->func_cache, 0, sizeof(b->func_cache));
+        if (b->data) {
+            free(b->data);
+            b->data = NULL;
+        }
+    }
+    ScopedSpinLock lock(&func_table_lock);
+    clear_func_table();
+}
+
+WEAK TraceBuffer *current_trace_buffer() {
+    uint64_t h = ((uint64_t)(uintptr_t)__builtin_frame_address(0) >> 20) * UINT64_C(0x9E3779B97F4A7C15);
+    return &trace_buffers[h >> (64 - kTraceBufferBits)];
+}
+
+// Get the id of a func in the trace file fd, writing a record that
+// gives its name to the file if it doesn't have one yet. The caller
+// must hold the buffer's lock.
+WEAK uint32_t get_func_id(void *user_context, TraceBuffer *b, const char *func, int fd) {
+    uint32_t h = func_hash(func, fd);
+    CachedFuncId *cached = &b->func_cache[h % kFuncCacheSize];
+    if (cached->id && cached->fd == fd && strcmp(cached->func, func) == 0) {
+        return cached->id;
+    }
+
+    ScopedSpinLock lock(&func_table_lock);
+    uint32_t slot = h % kFuncTableSize;
+    while (func_table[slot].func &&
+           !(func_table[slot].hash == h && func_table[slot].fd == fd &&
+             strcmp(func_table[slot].func, func) == 0)) {
+        slot = (slot + 1) % kFuncTableSize;
+    }
+    size_t name_length = strlen(func);
+    if (!func_table[slot].func) {
+        if (func_table_entries >= kFuncTableSize / 2) {
+            clear_func_table();
+            slot = h % kFuncTableSize;
+        }
+        char *name = (char *)malloc(name_length + 1);
+        halide_assert(user_context, name != NULL && "Can't allocate func name");
+        memcpy(name, func, name_length + 1);
+
+        uint8_t record[1024];
+        TraceRecordHeader *header = (TraceRecordHeader *)record;
+        memset(header, 0, sizeof(TraceRecordHeader));
+        size_t name_bytes = name_length;
+        if (name_bytes > sizeof(record) - sizeof(TraceRecordHeader) - 1) {
+            name_bytes = sizeof(record) - sizeof(TraceRecordHeader) - 1;
+        }
+        size_t size = (sizeof(TraceRecordHeader) + name_bytes + 1 + 3) & ~3;
+        memcpy(record + sizeof(TraceRecordHeader), func, name_bytes);
+        memset(record + sizeof(TraceRecordHeader) + name_bytes, 0, size - sizeof(TraceRecordHeader) - name_bytes);
+        header->size = size;
+        header->func_id = next_func_id++;
+        header->event = trace_func_name_record;
+
+        // Write the name straight to the file, rather than to the
+        // buffer, so that it comes before any record that uses the id,
+        // whichever buffer that is in.
+        write_trace_data(user_context, fd, record, size);
+
+        func_table[slot].func = name;
+        func_table[slot].fd = fd;
+        func_table[slot].hash = h;
+        func_table[slot].id = header->func_id;
+        func_table_entries++;
+    }
+    if (name_length < kCachedNameSize) {
+        memcpy(cached->func, func, name_length + 1);
+        cached->fd = fd;
+        cached->id = func_table[slot].id;
+    }
+    return func_table[slot].id;
+}
+
+// Get the offset of a coordinate in one dimension of a buffer. Folded
+// storage wraps around, so coordinates are taken modulo the extent.
+WEAK int64_t region_offset(const buffer_t *buf, int d, int32_t coord) {
+    int64_t offset = (int64_t)coord - buf->min[d];
+    if (buf->extent[d] > 0) {
+        offset %= buf->extent[d];
+        if (offset < 0) {
+            offset += buf->extent[d];
+        }
+    }
+    return offset * buf->stride[d];
+}
+
+// Write a store region record: the header, the min and extent of each
+// dimension, and then the values of the region, packed with the first
+// dimension innermost. The record can be much larger than the trace
+// buffer, so the values are gathered a buffer full at a time and
+// written straight to the file. The caller must hold the buffer's
+// lock.
+WEAK void write_store_region(void *user_context, TraceBuffer *b, TraceRecordHeader *header,
+                             const halide_trace_event *e) {
+    buffer_t *buf = *(buffer_t **)e->value;
+    int dims = (e->dimensions - 2) / 2;
+    halide_assert(user_context, dims >= 0 && dims <= 4 && "Tracing a bad store region");
+    const int32_t *coords = e->coordinates;
+    if (buf->dev_dirty) {
+        halide_copy_to_host(user_context, buf);
+    }
+    if (buf->host == NULL) {
+        return;
+    }
+
+    size_t elem_size = buf->elem_size;
+    uint64_t num_values = 1;
+    for (int d = 0; d < dims; d++) {
+        num_values *= coords[2*d+1] > 0 ? coords[2*d+1] : 0;
+    }
+    size_t header_bytes = sizeof(TraceRecordHeader);
+    size_t int_arg_bytes = 2 * dims * sizeof(int32_t);
+    uint64_t value_bytes = num_values * elem_size;
+    uint64_t total_bytes = (header_bytes + int_arg_bytes + value_bytes + 3) & ~3;
+    halide_assert(user_context, total_bytes <= 0xffffffff && "Store region too large to trace");
+
+    header->size = (uint32_t)total_bytes;
+    header->type_code = coords[2*dims];
+    header->bits = coords[2*dims+1];
+    header->vector_width = 1;
+    header->dimensions = 2 * dims;
+
+    // Anything already in this thread's buffer comes first.
+    flush_trace_buffer(user_context, b);
+
+    ScopedSpinLock lock(&halide_trace_file_lock);
+    write_trace_data_locked(user_context, b->fd, header, header_bytes);
+    write_trace_data_locked(user_context, b->fd, coords, int_arg_bytes);
+
+    if (num_values > 0) {
+        // Walk over the rows of the region, gathering them into the
+        // trace buffer.
+        int32_t pos[4] = {0, 0, 0, 0};
+        int32_t row_length = dims > 0 ? coords[1] : 1;
+        for (;;) {
+            int64_t row_offset = 0;
+            for (int d = 1; d < dims; d++) {
+                row_offset += region_offset(buf, d, coords[2*d] + pos[d]);
+            }
+            const uint8_t *row = buf->host + row_offset * elem_size;
+            for (int32_t x = 0; x < row_length; ) {
+                if (b->used + elem_size > kTraceBufferSize) {
+                    write_trace_data_locked(user_context, b->fd, b->data, b->used);
+                    b->used = 0;
+                }
+                int64_t offset = dims > 0 ? region_offset(buf, 0, coords[0] + x) : 0;
+                // Copy as much of a dense run as fits at once.
+                int32_t n = 1;
+                if (dims > 0 && buf->stride[0] == 1) {
+                    int64_t run = buf->extent[0] - offset;
+                    int64_t space = (kTraceBufferSize - b->used) / elem_size;
+                    n = row_length - x;
+                    n = run < n ? (int32_t)run : n;
+                    n = space < n ? (int32_t)space : n;
+                }
+                memcpy(b->data + b->used, row + offset * elem_size, n * elem_size);
+                b->used += n * elem_size;
+                x += n;
+            }
+            int d = 1;
+            while (d < dims && ++pos[d] == coords[2*d+1]) {
+                pos[d++] = 0;
+            }
+            if (d >= dims) {
+                break;
+            }
+        }
+    }
+
+    size_t padding = total_bytes - header_bytes - int_arg_bytes - value_bytes;
+    if (b->used + padding > kTraceBufferSize) {
+        write_trace_data_locked(user_context, b->fd, b->data, b->used);
+        b->used = 0;
+    }
+    memset(b->data + b->used, 0, padding);
+    b->used += padding;
+    write_trace_data_locked(user_context, b->fd, b->data, b->used);
+    b->used = 0;
+}
+
 WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
     static int32_t ids = 1;
 
     int32_t my_id = __sync_fetch_and_add(&ids, 1);
 
+    // If a timeline is being recorded, the realization events go to
+    // it instead.
+    if (e->event >= halide_trace_begin_realization &&
+        e->event <= halide_trace_end_pipeline &&
+        halide_timeline_enabled()) {
+        if (e->event != halide_trace_begin_realization &&
+            e->event != halide_trace_end_realization) {
+            halide_timeline_record(e->func, e->event, 0);
+        }
+        return my_id;
+    }
+
     // If we're dumping to a file, use a binary format
     int fd = halide_get_trace_file(user_context);
     if (fd > 0) {
-        // A 48-byte header. The first 6 bytes are metadata, then the rest is a zero-terminated string.
         uint8_t clamped_width = e->vector_width < 256 ? e->vector_width : 255;
         uint8_t clamped_dimensions = e->dimensions < 256 ? e->dimensions : 255;
 
@@ -32,48 +351,74 @@ WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
         int bytes = 1;
         while (bytes*8 < e->bits) bytes <<= 1;
 
-        // Compute the size of each portion of the tracing packet
-        size_t header_bytes = 48;
+        // Compute the size of each portion of the record
+        size_t header_bytes = sizeof(TraceRecordHeader);
         size_t value_bytes = clamped_width * bytes;
         size_t int_arg_bytes = clamped_dimensions * sizeof(int32_t);
-        size_t total_bytes = header_bytes + value_bytes + int_arg_bytes;
-        uint8_t buffer[4096];
-        halide_assert(user_context, total_bytes <= 4096 && "Tracing packet too large");
-
-        ((int32_t *)buffer)[0] = my_id;
-        ((int32_t *)buffer)[1] = e->parent_id;
-        buffer[8] = e->event;
-        buffer[9] = e->type_code;
-        buffer[10] = e->bits;
-        buffer[11] = clamped_width;
-        buffer[12] = e->value_index;
-        buffer[13] = clamped_dimensions;
-
-        // Use up to 33 bytes for the function name
-        size_t i = 14;
-        for (; i < header_bytes-1; i++) {
-            buffer[i] = e->func[i-14];
-            if (buffer[i] == 0) break;
-        }
-        // Fill the rest with zeros
-        for (; i < header_bytes; i++) {
-            buffer[i] = 0;
-        }
+        size_t total_bytes = (header_bytes + value_bytes + int_arg_bytes + 3) & ~3;
 
-        // Next comes the value
-        for (size_t i = 0; i < value_bytes; i++) {
-            buffer[header_bytes + i] = ((uint8_t *)(e->value))[i];
-        }
+        TraceBuffer *b = current_trace_buffer();
+        {
+            ScopedSpinLock lock(&b->lock);
+            if (b->data == NULL) {
+                b->data = (uint8_t *)malloc(kTraceBufferSize);
+                halide_assert(user_context, b->data != NULL && "Can't allocate trace buffer");
+            }
+            if (b->fd != fd) {
+                flush_trace_buffer(user_context, b);
+                b->fd = fd;
+            }
+            uint32_t func_id = get_func_id(user_context, b, e->func, fd);
+            if (e->event == halide_trace_store_region) {
+                TraceRecordHeader header;
+                header.id = my_id;
+                header.parent_id = e->parent_id;
+                header.func_id = func_id;
+                header.event = e->event;
+                header.value_index = e->value_index;
+                header.padding = 0;
+                write_store_region(user_context, b, &header, e);
+                return my_id;
+            }
+            if (b->used + total_bytes > kTraceBufferSize) {
+                flush_trace_buffer(user_context, b);
+            }
 
-        // Then the int args
-        for (size_t i = 0; i < int_arg_bytes; i++) {
-            buffer[header_bytes + value_bytes + i] = ((uint8_t *)(e->coordinates))[i];
+            uint8_t *record = b->data + b->used;
+            TraceRecordHeader *header = (TraceRecordHeader *)record;
+            header->size = total_bytes;
+            header->id = my_id;
+            header->parent_id = e->parent_id;
+            header->func_id = func_id;
+            header->event = e->event;
+            header->type_code = e->type_code;
+            header->bits = e->bits;
+            header->vector_width = clamped_width;
+            header->value_index = e->value_index;
+            header->dimensions = clamped_dimensions;
+            header->padding = 0;
+
+            // Next comes the value, then the int args.
+            memcpy(record + header_bytes, e->value, value_bytes);
+            memcpy(record + header_bytes + value_bytes, e->coordinates, int_arg_bytes);
+            memset(record + header_bytes + value_bytes + int_arg_bytes, 0,
+                   total_bytes - header_bytes - value_bytes - int_arg_bytes);
+            b->used += total_bytes;
+
+            // Events that other events name as their parent are
+            // written out straight away, so that parents always come
+            // before their children in the file.
+            if (e->event == halide_trace_begin_pipeline ||
+                e->event == halide_trace_begin_realization ||
+                e->event == halide_trace_produce ||
+                e->event == halide_trace_consume) {
+                flush_trace_buffer(user_context, b);
+            }
         }
 
-        {
-            ScopedSpinLock lock(&halide_trace_file_lock);
-            size_t written = write(fd, &buffer[0], total_bytes);
-            halide_assert(user_context, written == total_bytes && "Can't write to trace file");
+        // Make the whole trace of a pipeline visible once it returns.
+        if (e->event == halide_trace_end_pipeline) {
+            flush_trace_buffers(user_context);
         }
 
     } else {
@@ -94,7 +439,8 @@ WEAK int32_t default_trace(void *user_context, const halide_trace_event *e) {
                                      "Consume",
                                      "End consume",
                                      "Begin pipeline",
-                                     "End pipeline"};
+                                     "End pipeline",
+                                     "Store region"};
 
         // Only print out the value on stores and loads.
         bool print_value = (e->event < 2);
@@ -190,8 +536,11 @@ WEAK trace_fn halide_set_custom_trace(trace_fn t) {
 }
 
 WEAK void halide_set_trace_file(int fd) {
+    reset_trace_buffers(NULL);
+    ScopedSpinLock lock(&halide_trace_file_lock);
     halide_trace_file = fd;
-    halide_trace_file_initialized = true;
+    trace_header_fd = -1;
+    __atomic_store_n(&halide_trace_file_initialized, true, __ATOMIC_RELEASE);
 }
 
 extern int errno;
@@ -200,18 +549,22 @@ extern int errno;
 #define O_CREAT 64
 #define O_WRONLY 1
 WEAK int halide_get_trace_file(void *user_context) {
-    // Prevent multiple threads both trying to initialize the trace
-    // file at the same time.
-    ScopedSpinLock lock(&halide_trace_file_lock);
-    if (!halide_trace_file_initialized) {
-        const char *trace_file_name = getenv("HL_TRACE_FILE");
-        if (trace_file_name) {
-            int fd = open(trace_file_name, O_APPEND | O_CREAT | O_WRONLY, 0644);
-            halide_assert(user_context, (fd > 0) && "Failed to open trace file\n");
-            halide_set_trace_file(fd);
-            halide_trace_file_internally_opened = true;
-        } else {
-            halide_set_trace_file(0);
+    if (!__atomic_load_n(&halide_trace_file_initialized, __ATOMIC_ACQUIRE)) {
+        // Prevent multiple threads both trying to initialize the trace
+        // file at the same time.
+        ScopedSpinLock lock(&halide_trace_file_lock);
+        if (!halide_trace_file_initialized) {
+            const char *trace_file_name = getenv("HL_TRACE_FILE");
+            if (trace_file_name) {
+                int fd = open(trace_file_name, O_APPEND | O_CREAT | O_WRONLY, 0644);
+                halide_assert(user_context, (fd > 0) && "Failed to open trace file\n");
+                halide_trace_file = fd;
+                halide_trace_file_internally_opened = true;
+            } else {
+                halide_trace_file = 0;
+            }
+            trace_header_fd = -1;
+            __atomic_store_n(&halide_trace_file_initialized, true, __ATOMIC_RELEASE);
         }
     }
     return halide_trace_file;
@@ -222,6 +575,8 @@ WEAK int32_t halide_trace(void *user_context, const halide_trace_event *e) {
 }
 
 WEAK int halide_shutdown_trace() {
+    reset_trace_buffers(NULL);
+    trace_header_fd = -1;
     if (halide_trace_file_internally_opened) {
         int ret = close(halide_trace_file);
         halide_trace_file = 0;
@@ -32,6 +32,7 @@ extern WIN32API void DeleteCriticalSection(CriticalSection *);
 extern WIN32API void EnterCriticalSection(CriticalSection *);
 extern WIN32API void LeaveCriticalSection(CriticalSection *);
 extern WIN32API int32_t WaitForSingleObject(Thread, int32_t timeout);
+extern WIN32API int32_t GetCurrentThreadId();
 extern WIN32API bool InitOnceExecuteOnce(InitOnce *, bool WIN32API (*f)(InitOnce *, void *, void **), void *, void **);
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
@@ -318,6 +319,10 @@ WEAK void halide_spawn_thread(void *user_context, void(*f)(void *), void *closur
         CreateThread(NULL, 0, spawn_thread_helper, t, 0, NULL);
 }
 
+WEAK uintptr_t halide_current_thread() {
+    return (uintptr_t)(uint32_t)GetCurrentThreadId();
+}
+
 WEAK void halide_mutex_cleanup(halide_mutex *mutex_arg) {
     windows_mutex *mutex = (windows_mutex *)mutex_arg;
     if (mutex->once != 0) {
@@ -384,6 +389,37 @@ WEAK void halide_set_num_threads(int n) {
     num_threads = n;
 }
 
+WEAK void halide_set_thread_spin_time(int) {
+}
+
+WEAK void halide_set_thread_pool_hot(int) {
+}
+
+WEAK void halide_thread_pool_collect_wait_times(bool) {
+}
+
+WEAK void halide_thread_pool_wait_times(uint64_t *lock_wait_ns, uint64_t *idle_ns) {
+    *lock_wait_ns = 0;
+    *idle_ns = 0;
+}
+
+WEAK void halide_set_task_chunk_size(int) {
+}
+
+WEAK void halide_set_thread_affinity(const int *cpus, int num_cpus) {
+}
+
+WEAK halide_thread_pool *halide_create_thread_pool(void *user_context, int threads,
+                                                   const uint64_t *cpu_mask, int cpu_mask_words) {
+    return NULL;
+}
+
+WEAK void halide_destroy_thread_pool(halide_thread_pool *pool) {
+}
+
+WEAK void halide_bind_thread_pool(void *user_context, halide_thread_pool *pool) {
+}
+
 WEAK halide_do_task_t halide_set_custom_do_task(halide_do_task_t f) {
     halide_do_task_t result = custom_do_task;
     custom_do_task = f;
@@ -398,6 +434,9 @@ WEAK halide_do_par_for_t halide_set_custom_do_par_for(halide_do_par_for_t f) {
 
 WEAK int halide_do_task(void *user_context, halide_task_t f, int idx,
                         uint8_t *closure) {
+    if (halide_timeline_enabled()) {
+        return halide_timeline_do_task(user_context, custom_do_task, f, idx, closure);
+    }
     return (*custom_do_task)(user_context, f, idx, closure);
 }
 
@@ -1,5 +1,6 @@
 #include "Halide.h"
 #include <stdio.h>
+#include <string.h>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
@@ -42,6 +43,25 @@ void testCompileToOutputAndAssembly(Func j) {
     #endif
 }
 
+void testCompileToStaticLibrary(Func j) {
+    const char *fn_library = "compile_to_library.a";
+
+    #ifndef _MSC_VER
+    if (access(fn_library, F_OK) == 0) { unlink(fn_library); }
+    assert(access(fn_library, F_OK) != 0 && "Library file already exists.");
+    #endif
+
+    std::vector<Argument> empty_args;
+    j.compile_to(Outputs().static_library(fn_library), empty_args, "");
+
+    FILE *f = fopen(fn_library, "rb");
+    assert(f && "Library file not created.");
+    char magic[8];
+    size_t read = fread(magic, 1, 8, f);
+    fclose(f);
+    assert(read == 8 && memcmp(magic, "!<arch>\n", 8) == 0 && "Library file is not an archive.");
+}
+
 int main(int argc, char **argv) {
     Func f, g, h, j;
     Var x, y;
@@ -58,6 +78,13 @@ int main(int argc, char **argv) {
 
     testCompileToOutputAndAssembly(j);
 
+    // Give the library several parallel closures to spread over the
+    // code generation threads.
+    g.parallel(y);
+    h.parallel(y);
+    j.parallel(y);
+    testCompileToStaticLibrary(j);
+
     printf("Success!\n");
     return 0;
 }
@@ -0,0 +1,164 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace Halide;
+
+#ifdef __linux__
+// Whether the kernel can back the buffer with huge pages at all.
+bool huge_pages_available() {
+    char line[256] = {0};
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (f) {
+        bool ok = fgets(line, sizeof(line), f) && !strstr(line, "[never]");
+        fclose(f);
+        if (ok) {
+            return true;
+        }
+    }
+    f = fopen("/proc/meminfo", "r");
+    long reserved = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "HugePages_Total: %ld", &reserved);
+    }
+    if (f) {
+        fclose(f);
+    }
+    return reserved > 0;
+}
+
+// Find the mapping that holds addr in /proc/self/smaps, and return
+// whether any of it is in huge pages, either reserved ones or
+// transparent ones.
+bool mapped_in_huge_pages(const void *addr) {
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return false;
+    }
+    char line[512];
+    bool in_mapping = false, huge = false;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long start, end;
+        long kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            if (in_mapping) {
+                break;
+            }
+            in_mapping = (uintptr_t)addr >= start && (uintptr_t)addr < end;
+        } else if (in_mapping) {
+            if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 && kb > 0) {
+                huge = true;
+            } else if (sscanf(line, "KernelPageSize: %ld kB", &kb) == 1 && kb >= 2048) {
+                huge = true;
+            }
+        }
+    }
+    fclose(f);
+    return huge;
+}
+
+// The numa policy of the memory at addr, or -1 if it can't be read.
+int numa_policy_of(const void *addr) {
+    const int MPOL_F_ADDR = 2;
+    int mode = -1;
+    if (syscall(SYS_get_mempolicy, &mode, nullptr, 0, addr, MPOL_F_ADDR) != 0) {
+        return -1;
+    }
+    return mode;
+}
+
+// The runtime only calls mbind if it can find it.
+bool mbind_available() {
+    return dlsym(RTLD_DEFAULT, "mbind") != nullptr ||
+        dlopen("libnuma.so.1", RTLD_LAZY) != nullptr ||
+        dlopen("libnuma.so", RTLD_LAZY) != nullptr;
+}
+
+int pages_checked = 0;
+#endif
+
+// Run as an extern stage on the big buffer while it's still
+// allocated, and check how its memory was mapped.
+extern "C" int check_pages(buffer_t *in, buffer_t *out) {
+    if (in->host == nullptr) {
+        for (int i = 0; i < 2; i++) {
+            in->min[i] = 0;
+            in->extent[i] = 1024;
+        }
+        return 0;
+    }
+    int errors = 0;
+#ifdef __linux__
+    if (!huge_pages_available()) {
+        printf("Huge pages are turned off, not checking them\n");
+    } else if (!mapped_in_huge_pages(in->host)) {
+        printf("The big buffer isn't in huge pages\n");
+        errors++;
+    }
+    const int MPOL_INTERLEAVE = 3;
+    if (!mbind_available()) {
+        printf("No libnuma, not checking the numa policy\n");
+    } else if (numa_policy_of(in->host) != MPOL_INTERLEAVE) {
+        printf("The big buffer has numa policy %d instead of interleave\n",
+               numa_policy_of(in->host));
+        errors++;
+    }
+    pages_checked++;
+#endif
+    *(int *)out->host = errors;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+#ifdef _MSC_VER
+    printf("Skipping test on windows\n");
+#else
+    // The runtime reads these on its first allocation, so they must
+    // be set before anything is realized.
+    setenv("HL_HUGE_PAGE_THRESHOLD", "65536", 1);
+    setenv("HL_NUMA_POLICY", "interleave", 1);
+
+    // A large intermediate goes in huge pages, and a small one
+    // doesn't.
+    Func big("big"), small("small"), out("out");
+    Var x("x"), y("y");
+    big(x, y) = x + y;
+    small(x, y) = x - y;
+    out(x, y) = big(x, y) * 2 + small(x % 8, y % 8);
+    big.compute_root();
+    small.compute_root();
+    out.parallel(y);
+
+    Image<int> im = out.realize(1024, 1024);
+    for (int y = 0; y < im.height(); y++) {
+        for (int x = 0; x < im.width(); x++) {
+            int correct = (x + y) * 2 + (x % 8) - (y % 8);
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+#ifdef __linux__
+    // Look at how the big buffer was mapped, from inside a pipeline
+    // that still has it allocated.
+    Func pages("pages");
+    pages.define_extern("check_pages", {big}, Int(32), 1);
+    Image<int> errors = pages.realize(1);
+    if (pages_checked != 1 || errors(0) != 0) {
+        return -1;
+    }
+#endif
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
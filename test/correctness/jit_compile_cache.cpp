@@ -0,0 +1,138 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#ifndef _MSC_VER
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace Halide;
+
+#ifndef _MSC_VER
+const char *cache_dir = "jit_compile_cache_dir";
+
+// Count (and optionally delete) the jit object files in the
+// cache. Also returns the name and inode of the last one found.
+int cached_objects(bool remove, std::string *last = nullptr, ino_t *inode = nullptr) {
+    int count = 0;
+    DIR *dir = opendir(cache_dir);
+    if (!dir) return 0;
+    while (struct dirent *e = readdir(dir)) {
+        std::string name = e->d_name;
+        if (name == "." || name == "..") continue;
+        if (name.size() > 6 && name.substr(name.size() - 6) == ".jit.o") {
+            count++;
+            struct stat st;
+            if (last) *last = name;
+            if (inode && stat((std::string(cache_dir) + "/" + name).c_str(), &st) == 0) {
+                *inode = st.st_ino;
+            }
+        }
+        if (remove) {
+            unlink((std::string(cache_dir) + "/" + name).c_str());
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+// Each call makes a fresh but identical pipeline, as a new process
+// would.
+Image<int> run(int offset) {
+    Func f("f"), g("g");
+    Var x("x"), y("y");
+    Param<int> p("p");
+    f(x, y) = x * y + p;
+    g(x, y) = f(x, y) + f(x + 1, y);
+    f.compute_root().vectorize(x, 4);
+    g.parallel(y);
+    p.set(offset);
+    return g.realize(32, 32);
+}
+
+// A pipeline with a float constant baked into its code.
+Image<float> run_scaled(float scale) {
+    Func h("h");
+    Var x("x");
+    h(x) = cast<float>(x) * scale;
+    return h.realize(16);
+}
+
+bool check_scaled(Image<float> im, float scale) {
+    for (int x = 0; x < im.width(); x++) {
+        float correct = (float)x * scale;
+        if (im(x) != correct) {
+            printf("im(%d) = %.9g instead of %.9g\n", x, im(x), correct);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check(Image<int> im, int offset) {
+    for (int y = 0; y < im.height(); y++) {
+        for (int x = 0; x < im.width(); x++) {
+            int correct = x * y + (x + 1) * y + 2 * offset;
+            if (im(x, y) != correct) {
+                printf("im(%d, %d) = %d instead of %d\n", x, y, im(x, y), correct);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifdef _MSC_VER
+    printf("Skipping test on windows\n");
+#else
+    mkdir(cache_dir, 0755);
+    cached_objects(true);
+    setenv("HL_COMPILE_CACHE_DIR", cache_dir, 1);
+
+    // The first compilation fills the cache.
+    if (!check(run(3), 3)) return -1;
+    std::string first_name;
+    ino_t first_inode = 0;
+    if (cached_objects(false, &first_name, &first_inode) != 1) {
+        printf("Expected one cached object after the first compilation\n");
+        return -1;
+    }
+
+    // The second is lowered from fresh Funcs, so all the names made
+    // by unique_name are different, but it must still be served from
+    // the cache. Entries are always written to a new file and renamed
+    // into place, so an unchanged inode means the object was fetched
+    // rather than compiled and stored again.
+    if (!check(run(5), 5)) return -1;
+    std::string second_name;
+    ino_t second_inode = 0;
+    if (cached_objects(false, &second_name, &second_inode) != 1 ||
+        second_name != first_name) {
+        printf("Expected the second compilation to have the same key as the first\n");
+        return -1;
+    }
+    if (second_inode != first_inode) {
+        printf("Expected the second compilation to fetch the cached object\n");
+        return -1;
+    }
+
+    // Pipelines that differ only in the seventh digit of a constant
+    // must not share object code.
+    if (!check_scaled(run_scaled(0.1234567f), 0.1234567f)) return -1;
+    if (!check_scaled(run_scaled(0.1234568f), 0.1234568f)) return -1;
+    if (cached_objects(false) != 3) {
+        printf("Expected pipelines with different constants to be cached separately\n");
+        return -1;
+    }
+
+    cached_objects(true);
+    rmdir(cache_dir);
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
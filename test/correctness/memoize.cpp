@@ -566,6 +566,29 @@ int main(int argc, char **argv) {
 
     }
 
+    {
+        // Functions with the same names share results only if they
+        // are defined the same way, even when built from fresh Funcs.
+        call_count = 0;
+        auto run = [](int offset) {
+            Func count_calls("count_calls");
+            count_calls.define_extern("count_calls", {}, UInt(8), 2);
+
+            Func f("memoized"), g("out");
+            f() = count_calls(0, 0) + cast<uint8_t>(offset);
+            f.compute_root().memoize();
+            g() = f();
+            Image<uint8_t> result = g.realize();
+            return (int)result(0);
+        };
+
+        assert(run(1) == 43);
+        assert(run(2) == 44);
+        assert(call_count == 2);
+        assert(run(1) == 43);
+        assert(call_count == 2);
+    }
+
     {
         // Test out of memory handling.
         Param<float> val;
@@ -1,11 +1,48 @@
 #include "Halide.h"
+#include <fstream>
+#include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
 #ifndef _MSC_VER
 #include <unistd.h>
 #endif
 
 using namespace Halide;
 
+// The text of each span of costs in an html file, which are printed
+// next to the Funcs, loops and allocations they describe.
+std::vector<std::string> cost_spans(const char *file_name) {
+    std::ifstream f(file_name);
+    std::stringstream text;
+    text << f.rdbuf();
+    std::string html = text.str();
+    std::vector<std::string> spans;
+    size_t pos = 0;
+    while ((pos = html.find("<span class='Cost", pos)) != std::string::npos) {
+        size_t start = html.find('>', pos) + 1;
+        size_t end = html.find("</span>", start);
+        spans.push_back(html.substr(start, end - start));
+        pos = end;
+    }
+    return spans;
+}
+
+// Whether one of the spans contains all of the given strings.
+bool has_cost_span(const std::vector<std::string> &spans, const std::vector<std::string> &parts) {
+    for (const std::string &s : spans) {
+        bool all = true;
+        for (const std::string &p : parts) {
+            all = all && s.find(p) != std::string::npos;
+        }
+        if (all) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int main() {
     Var x, y;
 
@@ -52,6 +89,61 @@ int main() {
     assert(access(result_file_2, F_OK) == 0 && "Output file not created.");
     #endif
 
+    // Overlay the stats of a profiled run, as written by
+    // HL_PROFILER_JSON, on an auto-scheduled pipeline, and on one
+    // with a parallel loop and an allocation of known names.
+    const char *profile_file = "stmt_to_html_profile.json";
+    {
+        std::ofstream f(profile_file);
+        f << "{\"pipelines\": [\n"
+          << " {\"name\": \"consumer\", \"runs\": 2, \"time_ns\": 4000000, \"run_time_ns\": {\"p50\": 2000000},\n"
+          << "  \"funcs\": [{\"name\": \"producer\", \"time_ns\": 1000000},\n"
+          << "            {\"name\": \"consumer\", \"time_ns\": 3000000}],\n"
+          << "  \"allocations\": [], \"parallel_loops\": []},\n"
+          << " {\"name\": \"rows\", \"runs\": 2, \"time_ns\": 1000000,\n"
+          << "  \"funcs\": [{\"name\": \"rows\", \"time_ns\": 1000000}],\n"
+          << "  \"allocations\": [{\"name\": \"table\", \"func\": \"table\", \"loop\": \"root\",\n"
+          << "                   \"stack_bytes\": 0, \"memory_peak\": 4096, \"memory_total\": 8192, \"num_allocs\": 2}],\n"
+          << "  \"parallel_loops\": [{\"name\": \"rows.s0.y\", \"runs\": 2, \"tasks\": 32, \"task_time_ns\": 500000,\n"
+          << "                      \"task_time_p50_ns\": 15000, \"task_time_p99_ns\": 30000,\n"
+          << "                      \"lock_wait_ns\": 2000, \"idle_ns\": 40000}]}\n"
+          << "]}\n";
+    }
+    #ifdef _MSC_VER
+    _putenv_s("HL_STMT_HTML_PROFILE", profile_file);
+    #else
+    setenv("HL_STMT_HTML_PROFILE", profile_file, 1);
+    #endif
+
+    Func producer("producer"), consumer("consumer");
+    producer(x, y) = sqrt(cast<float>(x * y));
+    consumer(x, y) = producer(x, y) + producer(x + 1, y) + producer(x, y + 1);
+    consumer.estimate(x, 0, 1024).estimate(y, 0, 1024);
+    const char *result_file_4 = "stmt_to_html_dump_4.html";
+    consumer.compile_to_lowered_stmt(result_file_4, {}, Halide::HTML,
+                                     get_target_from_environment(), true);
+    std::vector<std::string> spans = cost_spans(result_file_4);
+    if (!has_cost_span(spans, {"est: ", "measured: 1.500ms/run"})) {
+        printf("The consumer has no estimated and measured costs in %s\n", result_file_4);
+        return -1;
+    }
+
+    Func table("table"), rows("rows");
+    table(x) = x * x;
+    rows(x, y) = table(x) + y;
+    table.compute_root();
+    rows.parallel(y);
+    const char *result_file_5 = "stmt_to_html_dump_5.html";
+    rows.compile_to_lowered_stmt(result_file_5, {}, Halide::HTML);
+    spans = cost_spans(result_file_5);
+    if (!has_cost_span(spans, {"measured: 16 tasks/run", "idle: 0.020ms/run"}) ||
+        !has_cost_span(spans, {"measured: heap peak 4096 allocs: 2"}) ||
+        !has_cost_span(spans, {"measured: 0.500ms/run"})) {
+        printf("The loop, allocation or Func of rows has no measured costs in %s\n", result_file_5);
+        return -1;
+    }
+    remove(profile_file);
+
     printf("Success!\n");
     return 0;
 }
@@ -0,0 +1,133 @@
+#include "Halide.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace Halide;
+
+// Parse a binary trace file (the format is described in
+// HalideRuntime.h), and check that func names are defined before
+// they are used, and that parents come before their children.
+// Returns the number of stores to each func.
+bool parse_trace(const char *filename, std::map<std::string, int> &stores) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        printf("Could not open %s\n", filename);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(f);
+
+    std::map<uint32_t, std::string> names;
+    std::set<int32_t> ids;
+    ids.insert(0);
+    size_t pos = 0;
+    bool seen_header = false;
+    while (pos + 8 <= data.size()) {
+        uint32_t size = *(uint32_t *)(&data[pos]);
+        if (size == 0x43525448) {
+            if (*(uint32_t *)(&data[pos + 4]) != 2) {
+                printf("Unexpected trace format version\n");
+                return false;
+            }
+            seen_header = true;
+            pos += 8;
+            continue;
+        }
+        if (!seen_header || size < 24 || size % 4 || pos + size > data.size()) {
+            printf("Bad record at offset %d\n", (int)pos);
+            return false;
+        }
+        int32_t id = *(int32_t *)(&data[pos + 4]);
+        int32_t parent = *(int32_t *)(&data[pos + 8]);
+        uint32_t func_id = *(uint32_t *)(&data[pos + 12]);
+        uint8_t event = data[pos + 16];
+        if (event == 255) {
+            names[func_id] = (const char *)(&data[pos + 24]);
+        } else {
+            if (!names.count(func_id)) {
+                printf("Func id %u used before it was named\n", func_id);
+                return false;
+            }
+            if (!ids.count(parent)) {
+                printf("Event %d came before its parent %d\n", id, parent);
+                return false;
+            }
+            ids.insert(id);
+            if (event == halide_trace_store) {
+                uint8_t width = data[pos + 19];
+                stores[names[func_id]] += width;
+            }
+        }
+        pos += size;
+    }
+    if (pos != data.size()) {
+        printf("Trailing bytes at the end of the trace\n");
+        return false;
+    }
+    return true;
+}
+
+// Trace the stores of a pipeline of two funcs with the given names.
+// Each call compiles a new pipeline, and frees it when it returns, so
+// the names of one may end up where those of an earlier one were.
+void realize_traced(const std::string &producer, const std::string &consumer) {
+    Func f(consumer), g(producer);
+    Var x("x"), y("y");
+    g(x, y) = x + y;
+    f(x, y) = g(x, y) + g(x + 1, y);
+    g.compute_root().parallel(y).vectorize(x, 4);
+    f.parallel(y);
+    g.trace_stores().trace_realizations();
+    f.trace_stores().trace_realizations();
+
+    f.realize(64, 64);
+}
+
+int main(int argc, char **argv) {
+#ifdef _MSC_VER
+    printf("Skipping test on windows\n");
+#else
+    const char *filename = "tracing_binary.trace";
+    remove(filename);
+    // The runtime reads this the first time it traces an event, so it
+    // must be set before anything is realized.
+    setenv("HL_TRACE_FILE", filename, 1);
+
+    // Func ids are given out by name, so each pipeline's stores must
+    // be counted against its own funcs.
+    const char *names[] = {"g", "f", "g_again", "f_again", "producer", "consumer"};
+    for (int i = 0; i < 6; i += 2) {
+        realize_traced(names[i], names[i + 1]);
+    }
+
+    std::map<std::string, int> stores;
+    if (!parse_trace(filename, stores)) {
+        return -1;
+    }
+    if (stores.size() != 6) {
+        printf("Expected stores to 6 funcs, got %d\n", (int)stores.size());
+        return -1;
+    }
+    for (int i = 0; i < 6; i += 2) {
+        if (stores[names[i]] != 68 * 64 || stores[names[i + 1]] != 64 * 64) {
+            printf("Expected %d stores to %s and %d to %s, got %d and %d\n",
+                   68 * 64, names[i], 64 * 64, names[i + 1],
+                   stores[names[i]], stores[names[i + 1]]);
+            return -1;
+        }
+    }
+    remove(filename);
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
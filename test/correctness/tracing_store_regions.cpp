@@ -0,0 +1,118 @@
+#include "Halide.h"
+#include <stdio.h>
+
+using namespace Halide;
+
+const int W = 37, H = 20;
+
+int store_events = 0, region_events = 0, errors = 0;
+// How many times each scanline of g has been reported.
+int g_rows[H + 1];
+
+// Get the value at some coordinates of a buffer. Folded storage
+// wraps around.
+template<typename T>
+T get_value(const buffer_t *buf, int x, int y) {
+    int ox = (x - buf->min[0]) % buf->extent[0];
+    int oy = (y - buf->min[1]) % buf->extent[1];
+    if (ox < 0) ox += buf->extent[0];
+    if (oy < 0) oy += buf->extent[1];
+    return ((const T *)buf->host)[ox * buf->stride[0] + oy * buf->stride[1]];
+}
+
+int my_trace(void *user_context, const halide_trace_event *e) {
+    if (e->event == halide_trace_store) {
+        store_events++;
+    } else if (e->event == halide_trace_store_region) {
+        region_events++;
+        const buffer_t *buf = *(const buffer_t * const *)e->value;
+        if (e->dimensions != 6) {
+            printf("Expected two dimensions and a type\n");
+            errors++;
+            return 0;
+        }
+        const int *c = e->coordinates;
+        bool is_float = (e->func[0] == 'g' && e->value_index == 1);
+        if (c[4] != (is_float ? 2 : 0) || c[5] != 32) {
+            printf("Wrong type for %s.%d: %d %d\n", e->func, e->value_index, c[4], c[5]);
+            errors++;
+        }
+        for (int y = c[2]; y < c[2] + c[3]; y++) {
+            if (e->func[0] == 'g' && e->value_index == 0 && y >= 0 && y <= H) {
+                g_rows[y]++;
+            }
+            for (int x = c[0]; x < c[0] + c[1]; x++) {
+                if (e->func[0] == 'f') {
+                    int correct = x + y * 100 + x / 2;
+                    int val = get_value<int>(buf, x, y);
+                    if (val != correct) {
+                        printf("f(%d, %d) = %d instead of %d\n", x, y, val, correct);
+                        errors++;
+                    }
+                } else if (e->value_index == 0) {
+                    int correct = x + y * 100;
+                    int val = get_value<int>(buf, x, y);
+                    if (val != correct) {
+                        printf("g(%d, %d)[0] = %d instead of %d\n", x, y, val, correct);
+                        errors++;
+                    }
+                } else {
+                    float correct = x * 0.5f;
+                    float val = get_value<float>(buf, x, y);
+                    if (val != correct) {
+                        printf("g(%d, %d)[1] = %f instead of %f\n", x, y, val, correct);
+                        errors++;
+                    }
+                }
+                if (errors > 10) {
+                    return 0;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Func f("f"), g("g");
+    Var x("x"), y("y");
+
+    g(x, y) = Tuple(x + y * 100, cast<float>(x) * 0.5f);
+    f(x, y) = g(x, y)[0] + cast<int>(g(x, y + 1)[1]);
+
+    // g is produced a scanline at a time, into storage that gets
+    // folded, and f is produced in one go.
+    g.store_root().compute_at(f, y).vectorize(x, 4);
+    g.trace_store_regions();
+    f.vectorize(x, 4);
+    f.trace_store_regions();
+
+    f.set_custom_trace(&my_trace);
+    Image<int> out = f.realize(W, H);
+
+    if (errors) {
+        return -1;
+    }
+
+    if (store_events) {
+        printf("There were %d store events\n", store_events);
+        return -1;
+    }
+
+    // Each value of g should report each of its scanlines once.
+    for (int i = 0; i <= H; i++) {
+        if (g_rows[i] != 1) {
+            printf("Scanline %d of g was reported %d times\n", i, g_rows[i]);
+            return -1;
+        }
+    }
+
+    // One event for f, and one per value per production of g.
+    if (region_events != 1 + 2 * H) {
+        printf("There were %d store region events instead of %d\n", region_events, 1 + 2 * H);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
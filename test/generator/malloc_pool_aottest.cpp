@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "malloc_pool.h"
+
+using namespace Halide::Tools;
+
+#if defined(__linux__) && defined(__GLIBC__)
+#include <malloc.h>
+
+// Count the big blocks that the runtime gets from and gives back to
+// the system allocator, by wrapping glibc's malloc and free.
+extern "C" void *__libc_malloc(size_t);
+extern "C" void __libc_free(void *);
+
+const size_t big_block = 256 * 1024;
+int counting = 0;
+int big_mallocs = 0;
+int big_frees = 0;
+
+extern "C" void *malloc(size_t size) noexcept {
+    if (size >= big_block && __atomic_load_n(&counting, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&big_mallocs, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_malloc(size);
+}
+
+extern "C" void free(void *ptr) noexcept {
+    if (ptr && __atomic_load_n(&counting, __ATOMIC_RELAXED) &&
+        malloc_usable_size(ptr) >= big_block) {
+        __atomic_add_fetch(&big_frees, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(ptr);
+}
+
+const int width = 64 * 1024;
+const int height = 64;
+const int threads = 4;
+
+int run_pipeline() {
+    Image<int> out(width, height);
+    int result = malloc_pool(out);
+    if (result != 0) {
+        printf("Result: %d\n", result);
+        return -1;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int correct = 2 * (x + y) + 1;
+            if (out(x, y) != correct) {
+                printf("out(%d, %d) = %d instead of %d\n", x, y, out(x, y), correct);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Run the pipeline some times, and return how many big blocks were
+// taken from the system allocator, or -1 on failure. The output
+// buffer is allocated before counting starts.
+int count_big_mallocs(int runs) {
+    big_mallocs = 0;
+    for (int i = 0; i < runs; i++) {
+        Image<int> out(width, height);
+        __atomic_store_n(&counting, 1, __ATOMIC_RELAXED);
+        int result = malloc_pool(out);
+        __atomic_store_n(&counting, 0, __ATOMIC_RELAXED);
+        if (result != 0) {
+            printf("Result: %d\n", result);
+            return -1;
+        }
+    }
+    return big_mallocs;
+}
+
+// Drop the pooled blocks, and return how many big ones were given
+// back to the system allocator.
+int count_big_frees_on_drain() {
+    big_frees = 0;
+    __atomic_store_n(&counting, 1, __ATOMIC_RELAXED);
+    halide_malloc_pool_set_size(0);
+    __atomic_store_n(&counting, 0, __ATOMIC_RELAXED);
+    return big_frees;
+}
+#endif
+
+int main(int argc, char **argv) {
+#if !defined(__linux__) || !defined(__GLIBC__)
+    printf("Skipping test on a platform without glibc\n");
+#else
+    setenv("HL_NUM_THREADS", "4", 1);
+    if (run_pipeline() != 0) {
+        return -1;
+    }
+
+    halide_malloc_pool_set_size(16 * 1024 * 1024);
+
+    // A freed block comes back for the next allocation of its size
+    // class from the same thread.
+    void *a = halide_malloc(NULL, 1000);
+    halide_free(NULL, a);
+    void *b = halide_malloc(NULL, 900);
+    halide_free(NULL, b);
+    if (a != b) {
+        printf("Freed block %p was not reused, got %p\n", a, b);
+        return -1;
+    }
+
+    // Each row's scratch buffer is freed back to the pool of the
+    // thread that ran it. After the first run, each thread has a
+    // block of the right size waiting, so the system allocator is
+    // only called for threads that hadn't run a row yet.
+    int first = count_big_mallocs(1);
+    int later = count_big_mallocs(10);
+    if (first < 1 || later < 0 || later > threads + 1) {
+        printf("Pooled runs took %d big blocks from the system at first and %d later\n",
+               first, later);
+        return -1;
+    }
+
+    // Turning pooling off returns every pooled block.
+    int drained = count_big_frees_on_drain();
+    if (drained != first + later) {
+        printf("Draining the pools freed %d big blocks instead of %d\n",
+               drained, first + later);
+        return -1;
+    }
+    if (count_big_frees_on_drain() != 0) {
+        printf("Pools were not empty after draining\n");
+        return -1;
+    }
+
+    // Without pooling, each row allocates its scratch buffer from the
+    // system.
+    int unpooled = count_big_mallocs(10);
+    if (unpooled < 10 * height) {
+        printf("Unpooled runs took %d big blocks from the system instead of at least %d\n",
+               unpooled, 10 * height);
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
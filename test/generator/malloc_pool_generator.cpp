@@ -0,0 +1,22 @@
+#include "Halide.h"
+
+namespace {
+
+class MallocPool : public Halide::Generator<MallocPool> {
+public:
+    Func build() {
+        Var x, y;
+        Func scratch, f;
+        scratch(x, y) = x + y;
+        f(x, y) = scratch(x, y) + scratch(x + 1, y);
+        // Each row allocates and frees its own scratch buffer on the
+        // heap, from whichever thread runs it.
+        scratch.compute_at(f, y);
+        f.parallel(y);
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<MallocPool> register_my_gen{"malloc_pool"};
+
+}  // namespace
@@ -0,0 +1,194 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "memoize_cost.h"
+
+#ifdef __linux__
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace Halide::Tools;
+
+const int num_keys = 100;
+const int num_calls = 5000;
+
+// Run a mixed workload, in which a quarter of the keys take a hundred
+// times longer to compute than the rest, through a cache that only
+// has room for 40 of the results. Returns the total work spent
+// recomputing results that missed.
+int64_t run(int policy) {
+    halide_memoization_cache_cleanup();
+    halide_memoization_cache_set_eviction_policy(policy);
+    halide_memoization_cache_set_size(40 * 256 * sizeof(float));
+
+    srand(0);
+    int64_t recomputed = 0;
+    uint64_t hits = 0;
+    Image<float> out(256);
+    for (int i = 0; i < num_calls; i++) {
+        int key = rand() % num_keys;
+        int work = (key % 4 == 0) ? 100 : 1;
+
+        halide_memoization_cache_stats before, after;
+        halide_memoization_cache_get_stats(&before);
+        memoize_cost(key, work, out);
+        halide_memoization_cache_get_stats(&after);
+
+        if (after.hits == before.hits) {
+            recomputed += work;
+        } else {
+            hits++;
+        }
+
+        float correct = (float)key;
+        for (int r = 0; r < work; r++) {
+            correct = correct * 0.99f + (float)r;
+        }
+        if (fabs(out(0) - correct) > 1e-3f * fabs(correct)) {
+            printf("out(0) = %f instead of %f for key %d\n", out(0), correct, key);
+            exit(-1);
+        }
+    }
+
+    printf("%s: hit rate %f, recomputed %lld units of work\n",
+           policy == halide_memoization_evict_lru ? "LRU" : "Cost aware",
+           (double)hits / num_calls, (long long)recomputed);
+    return recomputed;
+}
+
+#ifdef __linux__
+// Results stored in a cache file should be found again after the
+// in-memory cache has been emptied, as they would be by another
+// process. Emptying the cache also resets its counts, so the stores
+// are counted before it and the hits after.
+bool check_file_cache() {
+    const char *path = "memoize_cost_cache.bin";
+    const int64_t file_size = 1 << 20;
+    Image<float> out(256);
+
+    remove(path);
+    halide_memoization_cache_cleanup();
+    halide_memoization_cache_set_size(1 << 20);
+    if (halide_memoization_cache_set_file(NULL, path, file_size, 1) != 0) {
+        printf("Could not set the memoization cache file\n");
+        return false;
+    }
+
+    for (int key = 0; key < 10; key++) {
+        memoize_cost(key, 10, out);
+    }
+    halide_memoization_cache_stats stored, found;
+    halide_memoization_cache_get_stats(&stored);
+    halide_memoization_cache_cleanup();
+    halide_memoization_cache_set_file(NULL, path, file_size, 1);
+    for (int key = 0; key < 10; key++) {
+        memoize_cost(key, 10, out);
+        float correct = (float)key;
+        for (int r = 0; r < 10; r++) {
+            correct = correct * 0.99f + (float)r;
+        }
+        if (fabs(out(0) - correct) > 1e-3f * fabs(correct)) {
+            printf("out(0) = %f instead of %f for key %d from the cache file\n", out(0), correct, key);
+            return false;
+        }
+    }
+    halide_memoization_cache_get_stats(&found);
+    halide_memoization_cache_cleanup();
+    remove(path);
+
+    if (stored.file_stores != 10 || found.file_hits != 10) {
+        printf("Expected 10 stores to and 10 hits from the cache file, got %d and %d\n",
+               (int)stored.file_stores, (int)found.file_hits);
+        return false;
+    }
+    return true;
+}
+
+// Open the cache file with a version in a child process, as another
+// process would, and compute keys [first, first + count). Returns the
+// number of those found in the file, or -1 on failure.
+int file_hits_in_child(const char *path, int64_t file_size, uint64_t version, int first, int count) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        Image<float> out(256);
+        halide_memoization_cache_cleanup();
+        if (halide_memoization_cache_set_file(NULL, path, file_size, version) != 0) {
+            _exit(255);
+        }
+        for (int key = first; key < first + count; key++) {
+            memoize_cost(key, 10, out);
+        }
+        halide_memoization_cache_stats stats;
+        halide_memoization_cache_get_stats(&stats);
+        _exit((int)stats.file_hits);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 255) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// A process still running an old version of the pipelines must not
+// store results in a file that a process with a new version reset
+// after the old one opened it.
+bool check_file_cache_version() {
+    const char *path = "memoize_cost_cache_version.bin";
+    const int64_t file_size = 1 << 20;
+    Image<float> out(256);
+
+    remove(path);
+    halide_memoization_cache_cleanup();
+    halide_memoization_cache_set_file(NULL, path, file_size, 1);
+
+    // The new version resets the file.
+    if (file_hits_in_child(path, file_size, 2, 0, 0) != 0) {
+        printf("Could not open the cache file with a new version\n");
+        return false;
+    }
+
+    for (int key = 0; key < 10; key++) {
+        memoize_cost(key, 10, out);
+    }
+    halide_memoization_cache_stats stats;
+    halide_memoization_cache_get_stats(&stats);
+    halide_memoization_cache_cleanup();
+
+    int hits = file_hits_in_child(path, file_size, 2, 0, 10);
+    remove(path);
+
+    if (stats.file_stores != 0 || hits != 0) {
+        printf("Stored %d results in a file with another version, of which %d were found\n",
+               (int)stats.file_stores, hits);
+        return false;
+    }
+    return true;
+}
+#endif
+
+int main(int argc, char **argv) {
+    int64_t lru = run(halide_memoization_evict_lru);
+    int64_t cost_aware = run(halide_memoization_evict_cost_aware);
+
+    if (cost_aware > lru) {
+        printf("Cost aware eviction recomputed more work than LRU eviction: %lld vs %lld\n",
+               (long long)cost_aware, (long long)lru);
+        return -1;
+    }
+
+#ifdef __linux__
+    if (!check_file_cache() ||
+        !check_file_cache_version()) {
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,30 @@
+#include "Halide.h"
+
+namespace {
+
+class MemoizeCost : public Halide::Generator<MemoizeCost> {
+public:
+    Param<int> key{"key", 0};
+    Param<int> work{"work", 1};
+
+    Func build() {
+        Var x;
+
+        // Takes time proportional to work to compute, whatever its
+        // size.
+        RDom r(0, work);
+        Func expensive;
+        expensive(x) = cast<float>(x + key);
+        expensive(x) = expensive(x) * 0.99f + cast<float>(r);
+        expensive.compute_root().memoize();
+
+        Func f;
+        f(x) = expensive(x);
+
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<MemoizeCost> register_my_gen{"memoize_cost"};
+
+}  // namespace
@@ -55,6 +55,28 @@ void validate(halide_profiler_state *s) {
                 assert(fs->memory_total == mandelbrot_heap_total);
             }
         }
+
+        // Each value of the mandelbrot tuple is allocated on the heap
+        // at its own site inside the tile loop, and the two values of
+        // argmin on the stack.
+        int heap_sites = 0, argmin_stack = 0;
+        for (int i = 0; i < p->num_alloc_sites; i++) {
+            halide_profiler_alloc_site_stats *as = p->alloc_sites + i;
+            const char *func_name = p->funcs[as->func].name;
+            if (strncmp(func_name, "argmin", 6) == 0) {
+                assert(as->num_allocs == 0);
+                argmin_stack += as->stack_bytes;
+            } else if (strncmp(func_name, "mandelbrot", 10) == 0) {
+                assert(as->stack_bytes == 0);
+                assert(strstr(as->loop, ".xo") != NULL);
+                assert(as->num_allocs == mandelbrot_n_mallocs / 2);
+                assert((int)as->memory_total == mandelbrot_heap_total / 2);
+                assert(mandelbrot_heap_per_iter / 2 <= as->memory_peak);
+                heap_sites++;
+            }
+        }
+        assert(heap_sites == 2);
+        assert(argmin_stack == argmin_stack_peak);
     }
 }
 
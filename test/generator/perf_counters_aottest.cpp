@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "perf_counters.h"
+
+using namespace Halide::Tools;
+
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <thread>
+
+// The runtime's hardware counters, which the profiler reads for each
+// Func. They aren't part of the public API.
+extern "C" int halide_open_perf_counters(uint64_t vector_event, int *which, int *fds);
+extern "C" int halide_read_perf_counters(int fd, uint64_t *values, int n);
+extern "C" void halide_close_perf_counters(const int *fds);
+
+struct Counters {
+    int group;
+    int which[halide_profiler_num_counters];
+    int fds[halide_profiler_num_counters];
+    int num_values;
+
+    void open() {
+        group = halide_open_perf_counters(0, which, fds);
+        num_values = 0;
+        for (int i = 0; i < halide_profiler_num_counters; i++) {
+            if (which[i] >= 0) num_values++;
+        }
+    }
+};
+
+int count_open_fds() {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) {
+        return -1;
+    }
+    int count = 0;
+    while (readdir(dir)) {
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+int run_pipeline() {
+    Image<float> out(1 << 20);
+    int result = perf_counters(out);
+    if (result != 0) {
+        printf("Result: %d\n", result);
+        return -1;
+    }
+    return 0;
+}
+
+int test_counters() {
+    // The runtime only has counters on x86, and the kernel refuses
+    // them to unprivileged processes on some systems, and on machines
+    // (often virtual ones) that don't have them.
+    Counters c;
+    errno = 0;
+    c.open();
+    if (c.group < 0) {
+        if (errno == 0 || errno == EACCES || errno == EPERM || errno == ENOENT ||
+            errno == ENOSYS || errno == EOPNOTSUPP) {
+            printf("Skipping test, as hardware counters aren't available: %s\n", strerror(errno));
+            return 0;
+        }
+        printf("Failed to open the counters: %s\n", strerror(errno));
+        return -1;
+    }
+    if (c.which[halide_profiler_vector_instructions] != -1) {
+        printf("Vector instructions were counted without an event to count\n");
+        return -1;
+    }
+
+    // Counts only go up while the pipeline runs.
+    uint64_t before[halide_profiler_num_counters], after[halide_profiler_num_counters];
+    if (halide_read_perf_counters(c.group, before, c.num_values) != 0 ||
+        run_pipeline() != 0 ||
+        halide_read_perf_counters(c.group, after, c.num_values) != 0) {
+        printf("Failed to read the counters\n");
+        return -1;
+    }
+    int instructions = c.which[halide_profiler_instructions];
+    if (instructions >= 0 && after[instructions] <= before[instructions]) {
+        printf("Instructions went from %llu to %llu\n",
+               (unsigned long long)before[instructions], (unsigned long long)after[instructions]);
+        return -1;
+    }
+    for (int i = 0; i < c.num_values; i++) {
+        if (after[i] < before[i]) {
+            printf("Counter %d went down\n", i);
+            return -1;
+        }
+    }
+
+    // The profiler reopens a slot's group whenever another thread
+    // claims the slot. Reopening many times from other threads must
+    // not leak the counters of the group.
+    halide_close_perf_counters(c.fds);
+    int fds_before = count_open_fds();
+    for (int i = 0; i < 100; i++) {
+        bool ok = false;
+        std::thread t([&]() {
+            Counters other;
+            other.open();
+            uint64_t values[halide_profiler_num_counters];
+            ok = other.group >= 0 &&
+                other.num_values == c.num_values &&
+                halide_read_perf_counters(other.group, values, other.num_values) == 0;
+            halide_close_perf_counters(other.fds);
+        });
+        t.join();
+        if (!ok) {
+            printf("Failed to reopen the counters on another thread\n");
+            return -1;
+        }
+    }
+    int fds_after = count_open_fds();
+    if (fds_after != fds_before) {
+        printf("%d file descriptors were open before reopening the counters, and %d after\n",
+               fds_before, fds_after);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifndef __linux__
+    printf("Skipping test on a platform without perf_event_open\n");
+#else
+    if (test_counters() != 0) {
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include "Halide.h"
+
+namespace {
+
+class PerfCounters : public Halide::Generator<PerfCounters> {
+public:
+    Func build() {
+        Var x;
+        Func f;
+        f(x) = sqrt(cast<float>(x));
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<PerfCounters> register_my_gen{"perf_counters"};
+
+}  // namespace
@@ -0,0 +1,311 @@
+#include <chrono>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "profiler_stats.h"
+
+using namespace Halide::Tools;
+
+const int runs = 20;
+const char *producer_name = "producer \"quoted\" \\ name";
+
+std::string read_file(const char *name) {
+    std::string result;
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        return result;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        result.append(buf, n);
+    }
+    fclose(f);
+    return result;
+}
+
+std::vector<std::string> split(const std::string &s, char sep) {
+    std::vector<std::string> result;
+    size_t start = 0;
+    while (true) {
+        size_t end = s.find(sep, start);
+        if (end == std::string::npos) {
+            result.push_back(s.substr(start));
+            return result;
+        }
+        result.push_back(s.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+// Just enough of a json parser to check that the profiler writes valid
+// json, and to look at what's in it.
+struct JsonValue {
+    enum Kind {Null, Bool, Number, String, Array, Object} kind = Null;
+    double number = 0;
+    std::string str;
+    std::vector<JsonValue> elements;
+    std::map<std::string, JsonValue> members;
+
+    const JsonValue &operator[](const std::string &key) const {
+        static JsonValue null_value;
+        auto it = members.find(key);
+        return it == members.end() ? null_value : it->second;
+    }
+};
+
+struct JsonParser {
+    const std::string &text;
+    size_t pos = 0;
+
+    JsonParser(const std::string &text) : text(text) {}
+
+    void skip_space() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' ||
+                                     text[pos] == '\r' || text[pos] == '\t')) {
+            pos++;
+        }
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_string(std::string &out) {
+        if (!consume('"')) return false;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if ((unsigned char)c < 0x20) {
+                return false;
+            }
+            if (c == '\\') {
+                if (pos >= text.size()) return false;
+                char e = text[pos++];
+                if (e == 'u') {
+                    if (pos + 4 > text.size()) return false;
+                    out += (char)strtol(text.substr(pos, 4).c_str(), nullptr, 16);
+                    pos += 4;
+                } else if (e == 'n') {
+                    out += '\n';
+                } else if (e == 't') {
+                    out += '\t';
+                } else if (e == '"' || e == '\\' || e == '/') {
+                    out += e;
+                } else {
+                    return false;
+                }
+            } else {
+                out += c;
+            }
+        }
+        return consume('"');
+    }
+
+    bool parse(JsonValue &v) {
+        skip_space();
+        if (pos >= text.size()) return false;
+        char c = text[pos];
+        if (c == '{') {
+            pos++;
+            v.kind = JsonValue::Object;
+            if (consume('}')) return true;
+            do {
+                std::string key;
+                if (!parse_string(key) || !consume(':') || !parse(v.members[key])) return false;
+            } while (consume(','));
+            return consume('}');
+        } else if (c == '[') {
+            pos++;
+            v.kind = JsonValue::Array;
+            if (consume(']')) return true;
+            do {
+                v.elements.emplace_back();
+                if (!parse(v.elements.back())) return false;
+            } while (consume(','));
+            return consume(']');
+        } else if (c == '"') {
+            v.kind = JsonValue::String;
+            return parse_string(v.str);
+        } else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+            v.kind = JsonValue::Bool;
+            pos += (c == 't') ? 4 : 5;
+            return true;
+        } else if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+            return true;
+        } else {
+            char *end;
+            v.kind = JsonValue::Number;
+            v.number = strtod(text.c_str() + pos, &end);
+            if (end == text.c_str() + pos) return false;
+            pos = end - text.c_str();
+            return true;
+        }
+    }
+
+    bool parse_document(JsonValue &v) {
+        if (!parse(v)) return false;
+        skip_space();
+        return pos == text.size();
+    }
+};
+
+int collect_pipelines(void *context, const halide_profiler_pipeline_stats *p) {
+    ((std::vector<const halide_profiler_pipeline_stats *> *)context)->push_back(p);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const int threads = 4;
+    halide_set_num_threads(threads);
+
+    double fastest = 1e30, slowest = 0, total = 0;
+    for (int i = 0; i < runs; i++) {
+        Image<float> out(256, 256);
+        auto start = std::chrono::steady_clock::now();
+        int result = profiler_stats(out);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (result != 0) {
+            printf("Result: %d\n", result);
+            return -1;
+        }
+        fastest = std::min(fastest, ns);
+        slowest = std::max(slowest, ns);
+        total += ns;
+    }
+
+    // The pipeline shows up once, with all its runs.
+    std::vector<const halide_profiler_pipeline_stats *> pipelines;
+    if (halide_profiler_enumerate_pipelines(nullptr, &pipelines, collect_pipelines) != 0 ||
+        pipelines.size() != 1) {
+        printf("Expected to enumerate one pipeline, got %d\n", (int)pipelines.size());
+        return -1;
+    }
+    const halide_profiler_pipeline_stats *p = pipelines[0];
+    if (std::string(p->name) != "profiler_stats" || p->runs != runs) {
+        printf("Enumerated pipeline %s with %d runs\n", p->name, p->runs);
+        return -1;
+    }
+
+    // The percentiles are the middles of histogram buckets an eighth
+    // of a power of two wide, so they're within that of the measured
+    // run times.
+    uint64_t p50 = halide_profiler_run_time_percentile(p, 0.5f);
+    uint64_t p90 = halide_profiler_run_time_percentile(p, 0.9f);
+    uint64_t p99 = halide_profiler_run_time_percentile(p, 0.99f);
+    printf("Run times between %f and %f ms, p50 %f, p90 %f, p99 %f\n",
+           fastest / 1e6, slowest / 1e6, p50 / 1e6, p90 / 1e6, p99 / 1e6);
+    if (p50 == 0 || p50 > p90 || p90 > p99 ||
+        p50 < fastest * 0.8 || p99 > slowest * 1.2) {
+        printf("Percentiles don't match the run times\n");
+        return -1;
+    }
+
+    // The parallel loop over the rows of f runs a task per row. Its
+    // threads can't have waited for longer than they ran.
+    const halide_profiler_par_for_stats *loop = p->par_fors;
+    if (loop == nullptr || loop->next != nullptr ||
+        loop->runs != runs || loop->tasks / loop->runs != 256 ||
+        loop->lock_wait + loop->idle > total * threads) {
+        printf("Unexpected parallel loop stats\n");
+        if (loop) {
+            printf("runs: %d tasks: %llu lock wait: %llu ns idle: %llu ns\n",
+                   loop->runs, (unsigned long long)loop->tasks,
+                   (unsigned long long)loop->lock_wait, (unsigned long long)loop->idle);
+        }
+        return -1;
+    }
+
+    // A new csv file gets a header, and a row for each Func.
+    const char *csv_name = "profiler_stats.csv";
+    remove(csv_name);
+    if (halide_profiler_write_stats(nullptr, csv_name, halide_profiler_format_csv) != 0 ||
+        halide_profiler_write_stats(nullptr, csv_name, halide_profiler_format_csv) != 0) {
+        printf("Failed to write %s\n", csv_name);
+        return -1;
+    }
+    std::vector<std::string> lines = split(read_file(csv_name), '\n');
+    const std::string header =
+        "pipeline,func,runs,time_ns,memory_peak,memory_total,num_allocs,stack_peak,"
+        "cycles,instructions,cache_misses,vector_instructions,"
+        "run_time_p50_ns,run_time_p90_ns,run_time_p99_ns";
+    // Appending writes no second header. The file ends in a newline.
+    if (lines.size() != (size_t)(2 + 2 * p->num_funcs) || lines[0] != header || !lines.back().empty()) {
+        printf("Unexpected csv file:\n%s\n", read_file(csv_name).c_str());
+        return -1;
+    }
+    for (int i = 1; i <= 2 * p->num_funcs; i++) {
+        std::vector<std::string> row = split(lines[i], ',');
+        if (row.size() != 15 ||
+            row[0] != "profiler_stats" ||
+            row[1] != p->funcs[(i - 1) % p->num_funcs].name ||
+            atoi(row[2].c_str()) != runs ||
+            strtoull(row[12].c_str(), nullptr, 10) != p50 ||
+            strtoull(row[13].c_str(), nullptr, 10) != p90 ||
+            strtoull(row[14].c_str(), nullptr, 10) != p99) {
+            printf("Unexpected csv row: %s\n", lines[i].c_str());
+            return -1;
+        }
+    }
+    remove(csv_name);
+
+    // The json file parses, and has the same stats.
+    const char *json_name = "profiler_stats.json";
+    if (halide_profiler_write_stats(nullptr, json_name, halide_profiler_format_json) != 0) {
+        printf("Failed to write %s\n", json_name);
+        return -1;
+    }
+    std::string json = read_file(json_name);
+    JsonValue root;
+    JsonParser parser(json);
+    if (!parser.parse_document(root)) {
+        printf("Invalid json at offset %d:\n%s\n", (int)parser.pos, json.c_str());
+        return -1;
+    }
+    const JsonValue &pipes = root["pipelines"];
+    if (pipes.elements.size() != 1) {
+        printf("Expected one pipeline in the json\n");
+        return -1;
+    }
+    const JsonValue &pj = pipes.elements[0];
+    if (pj["name"].str != "profiler_stats" ||
+        pj["runs"].number != runs ||
+        (uint64_t)pj["run_time_ns"]["p50"].number != p50 ||
+        (uint64_t)pj["run_time_ns"]["p99"].number != p99 ||
+        pj["funcs"].elements.size() != (size_t)p->num_funcs) {
+        printf("Unexpected pipeline in the json:\n%s\n", json.c_str());
+        return -1;
+    }
+    const JsonValue &loops = pj["parallel_loops"];
+    if (loops.elements.size() != 1 ||
+        loops.elements[0]["runs"].number != runs ||
+        (uint64_t)loops.elements[0]["tasks"].number != loop->tasks ||
+        (uint64_t)loops.elements[0]["lock_wait_ns"].number != loop->lock_wait ||
+        (uint64_t)loops.elements[0]["idle_ns"].number != loop->idle) {
+        printf("Unexpected parallel loops in the json:\n%s\n", json.c_str());
+        return -1;
+    }
+    bool found_producer = false;
+    for (const JsonValue &f : pj["funcs"].elements) {
+        found_producer |= (f["name"].str == producer_name);
+    }
+    if (!found_producer) {
+        printf("The producer's name didn't survive the json:\n%s\n", json.c_str());
+        return -1;
+    }
+    remove(json_name);
+
+    printf("Success!\n");
+    return 0;
+}
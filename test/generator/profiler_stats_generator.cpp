@@ -0,0 +1,24 @@
+#include "Halide.h"
+
+namespace {
+
+class ProfilerStats : public Halide::Generator<ProfilerStats> {
+public:
+    Func build() {
+        target.set(get_target().with_feature(Target::Profile));
+
+        Var x, y;
+        // The producer's name has characters that have to be escaped
+        // in json.
+        Func producer("producer \"quoted\" \\ name"), f("f");
+        producer(x, y) = sqrt(cast<float>(x + y));
+        f(x, y) = producer(x, y) * 2.0f;
+        producer.compute_root();
+        f.parallel(y);
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<ProfilerStats> register_my_gen{"profiler_stats"};
+
+}  // namespace
@@ -0,0 +1,39 @@
+#include <stdio.h>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "static_library.h"
+
+using namespace Halide::Tools;
+
+// This test links against the library the generator wrote itself
+// (with -e static_library), rather than one made with ar, so it checks
+// that the library has a usable symbol table.
+int main(int argc, char **argv) {
+    Image<int32_t> input(16, 17);
+    for (int y = 0; y < 17; y++) {
+        for (int x = 0; x < 16; x++) {
+            input(x, y) = x + y * 16;
+        }
+    }
+    Image<int32_t> output(16, 16);
+
+    int result = static_library(input, output);
+    if (result != 0) {
+        printf("Result: %d\n", result);
+        return -1;
+    }
+
+    for (int y = 0; y < 16; y++) {
+        for (int x = 0; x < 16; x++) {
+            int correct = (input(x, y) * 2 + 1) + (input(x, y + 1) * 2 + 1);
+            if (output(x, y) != correct) {
+                printf("output(%d, %d) = %d instead of %d\n", x, y, output(x, y), correct);
+                return -1;
+            }
+        }
+    }
+
+    printf("Success!\n");
+    return 0;
+}
@@ -0,0 +1,28 @@
+#include "Halide.h"
+
+namespace {
+
+class StaticLibrary : public Halide::Generator<StaticLibrary> {
+public:
+    ImageParam input{Int(32), 2, "input"};
+
+    Func build() {
+        Var x, y;
+
+        // Several parallel loops, so that the code is spread over
+        // several objects in the library, which call each other.
+        Func f, g, h;
+        f(x, y) = input(x, y) * 2;
+        g(x, y) = f(x, y) + 1;
+        h(x, y) = g(x, y) + g(x, y + 1);
+        f.compute_root().parallel(y);
+        g.compute_root().parallel(y);
+        h.parallel(y);
+
+        return h;
+    }
+};
+
+Halide::RegisterGenerator<StaticLibrary> register_my_gen{"static_library"};
+
+}  // namespace
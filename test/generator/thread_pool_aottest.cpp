@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "thread_pool.h"
+
+using namespace Halide::Tools;
+
+#ifdef __linux__
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Parts of the runtime the profiler uses to measure parallel loops.
+extern "C" void halide_thread_pool_collect_wait_times(bool collect);
+extern "C" void halide_thread_pool_wait_times(uint64_t *lock_wait_ns, uint64_t *idle_ns);
+
+// The threads that ran tasks, and the cpus each was allowed to run on.
+struct TaskThread {
+    pthread_t thread;
+    cpu_set_t cpus;
+};
+std::mutex task_threads_mutex;
+std::vector<TaskThread> task_threads;
+
+void record_task_thread() {
+    // Make each task long enough that the workers get some of them.
+    usleep(1000);
+    TaskThread t;
+    t.thread = pthread_self();
+    sched_getaffinity(0, sizeof(t.cpus), &t.cpus);
+    std::lock_guard<std::mutex> lock(task_threads_mutex);
+    task_threads.push_back(t);
+}
+#endif
+
+extern "C" int thread_pool_task(int x) {
+#ifdef __linux__
+    record_task_thread();
+#endif
+    return x;
+}
+
+// The generator is built with the user_context feature, so that
+// pipelines can be bound to thread pools.
+int run_pipeline(void *user_context = nullptr) {
+    Image<int> out(64);
+    int result = thread_pool(user_context, out);
+    if (result != 0) {
+        printf("Result: %d\n", result);
+        return -1;
+    }
+    for (int x = 0; x < 64; x++) {
+        if (out(x) != x) {
+            printf("out(%d) = %d instead of %d\n", x, out(x), x);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Leave a child process, flushing what it printed.
+void exit_child(int status) {
+    fflush(stdout);
+    _exit(status);
+}
+
+// Run the pipeline with HL_THREAD_AFFINITY set to a cpu list, and
+// check that each worker that ran tasks was pinned to one of the
+// expected cpus, or not pinned at all if expected is empty. The
+// runtime reads HL_THREAD_AFFINITY once, so each list is tried in a
+// fresh child process.
+bool check_affinity(const std::string &list, const std::vector<int> &expected) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("HL_THREAD_AFFINITY", list.c_str(), 1);
+        setenv("HL_NUM_THREADS", "4", 1);
+        cpu_set_t all;
+        sched_getaffinity(0, sizeof(all), &all);
+        if (run_pipeline() != 0) {
+            exit_child(1);
+        }
+        int workers = 0;
+        for (const TaskThread &t : task_threads) {
+            // The thread that called the pipeline isn't pinned.
+            if (pthread_equal(t.thread, pthread_self())) continue;
+            workers++;
+            if (expected.empty()) {
+                if (!CPU_EQUAL(&t.cpus, &all)) {
+                    printf("HL_THREAD_AFFINITY=\"%s\" should have been ignored\n", list.c_str());
+                    exit_child(1);
+                }
+                continue;
+            }
+            bool ok = CPU_COUNT(&t.cpus) == 1;
+            bool found = false;
+            for (int cpu : expected) {
+                found = found || CPU_ISSET(cpu, &t.cpus);
+            }
+            if (!ok || !found) {
+                printf("HL_THREAD_AFFINITY=\"%s\": a worker was allowed on %d cpus, "
+                       "not on one of those listed\n", list.c_str(), CPU_COUNT(&t.cpus));
+                exit_child(1);
+            }
+        }
+        if (workers == 0) {
+            printf("HL_THREAD_AFFINITY=\"%s\": no worker ran any tasks\n", list.c_str());
+            exit_child(1);
+        }
+        exit_child(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int test_affinity() {
+    // Only use cpus this process may run on.
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cpus;
+    int pair = -1;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        cpus.push_back(c);
+        if (pair < 0 && c + 1 < CPU_SETSIZE && CPU_ISSET(c + 1, &allowed)) {
+            pair = c;
+        }
+    }
+    std::string a = std::to_string(cpus[0]);
+
+    if (!check_affinity(a, {cpus[0]})) return -1;
+    if (!check_affinity(a + "-" + a, {cpus[0]})) return -1;
+    if (cpus.size() > 1) {
+        std::string b = std::to_string(cpus[1]);
+        if (!check_affinity(a + "," + b, {cpus[0], cpus[1]})) return -1;
+        if (!check_affinity(b + "," + a + "-" + a, {cpus[0], cpus[1]})) return -1;
+    }
+    if (pair >= 0) {
+        std::string range = std::to_string(pair) + "-" + std::to_string(pair + 1);
+        if (!check_affinity(range, {pair, pair + 1})) return -1;
+    }
+
+    // Malformed lists leave the workers unpinned.
+    for (const char *bad : {"x", "1,,2", "2-", "-1", "0;1", "0 ", ",0", "0-x"}) {
+        if (!check_affinity(bad, {})) return -1;
+    }
+    return 0;
+}
+
+// Returns the number of threads that ran the tasks of the pipeline,
+// or -1 if it computed the wrong thing.
+int threads_used(void *user_context) {
+    task_threads.clear();
+    if (run_pipeline(user_context) != 0) return -1;
+    std::vector<pthread_t> threads;
+    for (const TaskThread &t : task_threads) {
+        bool seen = false;
+        for (pthread_t other : threads) {
+            seen = seen || pthread_equal(t.thread, other);
+        }
+        if (!seen) threads.push_back(t.thread);
+    }
+    return (int)threads.size();
+}
+
+int test_pools() {
+    halide_set_num_threads(1);
+
+    int bound_context, other_context;
+    if (threads_used(&bound_context) != 1) {
+        printf("The default pool should only use one thread\n");
+        return -1;
+    }
+
+    halide_thread_pool *pool = halide_create_thread_pool(&bound_context, 4, nullptr, 0);
+    if (!pool) {
+        printf("Could not create a thread pool\n");
+        return -1;
+    }
+
+    halide_bind_thread_pool(&bound_context, pool);
+    if (threads_used(&bound_context) < 2) {
+        printf("The bound pool should use more than one thread\n");
+        return -1;
+    }
+    if (threads_used(&other_context) != 1) {
+        printf("Other user_contexts should still use the default pool\n");
+        return -1;
+    }
+
+    halide_bind_thread_pool(&bound_context, nullptr);
+    if (threads_used(&bound_context) != 1) {
+        printf("Unbinding should go back to the default pool\n");
+        return -1;
+    }
+
+    halide_destroy_thread_pool(pool);
+    return 0;
+}
+
+// Claiming fixed size chunks of tasks, three at a time from a range
+// of 64 so that the last chunk is short, should still run each of
+// them exactly once.
+int test_chunk_size() {
+    halide_set_num_threads(4);
+    halide_set_task_chunk_size(3);
+    task_threads.clear();
+    int result = run_pipeline();
+    halide_set_task_chunk_size(0);
+    if (result != 0) {
+        printf("Claiming tasks three at a time computed the wrong thing\n");
+        return -1;
+    }
+    if (task_threads.size() != 64) {
+        printf("Claiming tasks three at a time ran %d tasks instead of 64\n",
+               (int)task_threads.size());
+        return -1;
+    }
+    return 0;
+}
+
+// The cpu time used by the whole process while the calling thread
+// sleeps for 50ms, in seconds. This is the time the idle workers of
+// the thread pool spend looking for work.
+double idle_cpu_time() {
+    struct timespec before, after;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &before);
+    usleep(50000);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &after);
+    return (after.tv_sec - before.tv_sec) + (after.tv_nsec - before.tv_nsec) * 1e-9;
+}
+
+int64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int test_wait_times() {
+    halide_set_num_threads(4);
+
+    // Nothing is counted until it's asked for.
+    uint64_t lock_wait[4], idle[4];
+    halide_thread_pool_wait_times(&lock_wait[0], &idle[0]);
+    if (run_pipeline() != 0) return -1;
+    halide_thread_pool_wait_times(&lock_wait[1], &idle[1]);
+    if (lock_wait[1] != lock_wait[0] || idle[1] != idle[0]) {
+        printf("Wait times were counted before they were asked for\n");
+        return -1;
+    }
+
+    // While they are, the threads that ran out of tasks first wait
+    // for the others. None of the four threads waits for longer than
+    // the loop ran.
+    halide_thread_pool_collect_wait_times(true);
+    int64_t start = now_ns();
+    if (run_pipeline() != 0) return -1;
+    int64_t elapsed = now_ns() - start;
+    halide_thread_pool_wait_times(&lock_wait[2], &idle[2]);
+    halide_thread_pool_collect_wait_times(false);
+    if (lock_wait[2] < lock_wait[1] || idle[2] <= idle[1] ||
+        (lock_wait[2] - lock_wait[1]) + (idle[2] - idle[1]) > (uint64_t)(4 * elapsed)) {
+        printf("A loop of %lld ns waited %lld ns for locks and was idle for %lld ns\n",
+               (long long)elapsed, (long long)(lock_wait[2] - lock_wait[1]),
+               (long long)(idle[2] - idle[1]));
+        return -1;
+    }
+
+    // Until counting is turned off again.
+    if (run_pipeline() != 0) return -1;
+    halide_thread_pool_wait_times(&lock_wait[3], &idle[3]);
+    if (lock_wait[3] != lock_wait[2] || idle[3] != idle[2]) {
+        printf("Wait times were counted after counting was turned off\n");
+        return -1;
+    }
+    return 0;
+}
+
+int test_hot() {
+    halide_set_num_threads(4);
+
+    // By default idle workers go straight to sleep.
+    if (run_pipeline() != 0) return -1;
+    usleep(10000);
+    double cold = idle_cpu_time();
+    if (cold > 0.01) {
+        printf("Idle workers used %f s of cpu time instead of sleeping\n", cold);
+        return -1;
+    }
+
+    // While the pool is hot, they keep looking for work.
+    halide_set_thread_pool_hot(1);
+    if (run_pipeline() != 0) return -1;
+    double hot = idle_cpu_time();
+    if (hot < 0.025) {
+        printf("Idle workers of a hot pool only used %f s of cpu time\n", hot);
+        return -1;
+    }
+
+    // Until it is turned off again.
+    halide_set_thread_pool_hot(0);
+    usleep(10000);
+    cold = idle_cpu_time();
+    if (cold > 0.01) {
+        printf("Idle workers used %f s of cpu time after the pool cooled down\n", cold);
+        return -1;
+    }
+
+    // They also keep looking for the spin time after each job.
+    halide_set_thread_spin_time(200000);
+    if (run_pipeline() != 0) return -1;
+    double spinning = idle_cpu_time();
+    halide_set_thread_spin_time(0);
+    if (spinning < 0.025) {
+        printf("Idle workers only used %f s of cpu time while spinning\n", spinning);
+        return -1;
+    }
+
+    halide_shutdown_thread_pool();
+    return 0;
+}
+#endif
+
+int main(int argc, char **argv) {
+#ifndef __linux__
+    printf("Skipping test on a platform without sched_getaffinity\n");
+#else
+    if (test_affinity() != 0 ||
+        test_pools() != 0 ||
+        test_chunk_size() != 0 ||
+        test_wait_times() != 0 ||
+        test_hot() != 0) {
+        return -1;
+    }
+#endif
+
+    printf("Success!\n");
+    return 0;
+}
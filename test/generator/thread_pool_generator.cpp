@@ -0,0 +1,22 @@
+#include "Halide.h"
+
+namespace {
+
+// Called once per task, so that the test can see which threads the
+// tasks ran on.
+HalideExtern_1(int, thread_pool_task, int);
+
+class ThreadPool : public Halide::Generator<ThreadPool> {
+public:
+    Func build() {
+        Var x;
+        Func f;
+        f(x) = thread_pool_task(x);
+        f.parallel(x);
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<ThreadPool> register_my_gen{"thread_pool"};
+
+}  // namespace
@@ -0,0 +1,271 @@
+#include <condition_variable>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "HalideRuntime.h"
+#include "halide_image.h"
+#include "timeline.h"
+
+using namespace Halide::Tools;
+
+const int height = 16;
+const char *producer_name = "producer \"quoted\"";
+
+std::string read_file(const char *name) {
+    std::string result;
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        return result;
+    }
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        result.append(buf, n);
+    }
+    fclose(f);
+    return result;
+}
+
+// Just enough of a json parser to check that the timeline is valid
+// json, and to look at what's in it.
+struct JsonValue {
+    enum Kind {Null, Bool, Number, String, Array, Object} kind = Null;
+    double number = 0;
+    std::string str;
+    std::vector<JsonValue> elements;
+    std::map<std::string, JsonValue> members;
+
+    const JsonValue &operator[](const std::string &key) const {
+        static JsonValue null_value;
+        auto it = members.find(key);
+        return it == members.end() ? null_value : it->second;
+    }
+};
+
+struct JsonParser {
+    const std::string &text;
+    size_t pos = 0;
+
+    JsonParser(const std::string &text) : text(text) {}
+
+    void skip_space() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\n' ||
+                                     text[pos] == '\r' || text[pos] == '\t')) {
+            pos++;
+        }
+    }
+
+    bool consume(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool parse_string(std::string &out) {
+        if (!consume('"')) return false;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if ((unsigned char)c < 0x20) {
+                return false;
+            }
+            if (c == '\\') {
+                if (pos >= text.size()) return false;
+                char e = text[pos++];
+                if (e == 'u') {
+                    if (pos + 4 > text.size()) return false;
+                    out += (char)strtol(text.substr(pos, 4).c_str(), nullptr, 16);
+                    pos += 4;
+                } else if (e == 'n') {
+                    out += '\n';
+                } else if (e == 't') {
+                    out += '\t';
+                } else if (e == '"' || e == '\\' || e == '/') {
+                    out += e;
+                } else {
+                    return false;
+                }
+            } else {
+                out += c;
+            }
+        }
+        return consume('"');
+    }
+
+    bool parse(JsonValue &v) {
+        skip_space();
+        if (pos >= text.size()) return false;
+        char c = text[pos];
+        if (c == '{') {
+            pos++;
+            v.kind = JsonValue::Object;
+            if (consume('}')) return true;
+            do {
+                std::string key;
+                if (!parse_string(key) || !consume(':') || !parse(v.members[key])) return false;
+            } while (consume(','));
+            return consume('}');
+        } else if (c == '[') {
+            pos++;
+            v.kind = JsonValue::Array;
+            if (consume(']')) return true;
+            do {
+                v.elements.emplace_back();
+                if (!parse(v.elements.back())) return false;
+            } while (consume(','));
+            return consume(']');
+        } else if (c == '"') {
+            v.kind = JsonValue::String;
+            return parse_string(v.str);
+        } else if (text.compare(pos, 4, "true") == 0 || text.compare(pos, 5, "false") == 0) {
+            v.kind = JsonValue::Bool;
+            pos += (c == 't') ? 4 : 5;
+            return true;
+        } else if (text.compare(pos, 4, "null") == 0) {
+            pos += 4;
+            return true;
+        } else {
+            char *end;
+            v.kind = JsonValue::Number;
+            v.number = strtod(text.c_str() + pos, &end);
+            if (end == text.c_str() + pos) return false;
+            pos = end - text.c_str();
+            return true;
+        }
+    }
+
+    bool parse_document(JsonValue &v) {
+        if (!parse(v)) return false;
+        skip_space();
+        return pos == text.size();
+    }
+};
+
+int run_pipeline() {
+    Image<int> out(8, height);
+    int result = timeline(out);
+    if (result != 0) {
+        printf("Result: %d\n", result);
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+#ifdef _WIN32
+    printf("Skipping test on windows\n");
+    return 0;
+#else
+    // More threads than cpus, so that the tasks are spread over
+    // several threads even on small machines.
+    setenv("HL_NUM_THREADS", "4", 1);
+
+    const char *file_name = "timeline_aottest.json";
+    int fd = open(file_name, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        printf("Failed to open %s\n", file_name);
+        return -1;
+    }
+    halide_set_timeline_file(fd);
+
+    const int main_runs = 3;
+    for (int i = 0; i < main_runs; i++) {
+        if (run_pipeline() != 0) {
+            return -1;
+        }
+    }
+
+    // Run the pipeline from more threads than the timeline has
+    // buffers, all alive at once, but one at a time, so that none of
+    // their events are dropped if each gives up its buffer when its
+    // pipeline is done.
+    const int num_threads = 300;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int waiting = 0, failures = 0;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back([&]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            waiting++;
+            cv.notify_all();
+            cv.wait(lock, [&]() { return waiting == num_threads; });
+            failures += (run_pipeline() != 0);
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    if (failures) {
+        return -1;
+    }
+
+    halide_shutdown_timeline();
+    close(fd);
+
+    std::string json = read_file(file_name);
+    JsonValue root;
+    JsonParser parser(json);
+    if (!parser.parse_document(root) || root.kind != JsonValue::Array) {
+        printf("Invalid json at offset %d\n", (int)parser.pos);
+        return -1;
+    }
+
+    // Every span begun on a thread ends on it, after the spans begun
+    // inside it.
+    std::map<int, std::vector<std::string>> open_spans;
+    std::map<std::string, int> spans;
+    for (const JsonValue &e : root.elements) {
+        const std::string &ph = e["ph"].str;
+        int tid = (int)e["tid"].number;
+        if (e["tid"].kind != JsonValue::Number || e["ts"].kind != JsonValue::Number) {
+            printf("Event without a thread or a time\n");
+            return -1;
+        }
+        if (ph == "B") {
+            std::string span = e["cat"].str + " " + e["name"].str;
+            open_spans[tid].push_back(span);
+            spans[span]++;
+        } else if (ph == "E") {
+            if (open_spans[tid].empty()) {
+                printf("Thread %d ends a span it didn't begin\n", tid);
+                return -1;
+            }
+            open_spans[tid].pop_back();
+        } else {
+            printf("Unexpected event phase %s\n", ph.c_str());
+            return -1;
+        }
+    }
+    for (const auto &t : open_spans) {
+        if (!t.second.empty()) {
+            printf("Thread %d never ends the span %s\n", t.first, t.second.back().c_str());
+            return -1;
+        }
+    }
+
+    const int runs = main_runs + num_threads;
+    if (spans["pipeline timeline"] != runs ||
+        spans["task task"] != runs * height ||
+        spans[std::string("produce ") + producer_name] != runs * height ||
+        spans[std::string("consume ") + producer_name] != runs * height) {
+        printf("Unexpected spans:\n");
+        for (const auto &s : spans) {
+            printf("  %s: %d\n", s.first.c_str(), s.second);
+        }
+        return -1;
+    }
+    remove(file_name);
+
+    printf("Success!\n");
+    return 0;
+#endif
+}
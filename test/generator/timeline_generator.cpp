@@ -0,0 +1,22 @@
+#include "Halide.h"
+
+namespace {
+
+class Timeline : public Halide::Generator<Timeline> {
+public:
+    Func build() {
+        Var x, y;
+        // The producer's name has a character that has to be escaped
+        // in json.
+        Func producer("producer \"quoted\""), f("f");
+        producer(x, y) = x + y;
+        f(x, y) = producer(x, y) * 2;
+        producer.compute_at(f, y).trace_realizations();
+        f.parallel(y).trace_realizations();
+        return f;
+    }
+};
+
+Halide::RegisterGenerator<Timeline> register_my_gen{"timeline"};
+
+}  // namespace
@@ -2,6 +2,7 @@
 #include "IRPrinter.h"
 #include "CodeGen_X86.h"
 #include "CodeGen_C.h"
+#include "CompilationCache.h"
 #include "CPlusPlusMangle.h"
 #include "Func.h"
 #include "Simplify.h"
@@ -11,6 +12,7 @@
 #include "ModulusRemainder.h"
 #include "CSE.h"
 #include "IREquality.h"
+#include "LoweringCache.h"
 #include "Solve.h"
 #include "Monotonic.h"
 #include "Reduction.h"
@@ -35,6 +37,8 @@ int main(int argc, const char **argv) {
     is_monotonic_test();
     split_predicate_test();
     static_library_test();
+    compilation_cache_test();
+    lowering_cache_test();
 
     return 0;
 }
@@ -7,12 +7,14 @@ int heap_peak = 0;
 int num_mallocs = 0;
 int malloc_avg = 0;
 int stack_peak = 0;
+float total_ms = 0;
 
 void reset_stats() {
     heap_peak = 0;
     num_mallocs = 0;
     malloc_avg = 0;
     stack_peak = 0;
+    total_ms = 0;
 }
 
 void my_print(void *, const char *msg) {
@@ -22,6 +24,10 @@ void my_print(void *, const char *msg) {
     int val;
 
     //printf("%s", msg);
+    if (sscanf(msg, "%*s total time: %f ms", &this_ms) == 1) {
+        total_ms = this_ms;
+    }
+
     val = sscanf(msg, " g_%d: %fms (%d%%) peak: %d num: %d avg: %d",
         &idx, &this_ms, &this_percentage, &this_heap_peak,
         &this_num_mallocs, &this_malloc_avg);
@@ -317,6 +323,42 @@ int main(int argc, char **argv) {
         }
     }
 
+    {
+        printf("Running pooled parallel allocate test...\n");
+        // The same scratch buffer is allocated and freed once per row,
+        // first by the system allocator and then from the pool.
+        const int size_x = 64*1024;
+        const int size_y = 200;
+
+        Func f13("f_13"), f14("f_14"), g9("g_9");
+        g9(x, y) = x*y;
+        f13(x, y) = g9(x, y);
+        f14(x, y) = g9(x, y) + f13(x, y);
+
+        g9.store_at(f14, y).compute_at(f14, y);
+        f13.compute_at(f14, y);
+
+        f14.parallel(y);
+
+        f14.set_custom_print(&my_print);
+
+        float ms[2];
+        for (int pooled = 0; pooled < 2; pooled++) {
+            Internal::JITSharedRuntime::malloc_pool_set_size(pooled ? 16*1024*1024 : 0);
+            reset_stats();
+            f14.realize(size_x, size_y, t);
+            ms[pooled] = total_ms;
+            int min_heap_peak = size_x*sizeof(int);
+            int total = size_x*size_y*sizeof(int);
+            if (check_error_parallel(min_heap_peak, total, size_y, total/size_y, 0) != 0) {
+                return -1;
+            }
+        }
+        Internal::JITSharedRuntime::malloc_pool_set_size(0);
+
+        printf("Time with the system allocator: %f ms, with pooling: %f ms\n", ms[0], ms[1]);
+    }
+
     printf("Success!\n");
     return 0;
 }
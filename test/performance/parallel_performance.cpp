@@ -1,5 +1,7 @@
 #include "Halide.h"
 #include <cstdio>
+#include <cstring>
+#include <sstream>
 #include "benchmark.h"
 
 using namespace Halide;
@@ -42,6 +44,34 @@ int main(int argc, char **argv) {
     double speedup = serialTime / parallelTime;
     printf("Speedup: %f\n", speedup);
 
+    // A loop with lots of very cheap tasks mostly measures the
+    // overhead of handing out tasks, so check how that scales with
+    // the number of threads. The thread pool reads HL_NUM_THREADS
+    // when the runtime starts up, so each thread count gets a fresh
+    // runtime, and a fresh Func so that it's compiled against it.
+    Image<float> imh(64, 16384);
+    double oneThreadTime = 0;
+    char buf[32] = {0};
+    for (int t = 1; t <= 64; t *= 2) {
+        std::ostringstream ss;
+        ss << "HL_NUM_THREADS=" << t;
+        std::string str = ss.str();
+        memcpy(buf, str.c_str(), str.size() + 1);
+        putenv(buf);
+        Halide::Internal::JITSharedRuntime::release_all();
+        Func h;
+        h(x, y) = sqrt(cast<float>(x + y));
+        h.parallel(y);
+        h.compile_jit();
+        h.realize(imh);
+        double t_time = benchmark(3, 10, [&]() { h.realize(imh); });
+        if (t == 1) {
+            oneThreadTime = t_time;
+        }
+        printf("Fine-grained tasks with %d threads: %f ms (%f x one thread)\n",
+               t, t_time * 1e3, oneThreadTime / t_time);
+    }
+
     if (speedup < 1.5) {
         fprintf(stderr, "WARNING: Parallel should be faster\n");
         return 0;
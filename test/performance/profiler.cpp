@@ -1,10 +1,23 @@
 #include "Halide.h"
+#include <atomic>
+#include <chrono>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#define DLLEXPORT __declspec(dllexport)
+#else
+#define DLLEXPORT
+#endif
 
 using namespace Halide;
 
 int percentage = 0;
 float ms = 0;
+float busy_threads = 0;
 void my_print(void *, const char *msg) {
     float this_ms;
     int this_percentage;
@@ -13,9 +26,13 @@ void my_print(void *, const char *msg) {
         ms = this_ms;
         percentage = this_percentage;
     }
+    float this_busy;
+    if (sscanf(msg, "threads: %f busy", &this_busy) == 1) {
+        busy_threads = this_busy;
+    }
 }
 
-int main(int argc, char **argv) {
+int run_test(bool use_par) {
     // Make a long chain of finely-interleaved Funcs, of which one is very expensive.
     Func f[30];
     Var c, x;
@@ -43,6 +60,11 @@ int main(int argc, char **argv) {
     out.set_custom_print(&my_print);
     out.compute_root();
     out.update().reorder(c, x, r);
+    if (use_par) {
+        // Each thread reports the Func it is computing separately, so
+        // the times should come out the same as when run serially.
+        out.update().parallel(x);
+    }
     for (int i = 0; i < 30; i++) {
         f[i].compute_at(out, x);
     }
@@ -61,6 +83,128 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    printf("Success!\n");
+    if (busy_threads <= 0) {
+        printf("No thread utilization was reported\n");
+        return -1;
+    }
+
     return 0;
 }
+
+// The reports printed when each of two pipelines run at the same time
+// return.
+std::string report_a, report_b;
+void print_a(void *, const char *msg) {
+    report_a += msg;
+}
+void print_b(void *, const char *msg) {
+    report_b += msg;
+}
+
+std::atomic<bool> b_started(false), a_done(false);
+
+// Keeps the tasks of pipeline b running until pipeline a is done.
+extern "C" DLLEXPORT int wait_for_a(int x) {
+    b_started = true;
+    while (!a_done) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return x;
+}
+HalideExtern_1(int, wait_for_a, int);
+
+// The total time a report gives a pipeline, in ms, or -1 if the
+// pipeline isn't in it.
+float pipeline_ms(const std::string &report, const std::string &name) {
+    std::string key = name + "\n total time: ";
+    size_t pos = report.find(key);
+    return pos == std::string::npos ? -1 : atof(report.c_str() + pos + key.size());
+}
+
+// The time a report gives a Func, in ms, or -1 if it isn't in it.
+float func_ms(const std::string &report, const std::string &name) {
+    std::string key = "  " + name + ": ";
+    size_t pos = report.find(key);
+    return pos == std::string::npos ? -1 : atof(report.c_str() + pos + key.size());
+}
+
+float busy_in(const std::string &report) {
+    size_t pos = report.find("\nthreads: ");
+    return pos == std::string::npos ? 0 : atof(report.c_str() + pos + strlen("\nthreads: "));
+}
+
+// Run a serial pipeline while a parallel one is running, and check
+// that each pipeline is billed for its own time, and that both
+// threads are counted as busy.
+int run_concurrent_test() {
+    Var x("x"), y("y");
+    Func a_work("a_work"), a_out("a_out");
+    Expr e = cast<float>(x + y);
+    for (int i = 0; i < 200; i++) {
+        e = sin(e);
+    }
+    a_work(x, y) = e;
+    a_out(x, y) = a_work(x, y) * 2.0f;
+    a_work.compute_root();
+    a_out.set_custom_print(&print_a);
+
+    Func b_wait("b_wait"), b_out("b_out");
+    b_wait(x) = wait_for_a(x);
+    b_out(x) = b_wait(x) + 1;
+    b_wait.compute_root().parallel(x);
+    b_out.set_custom_print(&print_b);
+
+    // Compile both first, so that only the pipelines run at the same
+    // time.
+    Target t = get_jit_target_from_environment().with_feature(Target::Profile);
+    a_out.compile_jit(t);
+    b_out.compile_jit(t);
+
+    std::thread b_thread([&]() { b_out.realize(16, t); });
+    while (!b_started) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto start = std::chrono::steady_clock::now();
+    a_out.realize(512, 512, t);
+    float a_wall_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+    a_done = true;
+    b_thread.join();
+
+    // a's report is printed while b is still running, so it has both.
+    float a_ms = pipeline_ms(report_a, "a_out");
+    float b_ms = pipeline_ms(report_a, "b_out");
+    float busy = busy_in(report_a);
+    printf("a took %fms, and was billed %fms while b was billed %fms, with %f threads busy\n",
+           a_wall_ms, a_ms, b_ms, busy);
+    if (a_ms <= 0 || a_ms > a_wall_ms * 1.25f + 5 || func_ms(report_a, "a_work") <= 0) {
+        printf("a wasn't billed its own time\n");
+        return -1;
+    }
+    if (b_ms < a_wall_ms * 0.75f || func_ms(report_a, "b_wait") <= 0) {
+        printf("b wasn't billed the time it was running with a\n");
+        return -1;
+    }
+    if (busy <= 1) {
+        printf("Expected more than one thread busy\n");
+        return -1;
+    }
+
+    // Resetting the profiler after a returned kept b's stats, as it
+    // was still running.
+    float b_total_ms = pipeline_ms(report_b, "b_out");
+    if (b_total_ms < a_wall_ms * 0.75f) {
+        printf("b's own report billed it %fms\n", b_total_ms);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (run_test(false) == 0 &&
+        run_test(true) == 0 &&
+        run_concurrent_test() == 0) {
+        printf("Success!\n");
+        return 0;
+    }
+    return -1;
+}
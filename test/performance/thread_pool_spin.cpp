@@ -0,0 +1,64 @@
+#include "Halide.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include "benchmark.h"
+
+using namespace Halide;
+
+int main(int argc, char **argv) {
+    // A chain of small parallel stages, each too short to hide the
+    // time it takes to wake up the thread pool.
+    Var x, y;
+    auto make_pipeline = [&]() {
+        std::vector<Func> stages;
+        Func first;
+        first(x, y) = x + y;
+        stages.push_back(first);
+        for (int i = 1; i < 16; i++) {
+            Func next;
+            next(x, y) = stages.back()(x, y) * 3 + i;
+            stages.push_back(next);
+        }
+        for (Func f : stages) {
+            f.compute_root().parallel(y);
+        }
+        return stages.back();
+    };
+
+    Image<int> im(64, 32);
+
+    // Compare idle threads going straight to sleep, which is the
+    // default, a short spin, and threads that never sleep between
+    // pipeline calls.
+    const int spins[] = {0, 50, 100000};
+    // The thread pool reads HL_THREAD_SPIN_US when the runtime starts
+    // up, so each setting gets a fresh runtime, and a fresh pipeline
+    // so that it's compiled against it.
+    double times[3];
+    char buf[32] = {0};
+    for (int i = 0; i < 3; i++) {
+        std::ostringstream ss;
+        ss << "HL_THREAD_SPIN_US=" << spins[i];
+        std::string str = ss.str();
+        memcpy(buf, str.c_str(), str.size() + 1);
+        putenv(buf);
+        Halide::Internal::JITSharedRuntime::release_all();
+        Func out = make_pipeline();
+        out.compile_jit();
+        out.realize(im);
+        times[i] = benchmark(10, 20, [&]() { out.realize(im); });
+        printf("Spinning for %d us: %f ms\n", spins[i], times[i] * 1e3);
+    }
+
+    if (times[1] > times[0] * 1.2) {
+        printf("Spinning shouldn't be slower than sleeping straight away: %f ms vs %f ms\n",
+               times[1] * 1e3, times[0] * 1e3);
+        return -1;
+    }
+
+    printf("Success!\n");
+    return 0;
+}
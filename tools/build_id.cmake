@@ -0,0 +1,26 @@
+# Write the id of a build of libHalide, used in the keys of the
+# compilation cache: a hash of its sources, the runtime, the llvm
+# version and the compiler flags. The header is only rewritten when
+# the id changes, so that CompilationCache.cpp isn't rebuilt needlessly.
+#
+# Run as cmake -DSRC_DIR=... -DOUTPUT=... -DCONFIG="..." -P build_id.cmake
+
+file(GLOB SOURCES
+  "${SRC_DIR}/*.cpp" "${SRC_DIR}/*.h"
+  "${SRC_DIR}/runtime/*.cpp" "${SRC_DIR}/runtime/*.h" "${SRC_DIR}/runtime/*.ll")
+list(SORT SOURCES)
+
+set(HASHES "${CONFIG}")
+foreach(SOURCE ${SOURCES})
+  file(MD5 "${SOURCE}" HASH)
+  set(HASHES "${HASHES} ${HASH}")
+endforeach()
+string(MD5 BUILD_ID "${HASHES}")
+
+set(CONTENTS "#define HALIDE_BUILD_ID \"${BUILD_ID}\"\n")
+if (EXISTS "${OUTPUT}")
+  file(READ "${OUTPUT}" OLD_CONTENTS)
+endif()
+if (NOT "${CONTENTS}" STREQUAL "${OLD_CONTENTS}")
+  file(WRITE "${OUTPUT}" "${CONTENTS}")
+endif()
@@ -29,15 +29,25 @@ using std::string;
 using std::queue;
 using std::array;
 
-// The first 48 bytes of a tracing packet are metadata
-const int packet_header_size = 48;
+// Traces come in two formats. Version 2 starts with a stream header
+// of a magic number and the version, followed by records that each
+// start with a 24-byte header, and refer to funcs by ids defined by
+// earlier records (see HalideRuntime.h). Older traces are a sequence
+// of packets that each start with a 48-byte header, which holds the
+// func name.
+const uint32_t trace_magic = 0x43525448;
+const uint32_t trace_format_version = 2;
+const uint8_t trace_func_name_record = 255;
+const uint8_t trace_store_region = 10;
+const int record_header_size = 24;
+const int legacy_packet_header_size = 48;
 
 // A struct representing a single Halide tracing packet.
 struct Packet {
     uint32_t id, parent;
     uint8_t event, type, bits, width, value_idx, num_int_args;
-    char name[packet_header_size - 14];
-    uint8_t payload[4096 - packet_header_size]; // Not all of this will be used, but this is the max possible packet size.
+    string name;
+    uint8_t payload[4096]; // Not all of this will be used, but this is the max possible packet size.
 
     size_t value_bytes() const {
         size_t bytes_per_elem = 1;
@@ -104,19 +114,25 @@ struct Packet {
         return (T)0;
     }
 
-    // Grab a packet from stdin. Returns false when stdin closes.
-    bool read_from_stdin() {
-        if (!read_stdin(this, packet_header_size)) {
-            return false;
-        }
-        if (!read_stdin(payload, payload_bytes())) {
-            fprintf(stderr, "Unexpected EOF mid-packet");
-        }
-        name[sizeof(name)-1] = 0;
-        return true;
+private:
+    void bad_type_error() const {
+        fprintf(stderr, "Can't visualize packet with type: %d bits: %d\n", type, bits);
     }
+};
+
+// Reads packets in either format from stdin. Store region records
+// are handed out as a series of store packets, a few values of a row
+// at a time, so that they draw the same way as stores.
+class PacketReader {
+    bool started = false, legacy = false;
+    map<uint32_t, string> func_names;
+
+    // The store region being handed out, and how far through it we are.
+    Packet region;
+    vector<uint8_t> region_values;
+    vector<int> region_coords;
+    size_t region_bytes_per_value = 0, region_next = 0, region_size = 0;
 
-private:
     // Do a blocking read of some number of bytes from stdin.
     bool read_stdin(void *d, ssize_t size) {
         uint8_t *dst = (uint8_t *)d;
@@ -138,8 +154,163 @@ private:
         }
     }
 
-    void bad_type_error() const {
-        fprintf(stderr, "Can't visualize packet with type: %d bits: %d\n", type, bits);
+    bool read_region(const uint8_t *header, uint32_t size) {
+        memcpy(&region.id, header, 4);
+        memcpy(&region.parent, header + 4, 4);
+        uint32_t func_id;
+        memcpy(&func_id, header + 8, 4);
+        region.name = func_names[func_id];
+        region.event = 1;
+        region.type = header[13];
+        region.bits = header[14];
+        region.value_idx = header[16];
+        int dims = header[17] / 2;
+        region_coords.resize(dims * 2);
+        region_values.resize(size - record_header_size);
+        if (!read_stdin(region_values.data(), region_values.size()) ||
+            region_values.size() < region_coords.size() * sizeof(int)) {
+            return false;
+        }
+        memcpy(region_coords.data(), region_values.data(), region_coords.size() * sizeof(int));
+        region_bytes_per_value = 1;
+        while (region_bytes_per_value * 8 < region.bits) region_bytes_per_value <<= 1;
+        region_size = 1;
+        for (int d = 0; d < dims; d++) {
+            region_size *= std::max(0, region_coords[2*d+1]);
+        }
+        if (region_coords.size() * sizeof(int) + region_size * region_bytes_per_value > region_values.size()) {
+            return false;
+        }
+        region_next = 0;
+        return true;
+    }
+
+    // Make a store packet for the next few values of the region,
+    // staying within a row.
+    void next_region_packet(Packet &p) {
+        int dims = region_coords.size() / 2;
+        size_t row_length = dims > 0 ? region_coords[1] : 1;
+        size_t width = row_length - region_next % row_length;
+        width = std::min(width, (size_t)(dims > 0 ? 255 / dims : 255));
+        width = std::min(width, (size_t)32);
+
+        p.id = region.id;
+        p.parent = region.parent;
+        p.name = region.name;
+        p.event = region.event;
+        p.type = region.type;
+        p.bits = region.bits;
+        p.width = width;
+        p.value_idx = region.value_idx;
+        p.num_int_args = width * dims;
+        const uint8_t *values = region_values.data() + region_coords.size() * sizeof(int);
+        memcpy(p.payload, values + region_next * region_bytes_per_value, width * region_bytes_per_value);
+        int *coords = (int *)(p.payload + p.value_bytes());
+        for (size_t lane = 0; lane < width; lane++) {
+            size_t idx = region_next + lane;
+            for (int d = 0; d < dims; d++) {
+                coords[d * width + lane] = region_coords[2*d] + idx % region_coords[2*d+1];
+                idx /= region_coords[2*d+1];
+            }
+        }
+        region_next += width;
+    }
+
+    bool read_legacy(Packet &p, const uint8_t *first_word) {
+        uint8_t header[legacy_packet_header_size];
+        memcpy(header, first_word, 4);
+        if (!read_stdin(header + 4, legacy_packet_header_size - 4)) {
+            return false;
+        }
+        memcpy(&p.id, header, 4);
+        memcpy(&p.parent, header + 4, 4);
+        p.event = header[8];
+        p.type = header[9];
+        p.bits = header[10];
+        p.width = header[11];
+        p.value_idx = header[12];
+        p.num_int_args = header[13];
+        header[legacy_packet_header_size - 1] = 0;
+        p.name = (const char *)(header + 14);
+        if (!read_stdin(p.payload, p.payload_bytes())) {
+            fprintf(stderr, "Unexpected EOF mid-packet");
+        }
+        return true;
+    }
+
+public:
+    // Grab a packet from stdin. Returns false when stdin closes.
+    bool read_packet(Packet &p) {
+        if (region_next < region_size) {
+            next_region_packet(p);
+            return true;
+        }
+        for (;;) {
+            uint32_t size;
+            if (!read_stdin(&size, 4)) {
+                return false;
+            }
+            if (!started) {
+                started = true;
+                legacy = (size != trace_magic);
+            }
+            if (legacy) {
+                return read_legacy(p, (const uint8_t *)&size);
+            }
+
+            if (size == trace_magic) {
+                // A stream header, at the start of the trace or of a
+                // trace appended to it.
+                uint32_t version;
+                if (!read_stdin(&version, 4)) {
+                    return false;
+                }
+                if (version != trace_format_version) {
+                    fprintf(stderr, "Unsupported trace format version: %u\n", version);
+                    exit(-1);
+                }
+                continue;
+            }
+
+            uint8_t header[record_header_size - 4];
+            if (size < record_header_size || !read_stdin(header, sizeof(header))) {
+                fprintf(stderr, "Unexpected EOF or bad record mid-trace\n");
+                return false;
+            }
+            if (header[12] == trace_store_region) {
+                if (!read_region(header, size)) {
+                    fprintf(stderr, "Unexpected EOF or bad record mid-trace\n");
+                    return false;
+                }
+                if (region_next < region_size) {
+                    next_region_packet(p);
+                    return true;
+                }
+                continue;
+            }
+            if (size > record_header_size + sizeof(p.payload) ||
+                !read_stdin(p.payload, size - record_header_size)) {
+                fprintf(stderr, "Unexpected EOF or bad record mid-trace\n");
+                return false;
+            }
+            uint32_t func_id;
+            memcpy(&p.id, header, 4);
+            memcpy(&p.parent, header + 4, 4);
+            memcpy(&func_id, header + 8, 4);
+            p.event = header[12];
+            if (p.event == trace_func_name_record) {
+                p.payload[size - record_header_size - 1] = 0;
+                func_names[func_id] = (const char *)p.payload;
+                continue;
+            }
+            p.type = header[13];
+            p.bits = header[14];
+            p.width = header[15];
+            p.value_idx = header[16];
+            p.num_int_args = header[17];
+            p.name = func_names[func_id];
+            return true;
+        }
     }
 };
 
@@ -382,8 +553,6 @@ void usage() {
 }
 
 int run(int argc, char **argv) {
-    static_assert(sizeof(Packet) == 4096, "");
-
     // State that determines how different funcs get drawn
     int frame_width = 1920, frame_height = 1080;
     int decay_factor = 2;
@@ -494,6 +663,7 @@ int run(int argc, char **argv) {
 
     map<uint32_t, PipelineInfo> pipeline_info;
 
+    PacketReader reader;
     size_t end_counter = 0;
     size_t packet_clock = 0;
     for (;;) {
@@ -538,7 +708,7 @@ int run(int argc, char **argv) {
 
         // Read a tracing packet
         Packet p;
-        if (!p.read_from_stdin()) {
+        if (!reader.read_packet(p)) {
             end_counter++;
             continue;
         }